@@ -0,0 +1,354 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <locale.h>
+
+#include "bench.h"
+#include "metrics.h"
+#include "ya_getopt.h"
+#include "arena.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define BENCH_MAX 128
+#define BENCH_NAME_MAX 64
+
+typedef struct bench_result
+{
+    char name[ BENCH_NAME_MAX ];
+    double ns_per_op;     // Median sample
+    double min_ns_per_op; // Fastest sample
+    double spread_pct;    // Interquartile range, as a percentage of the median
+    double mb_per_s;      // 0 if the benchmark doesn't count bytes
+    uint64_t iters;       // Per sample
+} bench_result;
+
+struct bench
+{
+    const char *filter;
+    int count;
+    int failures; // bench_fail calls
+    bench_result results[ BENCH_MAX ];
+};
+
+volatile uint64_t bench_sink;
+
+static uint64_t bench_time( bench_fn fn, void *user, uint64_t iters )
+{
+    uint64_t start_ns = get_time_ns();
+
+    fn( user, iters );
+    return get_time_ns() - start_ns;
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+    double x = *( const double * )a;
+    double y = *( const double * )b;
+
+    return ( x > y ) - ( x < y );
+}
+
+int bench_enabled( bench *b, const char *name )
+{
+    return !b->filter || strstr( name, b->filter );
+}
+
+void bench_fail( bench *b, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
+void bench_fail( bench *b, const char *fmt, ... )
+{
+    va_list ap;
+
+    fprintf( stderr, "ERROR: " );
+    va_start( ap, fmt );
+    vfprintf( stderr, fmt, ap );
+    va_end( ap );
+    fprintf( stderr, "\n" );
+    b->failures++;
+}
+
+void bench_run( bench *b, const char *name, bench_fn fn, void *user, uint64_t ops, uint64_t bytes )
+{
+    double samples[ BENCH_SAMPLES ];
+    uint64_t iters = 1;
+    uint64_t ns;
+
+    if ( !bench_enabled( b, name ) || ( b->count == BENCH_MAX ) )
+        return;
+
+    // Warm up, then grow iters until a run is long enough to scale from.
+    fn( user, 1 );
+    while ( ( ns = bench_time( fn, user, iters ) ) < BENCH_SAMPLE_NS / 4 )
+        iters = ( ns < 100000 ) ? iters * 16 : MAX( iters + 1, iters * BENCH_SAMPLE_NS / ns );
+    iters = MAX( 1, iters * BENCH_SAMPLE_NS / ns );
+
+    for ( int i = 0; i < BENCH_SAMPLES; i++ )
+        samples[ i ] = ( double )bench_time( fn, user, iters ) / ( iters * ops );
+    qsort( samples, BENCH_SAMPLES, sizeof( samples[ 0 ] ), cmp_double );
+
+    bench_result *r = &b->results[ b->count++ ];
+
+    snprintf( r->name, sizeof( r->name ), "%s", name );
+    r->ns_per_op = samples[ BENCH_SAMPLES / 2 ];
+    r->min_ns_per_op = samples[ 0 ];
+    r->spread_pct = 100.0 * ( samples[ BENCH_SAMPLES * 3 / 4 ] - samples[ BENCH_SAMPLES / 4 ] ) / r->ns_per_op;
+    r->mb_per_s = bytes ? ( bytes / ( r->ns_per_op * ops ) ) * 1e9 / ( 1024.0 * 1024.0 ) : 0.0;
+    r->iters = iters;
+
+    printf( "%-36s %12.2f ns/op  +-%5.1f%%", r->name, r->ns_per_op, r->spread_pct );
+    if ( bytes )
+        printf( "  %9.1f MB/s", r->mb_per_s );
+    printf( "\n" );
+    fflush( stdout );
+}
+
+static int bench_write_json( const bench *b, const char *filename )
+{
+    metrics_json json;
+
+    metrics_json_init( &json );
+    metrics_json_object( &json, NULL );
+    metrics_json_uint( &json, "version", 1 );
+    metrics_json_object( &json, "benchmarks" );
+    for ( int i = 0; i < b->count; i++ )
+    {
+        const bench_result *r = &b->results[ i ];
+
+        metrics_json_object( &json, r->name );
+        metrics_json_double( &json, "ns_per_op", r->ns_per_op );
+        metrics_json_double( &json, "min_ns_per_op", r->min_ns_per_op );
+        metrics_json_double( &json, "spread_pct", r->spread_pct );
+        if ( r->mb_per_s )
+            metrics_json_double( &json, "mb_per_s", r->mb_per_s );
+        metrics_json_uint( &json, "iters", r->iters );
+        metrics_json_end( &json );
+    }
+    metrics_json_end( &json );
+    metrics_json_end( &json );
+
+    int ret = metrics_json_write_file( &json, filename );
+
+    metrics_json_free( &json );
+    return ret;
+}
+
+static char *bench_read_file( const char *filename )
+{
+    FILE *fp = fopen( filename, "rb" );
+    size_t len = 0;
+    size_t size = 0;
+    char *data = NULL;
+
+    if ( !fp )
+        return NULL;
+
+    for ( ;; )
+    {
+        if ( len + 1 >= size )
+        {
+            size = MAX( 64 * 1024, size * 2 );
+            data = ( char * )realloc( data, size );
+            if ( !data )
+                FATAL_ERROR( realloc );
+        }
+
+        size_t count = fread( data + len, 1, size - len - 1, fp );
+        if ( !count )
+            break;
+        len += count;
+    }
+
+    fclose( fp );
+    data[ len ] = 0;
+    return data;
+}
+
+// A result is a regression if its median is more than threshold_pct slower
+// than the baseline, or twice its own spread if that's bigger: a noisy
+// benchmark has to get a lot slower before we believe it. Returns the
+// number of regressions, or -1 if baseline can't be read.
+static int bench_compare( const bench *b, const char *baseline, double threshold_pct )
+{
+    int regressions = 0;
+    char *data = bench_read_file( baseline );
+
+    if ( !data )
+        return -1;
+
+    printf( "\nCompared with %s (threshold %.0f%%):\n", baseline, threshold_pct );
+    for ( int i = 0; i < b->count; i++ )
+    {
+        const bench_result *r = &b->results[ i ];
+        char key[ BENCH_NAME_MAX + 32 ];
+
+        // Our own output: "name":{"ns_per_op":N,...
+        snprintf( key, sizeof( key ), "\"%s\":{\"ns_per_op\":", r->name );
+
+        const char *found = strstr( data, key );
+        if ( !found )
+        {
+            printf( "  %-36s %12.2f ns/op  (new)\n", r->name, r->ns_per_op );
+            continue;
+        }
+
+        double base = strtod( found + strlen( key ), NULL );
+        double change_pct = base ? 100.0 * ( r->ns_per_op - base ) / base : 0.0;
+        double limit_pct = MAX( threshold_pct, 2.0 * r->spread_pct );
+        const char *verdict = "";
+
+        if ( change_pct > limit_pct )
+        {
+            verdict = "  REGRESSION";
+            regressions++;
+        }
+        else if ( change_pct < -limit_pct )
+        {
+            verdict = "  faster";
+        }
+
+        printf( "  %-36s %12.2f -> %12.2f ns/op  %+6.1f%%%s\n", r->name, base, r->ns_per_op, change_pct, verdict );
+    }
+
+    free( data );
+    return regressions;
+}
+
+static void bench_usage( const char *argv0 )
+{
+    printf( "%s [options]\n\n", argv0 );
+
+    printf( "     --filter STR            Only run benchmarks with STR in their name.\n" );
+    printf( "     --json FILE             Write the results to FILE.\n" );
+    printf( "     --compare FILE          Compare with a --json FILE from an earlier run, exit 2 on regressions.\n" );
+    printf( "                             Failed checks (like heap use in debug builds) exit 3.\n" );
+    printf( "     --threshold PCT         Slowdown that counts as a regression (default 10).\n" );
+    printf( "     --cpu N                 Pin to CPU N for steadier numbers.\n" );
+    printf( "  -h --help                  Show this help.\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const struct option long_options[] =
+        {
+          { "help", ya_no_argument, 0, 0 },
+          { "filter", ya_required_argument, 0, 0 },
+          { "json", ya_required_argument, 0, 0 },
+          { "compare", ya_required_argument, 0, 0 },
+          { "threshold", ya_required_argument, 0, 0 },
+          { "cpu", ya_required_argument, 0, 0 },
+          { 0, 0, 0, 0 }
+        };
+    static bench b;
+    const char *json = NULL;
+    const char *compare = NULL;
+    double threshold_pct = 10.0;
+    int cpu = -1;
+
+    setlocale( LC_ALL, "" );
+
+    for ( ;; )
+    {
+        int option_index = 0;
+        int c = ya_getopt_long( argc, argv, "h?", long_options, &option_index );
+        if ( c == -1 )
+            break;
+
+        if ( c != 0 )
+        {
+            bench_usage( argv[ 0 ] );
+            return 1;
+        }
+
+        if ( !strcmp( long_options[ option_index ].name, "filter" ) )
+            b.filter = ya_optarg;
+        else if ( !strcmp( long_options[ option_index ].name, "json" ) )
+            json = ya_optarg;
+        else if ( !strcmp( long_options[ option_index ].name, "compare" ) )
+            compare = ya_optarg;
+        else if ( !strcmp( long_options[ option_index ].name, "threshold" ) )
+            threshold_pct = MAX( 0.0, atof( ya_optarg ) );
+        else if ( !strcmp( long_options[ option_index ].name, "cpu" ) )
+            cpu = atoi( ya_optarg );
+        else
+        {
+            bench_usage( argv[ 0 ] );
+            return 1;
+        }
+    }
+
+    if ( cpu >= 0 )
+    {
+        cpu_set_t set;
+
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        if ( sched_setaffinity( 0, sizeof( set ), &set ) )
+            fprintf( stderr, "WARNING: Unable to pin to cpu %d: %s\n", cpu, strerror( errno ) );
+    }
+
+    // termwin and friends log as they go.
+    clog_init_path( 0, "/dev/null" );
+
+    bench_termwin( &b );
+    bench_clog( &b );
+    bench_output( &b );
+    bench_scrollback( &b );
+
+    clog_free( 0 );
+    arena_thread_free();
+
+    if ( json && bench_write_json( &b, json ) )
+    {
+        fprintf( stderr, "ERROR: Unable to write '%s': %s\n", json, strerror( errno ) );
+        return 1;
+    }
+
+    if ( compare )
+    {
+        int regressions = bench_compare( &b, compare, threshold_pct );
+
+        if ( regressions < 0 )
+        {
+            fprintf( stderr, "ERROR: Unable to read baseline '%s': %s\n", compare, strerror( errno ) );
+            return 1;
+        }
+        if ( regressions )
+        {
+            printf( "%d regression%s\n", regressions, ( regressions == 1 ) ? "" : "s" );
+            return 2;
+        }
+    }
+    return b.failures ? 3 : 0;
+}
@@ -0,0 +1,63 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+// Micro-benchmarks for the hot paths, run by make bench.
+//
+// Each benchmark is a function that does iters iterations of some work.
+// bench_run calibrates iters so one sample takes about BENCH_SAMPLE_NS,
+// then takes BENCH_SAMPLES samples and keeps the median, which is what
+// --compare checks against a baseline.
+
+#define BENCH_SAMPLE_NS ( 20 * 1000000ULL )
+#define BENCH_SAMPLES 11
+
+typedef struct bench bench;
+
+typedef void ( *bench_fn )( void *user, uint64_t iters );
+
+// ops: operations per iteration, for the ns/op figure. bytes: bytes
+// processed per iteration for MB/s, or 0.
+void bench_run( bench *b, const char *name, bench_fn fn, void *user, uint64_t ops, uint64_t bytes );
+
+// Whether name passes --filter, for suites that do more than bench_run.
+int bench_enabled( bench *b, const char *name );
+// Report a failed check: make bench exits non-zero.
+void bench_fail( bench *b, const char *fmt, ... );
+
+// Somewhere to put results so the compiler can't drop the work.
+extern volatile uint64_t bench_sink;
+
+// The suites, in bench_*.c.
+void bench_termwin( bench *b );
+void bench_clog( bench *b );
+void bench_output( bench *b );
+void bench_scrollback( bench *b );
+
+#endif // _BENCH_H_
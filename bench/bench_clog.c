@@ -0,0 +1,84 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bench.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Logger 0 is cvterm's own, pointed at /dev/null by main.
+#define BENCH_LOGGER 1
+
+static const char s_message[] = "handle_output: 4096 bytes, 3 damage rects";
+
+static void bench_format( void *user, uint64_t iters )
+{
+    struct clog *logger = _clog_loggers[ BENCH_LOGGER ];
+    char buf[ 512 ];
+    uint64_t sum = 0;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+        sum += _clog_format( logger, buf, sizeof( buf ), __FILE__, __LINE__, __FUNCTION__, "INFO",
+                             s_message, sizeof( s_message ) - 1 );
+    bench_sink += sum;
+}
+
+static void bench_log( void *user, uint64_t iters )
+{
+    for ( uint64_t i = 0; i < iters; i++ )
+        clog_info( CLOG( BENCH_LOGGER ), "handle_output: %d bytes, %d damage rects", 4096, ( int )( i & 7 ) );
+}
+
+void bench_clog( bench *b )
+{
+    if ( clog_init_path( BENCH_LOGGER, "/dev/null" ) )
+        FATAL_ERROR( clog_init_path );
+
+    // What cvterm uses, then the default which also formats the date and time.
+    clog_set_fmt( BENCH_LOGGER, "%f(%F:%n): %l: %m\n" );
+    bench_run( b, "clog/format", bench_format, NULL, 1, 0 );
+    clog_set_fmt( BENCH_LOGGER, CLOG_DEFAULT_FORMAT );
+    bench_run( b, "clog/format/time", bench_format, NULL, 1, 0 );
+
+    clog_set_fmt( BENCH_LOGGER, "%f(%F:%n): %l: %m\n" );
+    bench_run( b, "clog/log/sync", bench_log, NULL, 1, 0 );
+
+    // Below the logger's level: the check in the clog_info macro and nothing else.
+    clog_set_level( BENCH_LOGGER, CLOG_WARN );
+    bench_run( b, "clog/log/filtered", bench_log, NULL, 1, 0 );
+    clog_set_level( BENCH_LOGGER, CLOG_DEBUG );
+
+    // Blocking, so the writer thread's cost shows up instead of drops.
+    clog_set_async( BENCH_LOGGER, 1024 * 1024, CLOG_ASYNC_BLOCK );
+    bench_run( b, "clog/log/async", bench_log, NULL, 1, 0 );
+
+    clog_free( BENCH_LOGGER );
+}
@@ -0,0 +1,323 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <vterm.h>
+
+#include "bench.h"
+#include "metrics.h"
+#include "termwin.h"
+#include "scrollback.h"
+#include "arena.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Output throughput: child output through vterm, termwin's damage tracking
+// and scrollback, in the chunks handle_output reads. No drawing; that's
+// in bench_termwin.c, except for output/frame: a main loop iteration's
+// worth of read, parse and draw, which debug builds also check leaves the
+// heap alone.
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+#define BENCH_STREAM_SIZE ( 1024 * 1024 )
+#define BENCH_CHUNK ( 64 * 1024 )
+#define BENCH_FRAME_CHUNK ( 8 * 1024 )
+#define BENCH_FRAME_SCROLLBACK ( 256 * 1024 )
+
+typedef struct bench_stream
+{
+    char *buf;
+    size_t len;
+    size_t size;
+} bench_stream;
+
+typedef struct bench_output_ctx
+{
+    VTerm *vt;
+    VTermScreen *vts;
+    termwin *twin;
+    scrollback *sb;
+    const bench_stream *stream;
+    size_t pos; // output/frame: where the next chunk starts
+} bench_output_ctx;
+
+static int bench_sb_pushline( int cols, const VTermScreenCell *cells, void *user )
+{
+    bench_output_ctx *ctx = ( bench_output_ctx * )user;
+
+    scrollback_push( ctx->sb, cols, cells );
+    return 1;
+}
+
+static int bench_damage( VTermRect rect, void *user )
+{
+    return termwin_damage_callback( rect, ( ( bench_output_ctx * )user )->twin );
+}
+
+static int bench_moverect( VTermRect dest, VTermRect src, void *user )
+{
+    return termwin_moverect_callback( dest, src, ( ( bench_output_ctx * )user )->twin );
+}
+
+static int bench_movecursor( VTermPos pos, VTermPos oldpos, int visible, void *user )
+{
+    return termwin_movecursor_callback( pos, oldpos, visible, ( ( bench_output_ctx * )user )->twin );
+}
+
+static const VTermScreenCallbacks s_bench_screen_cbs =
+    {
+      bench_damage,      // damage
+      bench_moverect,    // moverect
+      bench_movecursor,  // movecursor
+      NULL,              // settermprop
+      NULL,              // bell
+      NULL,              // resize
+      bench_sb_pushline, // sb_pushline
+      NULL               // sb_popline
+    };
+
+static void stream_printf( bench_stream *stream, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
+
+static void stream_printf( bench_stream *stream, const char *fmt, ... )
+{
+    va_list ap;
+
+    va_start( ap, fmt );
+    stream->len += vsnprintf( stream->buf + stream->len, stream->size - stream->len, fmt, ap );
+    va_end( ap );
+}
+
+static uint32_t bench_rand( uint32_t *state )
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Plain text lines, like a build log or cat of a source file.
+static void stream_ascii( bench_stream *stream, uint32_t *rng )
+{
+    while ( stream->len + 256 < stream->size )
+    {
+        int words = 4 + bench_rand( rng ) % 12;
+
+        for ( int i = 0; i < words; i++ )
+            stream_printf( stream, "%.*s ", ( int )( 2 + bench_rand( rng ) % 8 ), "abcdefghijklmnopqrstuvwxyz" );
+        stream_printf( stream, "\r\n" );
+    }
+}
+
+// Coloured output: ls --color, compiler diagnostics, git log --graph.
+static void stream_sgr( bench_stream *stream, uint32_t *rng )
+{
+    while ( stream->len + 512 < stream->size )
+    {
+        int words = 4 + bench_rand( rng ) % 12;
+
+        for ( int i = 0; i < words; i++ )
+        {
+            uint32_t r = bench_rand( rng );
+
+            switch ( r % 4 )
+            {
+            case 0:
+                stream_printf( stream, "\x1b[%d;%dm", 30 + r % 8 + ( ( r & 0x100 ) ? 60 : 0 ), ( r & 0x200 ) ? 1 : 22 );
+                break;
+            case 1:
+                stream_printf( stream, "\x1b[38;5;%dm", ( r >> 8 ) & 0xff );
+                break;
+            case 2:
+                stream_printf( stream, "\x1b[38;2;%d;%d;%dm", ( r >> 8 ) & 0xff, ( r >> 16 ) & 0xff, ( r >> 24 ) & 0xff );
+                break;
+            default:
+                stream_printf( stream, "\x1b[0m" );
+                break;
+            }
+            stream_printf( stream, "%.*s ", ( int )( 2 + bench_rand( rng ) % 8 ), "abcdefghijklmnopqrstuvwxyz" );
+        }
+        stream_printf( stream, "\x1b[0m\r\n" );
+    }
+}
+
+// A top like screen redrawn in place: cursor addressing, erase to end of
+// line and short runs of numbers, no scrolling.
+static void stream_cursor( bench_stream *stream, uint32_t *rng )
+{
+    while ( stream->len + BENCH_ROWS * 128 < stream->size )
+    {
+        stream_printf( stream, "\x1b[H\x1b[7m  PID USER      PR  NI    VIRT    RES  %%CPU COMMAND\x1b[K\x1b[0m" );
+        for ( int row = 2; row <= BENCH_ROWS; row++ )
+        {
+            uint32_t r = bench_rand( rng );
+
+            stream_printf( stream, "\x1b[%d;1H%5u %-8s  20   0 %7u %6u %5.1f %s\x1b[K", row,
+                           r % 65536, ( r & 1 ) ? "root" : "user", r % 9999999, ( r >> 8 ) % 999999,
+                           ( double )( r % 1000 ) / 10.0, ( r & 2 ) ? "cvterm" : "bash" );
+        }
+    }
+}
+
+// Accents, box drawing and double width characters.
+static void stream_utf8( bench_stream *stream, uint32_t *rng )
+{
+    static const char *s_words[] =
+        {
+          "caf\xc3\xa9", "na\xc3\xafve", "\xe2\x94\x80\xe2\x94\x80\xe2\x94\xbc\xe2\x94\x80\xe2\x94\x80",
+          "\xe6\xbc\xa2\xe5\xad\x97", "\xe3\x81\x8b\xe3\x81\xaa", "\xce\xbb\xce\xb1\xce\xbc\xce\xb2\xce\xb4\xce\xb1",
+          "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82", "ascii",
+        };
+
+    while ( stream->len + 512 < stream->size )
+    {
+        int words = 4 + bench_rand( rng ) % 10;
+
+        for ( int i = 0; i < words; i++ )
+            stream_printf( stream, "%s ", s_words[ bench_rand( rng ) % ( sizeof( s_words ) / sizeof( s_words[ 0 ] ) ) ] );
+        stream_printf( stream, "\r\n" );
+    }
+}
+
+static void bench_parse( void *user, uint64_t iters )
+{
+    bench_output_ctx *ctx = ( bench_output_ctx * )user;
+    const bench_stream *stream = ctx->stream;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        for ( size_t pos = 0; pos < stream->len; pos += BENCH_CHUNK )
+        {
+            vterm_input_write( ctx->vt, stream->buf + pos, MIN( BENCH_CHUNK, stream->len - pos ) );
+            vterm_screen_flush_damage( ctx->vts );
+        }
+    }
+}
+
+// One chunk through vterm and onto the (headless) screen, then the
+// per-iteration arena reset, as main_loop does it.
+static void bench_frame( void *user, uint64_t iters )
+{
+    bench_output_ctx *ctx = ( bench_output_ctx * )user;
+    const bench_stream *stream = ctx->stream;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        size_t len = MIN( BENCH_FRAME_CHUNK, stream->len - ctx->pos );
+
+        vterm_input_write( ctx->vt, stream->buf + ctx->pos, len );
+        vterm_screen_flush_damage( ctx->vts );
+        termwin_refresh( ctx->twin );
+        arena_reset( arena_thread() );
+
+        ctx->pos += len;
+        if ( ctx->pos == stream->len )
+            ctx->pos = 0;
+    }
+}
+
+void bench_output( bench *b )
+{
+    static const struct
+    {
+        const char *name;
+        void ( *gen )( bench_stream *stream, uint32_t *rng );
+    } s_streams[] =
+        {
+          { "output/ascii", stream_ascii },
+          { "output/sgr", stream_sgr },
+          { "output/cursor", stream_cursor },
+          { "output/utf8", stream_utf8 },
+        };
+    bench_output_ctx ctx;
+    bench_stream stream;
+
+    memset( &ctx, 0, sizeof( ctx ) );
+    stream.size = BENCH_STREAM_SIZE;
+    stream.buf = ( char * )malloc( stream.size );
+    if ( !stream.buf )
+        FATAL_ERROR( malloc );
+
+    ctx.twin = termwin_init_direct_headless( BENCH_ROWS, BENCH_COLS, 1 );
+    ctx.sb = scrollback_init( 64 * 1024 * 1024 );
+    ctx.vt = vterm_new( BENCH_ROWS, BENCH_COLS );
+    vterm_set_utf8( ctx.vt, 1 );
+    termwin_initvterm( ctx.vt );
+    termwin_setvterm( ctx.twin, ctx.vt );
+
+    ctx.vts = vterm_obtain_screen( ctx.vt );
+    vterm_screen_reset( ctx.vts, 1 );
+    vterm_screen_set_callbacks( ctx.vts, &s_bench_screen_cbs, &ctx );
+
+    for ( size_t i = 0; i < sizeof( s_streams ) / sizeof( s_streams[ 0 ] ); i++ )
+    {
+        uint32_t rng = 0x9e3779b9;
+
+        stream.len = 0;
+        s_streams[ i ].gen( &stream, &rng );
+        ctx.stream = &stream;
+        bench_run( b, s_streams[ i ].name, bench_parse, &ctx, 1, stream.len );
+    }
+
+    if ( bench_enabled( b, "output/frame" ) )
+    {
+        uint32_t rng = 0x9e3779b9;
+
+        // A scrollback that fills up quickly, so it's recycling pages by
+        // the time we look.
+        scrollback_free( ctx.sb );
+        ctx.sb = scrollback_init( BENCH_FRAME_SCROLLBACK );
+
+        stream.len = 0;
+        stream_sgr( &stream, &rng );
+        ctx.stream = &stream;
+        ctx.pos = 0;
+        bench_run( b, "output/frame", bench_frame, &ctx, 1, BENCH_FRAME_CHUNK );
+
+#ifdef ARENA_COUNT_HEAP
+        // Everything has grown to fit by now: frames shouldn't allocate.
+        uint64_t frames = stream.len / BENCH_FRAME_CHUNK;
+        uint64_t allocs = arena_heap_allocs();
+
+        bench_frame( &ctx, frames );
+        allocs = arena_heap_allocs() - allocs;
+        if ( allocs )
+            bench_fail( b, "output/frame: %" PRIu64 " heap allocations in %" PRIu64 " steady state frames", allocs, frames );
+#endif
+    }
+
+    vterm_free( ctx.vt );
+    scrollback_free( ctx.sb );
+    termwin_free( ctx.twin );
+    free( stream.buf );
+}
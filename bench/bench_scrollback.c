@@ -0,0 +1,141 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <vterm.h>
+
+#include "bench.h"
+#include "scrollback.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Scrollback search: indexing pushed lines, and looking for a string
+// that isn't there (the worst case, every line or page gets checked)
+// with the index and without it.
+
+#define BENCH_COLS 120
+#define BENCH_LINES ( 64 * 1024 )
+
+typedef struct bench_sb_ctx
+{
+    VTermScreenCell cells[ BENCH_LINES / 1024 ][ BENCH_COLS ];
+    scrollback *sb;
+    const char *query;
+} bench_sb_ctx;
+
+// Something like a build log.
+static void bench_sb_line( VTermScreenCell *cells, int i )
+{
+    char buf[ BENCH_COLS + 1 ];
+    int len = snprintf( buf, sizeof( buf ), "[%5d/%5d] gcc -O2 -Wall -c src/module%d/file%d.c -o _release/src/module%d/file%d.o",
+                        i, BENCH_LINES, i % 37, i % 997, i % 37, i % 997 );
+
+    memset( cells, 0, BENCH_COLS * sizeof( cells[ 0 ] ) );
+    for ( int col = 0; col < BENCH_COLS; col++ )
+    {
+        cells[ col ].width = 1;
+        cells[ col ].chars[ 0 ] = ( col < len ) ? ( uint32_t )buf[ col ] : 0;
+    }
+}
+
+static scrollback *bench_sb_fill( bench_sb_ctx *ctx )
+{
+    scrollback *sb = scrollback_init( 64 * 1024 * 1024 );
+    int variants = BENCH_LINES / 1024;
+
+    for ( int i = 0; i < BENCH_LINES; i++ )
+    {
+        // Different numbers in each line without formatting every one.
+        ctx->cells[ i % variants ][ 1 ].chars[ 0 ] = '0' + ( i / variants ) % 10;
+        ctx->cells[ i % variants ][ 2 ].chars[ 0 ] = '0' + ( i / variants / 10 ) % 10;
+        scrollback_push( sb, BENCH_COLS, ctx->cells[ i % variants ] );
+    }
+    return sb;
+}
+
+static void bench_sb_index( void *user, uint64_t iters )
+{
+    bench_sb_ctx *ctx = ( bench_sb_ctx * )user;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        scrollback *sb = bench_sb_fill( ctx );
+
+        bench_sink += scrollback_index( sb, BENCH_LINES );
+        scrollback_free( sb );
+    }
+}
+
+static void bench_sb_fill_only( void *user, uint64_t iters )
+{
+    bench_sb_ctx *ctx = ( bench_sb_ctx * )user;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+        scrollback_free( bench_sb_fill( ctx ) );
+}
+
+static void bench_sb_find( void *user, uint64_t iters )
+{
+    bench_sb_ctx *ctx = ( bench_sb_ctx * )user;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        uint64_t line = UINT64_MAX;
+
+        bench_sink += scrollback_find( ctx->sb, ctx->query, -1, &line, BENCH_LINES );
+    }
+}
+
+void bench_scrollback( bench *b )
+{
+    bench_sb_ctx *ctx = ( bench_sb_ctx * )calloc( 1, sizeof( *ctx ) );
+
+    if ( !ctx )
+        FATAL_ERROR( calloc );
+    for ( int i = 0; i < BENCH_LINES / 1024; i++ )
+        bench_sb_line( ctx->cells[ i ], i );
+
+    // Pushing with and without indexing after, per line.
+    bench_run( b, "scrollback/push", bench_sb_fill_only, ctx, BENCH_LINES, 0 );
+    bench_run( b, "scrollback/push_index", bench_sb_index, ctx, BENCH_LINES, 0 );
+
+    // Per line searched. Two bytes is too short for a trigram, so that one
+    // reads every line.
+    ctx->sb = bench_sb_fill( ctx );
+    scrollback_index( ctx->sb, BENCH_LINES );
+    ctx->query = "no such file";
+    bench_run( b, "scrollback/find/indexed", bench_sb_find, ctx, BENCH_LINES, 0 );
+    ctx->query = "zq";
+    bench_run( b, "scrollback/find/scan", bench_sb_find, ctx, BENCH_LINES, 0 );
+
+    scrollback_free( ctx->sb );
+    free( ctx );
+}
@@ -0,0 +1,306 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+// termwin's colour and pair lookups and termwin_draw are static, so this
+// builds termwin.c right in (and the bench target leaves termwin.o out).
+#include "termwin.c"
+
+#include "bench.h"
+
+#define BENCH_ROWS 60
+#define BENCH_COLS 200
+#define BENCH_COLORS 65536 // Distinct colours for the cache miss runs: 16x COLOR_CACHE_SIZE
+#define BENCH_LOOKUPS 1024 // Lookups per iteration
+
+typedef struct bench_termwin_ctx
+{
+    termwin *twin;
+    VTerm *vt;
+    VTermColor colors[ BENCH_COLORS ];
+    uint32_t color_mask; // Which of colors a run cycles through
+    uint16_t pairs[ BENCH_COLORS ];
+    uint32_t pos;
+    uint32_t rng;
+} bench_termwin_ctx;
+
+static const VTermScreenCallbacks s_bench_screen_cbs =
+    {
+      termwin_damage_callback,      // damage
+      termwin_moverect_callback,    // moverect
+      termwin_movecursor_callback,  // movecursor
+      termwin_settermprop_callback, // settermprop
+      termwin_bell_callback,        // bell
+      NULL,                         // resize
+      NULL,                         // sb_pushline
+      NULL                          // sb_popline
+    };
+
+// Same sequence every run.
+static uint32_t bench_rand( uint32_t *state )
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Pretend the terminal has numcolors colours (numcolors <= COLORS).
+static void bench_set_numcolors( termwin *twin, int numcolors )
+{
+    twin->numcolors = numcolors;
+    twin->numcolors_padded = ( numcolors + 3 ) & ~3;
+    for ( int i = 0; i < twin->numcolors_padded; i++ )
+    {
+        int pad = ( i >= numcolors );
+
+        twin->palette_rg[ i * 2 ] = pad ? PALETTE_PAD_VALUE : twin->ansi_colors[ i ].red;
+        twin->palette_rg[ i * 2 + 1 ] = pad ? PALETTE_PAD_VALUE : twin->ansi_colors[ i ].green;
+        twin->palette_b[ i * 2 ] = pad ? 0 : twin->ansi_colors[ i ].blue;
+        twin->palette_b[ i * 2 + 1 ] = 0;
+    }
+    memset( twin->color_cache_key, 0, sizeof( twin->color_cache_key ) );
+    memset( twin->style_cache, 0, sizeof( twin->style_cache ) );
+}
+
+static void bench_colorid( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+    uint64_t sum = 0;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        for ( int j = 0; j < BENCH_LOOKUPS; j++ )
+            sum += get_ncurses_colorid( ctx->twin, &ctx->colors[ ctx->pos++ & ctx->color_mask ] );
+    }
+    bench_sink += sum;
+}
+
+static void bench_pairid( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+    uint64_t sum = 0;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        for ( int j = 0; j < BENCH_LOOKUPS; j++ )
+        {
+            uint16_t key = ctx->pairs[ ctx->pos++ & ctx->color_mask ];
+
+            sum += get_ncurses_pairid( ctx->twin, key >> 8, key & 0xff );
+        }
+    }
+    bench_sink += sum;
+}
+
+// Direct frames go to /dev/null as they would to the terminal; ncurses ones
+// stop at the window, before doupdate.
+static void bench_draw_frame( termwin *twin )
+{
+    termwin_draw( twin );
+    if ( twin->out )
+        termout_flush( twin->out );
+}
+
+static void bench_draw_full( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        termwin_shadow_invalidate( ctx->twin, 0, ctx->twin->rows );
+        termwin_damage_rows( ctx->twin, 0, ctx->twin->rows );
+        bench_draw_frame( ctx->twin );
+    }
+}
+
+// All damaged, nothing changed: the shadow compare on its own.
+static void bench_draw_unchanged( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        termwin_damage_rows( ctx->twin, 0, ctx->twin->rows );
+        bench_draw_frame( ctx->twin );
+    }
+}
+
+// What a line of output at the bottom does: move up, draw the new row.
+static void bench_draw_scroll( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+    int rows = ctx->twin->rows;
+    VTermRect dest = { 0, rows - 1, 0, ctx->twin->cols };
+    VTermRect src = { 1, rows, 0, ctx->twin->cols };
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        if ( !termwin_moverect_callback( dest, src, ctx->twin ) )
+            termwin_damage_rows( ctx->twin, 0, rows - 1 );
+        termwin_shadow_invalidate( ctx->twin, rows - 1, rows );
+        termwin_damage_rows( ctx->twin, rows - 1, rows );
+        bench_draw_frame( ctx->twin );
+    }
+}
+
+// 32 scattered cells, like a clock and a few counters updating.
+static void bench_draw_sparse( void *user, uint64_t iters )
+{
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )user;
+    termwin *twin = ctx->twin;
+
+    for ( uint64_t i = 0; i < iters; i++ )
+    {
+        for ( int j = 0; j < 32; j++ )
+        {
+            int row = bench_rand( &ctx->rng ) % twin->rows;
+            int col = bench_rand( &ctx->rng ) % twin->cols;
+            VTermRect rect = { row, row + 1, col, col + 1 };
+
+            twin->shadow[ row * twin->cols + col ].pairid = -1;
+            termwin_damage_callback( rect, twin );
+        }
+        bench_draw_frame( twin );
+    }
+}
+
+// A screen of 256 colour words, every fourth one bold.
+static void bench_fill_screen( VTerm *vt )
+{
+    char buf[ 64 * 1024 ];
+    size_t len = 0;
+
+    for ( int row = 0; row < BENCH_ROWS; row++ )
+    {
+        len += snprintf( buf + len, sizeof( buf ) - len, "\x1b[%d;1H", row + 1 );
+        for ( int col = 0; col + 8 <= BENCH_COLS; col += 8 )
+        {
+            int word = row * BENCH_COLS / 8 + col / 8;
+
+            len += snprintf( buf + len, sizeof( buf ) - len, "\x1b[%s38;5;%d;48;5;%dmword%03d ",
+                             ( word % 4 ) ? "0;" : "1;", word % 256, ( word * 7 ) % 256, word % 1000 );
+        }
+        vterm_input_write( vt, buf, len );
+        len = 0;
+    }
+    vterm_screen_flush_damage( vterm_obtain_screen( vt ) );
+}
+
+static void bench_draw_suite( bench *b, bench_termwin_ctx *ctx, const char *backend )
+{
+    static const struct
+    {
+        const char *name;
+        bench_fn fn;
+    } s_draws[] =
+        {
+          { "full", bench_draw_full },
+          { "unchanged", bench_draw_unchanged },
+          { "scroll", bench_draw_scroll },
+          { "sparse", bench_draw_sparse },
+        };
+    char name[ 64 ];
+
+    ctx->vt = vterm_new( BENCH_ROWS, BENCH_COLS );
+    vterm_set_utf8( ctx->vt, 1 );
+    termwin_setvterm( ctx->twin, ctx->vt );
+
+    VTermScreen *vts = vterm_obtain_screen( ctx->vt );
+    vterm_screen_reset( vts, 1 );
+    vterm_screen_set_callbacks( vts, &s_bench_screen_cbs, ctx->twin );
+    bench_fill_screen( ctx->vt );
+    bench_draw_frame( ctx->twin );
+
+    for ( size_t i = 0; i < sizeof( s_draws ) / sizeof( s_draws[ 0 ] ); i++ )
+    {
+        snprintf( name, sizeof( name ), "draw/%s/%s", backend, s_draws[ i ].name );
+        bench_run( b, name, s_draws[ i ].fn, ctx, 1, 0 );
+    }
+}
+
+void bench_termwin( bench *b )
+{
+    static const int s_palettes[] = { 8, 16, 88, 256 };
+    bench_termwin_ctx *ctx = ( bench_termwin_ctx * )calloc( 1, sizeof( *ctx ) );
+    char name[ 64 ];
+
+    if ( !ctx )
+        FATAL_ERROR( calloc );
+
+    ctx->rng = 0x12345678;
+    for ( int i = 0; i < BENCH_COLORS; i++ )
+    {
+        uint32_t rgb = bench_rand( &ctx->rng );
+
+        ctx->colors[ i ].red = rgb & 0xff;
+        ctx->colors[ i ].green = ( rgb >> 8 ) & 0xff;
+        ctx->colors[ i ].blue = ( rgb >> 16 ) & 0xff;
+    }
+
+    // ncurses into /dev/null, with a 256 colour terminfo so every palette
+    // size below is possible.
+    ctx->twin = termwin_init_headless( "xterm-256color", BENCH_ROWS, BENCH_COLS );
+    if ( !ctx->twin )
+        FATAL_ERROR( termwin_init_headless );
+    bench_draw_suite( b, ctx, "ncurses" );
+
+    for ( size_t p = 0; p < sizeof( s_palettes ) / sizeof( s_palettes[ 0 ] ); p++ )
+    {
+        int numcolors = s_palettes[ p ];
+
+        if ( numcolors > COLORS )
+            continue;
+        bench_set_numcolors( ctx->twin, numcolors );
+
+        // 64 colours over and over: all cache hits after the first pass.
+        ctx->color_mask = 63;
+        snprintf( name, sizeof( name ), "colorid/hit/%d", numcolors );
+        bench_run( b, name, bench_colorid, ctx, BENCH_LOOKUPS, 0 );
+
+        ctx->color_mask = BENCH_COLORS - 1;
+        snprintf( name, sizeof( name ), "colorid/miss/%d", numcolors );
+        bench_run( b, name, bench_colorid, ctx, BENCH_LOOKUPS, 0 );
+
+        // Random fg / bg pairs out of the palette. With 256 colours there
+        // are more of them than COLOR_PAIRS, so this one evicts.
+        for ( int i = 0; i < BENCH_COLORS; i++ )
+            ctx->pairs[ i ] = ( uint16_t )( ( ( bench_rand( &ctx->rng ) % numcolors ) << 8 ) | ( bench_rand( &ctx->rng ) % numcolors ) );
+        snprintf( name, sizeof( name ), "pairid/%d", numcolors );
+        bench_run( b, name, bench_pairid, ctx, BENCH_LOOKUPS, 0 );
+    }
+
+    termwin_free( ctx->twin );
+    vterm_free( ctx->vt );
+
+    ctx->twin = termwin_init_direct_headless( BENCH_ROWS, BENCH_COLS, 1 );
+    bench_draw_suite( b, ctx, "direct" );
+    termwin_free( ctx->twin );
+    vterm_free( ctx->vt );
+
+    free( ctx );
+}
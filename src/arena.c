@@ -0,0 +1,224 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "arena.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_THREAD_SIZE ( 64 * 1024 )
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__( ( aligned( ARENA_ALIGN ) ) );
+} arena_block;
+
+struct arena
+{
+    arena_block *first;
+    arena_block *cur; // Allocations come from here; blocks after it are empty
+    arena_stats stats;
+};
+
+static __thread arena *t_arena = NULL;
+
+static arena_block *arena_new_block( size_t size )
+{
+    arena_block *block = ( arena_block * )malloc( sizeof( *block ) + size );
+
+    if ( !block )
+        FATAL_ERROR( malloc );
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+arena *arena_init( size_t size )
+{
+    arena *a = ( arena * )calloc( 1, sizeof( *a ) );
+
+    if ( !a )
+        FATAL_ERROR( calloc );
+
+    a->first = arena_new_block( size );
+    a->cur = a->first;
+    a->stats.size = size;
+    return a;
+}
+
+void arena_free( arena *a )
+{
+    if ( a )
+    {
+        arena_block *block = a->first;
+
+        while ( block )
+        {
+            arena_block *next = block->next;
+
+            free( block );
+            block = next;
+        }
+        free( a );
+    }
+}
+
+void *arena_alloc( arena *a, size_t size )
+{
+    arena_block *block = a->cur;
+
+    size = ( size + ARENA_ALIGN - 1 ) & ~( size_t )( ARENA_ALIGN - 1 );
+
+    while ( size > block->size - block->used )
+    {
+        if ( !block->next )
+        {
+            block->next = arena_new_block( MAX( size, block->size ) );
+            a->stats.size += block->next->size;
+            a->stats.grows++;
+        }
+        block = block->next;
+        block->used = 0;
+    }
+
+    void *ptr = block->data + block->used;
+
+    block->used += size;
+    a->cur = block;
+    a->stats.used += size;
+    a->stats.high_water = MAX( a->stats.high_water, a->stats.used );
+    return ptr;
+}
+
+void arena_reset( arena *a )
+{
+    // Swap a chain for one block that holds all of it.
+    if ( a->first->next )
+    {
+        size_t size = 0;
+
+        for ( arena_block *block = a->first; block; block = block->next )
+            size += block->size;
+
+        arena_block *block = a->first;
+        while ( block )
+        {
+            arena_block *next = block->next;
+
+            free( block );
+            block = next;
+        }
+
+        a->first = arena_new_block( size );
+        a->stats.size = size;
+    }
+
+    a->first->used = 0;
+    a->cur = a->first;
+    a->stats.used = 0;
+    a->stats.resets++;
+}
+
+arena_mark arena_getmark( arena *a )
+{
+    arena_mark mark;
+
+    mark.block = a->cur;
+    mark.used = a->cur->used;
+    mark.handed = a->stats.used;
+    return mark;
+}
+
+void arena_release( arena *a, arena_mark mark )
+{
+    a->cur = ( arena_block * )mark.block;
+    a->cur->used = mark.used;
+    a->stats.used = mark.handed;
+}
+
+void arena_getstats( arena *a, arena_stats *stats )
+{
+    *stats = a->stats;
+}
+
+arena *arena_thread()
+{
+    if ( !t_arena )
+        t_arena = arena_init( ARENA_THREAD_SIZE );
+    return t_arena;
+}
+
+void arena_thread_free()
+{
+    arena_free( t_arena );
+    t_arena = NULL;
+}
+
+#ifdef ARENA_COUNT_HEAP
+
+// Stand in for the libc allocator in the whole process, libraries
+// included, and count calls on the way through.
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t nmemb, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+
+static uint64_t g_heap_allocs = 0;
+
+void *malloc( size_t size )
+{
+    __atomic_add_fetch( &g_heap_allocs, 1, __ATOMIC_RELAXED );
+    return __libc_malloc( size );
+}
+
+void *calloc( size_t nmemb, size_t size )
+{
+    __atomic_add_fetch( &g_heap_allocs, 1, __ATOMIC_RELAXED );
+    return __libc_calloc( nmemb, size );
+}
+
+void *realloc( void *ptr, size_t size )
+{
+    __atomic_add_fetch( &g_heap_allocs, 1, __ATOMIC_RELAXED );
+    return __libc_realloc( ptr, size );
+}
+
+uint64_t arena_heap_allocs()
+{
+    return __atomic_load_n( &g_heap_allocs, __ATOMIC_RELAXED );
+}
+
+#endif
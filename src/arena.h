@@ -0,0 +1,83 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+// Scratch memory that's handed out by bumping a pointer and given back all
+// at once. Allocations come from one block; when a pass needs more, extra
+// blocks are chained on and at the next arena_reset replaced by a single
+// block big enough for the lot. Once the high water mark has been reached
+// an arena doesn't touch the heap again.
+//
+// Each thread has one (arena_thread). The main loop resets its own every
+// iteration, so anything it hands out there lasts until the next one. Code
+// that may run on any thread brackets its use with arena_getmark and
+// arena_release instead.
+
+typedef struct arena arena;
+
+typedef struct arena_mark
+{
+    void *block;
+    size_t used;
+    size_t handed;
+} arena_mark;
+
+typedef struct arena_stats
+{
+    size_t size;       // Bytes in the arena's blocks
+    size_t used;       // Bytes handed out since the last reset
+    size_t high_water; // Most ever handed out between resets
+    uint64_t resets;
+    uint64_t grows;    // Blocks added because a pass didn't fit
+} arena_stats;
+
+arena *arena_init( size_t size );
+void arena_free( arena *a );
+
+// size bytes, 16 byte aligned, until the next reset or release.
+void *arena_alloc( arena *a, size_t size );
+// Give back everything.
+void arena_reset( arena *a );
+// Give back everything allocated since mark was taken.
+arena_mark arena_getmark( arena *a );
+void arena_release( arena *a, arena_mark mark );
+void arena_getstats( arena *a, arena_stats *stats );
+
+// The calling thread's arena, made on first use.
+arena *arena_thread();
+void arena_thread_free();
+
+// Debug builds count every malloc, calloc and realloc in the process (ASAN
+// builds have their own allocator, so not those).
+#if defined( DEBUG ) && !defined( __SANITIZE_ADDRESS__ )
+#define ARENA_COUNT_HEAP 1
+uint64_t arena_heap_allocs();
+#endif
+
+#endif // _ARENA_H_
@@ -6,10 +6,13 @@
  * - Four log levels (debug, info, warn, error).
  * - Custom formats.
  * - Fast.
+ * - Optional asynchronous writes from a background thread.
  *
  * Dependencies:
- * - Should conform to C89, C++98 (but requires vsnprintf, unfortunately).
- * - POSIX environment.
+ * - C99 or C++11: variadic macros, va_copy and vsnprintf.
+ * - POSIX environment, pthreads.
+ * - GCC style __atomic builtins for async mode, __thread for the buffer
+ *   messages over 4096 bytes are formatted in.
  *
  * USAGE:
  *
@@ -43,8 +46,11 @@
  *
  * The CLOG macro used in the call to clog_info is a helper that passes the
  * __FILE__ and __LINE__ parameters for you, so you don't have to type them
- * every time. (It could be prettier with variadic macros, but that requires
- * C99 or C++11 to be standards compliant.)
+ * every time.
+ *
+ * The log functions are wrapped in (C99) variadic macros that check the
+ * logger's level before any arguments are evaluated.  Define CLOG_MIN_LEVEL
+ * to 1 (info), 2 (warn) or 3 (error) to compile out the levels below it.
  *
  * Errors encountered by clog will be printed to stderr.  You can suppress
  * these by defining a macro called CLOG_SILENT before including clog.h.
@@ -72,6 +78,9 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 /* Number of loggers that can be defined. */
 #define CLOG_MAX_LOGGERS 16
@@ -83,6 +92,11 @@
  * they will not appear in the log. */
 #define CLOG_DATETIME_LENGTH 256
 
+/* Calls below this level are compiled out (0: debug ... 3: error). */
+#ifndef CLOG_MIN_LEVEL
+#define CLOG_MIN_LEVEL 0
+#endif
+
 /* Default format strings. */
 #define CLOG_DEFAULT_FORMAT "%d %t %f(%n): %l: %m\n"
 #define CLOG_DEFAULT_DATE_FORMAT "%Y-%m-%d"
@@ -100,6 +114,13 @@ enum clog_level
     CLOG_ERROR
 };
 
+/* What an async logger does when its ring buffer is full. */
+enum clog_async_policy
+{
+    CLOG_ASYNC_DROP,  /* Drop the message and count it. */
+    CLOG_ASYNC_BLOCK  /* Wait for the writer thread to make room. */
+};
+
 struct clog;
 
 /**
@@ -164,10 +185,10 @@ void clog_free( int id );
  * @param ...
  * Any additional format arguments.
  */
-void clog_debug( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
-void clog_info( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
-void clog_warn( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
-void clog_error( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
+void( clog_debug )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
+void( clog_info )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
+void( clog_warn )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
+void( clog_error )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
 
 /**
  * Set the minimum level of messages that should be written to the log.
@@ -232,10 +253,93 @@ int clog_set_date_fmt( int id, const char *fmt );
  */
 int clog_set_fmt( int id, const char *fmt );
 
+/**
+ * Switch a logger to asynchronous mode.  Messages get formatted into a ring
+ * buffer by the caller and written out with writev() by a background thread,
+ * so a slow log file never stalls the logging thread.  Pending messages are
+ * flushed by clog_free().  Children fork()ed afterwards go back to
+ * synchronous writes.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param ring_size
+ * Size of the ring buffer in bytes (rounded up to a power of two).
+ *
+ * @param policy
+ * What to do with new messages when the ring buffer is full.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_async( int id, size_t ring_size, enum clog_async_policy policy );
+
+/**
+ * Number of messages dropped by an async logger with CLOG_ASYNC_DROP.
+ */
+unsigned long clog_get_dropped( int id );
+
+/**
+ * Times a thread's buffer for messages over 4096 bytes had to grow.
+ */
+unsigned long clog_get_grows( void );
+
 /*
  * No need to read below this point.
  */
 
+/**
+ * Async logger state.  Producers serialize on a spinlock to copy into the
+ * ring and only touch the mutex when the writer is asleep or they have to
+ * wait for room.
+ */
+struct clog_async
+{
+    char *ring;
+    size_t mask;
+
+    /* Free running positions: head is written by producers, tail by the
+     * writer thread.  head - tail bytes are pending. */
+    size_t head;
+    size_t tail;
+
+    enum clog_async_policy policy;
+    int lock;
+    int writer_sleeping;
+    int waiters;
+    int quit;
+    unsigned long dropped;
+    unsigned long dropped_reported;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake_writer;
+    pthread_cond_t wake_producers;
+};
+
+/**
+ * Compiled format: clog_set_fmt() turns the format string into a list of
+ * these so logging doesn't have to parse it again.
+ */
+enum clog_fmt_op_type
+{
+    CLOG_OP_LITERAL, /* len bytes of fmt starting at offset */
+    CLOG_OP_DATE,
+    CLOG_OP_TIME,
+    CLOG_OP_LEVEL,
+    CLOG_OP_LINE,
+    CLOG_OP_FILE,
+    CLOG_OP_FUNC,
+    CLOG_OP_MESSAGE
+};
+
+struct clog_fmt_op
+{
+    unsigned char type;
+    unsigned short offset;
+    unsigned short len;
+};
+
 /**
  * The C logger structure.
  */
@@ -257,20 +361,90 @@ struct clog
     /* Time format */
     char time_fmt[ CLOG_FORMAT_LENGTH ];
 
+    /* fmt compiled into ops. */
+    struct clog_fmt_op ops[ CLOG_FORMAT_LENGTH ];
+    int nops;
+    int uses_time;
+
+    /* Formatted date and time, updated at most once per second. */
+    time_t cached_time;
+    char date_buf[ CLOG_DATETIME_LENGTH ];
+    char time_buf[ CLOG_DATETIME_LENGTH ];
+    size_t date_len;
+    size_t time_len;
+
     /* Tracks whether the fd needs to be closed eventually. */
     int opened;
+
+    /* Non-NULL when writes go through the background thread. */
+    struct clog_async *async;
 };
 
 void _clog_err( const char *fmt, ... );
 
+/* What the log functions are built on, for benchmarks. */
+size_t _clog_format( struct clog *logger, char buf[], size_t buf_size,
+                     const char *sfile, int sline, const char *sfunc, const char *level,
+                     const char *message, size_t message_len );
+void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level level,
+                int id, const char *fmt, va_list ap );
+
 #ifdef CLOG_MAIN
 struct clog *_clog_loggers[ CLOG_MAX_LOGGERS ] = { 0 };
 #else
 extern struct clog *_clog_loggers[ CLOG_MAX_LOGGERS ];
 #endif
 
+/* The logger id is the fourth argument once CLOG( id ) has been expanded. */
+#define _CLOG_ARG4( _file, _line, _func, _id, ... ) _id
+
+/* Missing loggers go through so the call can report the error. */
+#define _CLOG_ENABLED( _level, _id ) \
+    ( !_clog_loggers[ _id ] || ( _level ) >= _clog_loggers[ _id ]->level )
+
+#define _CLOG_CALL( _level, _func, ... )                          \
+    do                                                            \
+    {                                                             \
+        if ( _CLOG_ENABLED( _level, _CLOG_ARG4( __VA_ARGS__ ) ) ) \
+            ( _func )( __VA_ARGS__ );                             \
+    } while ( 0 )
+
+/* Compiled out, but arguments are still type checked and count as used. */
+#define _CLOG_NOCALL( _func, ... )    \
+    do                                \
+    {                                 \
+        if ( 0 )                      \
+            ( _func )( __VA_ARGS__ ); \
+    } while ( 0 )
+
+#if CLOG_MIN_LEVEL <= 0
+#define clog_debug( ... ) _CLOG_CALL( CLOG_DEBUG, clog_debug, __VA_ARGS__ )
+#else
+#define clog_debug( ... ) _CLOG_NOCALL( clog_debug, __VA_ARGS__ )
+#endif
+
+#if CLOG_MIN_LEVEL <= 1
+#define clog_info( ... ) _CLOG_CALL( CLOG_INFO, clog_info, __VA_ARGS__ )
+#else
+#define clog_info( ... ) _CLOG_NOCALL( clog_info, __VA_ARGS__ )
+#endif
+
+#if CLOG_MIN_LEVEL <= 2
+#define clog_warn( ... ) _CLOG_CALL( CLOG_WARN, clog_warn, __VA_ARGS__ )
+#else
+#define clog_warn( ... ) _CLOG_NOCALL( clog_warn, __VA_ARGS__ )
+#endif
+
+#if CLOG_MIN_LEVEL <= 3
+#define clog_error( ... ) _CLOG_CALL( CLOG_ERROR, clog_error, __VA_ARGS__ )
+#else
+#define clog_error( ... ) _CLOG_NOCALL( clog_error, __VA_ARGS__ )
+#endif
+
 #ifdef CLOG_MAIN
 
+#include <stdint.h>
+
 const char *const CLOG_LEVEL_NAMES[] = {
     "DEBUG",
     "INFO",
@@ -295,6 +469,8 @@ int clog_init_path( int id, const char *const path )
     return 0;
 }
 
+void _clog_compile_fmt( struct clog *logger );
+
 int clog_init_fd( int id, int fd )
 {
     struct clog *logger;
@@ -315,18 +491,27 @@ int clog_init_fd( int id, int fd )
     logger->level = CLOG_DEBUG;
     logger->fd = fd;
     logger->opened = 0;
+    logger->async = NULL;
     strcpy( logger->fmt, CLOG_DEFAULT_FORMAT );
     strcpy( logger->date_fmt, CLOG_DEFAULT_DATE_FORMAT );
     strcpy( logger->time_fmt, CLOG_DEFAULT_TIME_FORMAT );
+    logger->cached_time = ( time_t )-1;
+    _clog_compile_fmt( logger );
 
     _clog_loggers[ id ] = logger;
     return 0;
 }
 
+void _clog_async_stop( struct clog *logger );
+
 void clog_free( int id )
 {
     if ( _clog_loggers[ id ] )
     {
+        if ( _clog_loggers[ id ]->async )
+        {
+            _clog_async_stop( _clog_loggers[ id ] );
+        }
         if ( _clog_loggers[ id ]->opened )
         {
             close( _clog_loggers[ id ]->fd );
@@ -364,6 +549,7 @@ int clog_set_time_fmt( int id, const char *fmt )
         return 1;
     }
     strcpy( logger->time_fmt, fmt );
+    logger->cached_time = ( time_t )-1;
     return 0;
 }
 
@@ -381,6 +567,7 @@ int clog_set_date_fmt( int id, const char *fmt )
         return 1;
     }
     strcpy( logger->date_fmt, fmt );
+    logger->cached_time = ( time_t )-1;
     return 0;
 }
 
@@ -398,61 +585,420 @@ int clog_set_fmt( int id, const char *fmt )
         return 1;
     }
     strcpy( logger->fmt, fmt );
+    _clog_compile_fmt( logger );
     return 0;
 }
 
-/* Internal functions */
+void *_clog_async_thread( void *arg );
+void _clog_async_atfork_child( void );
 
-size_t
-_clog_append_str( char **dst, char *orig_buf, const char *src, size_t cur_size )
+int clog_set_async( int id, size_t ring_size, enum clog_async_policy policy )
+{
+    static int atfork_registered = 0;
+    struct clog *logger = _clog_loggers[ id ];
+    struct clog_async *async;
+    size_t size = 4096;
+
+    if ( logger == NULL )
+    {
+        _clog_err( "clog_set_async: No such logger: %d\n", id );
+        return 1;
+    }
+    if ( logger->async )
+    {
+        _clog_err( "clog_set_async: Logger %d already async.\n", id );
+        return 1;
+    }
+
+    while ( size < ring_size )
+    {
+        size *= 2;
+    }
+
+    async = ( struct clog_async * )calloc( 1, sizeof( *async ) );
+    if ( async == NULL || ( async->ring = ( char * )malloc( size ) ) == NULL )
+    {
+        _clog_err( "Failed to allocate async logger: %s\n", strerror( errno ) );
+        free( async );
+        return 1;
+    }
+    async->mask = size - 1;
+    async->policy = policy;
+    pthread_mutex_init( &async->mutex, NULL );
+    pthread_cond_init( &async->wake_writer, NULL );
+    pthread_cond_init( &async->wake_producers, NULL );
+
+    logger->async = async;
+    if ( pthread_create( &async->thread, NULL, _clog_async_thread, logger ) )
+    {
+        _clog_err( "clog_set_async: pthread_create failed.\n" );
+        logger->async = NULL;
+        free( async->ring );
+        free( async );
+        return 1;
+    }
+
+    if ( !atfork_registered )
+    {
+        pthread_atfork( NULL, NULL, _clog_async_atfork_child );
+        atfork_registered = 1;
+    }
+    return 0;
+}
+
+unsigned long clog_get_dropped( int id )
 {
-    size_t new_size = cur_size;
+    struct clog *logger = _clog_loggers[ id ];
 
-    while ( strlen( *dst ) + strlen( src ) >= new_size )
+    if ( logger == NULL || logger->async == NULL )
+    {
+        return 0;
+    }
+    return __atomic_load_n( &logger->async->dropped, __ATOMIC_RELAXED );
+}
+
+/* Messages too long for the stack buffers are formatted here.  It only
+ * grows, so once it fits the longest message a thread logs, logging stays
+ * off the heap.  Left for the process exit to free. */
+static __thread char *_clog_long_buf = NULL;
+static __thread size_t _clog_long_size = 0;
+static unsigned long _clog_grows = 0;
+
+unsigned long clog_get_grows( void )
+{
+    return __atomic_load_n( &_clog_grows, __ATOMIC_RELAXED );
+}
+
+/* This thread's long message buffer, at least size bytes. NULL if it
+ * couldn't grow. */
+static char *_clog_long_reserve( size_t size )
+{
+    char *buf;
+    size_t new_size;
+
+    if ( size <= _clog_long_size )
+    {
+        return _clog_long_buf;
+    }
+
+    new_size = _clog_long_size ? _clog_long_size : 8192;
+    while ( new_size < size )
     {
         new_size *= 2;
     }
-    if ( new_size != cur_size )
+    buf = ( char * )realloc( _clog_long_buf, new_size );
+    if ( buf == NULL )
+    {
+        return NULL;
+    }
+    _clog_long_buf = buf;
+    _clog_long_size = new_size;
+    __atomic_add_fetch( &_clog_grows, 1, __ATOMIC_RELAXED );
+    return buf;
+}
+
+/* Internal functions */
+
+void
+_clog_async_write_fd( int fd, struct iovec *iov, int iovcnt )
+{
+    while ( iovcnt > 0 )
+    {
+        ssize_t result = writev( fd, iov, iovcnt );
+
+        if ( result < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
+            return;
+        }
+
+        /* Skip past whatever made it out. */
+        while ( iovcnt > 0 && ( size_t )result >= iov->iov_len )
+        {
+            result -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if ( iovcnt > 0 )
+        {
+            iov->iov_base = ( char * )iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+}
+
+void *
+_clog_async_thread( void *arg )
+{
+    struct clog *logger = ( struct clog * )arg;
+    struct clog_async *async = logger->async;
+    sigset_t all;
+
+    /* Leave signals to the application's threads. */
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, NULL );
+
+    for ( ;; )
     {
-        if ( *dst == orig_buf )
+        size_t head = __atomic_load_n( &async->head, __ATOMIC_SEQ_CST );
+        size_t tail = async->tail;
+        size_t start;
+        size_t len;
+        int iovcnt = 0;
+        struct iovec iov[ 3 ];
+        char note[ 64 ];
+        unsigned long dropped;
+
+        if ( head == tail )
+        {
+            int quit;
+
+            pthread_mutex_lock( &async->mutex );
+            __atomic_store_n( &async->writer_sleeping, 1, __ATOMIC_SEQ_CST );
+            while ( !( quit = async->quit ) &&
+                    __atomic_load_n( &async->head, __ATOMIC_SEQ_CST ) == tail )
+            {
+                pthread_cond_wait( &async->wake_writer, &async->mutex );
+            }
+            __atomic_store_n( &async->writer_sleeping, 0, __ATOMIC_SEQ_CST );
+            pthread_mutex_unlock( &async->mutex );
+
+            if ( quit && __atomic_load_n( &async->head, __ATOMIC_SEQ_CST ) == tail )
+            {
+                break;
+            }
+            continue;
+        }
+
+        /* Everything pending goes out in one writev, split at the wrap. */
+        start = tail & async->mask;
+        len = head - tail;
+        iov[ iovcnt ].iov_base = async->ring + start;
+        iov[ iovcnt ].iov_len = len;
+        if ( start + len > async->mask + 1 )
+        {
+            iov[ iovcnt ].iov_len = async->mask + 1 - start;
+            iov[ iovcnt + 1 ].iov_base = async->ring;
+            iov[ iovcnt + 1 ].iov_len = len - iov[ iovcnt ].iov_len;
+            iovcnt++;
+        }
+        iovcnt++;
+
+        dropped = __atomic_load_n( &async->dropped, __ATOMIC_RELAXED );
+        if ( dropped != async->dropped_reported )
         {
-            *dst = ( char * )malloc( new_size );
-            strcpy( *dst, orig_buf );
+            int n = snprintf( note, sizeof( note ), "clog: dropped %lu messages\n",
+                              dropped - async->dropped_reported );
+            iov[ iovcnt ].iov_base = note;
+            iov[ iovcnt ].iov_len = ( size_t )n;
+            iovcnt++;
+            async->dropped_reported = dropped;
         }
-        else
+
+        _clog_async_write_fd( logger->fd, iov, iovcnt );
+
+        __atomic_store_n( &async->tail, head, __ATOMIC_SEQ_CST );
+        if ( __atomic_load_n( &async->waiters, __ATOMIC_SEQ_CST ) )
         {
-            *dst = ( char * )realloc( *dst, new_size );
+            pthread_mutex_lock( &async->mutex );
+            pthread_cond_broadcast( &async->wake_producers );
+            pthread_mutex_unlock( &async->mutex );
         }
     }
 
-    strcat( *dst, src );
-    return new_size;
+    return NULL;
 }
 
-size_t
-_clog_append_int( char **dst, char *orig_buf, long int d, size_t cur_size )
+void
+_clog_async_lock( struct clog_async *async )
 {
-    char buf[ 40 ]; /* Enough for 128-bit decimal */
-    if ( snprintf( buf, 40, "%ld", d ) >= 40 )
+    while ( __atomic_exchange_n( &async->lock, 1, __ATOMIC_ACQUIRE ) )
     {
-        return cur_size;
+        while ( __atomic_load_n( &async->lock, __ATOMIC_RELAXED ) )
+        {
+        }
     }
-    return _clog_append_str( dst, orig_buf, buf, cur_size );
 }
 
-size_t
-_clog_append_time( char **dst, char *orig_buf, struct tm *lt,
-                   const char *fmt, size_t cur_size )
+void
+_clog_async_unlock( struct clog_async *async )
+{
+    __atomic_store_n( &async->lock, 0, __ATOMIC_RELEASE );
+}
+
+void
+_clog_async_write( struct clog_async *async, const char *message, size_t len )
+{
+    size_t size = async->mask + 1;
+    size_t head;
+    size_t start;
+    size_t first;
+
+    _clog_async_lock( async );
+    head = async->head;
+
+    while ( len > size - ( head - __atomic_load_n( &async->tail, __ATOMIC_SEQ_CST ) ) )
+    {
+        if ( async->policy == CLOG_ASYNC_DROP || len > size )
+        {
+            __atomic_add_fetch( &async->dropped, 1, __ATOMIC_RELAXED );
+            _clog_async_unlock( async );
+            return;
+        }
+
+        /* CLOG_ASYNC_BLOCK: wait for the writer to drain some. */
+        _clog_async_unlock( async );
+        pthread_mutex_lock( &async->mutex );
+        __atomic_add_fetch( &async->waiters, 1, __ATOMIC_SEQ_CST );
+        pthread_cond_signal( &async->wake_writer );
+        while ( len > size - ( head - __atomic_load_n( &async->tail, __ATOMIC_SEQ_CST ) ) )
+        {
+            pthread_cond_wait( &async->wake_producers, &async->mutex );
+        }
+        __atomic_sub_fetch( &async->waiters, 1, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &async->mutex );
+
+        _clog_async_lock( async );
+        head = async->head;
+    }
+
+    start = head & async->mask;
+    first = ( start + len > size ) ? ( size - start ) : len;
+    memcpy( async->ring + start, message, first );
+    memcpy( async->ring, message + first, len - first );
+    __atomic_store_n( &async->head, head + len, __ATOMIC_SEQ_CST );
+    _clog_async_unlock( async );
+
+    /* Only pay for the mutex when the writer has gone to sleep. */
+    if ( __atomic_load_n( &async->writer_sleeping, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &async->mutex );
+        pthread_cond_signal( &async->wake_writer );
+        pthread_mutex_unlock( &async->mutex );
+    }
+}
+
+void
+_clog_async_stop( struct clog *logger )
+{
+    struct clog_async *async = logger->async;
+
+    pthread_mutex_lock( &async->mutex );
+    async->quit = 1;
+    pthread_cond_signal( &async->wake_writer );
+    pthread_mutex_unlock( &async->mutex );
+    pthread_join( async->thread, NULL );
+
+    logger->async = NULL;
+    pthread_cond_destroy( &async->wake_producers );
+    pthread_cond_destroy( &async->wake_writer );
+    pthread_mutex_destroy( &async->mutex );
+    free( async->ring );
+    free( async );
+}
+
+void
+_clog_async_atfork_child( void )
+{
+    /* The writer thread doesn't exist in the child. Drop the pending data
+     * (the parent writes it) and go back to synchronous writes. */
+    int id;
+
+    for ( id = 0; id < CLOG_MAX_LOGGERS; id++ )
+    {
+        if ( _clog_loggers[ id ] )
+        {
+            _clog_loggers[ id ]->async = NULL;
+        }
+    }
+}
+
+void
+_clog_compile_fmt( struct clog *logger )
 {
-    char buf[ CLOG_DATETIME_LENGTH ];
-    size_t result = strftime( buf, CLOG_DATETIME_LENGTH, fmt, lt );
+    const char *fmt = logger->fmt;
+    size_t i;
 
-    if ( result > 0 )
+    logger->nops = 0;
+    logger->uses_time = 0;
+    for ( i = 0; fmt[ i ]; ++i )
     {
-        return _clog_append_str( dst, orig_buf, buf, cur_size );
+        struct clog_fmt_op *op = &logger->ops[ logger->nops ];
+
+        if ( fmt[ i ] != '%' || fmt[ i + 1 ] == '%' )
+        {
+            /* "%%" becomes a literal "%". */
+            if ( fmt[ i ] == '%' )
+            {
+                ++i;
+            }
+            if ( logger->nops && op[ -1 ].type == CLOG_OP_LITERAL &&
+                 op[ -1 ].offset + op[ -1 ].len == i )
+            {
+                op[ -1 ].len++;
+                continue;
+            }
+            op->type = CLOG_OP_LITERAL;
+            op->offset = ( unsigned short )i;
+            op->len = 1;
+            logger->nops++;
+            continue;
+        }
+
+        switch ( fmt[ ++i ] )
+        {
+        case 'd':
+            op->type = CLOG_OP_DATE;
+            logger->uses_time = 1;
+            break;
+        case 't':
+            op->type = CLOG_OP_TIME;
+            logger->uses_time = 1;
+            break;
+        case 'l':
+            op->type = CLOG_OP_LEVEL;
+            break;
+        case 'n':
+            op->type = CLOG_OP_LINE;
+            break;
+        case 'f':
+            op->type = CLOG_OP_FILE;
+            break;
+        case 'F':
+            op->type = CLOG_OP_FUNC;
+            break;
+        case 'm':
+            op->type = CLOG_OP_MESSAGE;
+            break;
+        case 0:
+            /* Trailing '%' */
+            return;
+        default:
+            /* Unknown substitutions are dropped. */
+            continue;
+        }
+        logger->nops++;
     }
+}
+
+void
+_clog_update_time( struct clog *logger )
+{
+    time_t t = time( NULL );
+
+    if ( t != logger->cached_time )
+    {
+        struct tm lt;
 
-    return cur_size;
+        localtime_r( &t, &lt );
+        logger->date_len = strftime( logger->date_buf, CLOG_DATETIME_LENGTH, logger->date_fmt, &lt );
+        logger->time_len = strftime( logger->time_buf, CLOG_DATETIME_LENGTH, logger->time_fmt, &lt );
+        logger->cached_time = t;
+    }
 }
 
 const char *
@@ -473,91 +1019,111 @@ _clog_basename( const char *path )
     return path;
 }
 
-char *
-_clog_format( const struct clog *logger, char buf[], size_t buf_size,
+/* Expand the compiled format into buf.  Returns the full length, which may
+ * be more than buf_size - 1 in which case the output was truncated. */
+size_t
+_clog_format( struct clog *logger, char buf[], size_t buf_size,
               const char *sfile, int sline, const char *sfunc, const char *level,
-              const char *message )
+              const char *message, size_t message_len )
 {
-    size_t cur_size = buf_size;
-    char *result = buf;
-    enum
+    size_t len = 0;
+    int i;
+
+    if ( logger->uses_time )
     {
-        NORMAL,
-        SUBST
-    } state = NORMAL;
-    size_t fmtlen = strlen( logger->fmt );
-    size_t i;
-    time_t t = time( NULL );
-    struct tm *lt = localtime( &t );
+        _clog_update_time( logger );
+    }
 
     sfile = _clog_basename( sfile );
-    result[ 0 ] = 0;
-    for ( i = 0; i < fmtlen; ++i )
+    for ( i = 0; i < logger->nops; ++i )
     {
-        if ( state == NORMAL )
+        const struct clog_fmt_op *op = &logger->ops[ i ];
+        const char *str = NULL;
+        size_t str_len = 0;
+        char num[ 24 ];
+
+        switch ( op->type )
         {
-            if ( logger->fmt[ i ] == '%' )
+        case CLOG_OP_LITERAL:
+            str = logger->fmt + op->offset;
+            str_len = op->len;
+            break;
+        case CLOG_OP_DATE:
+            str = logger->date_buf;
+            str_len = logger->date_len;
+            break;
+        case CLOG_OP_TIME:
+            str = logger->time_buf;
+            str_len = logger->time_len;
+            break;
+        case CLOG_OP_LEVEL:
+            str = level;
+            str_len = strlen( level );
+            break;
+        case CLOG_OP_LINE:
+        {
+            /* Digits backwards from the end of num. */
+            unsigned long d = ( sline < 0 ) ? ( unsigned long )-( long )sline : ( unsigned long )sline;
+            char *p = num + sizeof( num );
+
+            do
             {
-                state = SUBST;
-            }
-            else
+                *--p = ( char )( '0' + d % 10 );
+                d /= 10;
+            } while ( d );
+            if ( sline < 0 )
             {
-                char str[ 2 ] = { 0 };
-                str[ 0 ] = logger->fmt[ i ];
-                cur_size = _clog_append_str( &result, buf, str, cur_size );
+                *--p = '-';
             }
+            str = p;
+            str_len = num + sizeof( num ) - p;
+            break;
+        }
+        case CLOG_OP_FILE:
+            str = sfile;
+            str_len = strlen( sfile );
+            break;
+        case CLOG_OP_FUNC:
+            str = sfunc;
+            str_len = strlen( sfunc );
+            break;
+        case CLOG_OP_MESSAGE:
+            str = message;
+            str_len = message_len;
+            break;
         }
-        else
+
+        if ( len < buf_size )
         {
-            switch ( logger->fmt[ i ] )
-            {
-            case '%':
-                cur_size = _clog_append_str( &result, buf, "%", cur_size );
-                break;
-            case 't':
-                cur_size = _clog_append_time( &result, buf, lt,
-                                              logger->time_fmt, cur_size );
-                break;
-            case 'd':
-                cur_size = _clog_append_time( &result, buf, lt,
-                                              logger->date_fmt, cur_size );
-                break;
-            case 'l':
-                cur_size = _clog_append_str( &result, buf, level, cur_size );
-                break;
-            case 'n':
-                cur_size = _clog_append_int( &result, buf, sline, cur_size );
-                break;
-            case 'f':
-                cur_size = _clog_append_str( &result, buf, sfile, cur_size );
-                break;
-            case 'F':
-                cur_size = _clog_append_str( &result, buf, sfunc, cur_size );
-                break;
-            case 'm':
-                cur_size = _clog_append_str( &result, buf, message,
-                                             cur_size );
-                break;
-            }
-            state = NORMAL;
+            size_t n = buf_size - len;
+
+            memcpy( buf + len, str, ( str_len < n ) ? str_len : n );
         }
+        len += str_len;
     }
 
-    return result;
+    if ( buf_size )
+    {
+        buf[ ( len < buf_size ) ? len : buf_size - 1 ] = 0;
+    }
+    return len;
 }
 
 void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level level,
                 int id, const char *fmt, va_list ap )
 {
-    /* For speed: Use a stack buffer until message exceeds 4096, then switch
-     * to dynamically allocated.  This should greatly reduce the number of
-     * memory allocations (and subsequent fragmentation). */
+    /* For speed: Use stack buffers unless a message exceeds 4096 bytes, then
+     * switch to this thread's long message buffer: the text at the start,
+     * the formatted line after it. */
     char buf[ 4096 ];
-    size_t buf_size = 4096;
+    char message_buf[ 4096 ];
     char *dynbuf = buf;
-    char *message;
+    char *message = message_buf;
+    size_t text_size = 0;
+    size_t len;
     int result;
     struct clog *logger = _clog_loggers[ id ];
+    va_list ap2;
 
     if ( !logger )
     {
@@ -571,73 +1137,84 @@ void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level
     }
 
     /* Format the message text with the argument list. */
-    result = vsnprintf( dynbuf, buf_size, fmt, ap );
-    if ( ( size_t )result >= buf_size )
+    va_copy( ap2, ap );
+    result = vsnprintf( dynbuf, sizeof( buf ), fmt, ap );
+    if ( result < 0 )
     {
-        buf_size = result + 1;
-        dynbuf = ( char * )malloc( buf_size );
-        result = vsnprintf( dynbuf, buf_size, fmt, ap );
-        if ( ( size_t )result >= buf_size )
+        _clog_err( "Formatting failed (1).\n" );
+        va_end( ap2 );
+        return;
+    }
+    if ( ( size_t )result >= sizeof( buf ) )
+    {
+        text_size = ( size_t )result + 1;
+        dynbuf = _clog_long_reserve( text_size );
+        if ( dynbuf == NULL || vsnprintf( dynbuf, text_size, fmt, ap2 ) != result )
         {
-            /* Formatting failed -- too large */
             _clog_err( "Formatting failed (1).\n" );
-            free( dynbuf );
+            va_end( ap2 );
             return;
         }
     }
+    va_end( ap2 );
 
     /* Format according to log format and write to log */
+    len = _clog_format( logger, message, sizeof( message_buf ), sfile, sline, sfunc,
+                        CLOG_LEVEL_NAMES[ level ], dynbuf, ( size_t )result );
+    if ( len >= sizeof( message_buf ) )
     {
-        char message_buf[ 4096 ];
-        message = _clog_format( logger, message_buf, 4096, sfile, sline, sfunc,
-                                CLOG_LEVEL_NAMES[ level ], dynbuf );
-        if ( !message )
+        /* Growing may move the text too. */
+        message = _clog_long_reserve( text_size + len + 1 );
+        if ( message == NULL )
         {
             _clog_err( "Formatting failed (2).\n" );
-            if ( dynbuf != buf )
-            {
-                free( dynbuf );
-            }
             return;
         }
-        result = write( logger->fd, message, strlen( message ) );
-        if ( result == -1 )
-        {
-            _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
-        }
-        if ( message != message_buf )
+        if ( text_size )
         {
-            free( message );
+            dynbuf = message;
         }
-        if ( dynbuf != buf )
+        message += text_size;
+        _clog_format( logger, message, len + 1, sfile, sline, sfunc,
+                      CLOG_LEVEL_NAMES[ level ], dynbuf, ( size_t )result );
+    }
+
+    if ( logger->async )
+    {
+        _clog_async_write( logger->async, message, len );
+    }
+    else
+    {
+        result = write( logger->fd, message, len );
+        if ( result == -1 )
         {
-            free( dynbuf );
+            _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
         }
     }
 }
 
-void clog_debug( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void( clog_debug )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_DEBUG, id, fmt, ap );
 }
 
-void clog_info( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void( clog_info )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_INFO, id, fmt, ap );
 }
 
-void clog_warn( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void( clog_warn )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_WARN, id, fmt, ap );
 }
 
-void clog_error( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void( clog_error )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
@@ -27,181 +27,1674 @@
  **************************************************************************/
 #define _GNU_SOURCE
 #include <stdint.h>
+#include <inttypes.h>
 #include <locale.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 #include "vterm.h"
 #include "pseudo.h"
+#include "metrics.h"
+#include "latency.h"
 #include "termwin.h"
+#include "input.h"
+#include "writequeue.h"
+#include "ptyreader.h"
+#include "record.h"
+#include "remote.h"
+#include "scrollback.h"
+#include "sbview.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "arena.h"
+#include "eventloop.h"
+#include "server.h"
 #include "ya_getopt.h"
 #include "clog.h"
 #include "cvterm_utils.h"
 
+static int session_damage_callback( VTermRect rect, void *user );
+static int session_moverect_callback( VTermRect dest, VTermRect src, void *user );
+static int session_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user );
+static int session_settermprop_callback( VTermProp prop, VTermValue *val, void *user );
+static int session_bell_callback( void *user );
+static int sb_pushline_callback( int cols, const VTermScreenCell *cells, void *user );
+static int sb_popline_callback( int cols, VTermScreenCell *cells, void *user );
+
 static const VTermScreenCallbacks g_screen_cbs =
     {
-      termwin_damage_callback,      // damage
-      NULL,                         // moverect
-      termwin_movecursor_callback,  // movecursor
-      termwin_settermprop_callback, // settermprop
-      termwin_bell_callback,        // bell
-      NULL,                         // resize
-      NULL,                         // sb_pushline
-      NULL                          // sb_popline
+      session_damage_callback,      // damage
+      session_moverect_callback,    // moverect
+      session_movecursor_callback,  // movecursor
+      session_settermprop_callback, // settermprop
+      session_bell_callback,        // bell
+      NULL,                         // resize
+      sb_pushline_callback,         // sb_pushline
+      sb_popline_callback           // sb_popline
+    };
+
+typedef struct cvterm_opts
+{
+    const char *env_term;
+    const char *nc_term;
+    const char *logfile;
+    const char *log_mode;
+    const char *renderer;
+    int truecolor;
+    int wait_for_debugger;
+    int fps;
+    int latency_budget_ms;
+    int scrollback_mb;
+    int reader_ring;
+    int drain_budget_us;
+    const char *replay;
+    int replay_chunk;
+    int replay_rows;
+    int replay_cols;
+    int replay_tty;
+    int replay_offset;
+    int replay_realtime;
+    const char *record;
+    int record_input;
+    const char *stats_file;
+    int stats_interval;
+    const char *latency_trace;
+    int sessions;
+    int prefix_keys;
+    const char *server;
+    const char *attach;
+    const char *snapshot;
+    const char *snapshot_check;
+    const char *restore;
+    int startup_trace;
+
+    int argc;
+    const char **argv;
+    const char *argv_buf[ 2 ];
+} cvterm_opts;
+
+// One child on its own pty, with the vterm that parses its output. Only the
+// focused session is drawn; the rest keep parsing in the background and get
+// a full repaint when they are switched to.
+typedef struct session
+{
+    int id;
+    pid_t pid;
+    int master; // -1 when replaying
+    VTerm *vterm;
+    scrollback *sb;
+    inputparser *input;
+    writequeue *ptyqueue;
+    ptyreader *reader;
+    eventloop *el;
+
+    // Events always wanted on the master pty (none when the reader thread reads it).
+    int master_events;
+    int hangup;
+    int pending; // Output waiting for its turn in the background scheduler
+    int closed;  // Child is gone: freed by the main loop
+    int cursor_visible;
+
+    uint64_t bytes; // pty output parsed
+    uint64_t reads;
+
+    uint64_t input_due_ns; // When to give up on the rest of a key sequence
+} session;
+
+#define SESSIONS_MAX 64
+
+// Ctrl-] then n, p, or 1-9 switches sessions, and [, / or ? opens the
+// scrollback view. Ctrl-] twice sends a Ctrl-]. With one session that's
+// only on with --prefix_keys: Ctrl-] goes to the child otherwise.
+#define SESSION_PREFIX_KEY 0x1d
+
+// How long a read ending in ESC or a partial key sequence waits for the rest.
+#define INPUT_FLUSH_NS ( 10 * 1000000ULL )
+
+static session *g_sessions[ SESSIONS_MAX ];
+static int g_session_count = 0;
+static session *g_focus = NULL;
+static int g_session_prefix = 0; // Saw SESSION_PREFIX_KEY, waiting for the command
+static int g_prefix_keys = 0;    // SESSION_PREFIX_KEY commands are on
+static int g_session_next = 0;   // Where the background round robin starts
+
+static termwin *g_twin = NULL; // NULL with --server
+
+// What --server clients see of the focused session.
+static server *g_server = NULL;
+static termwin *g_client_twins[ SERVER_CLIENTS_MAX ];
+static int g_client_twin_count = 0;
+
+static recorder *g_recorder = NULL;
+static latency *g_latency = NULL;
+static int g_record_input = 0;
+static int g_host_paste = 0;
+
+// Size of each reader thread buffer.
+#define PTY_READER_BUFFER_SIZE ( 64 * 1024 )
+
+// Reading the pty: the read buffer adapts to the size of output bursts and
+// each wakeup stops parsing after budget_ns so a flood can't starve input or
+// rendering. Background sessions share budget_ns / OUTPUT_BACKGROUND_SHARE
+// per loop iteration between them.
+typedef struct output_drain
+{
+    char *buf;
+    size_t size;        // How much each read asks for
+    size_t size_max;    // Room in buf: it never shrinks, only size does
+    int small_reads;    // Consecutive reads that used less than 1/8 of buf
+    uint64_t budget_ns; // 0: no limit
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t yields; // Wakeups that stopped with output left over
+    uint64_t background_bytes;
+    uint64_t background_yields; // Loop iterations that left background output for later
+    metrics_hist read_bytes;
+    metrics_hist write_ns; // Time in vterm_input_write per read
+} output_drain;
+
+#define OUTPUT_READ_MIN ( 8 * 1024 )
+#define OUTPUT_READ_MAX ( 1024 * 1024 )
+#define OUTPUT_SHRINK_READS 64
+#define OUTPUT_BACKGROUND_SHARE 4
+
+// --startup_trace: when each step on the way to the first frame finished.
+#define STARTUP_PHASES_MAX 16
+
+typedef struct startup_trace
+{
+    uint64_t start_ns;
+    int count;
+    const char *names[ STARTUP_PHASES_MAX ];
+    uint64_t ns[ STARTUP_PHASES_MAX ];
+    int output_seen;
+    int frame_seen;
+} startup_trace;
+
+static startup_trace g_startup;
+
+static void startup_mark( const char *name )
+{
+    if ( g_startup.count < STARTUP_PHASES_MAX )
+    {
+        g_startup.names[ g_startup.count ] = name;
+        g_startup.ns[ g_startup.count++ ] = get_time_ns();
+    }
+}
+
+// One line per phase: how long it took and when it finished.
+static void startup_report( char *buf, size_t size )
+{
+    uint64_t prev_ns = g_startup.start_ns;
+    size_t len = snprintf( buf, size, "startup:\n" );
+
+    for ( int i = 0; ( i < g_startup.count ) && ( len < size ); i++ )
+    {
+        len += snprintf( buf + len, size - len, "  %-14s %8.2fms %8.2fms\n", g_startup.names[ i ],
+                         ( g_startup.ns[ i ] - prev_ns ) / 1e6, ( g_startup.ns[ i ] - g_startup.start_ns ) / 1e6 );
+        prev_ns = g_startup.ns[ i ];
+    }
+}
+
+static output_drain g_drain;
+
+// Main loop iterations. ARENA_COUNT_HEAP builds abort on one that went to
+// the heap: once buffers have grown to fit, moving output, input and
+// frames around shouldn't. Iterations that set alloc_ok did something
+// that is allowed to (a resize, a client or session coming or going).
+typedef struct loop_stats
+{
+    uint64_t iterations;
+    int alloc_ok;
+} loop_stats;
+
+static loop_stats g_loop;
+
+// Hand a read to the session's vterm (and the recording).
+static void output_drain_write( output_drain *drain, session *s, const char *buf, size_t len )
+{
+    drain->reads++;
+    drain->bytes += len;
+    metrics_hist_add( &drain->read_bytes, len );
+
+    s->reads++;
+    s->bytes += len;
+
+    // Captures only hold one screen: the first session's.
+    if ( g_recorder && !s->id )
+        record_chunk( g_recorder, RECORD_OUTPUT, buf, len );
+
+    uint64_t start_ns = get_time_ns();
+
+    if ( s != g_focus )
+        drain->background_bytes += len;
+    else if ( g_latency )
+        latency_output( g_latency, start_ns );
+
+    if ( !g_startup.output_seen && ( s == g_focus ) )
+    {
+        g_startup.output_seen = 1;
+        startup_mark( "first_output" );
+    }
+
+    vterm_input_write( s->vterm, buf, len );
+    metrics_hist_add( &drain->write_ns, get_time_ns() - start_ns );
+}
+
+static int output_drain_over_budget( output_drain *drain, uint64_t start_ns, uint64_t budget_ns )
+{
+    if ( budget_ns && ( get_time_ns() - start_ns >= budget_ns ) )
+    {
+        drain->yields++;
+        return 1;
+    }
+    return 0;
+}
+
+// Stop reading stdin once this much input is waiting for the child.
+#define PTY_QUEUE_MAX ( 4 * 1024 * 1024 )
+static int g_quit = 0;
+
+// Frame pacing: parse pty output as fast as it arrives, but draw at most
+// once per frame_ns. Output that shows up shortly after a keypress is most
+// likely its echo, so that gets drawn right away.
+typedef struct render_sched
+{
+    uint64_t frame_ns;      // Minimum time between frames (0: draw on every wakeup).
+    uint64_t latency_ns;    // Output this soon after a keypress is flushed immediately.
+    uint64_t last_frame_ns; // When we last drew.
+    uint64_t keypress_ns;   // When we last forwarded input to the pty (0: none pending).
+    int dirty;              // Something may have been damaged since the last frame.
+    int flush;              // Draw as soon as control gets back to the main loop.
+
+    // Per-frame draw times, only collected when record_frames is set.
+    int record_frames;
+    uint64_t *frame_times;
+    size_t frame_times_count;
+    size_t frame_times_size;
+} render_sched;
+
+static render_sched g_render;
+
+
+// The focused session goes to our own window and every attached client.
+// Background sessions only parse: what they'd draw is picked up by the
+// full repaint when they get focus.
+static int session_damage_callback( VTermRect rect, void *user )
+{
+    if ( user != g_focus )
+        return 1;
+
+    if ( g_twin )
+        termwin_damage_callback( rect, g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        termwin_damage_callback( rect, g_client_twins[ i ] );
+    return 1;
+}
+
+// If any window can't scroll, vterm sends damage instead, to all of them.
+static int session_moverect_callback( VTermRect dest, VTermRect src, void *user )
+{
+    int handled = 1;
+
+    if ( user != g_focus )
+        return 1;
+
+    if ( g_twin )
+        handled &= termwin_moverect_callback( dest, src, g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        handled &= termwin_moverect_callback( dest, src, g_client_twins[ i ] );
+    return handled;
+}
+
+static int session_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user )
+{
+    if ( user != g_focus )
+        return 1;
+
+    if ( g_twin )
+        termwin_movecursor_callback( pos, oldpos, visible, g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        termwin_movecursor_callback( pos, oldpos, visible, g_client_twins[ i ] );
+    return 1;
+}
+
+static int session_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
+{
+    session *s = ( session * )user;
+    int ret = 1;
+
+    // vterm can't be asked for this later, so keep it for focus switches.
+    if ( prop == VTERM_PROP_CURSORVISIBLE )
+        s->cursor_visible = !!val->boolean;
+
+    if ( s != g_focus )
+        return 1;
+
+    if ( g_twin )
+        ret = termwin_settermprop_callback( prop, val, g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        ret = termwin_settermprop_callback( prop, val, g_client_twins[ i ] );
+    return ret;
+}
+
+static int session_bell_callback( void *user )
+{
+    if ( user != g_focus )
+        return 1;
+
+    if ( g_twin )
+        termwin_bell_callback( g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        termwin_bell_callback( g_client_twins[ i ] );
+    return 1;
+}
+
+static int sb_pushline_callback( int cols, const VTermScreenCell *cells, void *user )
+{
+    session *s = ( session * )user;
+
+    if ( !s->sb )
+        return 0;
+
+    scrollback_push( s->sb, cols, cells );
+    return 1;
+}
+
+static int sb_popline_callback( int cols, VTermScreenCell *cells, void *user )
+{
+    session *s = ( session * )user;
+
+    return s->sb ? scrollback_pop( s->sb, cols, cells ) : 0;
+}
+
+static void render_init( int fps, int latency_budget_ms )
+{
+    memset( &g_render, 0, sizeof( g_render ) );
+
+    g_render.frame_ns = ( fps > 0 ) ? ( 1000000000ULL / fps ) : 0;
+    g_render.latency_ns = ( uint64_t )latency_budget_ms * 1000000ULL;
+}
+
+static void render_output( uint64_t now )
+{
+    g_render.dirty = 1;
+
+    if ( g_render.keypress_ns && ( now - g_render.keypress_ns <= g_render.latency_ns ) )
+    {
+        g_render.flush = 1;
+        g_render.keypress_ns = 0;
+    }
+}
+
+static void render_flush()
+{
+    g_render.dirty = 1;
+    g_render.flush = 1;
+}
+
+// Draw if a frame is due and return the epoll timeout until the next one.
+static int render_update( uint64_t now )
+{
+    if ( !g_render.dirty )
+        return -1;
+
+    uint64_t next_frame_ns = g_render.last_frame_ns + g_render.frame_ns;
+
+    if ( g_render.flush || ( now >= next_frame_ns ) )
+    {
+        int drew = g_twin ? termwin_refresh( g_twin ) : 0;
+
+        drew |= g_server && server_refresh( g_server );
+        if ( drew && g_latency )
+            latency_drawn( g_latency, get_time_ns() );
+
+        if ( drew && !g_startup.frame_seen && g_startup.start_ns )
+        {
+            char report[ 1024 ];
+
+            g_startup.frame_seen = 1;
+            startup_mark( "first_frame" );
+            startup_report( report, sizeof( report ) );
+            clog_info( CLOG( 0 ), "%s", report );
+        }
+
+        if ( g_render.record_frames )
+        {
+            if ( g_render.frame_times_count == g_render.frame_times_size )
+            {
+                g_render.frame_times_size = MAX( 1024, g_render.frame_times_size * 2 );
+                g_render.frame_times = ( uint64_t * )realloc( g_render.frame_times, g_render.frame_times_size * sizeof( g_render.frame_times[ 0 ] ) );
+                if ( !g_render.frame_times )
+                    FATAL_ERROR( realloc );
+            }
+            g_render.frame_times[ g_render.frame_times_count++ ] = get_time_ns() - now;
+        }
+
+        g_render.last_frame_ns = now;
+        g_render.dirty = 0;
+        g_render.flush = 0;
+        return -1;
+    }
+
+    return ( int )( ( next_frame_ns - now + 999999 ) / 1000000 );
+}
+
+// Scrollback view: Ctrl-] [ freezes the window on the focused session's
+// history, Ctrl-] / and Ctrl-] ? do that and start a search back or
+// forward through it. Keys then go to the view rather than the child.
+static sbview *g_view = NULL;
+
+// Draw it in our window and every client's.
+static void sbview_draw( const VTermScreenCell *cells, int rows, int cols, const char *status, void *user )
+{
+    if ( g_twin )
+    {
+        termwin_setview( g_twin, cells, rows, cols );
+        termwin_setstatus( g_twin, status );
+    }
+    for ( int i = 0; i < g_client_twin_count; i++ )
+    {
+        termwin_setview( g_client_twins[ i ], cells, rows, cols );
+        termwin_setstatus( g_client_twins[ i ], status );
+    }
+    render_flush();
+}
+
+// Scrollback housekeeping between events: catches the index up and takes
+// the next step of a search. Returns the eventloop timeout, 0 while either
+// has more to do.
+static int sessions_idle()
+{
+    int pending = 0;
+
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        if ( g_sessions[ i ]->sb && scrollback_index( g_sessions[ i ]->sb, SBVIEW_INDEX_LINES ) )
+            pending = 1;
+    }
+
+    pending |= sbview_idle( g_view );
+    return pending ? 0 : -1;
+}
+
+// Dragging a window edge sends a stream of SIGWINCHs. Each one just pushes
+// the resize back; it happens once things have been quiet for
+// RESIZE_SETTLE_NS (or RESIZE_MAX_DELAY_NS after the first, so a long drag
+// still redraws now and then).
+#define RESIZE_SETTLE_NS ( 30 * 1000000ULL )
+#define RESIZE_MAX_DELAY_NS ( 200 * 1000000ULL )
+
+static uint64_t g_resize_first_ns = 0; // 0: no resize pending
+static uint64_t g_resize_due_ns = 0;
+
+static void sigwinch_handler( int signo, void *user )
+{
+    uint64_t now = get_time_ns();
+
+    if ( !g_resize_first_ns )
+        g_resize_first_ns = now;
+    g_resize_due_ns = MIN( now + RESIZE_SETTLE_NS, g_resize_first_ns + RESIZE_MAX_DELAY_NS );
+}
+
+// Every session shares the one screen size.
+static void sessions_setsize( int rows, int cols )
+{
+    int cur_rows, cur_cols;
+
+    vterm_get_size( g_focus->vterm, &cur_rows, &cur_cols );
+    if ( ( rows == cur_rows ) && ( cols == cur_cols ) )
+        return;
+
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        session *s = g_sessions[ i ];
+        const struct winsize size = { rows, cols, 0, 0 };
+
+        // Set pty size.
+        if ( ( s->master >= 0 ) && ioctl( s->master, TIOCSWINSZ, &size ) != 0 )
+            FATAL_ERROR( ioctl( TIOCSWINSZ ) );
+
+        // Tell vterm our new size.
+        vterm_set_size( s->vterm, rows, cols );
+    }
+
+    if ( g_recorder )
+    {
+        uint16_t rec_size[ 2 ] = { ( uint16_t )rows, ( uint16_t )cols };
+
+        record_chunk( g_recorder, RECORD_RESIZE, rec_size, sizeof( rec_size ) );
+    }
+}
+
+static void resize_apply()
+{
+    int rows, cols;
+    struct winsize ws;
+
+    g_loop.alloc_ok = 1;
+
+    if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &ws ) != 0 )
+        FATAL_ERROR( ioctl( TIOCGWINSZ ) );
+
+    vterm_screen_flush_damage( vterm_obtain_screen( g_focus->vterm ) );
+
+    termwin_resize( g_twin, ws.ws_row, ws.ws_col );
+    termwin_getsize( g_twin, &rows, &cols );
+
+    sessions_setsize( rows, cols );
+    if ( sbview_active( g_view ) )
+        sbview_update( g_view );
+
+    clog_info( CLOG( 0 ), "resized to %dx%d (%dx%d inside)", ws.ws_col, ws.ws_row, cols, rows );
+    render_flush();
+}
+
+// Resize if one is due. Returns the ms until it is, or -1.
+static int resize_update( uint64_t now )
+{
+    if ( !g_resize_first_ns )
+        return -1;
+
+    if ( now < g_resize_due_ns )
+        return ( int )( ( g_resize_due_ns - now + 999999 ) / 1000000 );
+
+    g_resize_first_ns = 0;
+    resize_apply();
+    return -1;
+}
+
+// Round up to a power of two, staying within the read buffer limits.
+static size_t output_drain_clamp( size_t size )
+{
+    size_t ret = OUTPUT_READ_MIN;
+
+    while ( ret < size && ret < OUTPUT_READ_MAX )
+        ret *= 2;
+    return ret;
+}
+
+static void output_drain_resize( output_drain *drain, size_t size )
+{
+    size = output_drain_clamp( size );
+    if ( size > drain->size_max )
+    {
+        drain->buf = ( char * )realloc( drain->buf, size );
+        if ( !drain->buf )
+            FATAL_ERROR( realloc );
+        drain->size_max = size;
+    }
+    drain->size = size;
+}
+
+static int handle_output( session *s, uint64_t budget_ns )
+{
+    output_drain *drain = &g_drain;
+    int master = s->master;
+    uint64_t start_ns = get_time_ns();
+    int avail = 0;
+
+    // Size the first read to what's waiting.
+    if ( !ioctl( master, FIONREAD, &avail ) && ( ( size_t )avail > drain->size ) )
+        output_drain_resize( drain, avail );
+
+    for ( ;; )
+    {
+        ssize_t bytes_read = TEMP_FAILURE_RETRY( read( master, drain->buf, drain->size ) );
+
+        // Check if master pty was closed.
+        if ( !bytes_read )
+            return -1;
+
+        if ( bytes_read < 0 )
+        {
+            // EAGAIN: no data available.
+            // EIO: last slave fd closed.
+            if ( errno == EAGAIN )
+                return 0;
+            else if ( errno == EIO )
+                return -1;
+            else
+                FATAL_ERROR( read );
+        }
+
+        output_drain_write( drain, s, drain->buf, bytes_read );
+
+        // Grow when reads fill the buffer, shrink after a long run of small ones.
+        if ( ( size_t )bytes_read == drain->size )
+        {
+            output_drain_resize( drain, drain->size * 2 );
+            drain->small_reads = 0;
+        }
+        else if ( ( size_t )bytes_read < drain->size / 8 )
+        {
+            if ( ++drain->small_reads >= OUTPUT_SHRINK_READS )
+            {
+                output_drain_resize( drain, drain->size / 2 );
+                drain->small_reads = 0;
+            }
+        }
+        else
+        {
+            drain->small_reads = 0;
+        }
+
+        // Out of budget: let input and the frame scheduler run. The pty is
+        // still readable so the loop comes right back here.
+        if ( output_drain_over_budget( drain, start_ns, budget_ns ) )
+            return 0;
+    }
+}
+
+// Push queued input to the pty. While data is pending we also wait for the
+// pty to become writable, and stdin is left alone while the focused
+// session's queue is over PTY_QUEUE_MAX so a runaway paste can't grow it
+// without bound.
+static int pty_flush( session *s )
+{
+    if ( writequeue_flush( s->ptyqueue ) )
+        return -1;
+
+    if ( g_latency && ( s == g_focus ) )
+    {
+        writequeue_stats stats;
+
+        writequeue_getstats( s->ptyqueue, &stats );
+        latency_written( g_latency, get_time_ns(), stats.bytes_written );
+    }
+
+    size_t pending = writequeue_get_pending( s->ptyqueue );
+
+    if ( !s->hangup )
+        eventloop_mod_fd( s->el, s->master, s->master_events | ( pending ? EVENTLOOP_WRITE : 0 ) );
+
+    // Only stdin is held back: a server doesn't read it.
+    if ( ( s != g_focus ) || !g_twin )
+        return 0;
+
+    if ( pending > PTY_QUEUE_MAX )
+        eventloop_mod_fd( s->el, STDIN_FILENO, 0 );
+    else if ( pending <= PTY_QUEUE_MAX / 2 )
+        eventloop_mod_fd( s->el, STDIN_FILENO, EVENTLOOP_READ );
+    return 0;
+}
+
+// Parse what the child wrote, for up to budget_ns.
+static void session_read( session *s, uint64_t budget_ns )
+{
+    if ( s->reader )
+    {
+        size_t len;
+        const char *buf;
+        uint64_t start_ns = get_time_ns();
+
+        while ( ( buf = ptyreader_peek( s->reader, &len ) ) )
+        {
+            output_drain_write( &g_drain, s, buf, len );
+            ptyreader_release( s->reader );
+
+            if ( output_drain_over_budget( &g_drain, start_ns, budget_ns ) )
+                break;
+        }
+
+        // Leaves the notify fd readable if we stopped early.
+        ptyreader_clear_notify( s->reader );
+
+        if ( ptyreader_done( s->reader ) )
+            s->closed = 1;
+    }
+    else if ( handle_output( s, budget_ns ) )
+    {
+        s->closed = 1;
+    }
+
+    if ( s == g_focus )
+        render_output( get_time_ns() );
+}
+
+// The focused session is parsed as soon as it has output. Background ones
+// just get flagged here and wait for session_schedule.
+static void session_output_ready( session *s )
+{
+    if ( s == g_focus )
+        session_read( s, g_drain.budget_ns );
+    else
+        s->pending = 1;
+}
+
+static void master_pty_cb( int fd, int events, void *user )
+{
+    session *s = ( session * )user;
+
+    if ( ( events & EVENTLOOP_WRITE ) && pty_flush( s ) )
+        s->closed = 1;
+
+    if ( s->reader )
+    {
+        // The reader thread sees the hangup as well and drains what's left.
+        if ( events & EVENTLOOP_HANGUP )
+        {
+            eventloop_del_fd( s->el, fd );
+            s->hangup = 1;
+        }
+        return;
+    }
+
+    session_output_ready( s );
+}
+
+static void ptyreader_cb( int fd, int events, void *user )
+{
+    session_output_ready( ( session * )user );
+}
+
+// Background sessions take turns, starting after the last one served, until
+// their share of the drain budget is used up. Whatever is left stays
+// readable and comes back on the next wakeup.
+static void session_schedule()
+{
+    uint64_t budget_ns = g_drain.budget_ns / OUTPUT_BACKGROUND_SHARE;
+    uint64_t start_ns = get_time_ns();
+    int count = g_session_count;
+    int first = g_session_next;
+    int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        session *s = g_sessions[ ( first + i ) % count ];
+
+        if ( !s->pending )
+            continue;
+
+        uint64_t spent_ns = get_time_ns() - start_ns;
+
+        if ( budget_ns && ( spent_ns >= budget_ns ) )
+        {
+            g_drain.background_yields++;
+            g_session_next = ( first + i ) % count;
+            break;
+        }
+
+        session_read( s, budget_ns ? ( budget_ns - spent_ns ) : 0 );
+        g_session_next = ( first + i + 1 ) % count;
+    }
+
+    for ( i = 0; i < count; i++ )
+        g_sessions[ i ]->pending = 0;
+}
+
+// Show s in twin: the palette built for the first session is reused,
+// everything else gets repainted from s's screen.
+static void session_show( session *s, termwin *twin )
+{
+    VTermPos pos;
+    VTermValue val;
+
+    termwin_setvterm( twin, s->vterm );
+
+    vterm_state_get_cursorpos( vterm_obtain_state( s->vterm ), &pos );
+    termwin_movecursor_callback( pos, pos, s->cursor_visible, twin );
+    val.boolean = s->cursor_visible;
+    termwin_settermprop_callback( VTERM_PROP_CURSORVISIBLE, &val, twin );
+}
+
+static void session_focus( session *s )
+{
+    if ( s == g_focus )
+        return;
+
+    sbview_close( g_view );
+    g_focus = s;
+    g_loop.alloc_ok = 1;
+    if ( g_twin )
+        session_show( s, g_twin );
+    for ( int i = 0; i < g_client_twin_count; i++ )
+        session_show( s, g_client_twins[ i ] );
+
+    // Its queue may be the one holding stdin back now.
+    if ( s->ptyqueue && pty_flush( s ) )
+        s->closed = 1;
+
+    clog_info( CLOG( 0 ), "session %d (pid %d) focused", s->id, s->pid );
+    render_flush();
+}
+
+static void session_focus_index( int index )
+{
+    if ( g_session_count && ( index >= 0 ) && ( index < g_session_count ) )
+        session_focus( g_sessions[ index ] );
+}
+
+static int session_index( session *s )
+{
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        if ( g_sessions[ i ] == s )
+            return i;
+    }
+    return -1;
+}
+
+// The key after SESSION_PREFIX_KEY.
+static void session_command( int key )
+{
+    int index = session_index( g_focus );
+
+    if ( key == 'n' )
+        session_focus_index( ( index + 1 ) % g_session_count );
+    else if ( key == 'p' )
+        session_focus_index( ( index + g_session_count - 1 ) % g_session_count );
+    else if ( ( key >= '1' ) && ( key <= '9' ) )
+        session_focus_index( key - '1' );
+    else if ( ( key == '[' ) || ( key == '/' ) || ( key == '?' ) )
+    {
+        char c = ( char )key;
+
+        // / and ? go on to the view to start the search prompt.
+        sbview_open( g_view, g_focus->vterm, g_focus->sb );
+        g_loop.alloc_ok = 1;
+        clog_info( CLOG( 0 ), "session %d scrollback view", g_focus->id );
+        if ( key == '[' )
+            sbview_update( g_view );
+        else
+            sbview_input( g_view, &c, 1 );
+    }
+}
+
+// Shortest of two eventloop timeouts, where -1 is forever.
+static int timeout_min( int a, int b )
+{
+    if ( a < 0 )
+        return b;
+    if ( b < 0 )
+        return a;
+    return MIN( a, b );
+}
+
+static void session_queue_input( session *s, const char *out, size_t outlen, uint64_t read_ns )
+{
+    if ( g_record_input && !s->id )
+        record_chunk( g_recorder, RECORD_INPUT, out, outlen );
+
+    writequeue_append( s->ptyqueue, out, outlen );
+
+    if ( g_latency && outlen )
+    {
+        writequeue_stats stats;
+
+        writequeue_getstats( s->ptyqueue, &stats );
+        latency_input( g_latency, read_ns, stats.bytes_queued );
+    }
+
+    if ( pty_flush( s ) )
+        s->closed = 1;
+}
+
+// Text and pastes pass through as is, key sequences get translated.
+static void session_write_input( session *s, const char *buf, size_t len, uint64_t read_ns )
+{
+    size_t outlen;
+    const char *out;
+
+    if ( !len || s->closed )
+        return;
+
+    out = input_translate( s->input, buf, len, &outlen );
+    session_queue_input( s, out, outlen, read_ns );
+
+    if ( input_pending( s->input ) && !s->input_due_ns )
+        s->input_due_ns = read_ns + INPUT_FLUSH_NS;
+}
+
+// Send on key sequence starts that a read ended with and nothing finished.
+static int input_update( uint64_t now )
+{
+    int timeout = -1;
+
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        session *s = g_sessions[ i ];
+
+        if ( !s->input_due_ns )
+            continue;
+
+        if ( s->closed || !input_pending( s->input ) )
+        {
+            s->input_due_ns = 0;
+        }
+        else if ( now < s->input_due_ns )
+        {
+            timeout = timeout_min( timeout, ( int )( ( s->input_due_ns - now + 999999 ) / 1000000 ) );
+        }
+        else
+        {
+            size_t outlen;
+            const char *out = input_flush( s->input, &outlen );
+
+            s->input_due_ns = 0;
+            session_queue_input( s, out, outlen, now );
+        }
+    }
+    return timeout;
+}
+
+// Keyboard input, from stdin or a client, for the focused session.
+static void session_input( const char *buf, size_t len, uint64_t read_ns )
+{
+    size_t start = 0;
+
+    if ( sbview_active( g_view ) )
+    {
+        size_t used = sbview_input( g_view, buf, len );
+
+        buf += used;
+        len -= used;
+    }
+
+    // Without --sessions or --prefix_keys everything goes to the child,
+    // prefix key included.
+    if ( g_prefix_keys )
+    {
+        for ( size_t i = 0; i < len; i++ )
+        {
+            if ( g_session_prefix )
+            {
+                g_session_prefix = 0;
+                start = i + 1;
+
+                if ( buf[ i ] == SESSION_PREFIX_KEY )
+                    session_write_input( g_focus, &buf[ i ], 1, read_ns );
+                else
+                    session_command( ( unsigned char )buf[ i ] );
+
+                // Keys after a view opens are the view's.
+                if ( sbview_active( g_view ) )
+                {
+                    i += sbview_input( g_view, buf + i + 1, len - i - 1 );
+                    start = i + 1;
+                }
+            }
+            else if ( buf[ i ] == SESSION_PREFIX_KEY )
+            {
+                // Translate up to here to find out if this one was pasted.
+                session_write_input( g_focus, buf + start, i - start, read_ns );
+                start = i;
+                if ( input_in_paste( g_focus->input ) )
+                    continue;
+
+                g_session_prefix = 1;
+                start = i + 1;
+            }
+        }
+    }
+
+    session_write_input( g_focus, buf + start, len - start, read_ns );
+}
+
+static int handle_input()
+{
+    static char buf[ 64 * 1024 ];
+    ssize_t bytes_read = TEMP_FAILURE_RETRY( read( STDIN_FILENO, buf, sizeof( buf ) ) );
+
+    if ( bytes_read <= 0 )
+    {
+        if ( bytes_read < 0 && errno == EAGAIN )
+            return 0;
+
+        clog_info( CLOG( 0 ), "stdin read returned %zd: %d", bytes_read, errno );
+        return -1;
+    }
+
+    session_input( buf, bytes_read, get_time_ns() );
+    return 0;
+}
+
+static void stdin_cb( int fd, int events, void *user )
+{
+    if ( events & EVENTLOOP_HANGUP )
+    {
+        clog_info( CLOG( 0 ), "stdin hangup." );
+        g_quit = 1;
+        return;
+    }
+
+    if ( handle_input() )
+    {
+        g_quit = 1;
+        return;
+    }
+
+    g_render.keypress_ns = get_time_ns();
+}
+
+// --server clients, see server.h. They see the focused session, like g_twin.
+static void server_clients( termwin **twins, int count, void *user )
+{
+    memcpy( g_client_twins, twins, count * sizeof( twins[ 0 ] ) );
+    g_client_twin_count = count;
+    g_loop.alloc_ok = 1;
+}
+
+static void server_attach( termwin *twin, void *user )
+{
+    session_show( g_focus, twin );
+}
+
+static void server_resize( int rows, int cols, void *user )
+{
+    g_loop.alloc_ok = 1;
+    sessions_setsize( rows, cols );
+    render_flush();
+}
+
+static void server_input( const char *buf, size_t len, void *user )
+{
+    uint64_t now = get_time_ns();
+
+    session_input( buf, len, now );
+    g_render.keypress_ns = now;
+}
+
+static void server_redraw( void *user )
+{
+    render_flush();
+}
+
+static const server_callbacks g_server_callbacks =
+    {
+      server_clients, // clients
+      server_attach,  // attach
+      server_resize,  // resize
+      server_input,   // input
+      server_redraw   // redraw
     };
 
-typedef struct cvterm_opts
+// Where SIGUSR1 and --stats_interval dumps go (NULL: the log).
+static const char *g_stats_file = NULL;
+static uint64_t g_stats_interval_ns = 0;
+static uint64_t g_stats_next_ns = 0;
+// Kept between dumps so the buffer only grows once.
+static metrics_json g_stats_json;
+
+// Everything we count, as one JSON object.
+static void stats_dump()
 {
-    const char *env_term;
-    const char *nc_term;
-    const char *logfile;
-    int wait_for_debugger;
+    metrics_json json = g_stats_json;
+    arena_stats scratch;
+
+    metrics_json_reset( &json );
+    metrics_json_object( &json, NULL );
+    metrics_json_uint( &json, "time_ns", get_time_ns() );
+
+    metrics_json_object( &json, "pty_output" );
+    metrics_json_uint( &json, "reads", g_drain.reads );
+    metrics_json_uint( &json, "bytes", g_drain.bytes );
+    metrics_json_uint( &json, "yields", g_drain.yields );
+    metrics_json_uint( &json, "read_size", g_drain.size );
+    metrics_json_uint( &json, "background_bytes", g_drain.background_bytes );
+    metrics_json_uint( &json, "background_yields", g_drain.background_yields );
+    metrics_json_hist( &json, "read_bytes", &g_drain.read_bytes );
+    metrics_json_hist( &json, "vterm_write_ns", &g_drain.write_ns );
+    metrics_json_end( &json );
+
+    metrics_json_object( &json, "sessions" );
+    metrics_json_uint( &json, "count", g_session_count );
+    metrics_json_uint( &json, "focus", g_focus ? g_focus->id : 0 );
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        char name[ 32 ];
+
+        snprintf( name, sizeof( name ), "%d", g_sessions[ i ]->id );
+        metrics_json_object( &json, name );
+        metrics_json_uint( &json, "pid", g_sessions[ i ]->pid );
+        metrics_json_uint( &json, "reads", g_sessions[ i ]->reads );
+        metrics_json_uint( &json, "bytes", g_sessions[ i ]->bytes );
+        metrics_json_end( &json );
+    }
+    metrics_json_end( &json );
 
-    int argc;
-    const char **argv;
-    const char *argv_buf[ 2 ];
-} cvterm_opts;
+    if ( g_server )
+        server_stats_json( g_server, &json );
+
+    // The rest is for the focused session.
+    if ( g_focus && g_focus->reader )
+    {
+        ptyreader_stats stats;
+
+        ptyreader_getstats( g_focus->reader, &stats );
+        metrics_json_object( &json, "pty_reader" );
+        metrics_json_uint( &json, "reads", stats.reads );
+        metrics_json_uint( &json, "bytes", stats.bytes );
+        metrics_json_uint( &json, "buffers", stats.buffers );
+        metrics_json_uint( &json, "full_waits", stats.full_waits );
+        metrics_json_uint( &json, "fill", stats.fill );
+        metrics_json_uint( &json, "fill_max", stats.fill_max );
+        metrics_json_end( &json );
+    }
+
+    if ( g_twin )
+    {
+        termwin_stats stats;
+
+        termwin_getstats( g_twin, &stats );
+        metrics_json_object( &json, "render" );
+        metrics_json_uint( &json, "frames", stats.frames );
+        metrics_json_uint( &json, "damage_rects", stats.damage_rects );
+        metrics_json_uint( &json, "cells_drawn", stats.cells_drawn );
+        metrics_json_uint( &json, "cells_skipped", stats.cells_skipped );
+        metrics_json_uint( &json, "moverects", stats.moverects );
+        metrics_json_uint( &json, "color_cache_misses", stats.color_cache_misses );
+        metrics_json_uint( &json, "pairs_allocated", stats.pairs_allocated );
+        metrics_json_uint( &json, "pairs_evicted", stats.pairs_evicted );
+        metrics_json_uint( &json, "style_cache_hits", stats.style_cache_hits );
+        metrics_json_uint( &json, "style_cache_misses", stats.style_cache_misses );
+        metrics_json_uint( &json, "bytes_written", stats.bytes_written );
+        metrics_json_uint( &json, "doupdate_allocs", stats.doupdate_allocs );
+        metrics_json_hist( &json, "draw_ns", &stats.draw_ns );
+        metrics_json_hist( &json, "doupdate_ns", &stats.doupdate_ns );
+        metrics_json_end( &json );
+    }
+
+    if ( g_focus && g_focus->ptyqueue )
+    {
+        writequeue_stats stats;
+
+        writequeue_getstats( g_focus->ptyqueue, &stats );
+        metrics_json_object( &json, "pty_input" );
+        metrics_json_uint( &json, "bytes_queued", stats.bytes_queued );
+        metrics_json_uint( &json, "bytes_written", stats.bytes_written );
+        metrics_json_uint( &json, "writes", stats.writes );
+        metrics_json_uint( &json, "stalls", stats.stalls );
+        metrics_json_uint( &json, "stall_ns", stats.stall_ns );
+        metrics_json_uint( &json, "stall_ns_max", stats.stall_ns_max );
+        metrics_json_uint( &json, "depth", stats.depth );
+        metrics_json_uint( &json, "depth_max", stats.depth_max );
+        metrics_json_end( &json );
+    }
+
+    if ( g_focus && g_focus->sb )
+    {
+        scrollback_stats stats;
+
+        scrollback_getstats( g_focus->sb, &stats );
+        metrics_json_object( &json, "scrollback" );
+        metrics_json_uint( &json, "lines", stats.lines );
+        metrics_json_uint( &json, "lines_pushed", stats.lines_pushed );
+        metrics_json_uint( &json, "lines_popped", stats.lines_popped );
+        metrics_json_uint( &json, "lines_dropped", stats.lines_dropped );
+        metrics_json_uint( &json, "bytes_used", stats.bytes_used );
+        metrics_json_uint( &json, "bytes_alloced", stats.bytes_alloced );
+        metrics_json_uint( &json, "lines_unindexed", stats.lines_unindexed );
+        metrics_json_uint( &json, "search_pages_skipped", stats.search_pages_skipped );
+        metrics_json_uint( &json, "search_lines_read", stats.search_lines_read );
+        metrics_json_end( &json );
+    }
+
+    if ( g_latency )
+    {
+        latency_stats stats;
+
+        latency_getstats( g_latency, &stats );
+        metrics_json_object( &json, "latency" );
+        metrics_json_uint( &json, "traces", stats.traces );
+        metrics_json_uint( &json, "completed", stats.completed );
+        metrics_json_uint( &json, "unechoed", stats.unechoed );
+        metrics_json_uint( &json, "overflowed", stats.overflowed );
+        metrics_json_hist( &json, "input_to_pty_ns", &stats.input_to_pty );
+        metrics_json_hist( &json, "pty_to_echo_ns", &stats.pty_to_echo );
+        metrics_json_hist( &json, "echo_to_drawn_ns", &stats.echo_to_drawn );
+        metrics_json_hist( &json, "total_ns", &stats.total );
+        metrics_json_end( &json );
+    }
 
-static VTerm *g_vterm = NULL;
-static termwin *g_twin = NULL;
-static int g_master_pty;
-static struct sigaction g_winch_sigaction_old;
+    metrics_json_object( &json, "log" );
+    metrics_json_uint( &json, "dropped", clog_get_dropped( 0 ) );
+    metrics_json_uint( &json, "grows", clog_get_grows() );
+    metrics_json_end( &json );
+
+    arena_getstats( arena_thread(), &scratch );
+    metrics_json_object( &json, "loop" );
+    metrics_json_uint( &json, "iterations", g_loop.iterations );
+#ifdef ARENA_COUNT_HEAP
+    metrics_json_uint( &json, "heap_allocs_total", arena_heap_allocs() );
+#endif
+    metrics_json_uint( &json, "scratch_size", scratch.size );
+    metrics_json_uint( &json, "scratch_high_water", scratch.high_water );
+    metrics_json_uint( &json, "scratch_grows", scratch.grows );
+    metrics_json_end( &json );
+
+    metrics_json_end( &json );
+
+    if ( g_stats_file )
+        metrics_json_write_file( &json, g_stats_file );
+    else
+        clog_info( CLOG( 0 ), "stats: %.*s", ( int )json.len, json.buf );
+
+    // Growing the buffer to fit is fine.
+    if ( json.size != g_stats_json.size )
+        g_loop.alloc_ok = 1;
+    g_stats_json = json;
+}
 
-static void sigwinch( int how )
+static void sigusr1_handler( int signo, void *user )
 {
-    sigset_t signal_set;
+    stats_dump();
+}
+
+static const char *g_snapshot_file = NULL;
 
-    if ( sigemptyset( &signal_set ) )
-        FATAL_ERROR( sigemptyset );
+// --snapshot: the last session's screen is saved when it closes, the focused
+// one's on SIGUSR2.
+static void session_snapshot( session *s )
+{
+    uint64_t start_ns = get_time_ns();
 
-    if ( sigaddset( &signal_set, SIGWINCH ) )
-        FATAL_ERROR( sigaddset );
+    if ( snapshot_save( g_snapshot_file, s->vterm, s->sb, s->cursor_visible ) )
+        clog_warn( CLOG( 0 ), "Unable to save snapshot to %s: %d", g_snapshot_file, errno );
+    else
+        clog_info( CLOG( 0 ), "session %d saved to %s in %.2fms", s->id, g_snapshot_file, ( get_time_ns() - start_ns ) / 1e6 );
+}
 
-    if ( sigprocmask( how, &signal_set, NULL ) )
-        FATAL_ERROR( sigprocmask );
+static void sigusr2_handler( int signo, void *user )
+{
+    g_loop.alloc_ok = 1;
+    if ( g_focus )
+        session_snapshot( g_focus );
 }
 
-static void sigwinch_handler( int signo )
+// --restore: warm start s from a snapshot before anything else is written to it.
+static void session_restore( session *s, const char *filename )
 {
-    int rows, cols;
+    uint64_t start_ns = get_time_ns();
 
-    if ( g_winch_sigaction_old.sa_handler )
-        ( *g_winch_sigaction_old.sa_handler )( signo );
+    if ( snapshot_restore( filename, s->vterm, s->sb ) )
+        clog_warn( CLOG( 0 ), "Unable to restore snapshot %s: %d", filename, errno );
+    else
+        clog_info( CLOG( 0 ), "session %d restored from %s in %.2fms", s->id, filename, ( get_time_ns() - start_ns ) / 1e6 );
+}
 
-    vterm_screen_flush_damage( vterm_obtain_screen( g_vterm ) );
+// Periodic dumps. Returns the ms until the next one, or -1.
+static int stats_update( uint64_t now )
+{
+    if ( !g_stats_interval_ns )
+        return -1;
 
-    termwin_resize( g_twin );
-    termwin_getsize( g_twin, &rows, &cols );
+    if ( now >= g_stats_next_ns )
+    {
+        stats_dump();
+        g_stats_next_ns = now + g_stats_interval_ns;
+    }
+    return ( int )( ( g_stats_next_ns - now + 999999 ) / 1000000 );
+}
+
+// A session with a vterm hooked up to g_twin and a scrollback. The first
+// one is shown; the others only get termwin's default colours.
+static session *session_create( int rows, int cols, const cvterm_opts *opts )
+{
+    session *s = ( session * )calloc( 1, sizeof( *s ) );
+
+    if ( !s )
+        FATAL_ERROR( calloc );
+
+    s->id = g_session_count;
+    s->master = -1;
+    s->master_events = EVENTLOOP_READ;
+    s->cursor_visible = 1;
+
+    s->vterm = vterm_new( rows, cols );
+    vterm_set_utf8( s->vterm, 1 );
+
+    if ( !g_focus )
+        g_focus = s;
+
+    if ( g_twin && ( g_focus == s ) )
+        termwin_setvterm( g_twin, s->vterm );
+    else
+        termwin_initvterm( s->vterm );
+
+    if ( opts->scrollback_mb )
+        s->sb = scrollback_init( ( size_t )opts->scrollback_mb * 1024 * 1024 );
+
+    // Initialize vterm screen.
+    VTermScreen *vtscreen = vterm_obtain_screen( s->vterm );
+    vterm_screen_enable_altscreen( vtscreen, 1 );
+    vterm_screen_reset( vtscreen, 1 );
+    vterm_screen_set_callbacks( vtscreen, &g_screen_cbs, s );
+
+    g_sessions[ g_session_count++ ] = s;
+    return s;
+}
 
-    // Set pty size.
+// Start opts->argv on a new pty for s.
+static void session_spawn( session *s, const cvterm_opts *opts, const struct termios *child_termios, int rows, int cols )
+{
+    char slavename[ 128 ];
     const struct winsize size = { rows, cols, 0, 0 };
-    if ( ioctl( g_master_pty, TIOCSWINSZ, &size ) != 0 )
-        FATAL_ERROR( ioctl( TIOCSWINSZ ) );
 
-    // Tell vterm our new size.
-    vterm_set_size( g_vterm, rows, cols );
+    s->pid = pty_fork( &s->master, slavename, sizeof( slavename ), child_termios, &size );
+    clog_info( CLOG( 0 ), "pty_fork session:%d child:%d slavename:%s", s->id, s->pid, slavename );
+
+    if ( s->pid == 0 )
+    {
+        if ( opts->env_term )
+        {
+            if ( setenv( "TERM", opts->env_term, 1 ) )
+                FATAL_ERROR( setenv );
+        }
+        else
+        {
+            if ( unsetenv( "TERM" ) )
+                FATAL_ERROR( unsetenv );
+        }
+
+        execvp( opts->argv[ 0 ], ( char *const * )opts->argv );
+        FATAL_ERROR( execvp );
+    }
+
+    // Make the master pty non-blocking.
+    if ( fcntl( s->master, F_SETFL, fcntl( s->master, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+
+    s->ptyqueue = writequeue_init( s->master );
+    s->input = input_init( s->vterm );
 }
 
-static void handle_input( VTerm *vt, int master )
+static void session_start( session *s, eventloop *el, const cvterm_opts *opts )
 {
-    size_t buflen;
-    char buf[ 8192 ];
+    s->el = el;
 
-    while ( vterm_output_get_buffer_remaining( vt ) > 0 )
+    if ( opts->reader_ring )
     {
-        int ch = termwin_getch( g_twin );
-        if ( ch == -1 )
-            break;
+        s->reader = ptyreader_init( s->master, opts->reader_ring, PTY_READER_BUFFER_SIZE );
+        s->master_events = 0;
+        eventloop_add_fd( el, ptyreader_get_notify_fd( s->reader ), EVENTLOOP_READ, ptyreader_cb, s );
+    }
+    eventloop_add_fd( el, s->master, s->master_events, master_pty_cb, s );
+}
+
+static void session_free( session *s )
+{
+    if ( s->reader )
+    {
+        ptyreader_stats stats;
+
+        ptyreader_getstats( s->reader, &stats );
+        clog_info( CLOG( 0 ), "session %d pty reader reads:%" PRIu64 " bytes:%" PRIu64 " buffers:%" PRIu64 " full_waits:%" PRIu64 " fill_max:%zu/%zu errno:%d",
+                   s->id, stats.reads, stats.bytes, stats.buffers, stats.full_waits,
+                   stats.fill_max, stats.slots, stats.read_errno );
+
+        if ( s->el )
+            eventloop_del_fd( s->el, ptyreader_get_notify_fd( s->reader ) );
+        ptyreader_free( s->reader );
+    }
+
+    if ( s->ptyqueue )
+    {
+        writequeue_stats stats;
+
+        writequeue_getstats( s->ptyqueue, &stats );
+        clog_info( CLOG( 0 ), "session %d pty input queued:%" PRIu64 " written:%" PRIu64 " writes:%" PRIu64 " depth_max:%zu stalls:%" PRIu64 " stall_ms:%" PRIu64 " (max %" PRIu64 ")",
+                   s->id, stats.bytes_queued, stats.bytes_written, stats.writes, stats.depth_max,
+                   stats.stalls, stats.stall_ns / 1000000, stats.stall_ns_max / 1000000 );
 
-        vterm_keyboard_unichar( vt, ( uint32_t )ch, VTERM_MOD_NONE );
+        writequeue_free( s->ptyqueue );
+    }
+
+    if ( s->sb )
+    {
+        scrollback_stats stats;
+
+        scrollback_getstats( s->sb, &stats );
+        clog_info( CLOG( 0 ), "session %d scrollback lines:%zu pushed:%" PRIu64 " popped:%" PRIu64 " dropped:%" PRIu64 " bytes_used:%zu bytes_alloced:%zu",
+                   s->id, stats.lines, stats.lines_pushed, stats.lines_popped, stats.lines_dropped,
+                   stats.bytes_used, stats.bytes_alloced );
+
+        scrollback_free( s->sb );
+    }
+
+    if ( s->master >= 0 )
+    {
+        if ( s->el && !s->hangup )
+            eventloop_del_fd( s->el, s->master );
+        close( s->master );
     }
 
-    while ( ( buflen = vterm_output_get_buffer_current( vt ) ) > 0 )
+    if ( s->pid > 0 )
     {
-        buflen = MIN( buflen, sizeof( buf ) );
-        buflen = vterm_output_read( vt, buf, buflen );
+        int status;
 
-        ssize_t bytes_write = TEMP_FAILURE_RETRY( write( master, buf, buflen ) );
-        if ( bytes_write != ( ssize_t )buflen )
-            FATAL_ERROR( write );
+        if ( waitpid( s->pid, &status, WNOHANG ) == s->pid )
+            clog_info( CLOG( 0 ), "session %d child %d exited: %d", s->id, s->pid, status );
     }
+
+    input_free( s->input );
+    vterm_free( s->vterm );
+    free( s );
 }
 
-static int handle_output( VTerm *vt, int master )
+// Free sessions whose child went away. Focus moves to the next one; the
+// last one going quits.
+static void session_reap()
 {
-    char buf[ 8192 ];
+    int i = 0;
 
-    for ( ;; )
+    while ( i < g_session_count )
     {
-        ssize_t bytes_read = TEMP_FAILURE_RETRY( read( master, buf, sizeof( buf ) ) );
+        session *s = g_sessions[ i ];
 
-        // Check if master pty was closed.
-        if ( !bytes_read )
-            return -1;
+        if ( !s->closed )
+        {
+            i++;
+            continue;
+        }
 
-        if ( bytes_read < 0 )
+        clog_info( CLOG( 0 ), "session %d closed (%" PRIu64 " bytes)", s->id, s->bytes );
+
+        memmove( &g_sessions[ i ], &g_sessions[ i + 1 ], ( g_session_count - i - 1 ) * sizeof( g_sessions[ 0 ] ) );
+        g_session_count--;
+        g_session_next = 0;
+        g_loop.alloc_ok = 1;
+
+        if ( !g_session_count && g_snapshot_file )
+            session_snapshot( s );
+
+        if ( s == g_focus )
         {
-            // EAGAIN: no data available.
-            // EIO: last slave fd closed.
-            if ( errno == EAGAIN )
-                return 0;
-            else if ( errno == EIO )
-                return -1;
-            else
-                FATAL_ERROR( read );
+            // Keep g_focus pointing at something alive while switching.
+            g_focus = NULL;
+            if ( g_session_count )
+                session_focus( g_sessions[ MIN( i, g_session_count - 1 ) ] );
         }
 
-        vterm_input_write( vt, buf, bytes_read );
+        session_free( s );
     }
+
+    if ( !g_session_count )
+        g_quit = 1;
 }
 
-static void main_loop( VTerm *vt, int master )
+#ifdef ARENA_COUNT_HEAP
+// Things that allocate as they grow to their limit rather than in the
+// steady state: scrollback pages up to max_bytes, colour pairs (ncurses
+// allocates in init_pair), the terminfo strings ncurses caches in doupdate,
+// clog's long message buffer and the scratch arena. Changes when any grew.
+static uint64_t loop_growth()
 {
-    struct sigaction winch_sigaction;
+    uint64_t growth = 0;
+    arena_stats scratch;
+
+    for ( int i = 0; i < g_session_count; i++ )
+    {
+        if ( g_sessions[ i ]->sb )
+        {
+            scrollback_stats stats;
+
+            scrollback_getstats( g_sessions[ i ]->sb, &stats );
+            growth += stats.bytes_alloced;
+        }
+    }
+    if ( g_twin )
+    {
+        termwin_stats stats;
+
+        termwin_getstats( g_twin, &stats );
+        growth += stats.pairs_allocated + stats.doupdate_allocs;
+    }
 
-    // Set up window size change signal handler
-    winch_sigaction.sa_handler = sigwinch_handler;
-    sigemptyset( &winch_sigaction.sa_mask );
-    winch_sigaction.sa_flags = 0;
+    arena_getstats( arena_thread(), &scratch );
+    return growth + clog_get_grows() + scratch.grows;
+}
 
-    if ( sigaction( SIGWINCH, &winch_sigaction, &g_winch_sigaction_old ) )
-        FATAL_ERROR( sigaction );
+static void loop_check_heap( uint64_t heap_allocs, uint64_t growth )
+{
+    uint64_t allocs = arena_heap_allocs() - heap_allocs;
 
-    for ( ;; )
+    if ( !allocs || g_loop.alloc_ok || ( loop_growth() != growth ) )
+        return;
+
+    clog_error( CLOG( 0 ), "main loop iteration %" PRIu64 ": %" PRIu64 " heap allocations", g_loop.iterations, allocs );
+    if ( is_debugger_attached() )
+        __debugbreak();
+    abort();
+}
+#endif
+
+static void main_loop( const cvterm_opts *opts )
+{
+    int timeout = -1;
+    eventloop *el = eventloop_init();
+    arena *scratch = arena_thread();
+
+    render_init( opts->fps, opts->latency_budget_ms );
+    g_view = sbview_init( sbview_draw, NULL );
+
+    // First frame (the border and whatever is there so far) right away,
+    // without waiting on the child.
+    if ( g_twin )
     {
-        int ret;
-        fd_set fds;
-        // Update every 20ms.
-        struct timeval timeout = { 0, 20000 };
+        render_flush();
+        render_update( get_time_ns() );
+    }
 
-        FD_ZERO( &fds );
-        FD_SET( STDIN_FILENO, &fds );
-        FD_SET( master, &fds );
+    g_drain.budget_ns = ( uint64_t )opts->drain_budget_us * 1000;
+    output_drain_resize( &g_drain, OUTPUT_READ_MIN );
 
-        sigwinch( SIG_UNBLOCK );
-        ret = select( master + 1, &fds, NULL, NULL, &timeout );
-        sigwinch( SIG_BLOCK );
+    if ( opts->record )
+    {
+        int rows, cols;
 
-        if ( ret == -1 )
-        {
-            if ( errno == EINTR )
-                continue;
+        vterm_get_size( g_focus->vterm, &rows, &cols );
+        g_recorder = record_init( opts->record, rows, cols );
+        g_record_input = g_recorder && opts->record_input;
+    }
 
-            FATAL_ERROR( select );
-        }
+    // Keep the first 100k keystrokes for --latency_trace.
+    g_latency = latency_init( opts->latency_trace ? 100000 : 0 );
 
-        if ( FD_ISSET( master, &fds ) )
-        {
-            if ( handle_output( vt, master ) )
-                return;
-        }
+    g_stats_file = opts->stats_file;
+    if ( opts->stats_interval )
+    {
+        g_stats_interval_ns = ( uint64_t )opts->stats_interval * 1000000000ULL;
+        g_stats_next_ns = get_time_ns() + g_stats_interval_ns;
+    }
 
-        if ( FD_ISSET( STDIN_FILENO, &fds ) )
-        {
-            handle_input( vt, master );
-        }
+    eventloop_add_signal( el, SIGUSR1, sigusr1_handler, NULL );
+    g_prefix_keys = ( opts->sessions > 1 ) || opts->prefix_keys;
+    g_snapshot_file = opts->snapshot;
+    if ( g_snapshot_file )
+        eventloop_add_signal( el, SIGUSR2, sigusr2_handler, NULL );
+    for ( int i = 0; i < g_session_count; i++ )
+        session_start( g_sessions[ i ], el, opts );
+
+    // A server has no terminal of its own, just clients.
+    if ( g_server )
+    {
+        server_start( g_server, el );
+    }
+    else
+    {
+        eventloop_add_signal( el, SIGWINCH, sigwinch_handler, NULL );
+        eventloop_add_fd( el, STDIN_FILENO, EVENTLOOP_READ, stdin_cb, el );
+    }
+
+    // Sleep until a pty, stdin, a signal, or the next frame needs us.
+    while ( !g_quit )
+    {
+#ifdef ARENA_COUNT_HEAP
+        uint64_t heap_allocs = arena_heap_allocs();
+        uint64_t growth = loop_growth();
+#endif
+
+        eventloop_run_once( el, timeout );
+
+        // The focused session was read by its callback, now the others.
+        session_schedule();
+        session_reap();
+        if ( !g_session_count )
+            break;
+        if ( g_server )
+            server_reap( g_server );
+
+        uint64_t now = get_time_ns();
+
+        // Before drawing, so the first frame after a resize is the new size
+        // and a search step's result goes out with it.
+        int resize_timeout = resize_update( now );
+        int idle_timeout = sessions_idle();
+        int input_timeout = input_update( now );
+
+        timeout = timeout_min( render_update( now ), resize_timeout );
+        timeout = timeout_min( timeout, idle_timeout );
+        timeout = timeout_min( timeout, input_timeout );
+        timeout = timeout_min( timeout, stats_update( now ) );
+        if ( g_recorder )
+            timeout = timeout_min( timeout, record_update( g_recorder, now ) );
+
+        g_loop.iterations++;
+#ifdef ARENA_COUNT_HEAP
+        loop_check_heap( heap_allocs, growth );
+#endif
+        g_loop.alloc_ok = 0;
+
+        // Scratch memory is only good for one iteration.
+        arena_reset( scratch );
+    }
+
+    // Final numbers for whoever is watching the stats file.
+    if ( g_stats_file )
+        stats_dump();
+
+    {
+        latency_stats stats;
+
+        latency_getstats( g_latency, &stats );
+        clog_info( CLOG( 0 ), "keystroke latency us: p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 " (%" PRIu64 " of %" PRIu64 " keystrokes, %" PRIu64 " unechoed)",
+                   metrics_hist_percentile( &stats.total, 50 ) / 1000, metrics_hist_percentile( &stats.total, 90 ) / 1000,
+                   metrics_hist_percentile( &stats.total, 99 ) / 1000, stats.total.max / 1000,
+                   stats.completed, stats.traces, stats.unechoed );
 
-        termwin_refresh( g_twin );
+        if ( opts->latency_trace )
+            latency_write_trace( g_latency, opts->latency_trace );
+
+        latency_free( g_latency );
+        g_latency = NULL;
     }
+
+    for ( int i = 0; i < g_session_count; i++ )
+        g_sessions[ i ]->el = NULL;
+    if ( g_server )
+        server_stop( g_server );
+    eventloop_free( el );
+
+    clog_info( CLOG( 0 ), "pty output reads:%" PRIu64 " bytes:%" PRIu64 " yields:%" PRIu64 " read_size:%zu (max %zu)",
+               g_drain.reads, g_drain.bytes, g_drain.yields, g_drain.size, g_drain.size_max );
+    free( g_drain.buf );
+    memset( &g_drain, 0, sizeof( g_drain ) );
+
+    sbview_free( g_view );
+    g_view = NULL;
+
+    metrics_json_free( &g_stats_json );
 }
 
 static void cvterm_shutdown()
@@ -209,16 +1702,38 @@ static void cvterm_shutdown()
     if ( _clog_loggers[ 0 ] )
         clog_debug( CLOG( 0 ), "atexit function called." );
 
-    if ( g_vterm )
+    record_free( g_recorder );
+    g_recorder = NULL;
+    g_record_input = 0;
+
+    server_free( g_server );
+    g_server = NULL;
+
+    while ( g_session_count )
+        session_free( g_sessions[ --g_session_count ] );
+    g_focus = NULL;
+
+    if ( g_twin )
     {
-        vterm_free( g_vterm );
-        g_vterm = NULL;
+        termwin_stats stats;
+
+        termwin_getstats( g_twin, &stats );
+        clog_info( CLOG( 0 ), "frames:%" PRIu64 " cells_drawn:%" PRIu64 " (%" PRIu64 " per frame) cells_skipped:%" PRIu64 " moverects:%" PRIu64 " color_cache_misses:%" PRIu64 " pairs_allocated:%" PRIu64 " pairs_evicted:%" PRIu64 " style_cache:%" PRIu64 "/%" PRIu64,
+                   stats.frames, stats.cells_drawn, stats.frames ? ( stats.cells_drawn / stats.frames ) : 0,
+                   stats.cells_skipped, stats.moverects, stats.color_cache_misses,
+                   stats.pairs_allocated, stats.pairs_evicted,
+                   stats.style_cache_hits, stats.style_cache_hits + stats.style_cache_misses );
     }
 
+    if ( g_host_paste )
+        input_set_host_paste( 0 );
+    g_host_paste = 0;
+
     termwin_free( g_twin );
     g_twin = NULL;
 
     clog_free( 0 );
+    arena_thread_free();
 }
 
 static void opts_print( cvterm_opts *opts )
@@ -229,7 +1744,48 @@ static void opts_print( cvterm_opts *opts )
     printf( "  TERM: %s\n", opts->env_term );
     printf( "  NCTERM: %s\n", opts->nc_term );
     printf( "  logfile: %s\n", opts->logfile );
+    printf( "  log_mode: %s\n", opts->log_mode );
+    printf( "  renderer: %s%s\n", opts->renderer,
+            strcmp( opts->renderer, "direct" ) ? "" : ( opts->truecolor ? " (truecolor)" : " (256 colors)" ) );
     printf( "  wait_for_debugger: %d\n", opts->wait_for_debugger );
+    printf( "  fps: %d\n", opts->fps );
+    printf( "  latency_budget: %dms\n", opts->latency_budget_ms );
+    printf( "  scrollback: %dMB\n", opts->scrollback_mb );
+    printf( "  reader_ring: %d\n", opts->reader_ring );
+    printf( "  drain_budget: %dus\n", opts->drain_budget_us );
+    printf( "  sessions: %d\n", opts->sessions );
+    printf( "  prefix_keys: %d\n", opts->prefix_keys );
+    if ( opts->server )
+        printf( "  server: %s\n", opts->server );
+    if ( opts->attach )
+        printf( "  attach: %s\n", opts->attach );
+    if ( opts->stats_file )
+        printf( "  stats_file: %s\n", opts->stats_file );
+    printf( "  stats_interval: %ds\n", opts->stats_interval );
+    if ( opts->latency_trace )
+        printf( "  latency_trace: %s\n", opts->latency_trace );
+    if ( opts->snapshot )
+        printf( "  snapshot: %s\n", opts->snapshot );
+    if ( opts->snapshot_check )
+        printf( "  snapshot_check: %s\n", opts->snapshot_check );
+    if ( opts->restore )
+        printf( "  restore: %s\n", opts->restore );
+    printf( "  startup_trace: %d\n", opts->startup_trace );
+    if ( opts->record )
+    {
+        printf( "  record: %s\n", opts->record );
+        printf( "  record_input: %d\n", opts->record_input );
+    }
+    if ( opts->replay )
+    {
+        printf( "  replay: %s\n", opts->replay );
+        printf( "  replay_chunk: %d\n", opts->replay_chunk );
+        if ( opts->replay_rows )
+            printf( "  replay_size: %dx%d\n", opts->replay_cols, opts->replay_rows );
+        printf( "  replay_tty: %d\n", opts->replay_tty );
+        printf( "  replay_offset: %d\n", opts->replay_offset );
+        printf( "  replay_realtime: %d\n", opts->replay_realtime );
+    }
 
     printf( "  cmd: " );
     for ( i = 0; i < opts->argc; i++ )
@@ -243,6 +1799,35 @@ static void opts_usage( cvterm_opts *opts, int argc, char *argv[] )
 
     printf( "  -w --wait_for_debugger     Wait for debugger to attach.\n" );
     printf( "  -l --logfile FILE          Set logfile name.\n" );
+    printf( "     --log_mode MODE         sync, or write from a thread and drop/block when behind (default block).\n" );
+    printf( "     --renderer NAME         ncurses, or direct to draw with escape sequences (default ncurses).\n" );
+    printf( "     --truecolor 0|1         24-bit colours with --renderer direct (default: from $COLORTERM).\n" );
+    printf( "     --fps N                 Max frames drawn per second (0: unlimited, default 60).\n" );
+    printf( "     --latency_budget MS     Draw output this soon after a keypress right away (default 50).\n" );
+    printf( "     --scrollback MB         Memory cap for scrollback lines (0: none, default 16).\n" );
+    printf( "     --reader_ring N         Read the pty on a thread with N 64KB buffers (0: off, default).\n" );
+    printf( "     --drain_budget US       Max time parsing pty output per wakeup (0: unlimited, default 4000).\n" );
+    printf( "     --sessions N            Run N copies of CMD, one shown at a time (default 1).\n" );
+    printf( "                             Ctrl-] then n/p/1-9 switches, Ctrl-] Ctrl-] sends Ctrl-].\n" );
+    printf( "     --prefix_keys           Take Ctrl-] commands with one session too (on with --sessions).\n" );
+    printf( "                             Ctrl-] then [ scrolls back, / or ? searches; q or Esc leaves.\n" );
+    printf( "     --server SOCKET         Run CMD without a terminal and let clients attach at SOCKET.\n" );
+    printf( "     --attach SOCKET         Attach this terminal to a --server. Ctrl-] d detaches.\n" );
+    printf( "     --stats_file FILE       Write JSON stats here on SIGUSR1 instead of to the log.\n" );
+    printf( "     --stats_interval SEC    Also write stats every SEC seconds (0: off, default).\n" );
+    printf( "     --latency_trace FILE    Save per-keystroke latency as Chrome trace JSON on exit.\n" );
+    printf( "     --snapshot FILE         Save the screen and scrollback to FILE on exit and on SIGUSR2.\n" );
+    printf( "     --restore FILE          Start the (first) session from a --snapshot.\n" );
+    printf( "     --snapshot_check FILE   With --replay: fail unless the final screen matches a --snapshot.\n" );
+    printf( "     --startup_trace         Print how long each startup step took on exit.\n" );
+    printf( "     --record FILE           Capture pty output with timestamps to FILE (and FILE.idx).\n" );
+    printf( "     --record_input          Capture what's written to the pty as well.\n" );
+    printf( "     --replay FILE           Benchmark: render a --record capture or raw pty stream and exit.\n" );
+    printf( "     --replay_chunk BYTES    Bytes fed to vterm per read of a raw stream (default 4096).\n" );
+    printf( "     --replay_size COLSxROWS Screen size when replaying headless (default: captured, or 80x24).\n" );
+    printf( "     --replay_tty            Replay to this terminal instead of /dev/null.\n" );
+    printf( "     --replay_offset N       Start a capture replay at chunk N.\n" );
+    printf( "     --replay_realtime       Replay a capture at its recorded speed.\n" );
     printf( "  -h --help                  Show this help.\n" );
 
     exit( 1 );
@@ -255,16 +1840,55 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
           { "help", ya_no_argument, 0, 0 },
           { "wait_for_debugger", ya_no_argument, 0, 0 },
           { "logfile", ya_required_argument, 0, 0 },
+          { "log_mode", ya_required_argument, 0, 0 },
+          { "renderer", ya_required_argument, 0, 0 },
+          { "truecolor", ya_required_argument, 0, 0 },
+          { "fps", ya_required_argument, 0, 0 },
+          { "latency_budget", ya_required_argument, 0, 0 },
+          { "scrollback", ya_required_argument, 0, 0 },
+          { "reader_ring", ya_required_argument, 0, 0 },
+          { "drain_budget", ya_required_argument, 0, 0 },
+          { "sessions", ya_required_argument, 0, 0 },
+          { "prefix_keys", ya_no_argument, 0, 0 },
+          { "server", ya_required_argument, 0, 0 },
+          { "attach", ya_required_argument, 0, 0 },
+          { "replay", ya_required_argument, 0, 0 },
+          { "replay_chunk", ya_required_argument, 0, 0 },
+          { "replay_size", ya_required_argument, 0, 0 },
+          { "replay_tty", ya_no_argument, 0, 0 },
+          { "replay_offset", ya_required_argument, 0, 0 },
+          { "replay_realtime", ya_no_argument, 0, 0 },
+          { "stats_file", ya_required_argument, 0, 0 },
+          { "stats_interval", ya_required_argument, 0, 0 },
+          { "latency_trace", ya_required_argument, 0, 0 },
+          { "snapshot", ya_required_argument, 0, 0 },
+          { "snapshot_check", ya_required_argument, 0, 0 },
+          { "restore", ya_required_argument, 0, 0 },
+          { "startup_trace", ya_no_argument, 0, 0 },
+          { "record", ya_required_argument, 0, 0 },
+          { "record_input", ya_no_argument, 0, 0 },
           { 0, 0, 0, 0 }
         };
     const char *env_shell = getenv( "SHELL" );
     const char *env_term = getenv( "TERM" );
     const char *env_ncterm = getenv( "NCTERM" );
+    const char *env_colorterm = getenv( "COLORTERM" );
 
     opts->env_term = env_term;
     opts->nc_term = env_ncterm ? env_ncterm : env_term;
     opts->logfile = "cvterm.log";
+    opts->log_mode = "block";
+    opts->renderer = "ncurses";
+    opts->truecolor = env_colorterm && ( !strcmp( env_colorterm, "truecolor" ) || !strcmp( env_colorterm, "24bit" ) );
     opts->wait_for_debugger = 0;
+    opts->fps = 60;
+    opts->latency_budget_ms = 50;
+    opts->scrollback_mb = 16;
+    opts->drain_budget_us = 4000;
+    opts->sessions = 1;
+    opts->replay_chunk = 4096;
+    opts->replay_rows = 0;
+    opts->replay_cols = 0;
 
     opts->argv_buf[ 0 ] = env_shell ? env_shell : "/bin/sh";
     opts->argv_buf[ 1 ] = NULL;
@@ -287,6 +1911,81 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
                 opts->wait_for_debugger = 1;
             else if ( !strcmp( long_options[ option_index ].name, "logfile" ) )
                 opts->logfile = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "log_mode" ) )
+            {
+                opts->log_mode = ya_optarg;
+                if ( strcmp( ya_optarg, "sync" ) && strcmp( ya_optarg, "drop" ) && strcmp( ya_optarg, "block" ) )
+                {
+                    fprintf( stderr, "ERROR: Unknown log_mode '%s'.\n", ya_optarg );
+                    return -1;
+                }
+            }
+            else if ( !strcmp( long_options[ option_index ].name, "renderer" ) )
+            {
+                opts->renderer = ya_optarg;
+                if ( strcmp( ya_optarg, "ncurses" ) && strcmp( ya_optarg, "direct" ) )
+                {
+                    fprintf( stderr, "ERROR: Unknown renderer '%s'.\n", ya_optarg );
+                    return -1;
+                }
+            }
+            else if ( !strcmp( long_options[ option_index ].name, "truecolor" ) )
+                opts->truecolor = !!atoi( ya_optarg );
+            else if ( !strcmp( long_options[ option_index ].name, "fps" ) )
+                opts->fps = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "latency_budget" ) )
+                opts->latency_budget_ms = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "scrollback" ) )
+                opts->scrollback_mb = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "reader_ring" ) )
+                opts->reader_ring = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "drain_budget" ) )
+                opts->drain_budget_us = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "sessions" ) )
+                opts->sessions = MIN( SESSIONS_MAX, MAX( 1, atoi( ya_optarg ) ) );
+            else if ( !strcmp( long_options[ option_index ].name, "prefix_keys" ) )
+                opts->prefix_keys = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "server" ) )
+                opts->server = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "attach" ) )
+                opts->attach = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "replay" ) )
+                opts->replay = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "replay_chunk" ) )
+                opts->replay_chunk = MAX( 1, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "replay_size" ) )
+            {
+                if ( sscanf( ya_optarg, "%dx%d", &opts->replay_cols, &opts->replay_rows ) != 2 ||
+                     opts->replay_cols < 1 || opts->replay_rows < 1 )
+                {
+                    fprintf( stderr, "ERROR: Bad replay_size '%s'.\n", ya_optarg );
+                    return -1;
+                }
+            }
+            else if ( !strcmp( long_options[ option_index ].name, "replay_tty" ) )
+                opts->replay_tty = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "replay_offset" ) )
+                opts->replay_offset = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "replay_realtime" ) )
+                opts->replay_realtime = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "stats_file" ) )
+                opts->stats_file = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "stats_interval" ) )
+                opts->stats_interval = MAX( 0, atoi( ya_optarg ) );
+            else if ( !strcmp( long_options[ option_index ].name, "latency_trace" ) )
+                opts->latency_trace = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "snapshot" ) )
+                opts->snapshot = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "snapshot_check" ) )
+                opts->snapshot_check = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "restore" ) )
+                opts->restore = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "startup_trace" ) )
+                opts->startup_trace = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "record" ) )
+                opts->record = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "record_input" ) )
+                opts->record_input = 1;
             else
             {
                 fprintf( stderr, "ERROR: Unhandled option '--%s'.\n",
@@ -339,6 +2038,8 @@ static int opts_init( cvterm_opts *opts, int argc, char *argv[] )
 
     // Initialize logging.
     clog_init_path( 0, opts->logfile );
+    if ( strcmp( opts->log_mode, "sync" ) )
+        clog_set_async( 0, 1024 * 1024, !strcmp( opts->log_mode, "drop" ) ? CLOG_ASYNC_DROP : CLOG_ASYNC_BLOCK );
     clog_set_fmt( 0, "%m" );
     clog_info( CLOG( 0 ), "\n" );
     clog_set_fmt( 0, "%d %d: %m\n" );
@@ -351,77 +2052,188 @@ static int opts_init( cvterm_opts *opts, int argc, char *argv[] )
     return 0;
 }
 
+// Our window on the terminal (or /dev/null when headless) with the
+// renderer from --renderer.
+static termwin *twin_create( const cvterm_opts *opts, int headless, int rows, int cols )
+{
+    int direct = !strcmp( opts->renderer, "direct" );
+    termwin *twin;
+
+    if ( headless )
+        twin = direct ? termwin_init_direct_headless( rows, cols, opts->truecolor ) : termwin_init_headless( opts->nc_term, rows, cols );
+    else
+        twin = direct ? termwin_init_direct( opts->truecolor ) : termwin_init( opts->nc_term );
+
+    if ( !twin )
+        FATAL_ERROR( termwin_init );
+    return twin;
+}
+
+// --replay, see replay.h. The screen is g_twin and one session, drawn
+// with the usual render_* pacing.
+static void replay_start( int rows, int cols, int *term_rows, int *term_cols, void *user )
+{
+    const cvterm_opts *opts = ( const cvterm_opts * )user;
+
+    g_twin = twin_create( opts, !opts->replay_tty, rows, cols );
+    termwin_getsize( g_twin, term_rows, term_cols );
+
+    session *s = session_create( *term_rows, *term_cols, opts );
+
+    if ( opts->restore )
+        session_restore( s, opts->restore );
+
+    render_init( opts->fps, 0 );
+    g_render.record_frames = 1;
+}
+
+static void replay_write( const char *buf, size_t len, void *user )
+{
+    vterm_input_write( g_focus->vterm, buf, len );
+
+    render_output( 0 );
+    render_update( get_time_ns() );
+}
+
+static void replay_finish( replay_result *result, void *user )
+{
+    vterm_screen_flush_damage( vterm_obtain_screen( g_focus->vterm ) );
+    render_flush();
+    render_update( get_time_ns() );
+
+    result->vt = g_focus->vterm;
+    result->sb = g_focus->sb;
+    result->cursor_visible = g_focus->cursor_visible;
+    termwin_getstats( g_twin, &result->stats );
+    result->frame_times = g_render.frame_times;
+    result->frames = g_render.frame_times_count;
+}
+
+static void replay_stop( void *user )
+{
+    free( g_render.frame_times );
+    g_render.frame_times = NULL;
+    g_render.frame_times_count = 0;
+    cvterm_shutdown();
+}
+
+static const replay_callbacks g_replay_callbacks =
+    {
+      replay_start,  // start
+      replay_write,  // write
+      replay_finish, // finish
+      replay_stop    // stop
+    };
+
+static int replay_run( const cvterm_opts *opts )
+{
+    replay_opts ropts;
+
+    memset( &ropts, 0, sizeof( ropts ) );
+    ropts.file = opts->replay;
+    ropts.chunk = opts->replay_chunk;
+    ropts.rows = opts->replay_rows;
+    ropts.cols = opts->replay_cols;
+    ropts.offset = opts->replay_offset;
+    ropts.realtime = opts->replay_realtime;
+    ropts.snapshot = opts->snapshot;
+    ropts.snapshot_check = opts->snapshot_check;
+    ropts.renderer = opts->renderer;
+    return replay_main( &ropts, &g_replay_callbacks, ( void * )opts );
+}
+
 int main( int argc, char *argv[] )
 {
     cvterm_opts opts;
 
-    sigwinch( SIG_BLOCK );
+    g_startup.start_ns = get_time_ns();
     setlocale( LC_ALL, "" );
 
     // Initialize options.
     if ( opts_init( &opts, argc, argv ) )
         return 1;
+    startup_mark( "options" );
 
     // Call cvterm_shutdown on exit.
     atexit( cvterm_shutdown );
 
-    // Get stdin termios parameters.
-    struct termios child_termios;
-    if ( tcgetattr( STDIN_FILENO, &child_termios ) != 0 )
-        FATAL_ERROR( tcgetattr );
+    if ( opts.replay )
+        return replay_run( &opts );
 
-    // Initialize our terminal window.
-    int rows, cols;
-    g_twin = termwin_init( opts.nc_term );
-    if ( !g_twin )
-        FATAL_ERROR( termwin_init );
-    termwin_getsize( g_twin, &rows, &cols );
+    if ( opts.attach )
+        return remote_attach( opts.attach, opts.truecolor );
 
-    // Create our vterm object.
-    g_vterm = vterm_new( rows, cols );
-    vterm_set_utf8( g_vterm, 1 );
+    // Initialize our terminal window, or the socket clients attach to.
+    int rows = 24;
+    int cols = 80;
+    struct termios child_termios;
+    int have_termios = !tcgetattr( STDIN_FILENO, &child_termios );
 
-    termwin_setvterm( g_twin, g_vterm );
+    if ( opts.server )
+    {
+        g_server = server_init( opts.server, &g_server_callbacks, NULL );
+        if ( !g_server )
+        {
+            fprintf( stderr, "ERROR: Unable to listen on '%s': %s\n", opts.server, strerror( errno ) );
+            return 1;
+        }
 
-    // Initialize vterm screen.
-    VTermScreen *vtscreen = vterm_obtain_screen( g_vterm );
-    vterm_screen_enable_altscreen( vtscreen, 1 );
-    vterm_screen_reset( vtscreen, 1 );
-    vterm_screen_set_callbacks( vtscreen, &g_screen_cbs, g_twin );
+        // Outlive the terminal that started us; a client going away
+        // mid-write shows up as EPIPE.
+        signal( SIGHUP, SIG_IGN );
+        signal( SIGPIPE, SIG_IGN );
+    }
+    else
+    {
+        struct winsize ws;
+
+        // Get stdin termios parameters.
+        if ( !have_termios )
+            FATAL_ERROR( tcgetattr );
+
+        // The children start before the terminal is set up, so they're
+        // already running while ncurses and the palette initialize. Their
+        // size is what our window will be; it's checked again below.
+        if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &ws ) )
+            FATAL_ERROR( ioctl( TIOCGWINSZ ) );
+        termwin_size_for_terminal( ws.ws_row, ws.ws_col, &rows, &cols );
+    }
 
+    for ( int i = 0; i < opts.sessions; i++ )
     {
-        char slavename[ 128 ];
-        const struct winsize size = { rows, cols, 0, 0 };
+        session *s = session_create( rows, cols, &opts );
 
-        pid_t child = pty_fork( &g_master_pty, slavename, sizeof( slavename ), &child_termios, &size );
-        clog_info( CLOG( 0 ), "pty_fork child:%d slavename:%s", child, slavename );
+        if ( opts.restore && !i )
+            session_restore( s, opts.restore );
+        session_spawn( s, &opts, have_termios ? &child_termios : NULL, rows, cols );
+    }
+    startup_mark( "spawn" );
 
-        if ( child == 0 )
-        {
-            if ( opts.env_term )
-            {
-                if ( setenv( "TERM", opts.env_term, 1 ) )
-                    FATAL_ERROR( setenv );
-            }
-            else
-            {
-                if ( unsetenv( "TERM" ) )
-                    FATAL_ERROR( unsetenv );
-            }
+    if ( !opts.server )
+    {
+        g_twin = twin_create( &opts, 0, 0, 0 );
+        startup_mark( "termwin_init" );
 
-            sigwinch( SIG_UNBLOCK );
+        session_show( g_focus, g_twin );
+        startup_mark( "palette" );
 
-            execvp( opts.argv[ 0 ], ( char *const * )opts.argv );
-            FATAL_ERROR( execvp );
-        }
-    }
+        termwin_getsize( g_twin, &rows, &cols );
+        sessions_setsize( rows, cols );
 
-    // Make g_master_py non-blocking.
-    if ( fcntl( g_master_pty, F_SETFL, fcntl( g_master_pty, F_GETFL ) | O_NONBLOCK ) < 0 )
-        FATAL_ERROR( fcntl );
+        input_set_host_paste( 1 );
+        g_host_paste = 1;
+    }
 
-    main_loop( g_vterm, g_master_pty );
+    main_loop( &opts );
 
     cvterm_shutdown();
+
+    if ( opts.startup_trace )
+    {
+        char report[ 1024 ];
+
+        startup_report( report, sizeof( report ) );
+        fputs( report, stderr );
+    }
     return 0;
 }
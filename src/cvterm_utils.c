@@ -120,19 +120,21 @@ uint32_t sqrt_uint32( uint32_t a_nInput )
 // Get number of milliseconds since app started up
 uint32_t get_ticks()
 {
-    struct timeval t;
-    static struct timeval s_t0;
-    static int s_inited = 0;
+    static uint64_t s_t0 = 0;
 
-    if ( !s_inited )
-    {
-        s_inited = 1;
-        if ( gettimeofday( &s_t0, NULL ) )
-            FATAL_ERROR( gettimeofday );
-    }
+    if ( !s_t0 )
+        s_t0 = get_time_ns();
+
+    return ( uint32_t )( ( get_time_ns() - s_t0 ) / 1000000 );
+}
+
+// Get CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns()
+{
+    struct timespec ts;
 
-    if ( gettimeofday( &t, NULL ) )
-        FATAL_ERROR( gettimeofday );
+    if ( clock_gettime( CLOCK_MONOTONIC, &ts ) )
+        FATAL_ERROR( clock_gettime );
 
-    return ( t.tv_sec - s_t0.tv_sec ) * 1000 + ( t.tv_usec - s_t0.tv_usec ) / 1000;
+    return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
@@ -62,4 +62,7 @@ uint32_t sqrt_uint32( uint32_t a_nInput );
 // Get number of milliseconds since app started up
 uint32_t get_ticks();
 
+// Get CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns();
+
 #endif // _CVTERM_UTILS_H_
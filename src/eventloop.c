@@ -0,0 +1,486 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#if defined( HAVE_LINUX ) && !defined( EVENTLOOP_USE_POLL )
+#define EVENTLOOP_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "eventloop.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define EVENTLOOP_MAX_SIGNALS 8
+#define EVENTLOOP_MAX_EVENTS 16
+
+typedef struct eventloop_handler
+{
+    int events;
+    eventloop_fd_cb cb;
+    void *user;
+} eventloop_handler;
+
+typedef struct eventloop_signal
+{
+    int signo;
+    eventloop_signal_cb cb;
+    void *user;
+#if !defined( EVENTLOOP_EPOLL )
+    struct sigaction old_sigaction;
+#endif
+} eventloop_signal;
+
+struct eventloop
+{
+#if defined( EVENTLOOP_EPOLL )
+    int epfd;
+#else
+    int pollfds_dirty;
+    int pollfds_count;
+    struct pollfd *pollfds;
+#endif
+
+    // Handlers indexed by fd.
+    int handlers_count;
+    eventloop_handler *handlers;
+
+#if defined( EVENTLOOP_EPOLL )
+    // Our signals are blocked and read from a signalfd.
+    int signal_fd;
+    sigset_t signal_mask;
+#else
+    // Signal handler writes signal numbers here, we read them in the loop.
+    int signal_pipe[ 2 ];
+#endif
+    int signals_count;
+    eventloop_signal signals[ EVENTLOOP_MAX_SIGNALS ];
+};
+
+static eventloop_signal *find_signal( eventloop *el, int signo )
+{
+    int i;
+
+    for ( i = 0; i < el->signals_count; i++ )
+    {
+        if ( el->signals[ i ].signo == signo )
+            return &el->signals[ i ];
+    }
+    return NULL;
+}
+
+// Coalesce: each signal is dispatched once no matter how many times it fired.
+static void dispatch_signals( eventloop *el, const int *pending )
+{
+    int i;
+
+    for ( i = 0; i < el->signals_count; i++ )
+    {
+        if ( pending[ i ] )
+            el->signals[ i ].cb( el->signals[ i ].signo, el->signals[ i ].user );
+    }
+}
+
+#if defined( EVENTLOOP_EPOLL )
+
+static void eventloop_signalfd_cb( int fd, int events, void *user )
+{
+    int i;
+    ssize_t bytes_read;
+    struct signalfd_siginfo info[ 16 ];
+    int pending[ EVENTLOOP_MAX_SIGNALS ] = { 0 };
+    eventloop *el = ( eventloop * )user;
+
+    while ( ( bytes_read = TEMP_FAILURE_RETRY( read( fd, info, sizeof( info ) ) ) ) > 0 )
+    {
+        for ( i = 0; i < bytes_read / ( ssize_t )sizeof( info[ 0 ] ); i++ )
+        {
+            eventloop_signal *sigdata = find_signal( el, info[ i ].ssi_signo );
+
+            if ( sigdata )
+                pending[ sigdata - el->signals ] = 1;
+        }
+    }
+
+    dispatch_signals( el, pending );
+}
+
+#else
+
+// Signal handlers can only get at globals.
+static eventloop *g_signal_el = NULL;
+
+static void set_fd_flags( int fd )
+{
+    if ( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+    if ( fcntl( fd, F_SETFD, fcntl( fd, F_GETFD ) | FD_CLOEXEC ) < 0 )
+        FATAL_ERROR( fcntl );
+}
+
+static void eventloop_signal_handler( int signo )
+{
+    int saved_errno = errno;
+    unsigned char sig = ( unsigned char )signo;
+
+    // Pipe is non-blocking: if it's full there is already a wakeup pending.
+    ssize_t ret = write( g_signal_el->signal_pipe[ 1 ], &sig, 1 );
+    ( void )ret;
+
+    errno = saved_errno;
+}
+
+static void eventloop_signal_pipe_cb( int fd, int events, void *user )
+{
+    int i;
+    ssize_t bytes_read;
+    unsigned char buf[ 64 ];
+    int pending[ EVENTLOOP_MAX_SIGNALS ] = { 0 };
+    eventloop *el = ( eventloop * )user;
+
+    while ( ( bytes_read = TEMP_FAILURE_RETRY( read( fd, buf, sizeof( buf ) ) ) ) > 0 )
+    {
+        for ( i = 0; i < bytes_read; i++ )
+        {
+            eventloop_signal *sigdata = find_signal( el, buf[ i ] );
+
+            if ( sigdata )
+                pending[ sigdata - el->signals ] = 1;
+        }
+    }
+
+    dispatch_signals( el, pending );
+}
+
+#endif
+
+#if defined( EVENTLOOP_EPOLL )
+static uint32_t to_epoll_events( int events )
+{
+    return ( ( events & EVENTLOOP_READ ) ? EPOLLIN : 0 ) |
+           ( ( events & EVENTLOOP_WRITE ) ? EPOLLOUT : 0 );
+}
+#endif
+
+eventloop *eventloop_init()
+{
+    eventloop *el = ( eventloop * )calloc( 1, sizeof( *el ) );
+
+#if defined( EVENTLOOP_EPOLL )
+    el->epfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( el->epfd < 0 )
+        FATAL_ERROR( epoll_create1 );
+#endif
+
+#if defined( EVENTLOOP_EPOLL )
+    // Created with the first signal.
+    el->signal_fd = -1;
+    sigemptyset( &el->signal_mask );
+#else
+    if ( pipe( el->signal_pipe ) )
+        FATAL_ERROR( pipe );
+    set_fd_flags( el->signal_pipe[ 0 ] );
+    set_fd_flags( el->signal_pipe[ 1 ] );
+
+    eventloop_add_fd( el, el->signal_pipe[ 0 ], EVENTLOOP_READ, eventloop_signal_pipe_cb, el );
+#endif
+
+    clog_info( CLOG( 0 ), "eventloop backend: %s",
+#if defined( EVENTLOOP_EPOLL )
+               "epoll"
+#else
+               "poll"
+#endif
+               );
+    return el;
+}
+
+void eventloop_free( eventloop *el )
+{
+    if ( el )
+    {
+#if defined( EVENTLOOP_EPOLL )
+        if ( el->signal_fd >= 0 )
+        {
+            struct signalfd_siginfo info[ 16 ];
+
+            // Swallow anything still pending so unblocking doesn't run the
+            // default action (SIGUSR1 would kill us).
+            while ( TEMP_FAILURE_RETRY( read( el->signal_fd, info, sizeof( info ) ) ) > 0 )
+                ;
+            close( el->signal_fd );
+            pthread_sigmask( SIG_UNBLOCK, &el->signal_mask, NULL );
+        }
+
+        close( el->epfd );
+#else
+        int i;
+
+        for ( i = 0; i < el->signals_count; i++ )
+            sigaction( el->signals[ i ].signo, &el->signals[ i ].old_sigaction, NULL );
+        if ( g_signal_el == el )
+            g_signal_el = NULL;
+
+        close( el->signal_pipe[ 0 ] );
+        close( el->signal_pipe[ 1 ] );
+
+        free( el->pollfds );
+#endif
+        free( el->handlers );
+        free( el );
+    }
+}
+
+void eventloop_add_fd( eventloop *el, int fd, int events, eventloop_fd_cb cb, void *user )
+{
+    if ( fd >= el->handlers_count )
+    {
+        int count = MAX( fd + 1, el->handlers_count * 2 );
+
+        el->handlers = ( eventloop_handler * )realloc( el->handlers, count * sizeof( el->handlers[ 0 ] ) );
+        memset( el->handlers + el->handlers_count, 0,
+                ( count - el->handlers_count ) * sizeof( el->handlers[ 0 ] ) );
+        el->handlers_count = count;
+    }
+
+    el->handlers[ fd ].events = events;
+    el->handlers[ fd ].cb = cb;
+    el->handlers[ fd ].user = user;
+
+#if defined( EVENTLOOP_EPOLL )
+    struct epoll_event ev;
+
+    ev.events = to_epoll_events( events );
+    ev.data.fd = fd;
+    if ( epoll_ctl( el->epfd, EPOLL_CTL_ADD, fd, &ev ) )
+        FATAL_ERROR( epoll_ctl );
+#else
+    el->pollfds_dirty = 1;
+#endif
+}
+
+void eventloop_mod_fd( eventloop *el, int fd, int events )
+{
+    if ( el->handlers[ fd ].events == events )
+        return;
+
+    el->handlers[ fd ].events = events;
+
+#if defined( EVENTLOOP_EPOLL )
+    struct epoll_event ev;
+
+    ev.events = to_epoll_events( events );
+    ev.data.fd = fd;
+    if ( epoll_ctl( el->epfd, EPOLL_CTL_MOD, fd, &ev ) )
+        FATAL_ERROR( epoll_ctl );
+#else
+    el->pollfds_dirty = 1;
+#endif
+}
+
+void eventloop_del_fd( eventloop *el, int fd )
+{
+    if ( fd >= el->handlers_count || !el->handlers[ fd ].cb )
+        return;
+
+    memset( &el->handlers[ fd ], 0, sizeof( el->handlers[ fd ] ) );
+
+#if defined( EVENTLOOP_EPOLL )
+    if ( epoll_ctl( el->epfd, EPOLL_CTL_DEL, fd, NULL ) && ( errno != EBADF ) )
+        FATAL_ERROR( epoll_ctl );
+#else
+    el->pollfds_dirty = 1;
+#endif
+}
+
+void eventloop_add_signal( eventloop *el, int signo, eventloop_signal_cb cb, void *user )
+{
+    eventloop_signal *sigdata = find_signal( el, signo );
+
+    if ( sigdata )
+    {
+        sigdata->cb = cb;
+        sigdata->user = user;
+        return;
+    }
+
+    if ( el->signals_count >= EVENTLOOP_MAX_SIGNALS )
+        FATAL_ERROR( eventloop_add_signal );
+
+    sigdata = &el->signals[ el->signals_count ];
+    sigdata->signo = signo;
+    sigdata->cb = cb;
+    sigdata->user = user;
+
+#if defined( EVENTLOOP_EPOLL )
+    int add_fd = ( el->signal_fd < 0 );
+
+    sigaddset( &el->signal_mask, signo );
+    if ( pthread_sigmask( SIG_BLOCK, &el->signal_mask, NULL ) )
+        FATAL_ERROR( pthread_sigmask );
+
+    el->signal_fd = signalfd( el->signal_fd, &el->signal_mask, SFD_NONBLOCK | SFD_CLOEXEC );
+    if ( el->signal_fd < 0 )
+        FATAL_ERROR( signalfd );
+
+    if ( add_fd )
+        eventloop_add_fd( el, el->signal_fd, EVENTLOOP_READ, eventloop_signalfd_cb, el );
+#else
+    struct sigaction sa;
+
+    if ( g_signal_el && ( g_signal_el != el ) )
+        FATAL_ERROR( eventloop_add_signal );
+    g_signal_el = el;
+
+    sa.sa_handler = eventloop_signal_handler;
+    sigemptyset( &sa.sa_mask );
+    sa.sa_flags = SA_RESTART;
+
+    if ( sigaction( signo, &sa, &sigdata->old_sigaction ) )
+        FATAL_ERROR( sigaction );
+#endif
+
+    el->signals_count++;
+}
+
+static int dispatch( eventloop *el, int fd, int events )
+{
+    if ( ( fd < el->handlers_count ) && el->handlers[ fd ].cb )
+    {
+        el->handlers[ fd ].cb( fd, events, el->handlers[ fd ].user );
+        return 1;
+    }
+    return 0;
+}
+
+#if defined( EVENTLOOP_EPOLL )
+
+int eventloop_run_once( eventloop *el, int timeout_ms )
+{
+    int i;
+    int count = 0;
+    struct epoll_event events[ EVENTLOOP_MAX_EVENTS ];
+    int ret = epoll_wait( el->epfd, events, EVENTLOOP_MAX_EVENTS, timeout_ms );
+
+    if ( ret < 0 )
+    {
+        if ( errno == EINTR )
+            return 0;
+        FATAL_ERROR( epoll_wait );
+    }
+
+    for ( i = 0; i < ret; i++ )
+    {
+        int ev = 0;
+
+        if ( events[ i ].events & EPOLLIN )
+            ev |= EVENTLOOP_READ;
+        if ( events[ i ].events & EPOLLOUT )
+            ev |= EVENTLOOP_WRITE;
+        if ( events[ i ].events & ( EPOLLHUP | EPOLLERR ) )
+            ev |= EVENTLOOP_HANGUP;
+
+        count += dispatch( el, events[ i ].data.fd, ev );
+    }
+
+    return count;
+}
+
+#else
+
+static void rebuild_pollfds( eventloop *el )
+{
+    int fd;
+
+    el->pollfds = ( struct pollfd * )realloc( el->pollfds, el->handlers_count * sizeof( el->pollfds[ 0 ] ) );
+    el->pollfds_count = 0;
+
+    for ( fd = 0; fd < el->handlers_count; fd++ )
+    {
+        if ( el->handlers[ fd ].cb )
+        {
+            struct pollfd *pfd = &el->pollfds[ el->pollfds_count++ ];
+
+            pfd->fd = fd;
+            pfd->events = ( ( el->handlers[ fd ].events & EVENTLOOP_READ ) ? POLLIN : 0 ) |
+                          ( ( el->handlers[ fd ].events & EVENTLOOP_WRITE ) ? POLLOUT : 0 );
+            pfd->revents = 0;
+        }
+    }
+
+    el->pollfds_dirty = 0;
+}
+
+int eventloop_run_once( eventloop *el, int timeout_ms )
+{
+    int i;
+    int ret;
+    int count = 0;
+    int pollfds_count;
+
+    if ( el->pollfds_dirty )
+        rebuild_pollfds( el );
+
+    ret = poll( el->pollfds, el->pollfds_count, timeout_ms );
+    if ( ret < 0 )
+    {
+        if ( errno == EINTR )
+            return 0;
+        FATAL_ERROR( poll );
+    }
+
+    // Callbacks may add or remove fds: only walk the entries we polled.
+    pollfds_count = el->pollfds_count;
+    for ( i = 0; ( i < pollfds_count ) && ( count < ret ); i++ )
+    {
+        int ev = 0;
+        short revents = el->pollfds[ i ].revents;
+
+        if ( !revents )
+            continue;
+
+        if ( revents & POLLIN )
+            ev |= EVENTLOOP_READ;
+        if ( revents & POLLOUT )
+            ev |= EVENTLOOP_WRITE;
+        if ( revents & ( POLLHUP | POLLERR | POLLNVAL ) )
+            ev |= EVENTLOOP_HANGUP;
+
+        count += dispatch( el, el->pollfds[ i ].fd, ev );
+    }
+
+    return count;
+}
+
+#endif
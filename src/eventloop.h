@@ -0,0 +1,61 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _EVENTLOOP_H_
+#define _EVENTLOOP_H_
+
+// Minimal fd + signal event loop. Uses epoll on Linux and poll() elsewhere
+// (or when built with EVENTLOOP_USE_POLL).
+
+#define EVENTLOOP_READ 0x1
+#define EVENTLOOP_WRITE 0x2
+#define EVENTLOOP_HANGUP 0x4
+
+typedef struct eventloop eventloop;
+
+typedef void ( *eventloop_fd_cb )( int fd, int events, void *user );
+typedef void ( *eventloop_signal_cb )( int signo, void *user );
+
+eventloop *eventloop_init();
+void eventloop_free( eventloop *el );
+
+// Watch fd for EVENTLOOP_READ and/or EVENTLOOP_WRITE. Hangups are always reported.
+void eventloop_add_fd( eventloop *el, int fd, int events, eventloop_fd_cb cb, void *user );
+void eventloop_mod_fd( eventloop *el, int fd, int events );
+void eventloop_del_fd( eventloop *el, int fd );
+
+// Deliver signo through the loop instead of in signal context. With epoll the
+// signal is blocked and read from a signalfd, so threads started earlier
+// should block it too. Otherwise a handler writes it to a self-pipe.
+// Previously installed handlers are not called.
+void eventloop_add_signal( eventloop *el, int signo, eventloop_signal_cb cb, void *user );
+
+// Wait up to timeout_ms (-1: forever) and dispatch ready callbacks.
+// Returns number of callbacks dispatched.
+int eventloop_run_once( eventloop *el, int timeout_ms );
+
+#endif // _EVENTLOOP_H_
@@ -0,0 +1,413 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vterm.h"
+#include "input.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Longest key sequence kept back when a read ends partway through one.
+// Translated keys are at most ESC [ nn ; n ~, so this is plenty.
+#define INPUT_CARRY_MAX 16
+#define INPUT_OUT_INITIAL 4096
+
+struct inputparser
+{
+    VTerm *vt;
+    int in_paste;
+
+    // Tail of the last chunk that might be the start of PASTE_END, or of
+    // a key sequence or PASTE_START outside a paste.
+    char carry[ INPUT_CARRY_MAX ];
+    size_t carry_len;
+
+    char *scratch; // carry + next chunk
+    size_t scratch_size;
+
+    char *out; // Bytes for the pty
+    size_t out_len;
+    size_t out_size;
+};
+
+static void input_reserve( inputparser *in, size_t len )
+{
+    if ( in->out_len + len > in->out_size )
+    {
+        in->out_size = MAX( in->out_len + len, in->out_size * 2 );
+        in->out = ( char * )realloc( in->out, in->out_size );
+        if ( !in->out )
+            FATAL_ERROR( realloc );
+    }
+}
+
+inputparser *input_init( VTerm *vt )
+{
+    inputparser *in = ( inputparser * )calloc( 1, sizeof( *in ) );
+
+    if ( !in )
+        FATAL_ERROR( calloc );
+
+    in->vt = vt;
+    // Room for ordinary typing up front, so keystrokes don't allocate.
+    input_reserve( in, INPUT_OUT_INITIAL );
+    return in;
+}
+
+void input_free( inputparser *in )
+{
+    if ( in )
+    {
+        free( in->scratch );
+        free( in->out );
+        free( in );
+    }
+}
+
+void input_set_host_paste( int enable )
+{
+    const char *seq = enable ? "\033[?2004h" : "\033[?2004l";
+
+    if ( TEMP_FAILURE_RETRY( write( STDOUT_FILENO, seq, strlen( seq ) ) ) < 0 )
+        clog_warn( CLOG( 0 ), "bracketed paste write failed: %d", errno );
+}
+
+static void input_append( inputparser *in, const char *buf, size_t len )
+{
+    input_reserve( in, len );
+    memcpy( in->out + in->out_len, buf, len );
+    in->out_len += len;
+}
+
+// Move whatever the last vterm_keyboard_* call produced into out.
+static void input_append_vterm( inputparser *in )
+{
+    size_t len;
+
+    while ( ( len = vterm_output_get_buffer_current( in->vt ) ) > 0 )
+    {
+        input_reserve( in, len );
+        in->out_len += vterm_output_read( in->vt, in->out + in->out_len, len );
+    }
+}
+
+// xterm modifier parameter (1 + shift/alt/ctrl bits) to VTermModifier.
+static VTermModifier input_modifier( int param )
+{
+    return ( param > 1 ) ? ( VTermModifier )( ( param - 1 ) & 0x7 ) : VTERM_MOD_NONE;
+}
+
+static VTermKey input_letter_key( char c )
+{
+    switch ( c )
+    {
+    case 'A':
+        return VTERM_KEY_UP;
+    case 'B':
+        return VTERM_KEY_DOWN;
+    case 'C':
+        return VTERM_KEY_RIGHT;
+    case 'D':
+        return VTERM_KEY_LEFT;
+    case 'H':
+        return VTERM_KEY_HOME;
+    case 'F':
+        return VTERM_KEY_END;
+    case 'P':
+        return VTERM_KEY_FUNCTION( 1 );
+    case 'Q':
+        return VTERM_KEY_FUNCTION( 2 );
+    case 'R':
+        return VTERM_KEY_FUNCTION( 3 );
+    case 'S':
+        return VTERM_KEY_FUNCTION( 4 );
+    }
+    return VTERM_KEY_NONE;
+}
+
+static VTermKey input_tilde_key( int param )
+{
+    switch ( param )
+    {
+    case 1:
+    case 7:
+        return VTERM_KEY_HOME;
+    case 2:
+        return VTERM_KEY_INS;
+    case 3:
+        return VTERM_KEY_DEL;
+    case 4:
+    case 8:
+        return VTERM_KEY_END;
+    case 5:
+        return VTERM_KEY_PAGEUP;
+    case 6:
+        return VTERM_KEY_PAGEDOWN;
+    }
+    if ( param >= 11 && param <= 15 )
+        return VTERM_KEY_FUNCTION( param - 10 );
+    if ( param >= 17 && param <= 21 )
+        return VTERM_KEY_FUNCTION( param - 11 );
+    if ( param >= 23 && param <= 24 )
+        return VTERM_KEY_FUNCTION( param - 12 );
+    return VTERM_KEY_NONE;
+}
+
+// Parse a key sequence starting with ESC. Returns its length, or 0 if it is
+// incomplete or not a key we translate (the caller passes those through).
+static size_t input_parse_key( const char *buf, size_t len, VTermKey *key, VTermModifier *mod )
+{
+    *key = VTERM_KEY_NONE;
+    *mod = VTERM_MOD_NONE;
+
+    if ( len < 3 )
+        return 0;
+
+    if ( buf[ 1 ] == 'O' )
+    {
+        // SS3: application mode cursor keys and F1-F4.
+        *key = input_letter_key( buf[ 2 ] );
+        return ( *key != VTERM_KEY_NONE ) ? 3 : 0;
+    }
+
+    if ( buf[ 1 ] != '[' )
+        return 0;
+
+    // CSI [param[;param]] final
+    int params[ 2 ] = { 0, 0 };
+    int nparams = 0;
+    size_t i;
+
+    for ( i = 2; i < len; i++ )
+    {
+        char c = buf[ i ];
+
+        if ( c >= '0' && c <= '9' )
+        {
+            if ( !nparams )
+                nparams = 1;
+            params[ nparams - 1 ] = MIN( params[ nparams - 1 ] * 10 + ( c - '0' ), 9999 );
+        }
+        else if ( c == ';' )
+        {
+            if ( !nparams )
+                nparams = 1;
+            if ( nparams == 2 )
+                return 0;
+            nparams++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if ( i == len )
+        return 0;
+
+    char final = buf[ i ];
+    if ( final == '~' )
+        *key = input_tilde_key( params[ 0 ] );
+    else if ( final == 'Z' && !nparams )
+    {
+        *key = VTERM_KEY_TAB;
+        *mod = VTERM_MOD_SHIFT;
+    }
+    else if ( nparams == 0 || params[ 0 ] == 1 )
+        *key = input_letter_key( final );
+
+    if ( *key == VTERM_KEY_NONE )
+        return 0;
+
+    if ( nparams == 2 )
+        *mod = input_modifier( params[ 1 ] );
+    return i + 1;
+}
+
+// Number of bytes at the end of buf that could be the start of PASTE_END.
+static size_t input_paste_end_prefix( const char *buf, size_t len )
+{
+    for ( size_t n = MIN( len, PASTE_MARKER_LEN - 1 ); n > 0; n-- )
+    {
+        if ( !memcmp( buf + len - n, PASTE_END, n ) )
+            return n;
+    }
+    return 0;
+}
+
+// Could buf (starting with ESC) be the start of a key sequence we translate
+// or of PASTE_START, cut short by the end of the read?
+static int input_key_incomplete( const char *buf, size_t len )
+{
+    if ( len >= INPUT_CARRY_MAX )
+        return 0;
+    if ( len == 1 )
+        return 1;
+    if ( buf[ 1 ] == 'O' )
+        return len == 2;
+    if ( buf[ 1 ] != '[' )
+        return 0;
+
+    for ( size_t i = 2; i < len; i++ )
+    {
+        if ( !( ( buf[ i ] >= '0' && buf[ i ] <= '9' ) || buf[ i ] == ';' ) )
+            return 0;
+    }
+    return 1;
+}
+
+const char *input_translate( inputparser *in, const char *buf, size_t len, size_t *outlen )
+{
+    size_t joined = in->carry_len;
+
+    in->out_len = 0;
+
+    if ( in->carry_len )
+    {
+        // Rejoin a key sequence or paste marker that straddled two reads.
+        size_t size = in->carry_len + len;
+
+        if ( size > in->scratch_size )
+        {
+            in->scratch_size = size;
+            in->scratch = ( char * )realloc( in->scratch, size );
+            if ( !in->scratch )
+                FATAL_ERROR( realloc );
+        }
+        memcpy( in->scratch, in->carry, in->carry_len );
+        memcpy( in->scratch + in->carry_len, buf, len );
+        buf = in->scratch;
+        len = size;
+        in->carry_len = 0;
+    }
+
+    for ( size_t i = 0; i < len; )
+    {
+        if ( in->in_paste )
+        {
+            const char *end = ( const char * )memmem( buf + i, len - i, PASTE_END, PASTE_MARKER_LEN );
+
+            if ( !end )
+            {
+                // Whole rest of the chunk is pasted text, minus a possible partial marker.
+                size_t keep = input_paste_end_prefix( buf + i, len - i );
+
+                input_append( in, buf + i, len - i - keep );
+                memcpy( in->carry, buf + len - keep, keep );
+                in->carry_len = keep;
+                break;
+            }
+
+            input_append( in, buf + i, end - ( buf + i ) );
+            vterm_keyboard_end_paste( in->vt );
+            input_append_vterm( in );
+            in->in_paste = 0;
+            i = end - buf + PASTE_MARKER_LEN;
+            continue;
+        }
+
+        if ( buf[ i ] != '\033' )
+        {
+            // Plain text (and control characters) goes straight through.
+            const char *esc = ( const char * )memchr( buf + i, '\033', len - i );
+            size_t run = esc ? ( size_t )( esc - ( buf + i ) ) : ( len - i );
+
+            input_append( in, buf + i, run );
+            i += run;
+            continue;
+        }
+
+        // Terminals write a key in one go, so a read that is nothing but
+        // ESC is the Escape key. After other bytes it may be cut short:
+        // wait for the rest, or input_flush if it never comes.
+        if ( ( i || joined ) && input_key_incomplete( buf + i, len - i ) )
+        {
+            memcpy( in->carry, buf + i, len - i );
+            in->carry_len = len - i;
+            break;
+        }
+
+        if ( ( len - i >= PASTE_MARKER_LEN ) && !memcmp( buf + i, PASTE_START, PASTE_MARKER_LEN ) )
+        {
+            vterm_keyboard_start_paste( in->vt );
+            input_append_vterm( in );
+            in->in_paste = 1;
+            i += PASTE_MARKER_LEN;
+            continue;
+        }
+
+        VTermKey key;
+        VTermModifier mod;
+        size_t keylen = input_parse_key( buf + i, len - i, &key, &mod );
+
+        if ( keylen )
+        {
+            vterm_keyboard_key( in->vt, key, mod );
+            input_append_vterm( in );
+            i += keylen;
+        }
+        else
+        {
+            // Lone ESC, Alt+key, or a sequence we don't know: pass it through.
+            input_append( in, buf + i, 1 );
+            i++;
+        }
+    }
+
+    *outlen = in->out_len;
+    return in->out;
+}
+
+int input_in_paste( inputparser *in )
+{
+    return in->in_paste;
+}
+
+int input_pending( inputparser *in )
+{
+    return !in->in_paste && in->carry_len;
+}
+
+const char *input_flush( inputparser *in, size_t *outlen )
+{
+    in->out_len = 0;
+
+    // Nothing more came, so it was a lone ESC or Alt+key after all.
+    if ( input_pending( in ) )
+    {
+        input_append( in, in->carry, in->carry_len );
+        in->carry_len = 0;
+    }
+
+    *outlen = in->out_len;
+    return in->out;
+}
@@ -0,0 +1,61 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+// Translates what the host terminal sends on stdin into bytes for the pty.
+// Text is passed through untouched. Cursor, editing and function key
+// sequences go through vterm_keyboard_key() so they honor the modes the
+// child set (DECCKM etc). Bracketed pastes are forwarded as one block.
+
+// Bracketed paste markers, as the host terminal sends them.
+#define PASTE_START "\033[200~"
+#define PASTE_END "\033[201~"
+#define PASTE_MARKER_LEN 6
+
+typedef struct inputparser inputparser;
+
+inputparser *input_init( VTerm *vt );
+void input_free( inputparser *in );
+
+// Translate len bytes read from stdin. The returned bytes are valid until the
+// next call and should be written to the pty in order.
+const char *input_translate( inputparser *in, const char *buf, size_t len, size_t *outlen );
+
+// Between PASTE_START and PASTE_END, as of the last byte translated.
+int input_in_paste( inputparser *in );
+
+// A read that ends partway through a key sequence keeps the start back for
+// the next one. If nothing follows, input_flush sends it on as typed.
+int input_pending( inputparser *in );
+const char *input_flush( inputparser *in, size_t *outlen );
+
+// Ask the host terminal to bracket pastes (or stop).
+void input_set_host_paste( int enable );
+
+#endif // _INPUT_H_
@@ -0,0 +1,236 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "metrics.h"
+#include "latency.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define LATENCY_PENDING 64
+#define LATENCY_TIMEOUT_NS 1000000000ULL
+
+typedef struct latency_trace
+{
+    uint64_t input_ns;
+    uint64_t written_ns;
+    uint64_t echo_ns;
+    uint64_t drawn_ns;
+    uint64_t queue_end;
+} latency_trace;
+
+struct latency
+{
+    // In flight, oldest first. Each stage is reached in order, so the
+    // traces that have reached a stage are always a prefix.
+    latency_trace pending[ LATENCY_PENDING ];
+    size_t head;
+    size_t count;
+
+    latency_trace *done;
+    size_t done_count;
+    size_t max_done;
+
+    latency_stats stats;
+};
+
+#define LATENCY_PENDING_AT( _lt, _i ) ( &( _lt )->pending[ ( ( _lt )->head + ( _i ) ) % LATENCY_PENDING ] )
+
+latency *latency_init( size_t max_trace )
+{
+    latency *lt = ( latency * )calloc( 1, sizeof( *lt ) );
+
+    if ( !lt )
+        FATAL_ERROR( calloc );
+
+    if ( max_trace )
+    {
+        lt->done = ( latency_trace * )malloc( max_trace * sizeof( lt->done[ 0 ] ) );
+        if ( !lt->done )
+            FATAL_ERROR( malloc );
+        lt->max_done = max_trace;
+    }
+    return lt;
+}
+
+void latency_free( latency *lt )
+{
+    if ( lt )
+    {
+        free( lt->done );
+        free( lt );
+    }
+}
+
+static void latency_pop( latency *lt )
+{
+    lt->head = ( lt->head + 1 ) % LATENCY_PENDING;
+    lt->count--;
+}
+
+// Give up on input that never got output back.
+static void latency_expire( latency *lt, uint64_t now )
+{
+    while ( lt->count )
+    {
+        latency_trace *trace = LATENCY_PENDING_AT( lt, 0 );
+
+        if ( trace->echo_ns || ( now - trace->input_ns < LATENCY_TIMEOUT_NS ) )
+            break;
+
+        lt->stats.unechoed++;
+        latency_pop( lt );
+    }
+}
+
+void latency_input( latency *lt, uint64_t now, uint64_t queue_end )
+{
+    latency_expire( lt, now );
+
+    if ( lt->count == LATENCY_PENDING )
+    {
+        lt->stats.overflowed++;
+        latency_pop( lt );
+    }
+
+    latency_trace *trace = LATENCY_PENDING_AT( lt, lt->count );
+
+    memset( trace, 0, sizeof( *trace ) );
+    trace->input_ns = now;
+    trace->queue_end = queue_end;
+    lt->count++;
+    lt->stats.traces++;
+}
+
+void latency_written( latency *lt, uint64_t now, uint64_t bytes_written )
+{
+    size_t i;
+
+    for ( i = 0; i < lt->count; i++ )
+    {
+        latency_trace *trace = LATENCY_PENDING_AT( lt, i );
+
+        if ( trace->written_ns )
+            continue;
+        if ( trace->queue_end > bytes_written )
+            break;
+        trace->written_ns = now;
+    }
+}
+
+void latency_output( latency *lt, uint64_t now )
+{
+    size_t i;
+
+    for ( i = 0; i < lt->count; i++ )
+    {
+        latency_trace *trace = LATENCY_PENDING_AT( lt, i );
+
+        if ( trace->echo_ns )
+            continue;
+        if ( !trace->written_ns )
+            break;
+        trace->echo_ns = now;
+    }
+}
+
+void latency_drawn( latency *lt, uint64_t now )
+{
+    while ( lt->count )
+    {
+        latency_trace *trace = LATENCY_PENDING_AT( lt, 0 );
+
+        if ( !trace->echo_ns )
+            break;
+
+        trace->drawn_ns = now;
+        metrics_hist_add( &lt->stats.input_to_pty, trace->written_ns - trace->input_ns );
+        metrics_hist_add( &lt->stats.pty_to_echo, trace->echo_ns - trace->written_ns );
+        metrics_hist_add( &lt->stats.echo_to_drawn, trace->drawn_ns - trace->echo_ns );
+        metrics_hist_add( &lt->stats.total, trace->drawn_ns - trace->input_ns );
+        lt->stats.completed++;
+
+        if ( lt->done_count < lt->max_done )
+            lt->done[ lt->done_count++ ] = *trace;
+
+        latency_pop( lt );
+    }
+
+    latency_expire( lt, now );
+}
+
+void latency_getstats( latency *lt, latency_stats *stats )
+{
+    *stats = lt->stats;
+}
+
+static void latency_trace_event( FILE *fp, int *first, const char *name, uint64_t id, uint64_t start_ns, uint64_t end_ns )
+{
+    fprintf( fp, "%s\n{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"key\":%" PRIu64 "}}",
+             *first ? "" : ",", name, start_ns / 1000.0, ( end_ns - start_ns ) / 1000.0, id );
+    *first = 0;
+}
+
+int latency_write_trace( latency *lt, const char *filename )
+{
+    size_t i;
+    int first = 1;
+    FILE *fp = fopen( filename, "w" );
+
+    if ( !fp )
+    {
+        clog_warn( CLOG( 0 ), "Unable to write latency trace %s: %d", filename, errno );
+        return -1;
+    }
+
+    fprintf( fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+    for ( i = 0; i < lt->done_count; i++ )
+    {
+        const latency_trace *trace = &lt->done[ i ];
+
+        // The stages nest under the whole keystroke.
+        latency_trace_event( fp, &first, "keystroke", i, trace->input_ns, trace->drawn_ns );
+        latency_trace_event( fp, &first, "input_to_pty", i, trace->input_ns, trace->written_ns );
+        latency_trace_event( fp, &first, "pty_to_echo", i, trace->written_ns, trace->echo_ns );
+        latency_trace_event( fp, &first, "echo_to_drawn", i, trace->echo_ns, trace->drawn_ns );
+    }
+    fprintf( fp, "\n]}\n" );
+
+    if ( fclose( fp ) )
+    {
+        clog_warn( CLOG( 0 ), "Unable to write latency trace %s: %d", filename, errno );
+        return -1;
+    }
+    return 0;
+}
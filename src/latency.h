@@ -0,0 +1,76 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+// Keystroke to screen latency. Each stdin read is followed through four
+// points: read from stdin, fully written to the pty, the next pty output
+// after that (taken to be the echo), and the end of the doupdate that drew
+// it. Reads that get no output back within a second are counted and dropped.
+//
+// Callers include metrics.h first.
+
+typedef struct latency latency;
+
+typedef struct latency_stats
+{
+    uint64_t traces;     // stdin reads seen
+    uint64_t completed;  // Made it all the way to the screen
+    uint64_t unechoed;   // No output within a second
+    uint64_t overflowed; // Dropped because too many were in flight
+    metrics_hist input_to_pty;
+    metrics_hist pty_to_echo;
+    metrics_hist echo_to_drawn;
+    metrics_hist total;
+} latency_stats;
+
+// max_trace is how many completed keystrokes latency_write_trace can save
+// (0: aggregate only).
+latency *latency_init( size_t max_trace );
+void latency_free( latency *lt );
+
+// Input was read at now and queued for the pty. queue_end is the pty
+// queue's total bytes queued after it went in.
+void latency_input( latency *lt, uint64_t now, uint64_t queue_end );
+
+// The pty queue has written bytes_written bytes in total.
+void latency_written( latency *lt, uint64_t now, uint64_t bytes_written );
+
+// Output came back from the pty.
+void latency_output( latency *lt, uint64_t now );
+
+// A frame finished drawing.
+void latency_drawn( latency *lt, uint64_t now );
+
+void latency_getstats( latency *lt, latency_stats *stats );
+
+// Save the completed keystrokes as Chrome trace event JSON (load it in
+// chrome://tracing or Perfetto). Returns 0 on success.
+int latency_write_trace( latency *lt, const char *filename );
+
+#endif // _LATENCY_H_
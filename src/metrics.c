@@ -0,0 +1,219 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+static uint64_t metrics_bucket_max( int bucket )
+{
+    if ( !bucket )
+        return 0;
+    if ( bucket == 64 )
+        return UINT64_MAX;
+    return ( 1ULL << bucket ) - 1;
+}
+
+uint64_t metrics_hist_percentile( const metrics_hist *hist, int pct )
+{
+    int i;
+    uint64_t seen = 0;
+    uint64_t target = ( hist->count * pct + 99 ) / 100;
+
+    if ( !hist->count )
+        return 0;
+
+    for ( i = 0; i < METRICS_HIST_BUCKETS; i++ )
+    {
+        seen += hist->buckets[ i ];
+        if ( seen >= target )
+            return MIN( metrics_bucket_max( i ), hist->max );
+    }
+    return hist->max;
+}
+
+void metrics_json_init( metrics_json *json )
+{
+    memset( json, 0, sizeof( *json ) );
+}
+
+void metrics_json_free( metrics_json *json )
+{
+    free( json->buf );
+    memset( json, 0, sizeof( *json ) );
+}
+
+void metrics_json_reset( metrics_json *json )
+{
+    json->len = 0;
+    json->need_comma = 0;
+}
+
+static void metrics_json_printf( metrics_json *json, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
+static void metrics_json_printf( metrics_json *json, const char *fmt, ... )
+{
+    for ( ;; )
+    {
+        va_list args;
+        size_t avail = json->size - json->len;
+
+        va_start( args, fmt );
+        int len = vsnprintf( json->buf ? json->buf + json->len : NULL, avail, fmt, args );
+        va_end( args );
+
+        if ( len < 0 )
+            return;
+        if ( ( size_t )len < avail )
+        {
+            json->len += len;
+            return;
+        }
+
+        json->size = MAX( 4096, json->size * 2 + len );
+        json->buf = ( char * )realloc( json->buf, json->size );
+        if ( !json->buf )
+            FATAL_ERROR( realloc );
+    }
+}
+
+// Comma and key for the next member.
+static void metrics_json_key( metrics_json *json, const char *name )
+{
+    if ( json->need_comma )
+        metrics_json_printf( json, "," );
+    if ( name )
+        metrics_json_printf( json, "\"%s\":", name );
+    json->need_comma = 1;
+}
+
+void metrics_json_object( metrics_json *json, const char *name )
+{
+    metrics_json_key( json, name );
+    metrics_json_printf( json, "{" );
+    json->need_comma = 0;
+}
+
+void metrics_json_end( metrics_json *json )
+{
+    metrics_json_printf( json, "}" );
+    json->need_comma = 1;
+}
+
+void metrics_json_uint( metrics_json *json, const char *name, uint64_t val )
+{
+    metrics_json_key( json, name );
+    metrics_json_printf( json, "%" PRIu64, val );
+}
+
+void metrics_json_double( metrics_json *json, const char *name, double val )
+{
+    metrics_json_key( json, name );
+    metrics_json_printf( json, "%.3f", val );
+}
+
+void metrics_json_string( metrics_json *json, const char *name, const char *val )
+{
+    metrics_json_key( json, name );
+    metrics_json_printf( json, "\"" );
+    for ( ; *val; val++ )
+    {
+        unsigned char c = ( unsigned char )*val;
+
+        if ( c == '"' || c == '\\' )
+            metrics_json_printf( json, "\\%c", c );
+        else if ( c < 0x20 )
+            metrics_json_printf( json, "\\u%04x", c );
+        else
+            metrics_json_printf( json, "%c", c );
+    }
+    metrics_json_printf( json, "\"" );
+}
+
+void metrics_json_hist( metrics_json *json, const char *name, const metrics_hist *hist )
+{
+    int i;
+    int first = 1;
+
+    metrics_json_object( json, name );
+    metrics_json_uint( json, "count", hist->count );
+    metrics_json_uint( json, "sum", hist->sum );
+    metrics_json_uint( json, "max", hist->max );
+    metrics_json_uint( json, "p50", metrics_hist_percentile( hist, 50 ) );
+    metrics_json_uint( json, "p90", metrics_hist_percentile( hist, 90 ) );
+    metrics_json_uint( json, "p99", metrics_hist_percentile( hist, 99 ) );
+
+    metrics_json_key( json, "buckets" );
+    metrics_json_printf( json, "[" );
+    for ( i = 0; i < METRICS_HIST_BUCKETS; i++ )
+    {
+        if ( hist->buckets[ i ] )
+        {
+            metrics_json_printf( json, "%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",",
+                                 metrics_bucket_max( i ), hist->buckets[ i ] );
+            first = 0;
+        }
+    }
+    metrics_json_printf( json, "]" );
+
+    metrics_json_end( json );
+}
+
+int metrics_json_write_file( const metrics_json *json, const char *filename )
+{
+    char tmpname[ PATH_MAX ];
+
+    if ( snprintf( tmpname, sizeof( tmpname ), "%s.tmp", filename ) >= ( int )sizeof( tmpname ) )
+        return -1;
+
+    // Plain write rather than stdio, which would malloc a FILE every dump.
+    int fd = open( tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if ( fd < 0 )
+        return -1;
+
+    struct iovec iov[ 2 ] = { { json->buf, json->len }, { ( void * )"\n", 1 } };
+    int ok = ( writev( fd, iov, 2 ) == ( ssize_t )( json->len + 1 ) );
+
+    if ( close( fd ) || !ok || rename( tmpname, filename ) )
+    {
+        clog_warn( CLOG( 0 ), "Unable to write stats to %s: %d", filename, errno );
+        unlink( tmpname );
+        return -1;
+    }
+    return 0;
+}
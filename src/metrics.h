@@ -0,0 +1,88 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+// Fixed-bucket histograms and a small JSON writer for dumping stats.
+//
+// Bucket i counts values that need i bits (bucket 0 is zero, bucket i is
+// [2^(i-1), 2^i)), so adding a sample is a clz and an increment and
+// percentiles are good to within a factor of two.
+
+#define METRICS_HIST_BUCKETS 65
+
+typedef struct metrics_hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[ METRICS_HIST_BUCKETS ];
+} metrics_hist;
+
+static inline void metrics_hist_add( metrics_hist *hist, uint64_t val )
+{
+    hist->count++;
+    hist->sum += val;
+    if ( val > hist->max )
+        hist->max = val;
+    hist->buckets[ val ? 64 - __builtin_clzll( val ) : 0 ]++;
+}
+
+// Upper bound of the bucket holding the pct'th percentile, capped at max.
+uint64_t metrics_hist_percentile( const metrics_hist *hist, int pct );
+
+typedef struct metrics_json
+{
+    char *buf;
+    size_t len;
+    size_t size;
+    int need_comma;
+} metrics_json;
+
+void metrics_json_init( metrics_json *json );
+void metrics_json_free( metrics_json *json );
+// Start over, keeping the buffer for the next document.
+void metrics_json_reset( metrics_json *json );
+
+// Open a nested object. name is NULL for the top level object.
+void metrics_json_object( metrics_json *json, const char *name );
+void metrics_json_end( metrics_json *json );
+
+void metrics_json_uint( metrics_json *json, const char *name, uint64_t val );
+void metrics_json_double( metrics_json *json, const char *name, double val );
+void metrics_json_string( metrics_json *json, const char *name, const char *val );
+
+// {"count", "sum", "max", "p50", "p90", "p99", "buckets": [[upper, count], ...]}
+// with only the buckets that have samples.
+void metrics_json_hist( metrics_json *json, const char *name, const metrics_hist *hist );
+
+// Replace filename with the json text, via a rename so readers never see a
+// partial file. Returns 0 on success.
+int metrics_json_write_file( const metrics_json *json, const char *filename );
+
+#endif // _METRICS_H_
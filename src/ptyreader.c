@@ -0,0 +1,306 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ptyreader.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+typedef struct ptyreader_slot
+{
+    size_t len;
+    char *data;
+} ptyreader_slot;
+
+struct ptyreader
+{
+    int fd;
+
+    ptyreader_slot *slots;
+    size_t nslots;
+    size_t slot_size;
+
+    // Free running indices: write_idx is only stored by the thread,
+    // read_idx only by the main thread.
+    size_t write_idx;
+    size_t read_idx;
+
+    int notify_pipe[ 2 ]; // Thread -> main: buffers ready
+    int stop_pipe[ 2 ];   // Main -> thread: quit
+    int notified;         // A wakeup is already sitting in notify_pipe
+    int eof;
+
+    int reader_waiting; // Thread is asleep waiting for a free slot
+    int quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    ptyreader_stats stats;
+};
+
+static void ptyreader_set_fd_flags( int fd )
+{
+    if ( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+    if ( fcntl( fd, F_SETFD, fcntl( fd, F_GETFD ) | FD_CLOEXEC ) < 0 )
+        FATAL_ERROR( fcntl );
+}
+
+static void ptyreader_notify( ptyreader *pr )
+{
+    // Only the first buffer after the main thread cleared notified writes.
+    if ( !__atomic_exchange_n( &pr->notified, 1, __ATOMIC_SEQ_CST ) )
+    {
+        char c = 0;
+        ssize_t ret = write( pr->notify_pipe[ 1 ], &c, 1 );
+        ( void )ret;
+    }
+}
+
+// Wait for a free slot. Returns 0 if we were asked to quit.
+static int ptyreader_wait_slot( ptyreader *pr )
+{
+    while ( pr->write_idx - __atomic_load_n( &pr->read_idx, __ATOMIC_SEQ_CST ) == pr->nslots )
+    {
+        pthread_mutex_lock( &pr->mutex );
+        __atomic_store_n( &pr->reader_waiting, 1, __ATOMIC_SEQ_CST );
+        pr->stats.full_waits++;
+        while ( !pr->quit &&
+                ( pr->write_idx - __atomic_load_n( &pr->read_idx, __ATOMIC_SEQ_CST ) == pr->nslots ) )
+        {
+            pthread_cond_wait( &pr->cond, &pr->mutex );
+        }
+        __atomic_store_n( &pr->reader_waiting, 0, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &pr->mutex );
+    }
+    return !__atomic_load_n( &pr->quit, __ATOMIC_SEQ_CST );
+}
+
+static void *ptyreader_thread( void *arg )
+{
+    ptyreader *pr = ( ptyreader * )arg;
+    sigset_t all;
+
+    // Signals are handled by the main thread's event loop.
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, NULL );
+
+    while ( ptyreader_wait_slot( pr ) )
+    {
+        struct pollfd pfds[ 2 ] = {
+            { pr->fd, POLLIN, 0 },
+            { pr->stop_pipe[ 0 ], POLLIN, 0 }
+        };
+
+        if ( poll( pfds, 2, -1 ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            pr->stats.read_errno = errno;
+            break;
+        }
+        if ( pfds[ 1 ].revents )
+            break;
+
+        // Fill the slot with as much as the pty has for us.
+        ptyreader_slot *slot = &pr->slots[ pr->write_idx % pr->nslots ];
+        int done = 0;
+
+        slot->len = 0;
+        while ( slot->len < pr->slot_size )
+        {
+            ssize_t bytes_read = TEMP_FAILURE_RETRY( read( pr->fd, slot->data + slot->len, pr->slot_size - slot->len ) );
+
+            if ( bytes_read > 0 )
+            {
+                slot->len += bytes_read;
+                pr->stats.reads++;
+                pr->stats.bytes += bytes_read;
+                continue;
+            }
+
+            // EAGAIN: drained. EIO or 0: last slave fd closed.
+            if ( !bytes_read || errno != EAGAIN )
+            {
+                pr->stats.read_errno = bytes_read ? errno : 0;
+                if ( pr->stats.read_errno == EIO )
+                    pr->stats.read_errno = 0;
+                done = 1;
+            }
+            break;
+        }
+
+        if ( slot->len )
+        {
+            size_t fill = pr->write_idx + 1 - __atomic_load_n( &pr->read_idx, __ATOMIC_SEQ_CST );
+
+            pr->stats.buffers++;
+            pr->stats.fill_max = MAX( pr->stats.fill_max, fill );
+            __atomic_store_n( &pr->write_idx, pr->write_idx + 1, __ATOMIC_SEQ_CST );
+            ptyreader_notify( pr );
+        }
+        if ( done )
+            break;
+    }
+
+    __atomic_store_n( &pr->eof, 1, __ATOMIC_SEQ_CST );
+    __atomic_store_n( &pr->notified, 0, __ATOMIC_SEQ_CST );
+    ptyreader_notify( pr );
+    return NULL;
+}
+
+ptyreader *ptyreader_init( int fd, size_t slots, size_t slot_size )
+{
+    ptyreader *pr = ( ptyreader * )calloc( 1, sizeof( *pr ) );
+
+    if ( !pr )
+        FATAL_ERROR( calloc );
+
+    pr->fd = fd;
+    pr->nslots = MAX( 2, slots );
+    pr->slot_size = slot_size;
+    pr->slots = ( ptyreader_slot * )calloc( pr->nslots, sizeof( pr->slots[ 0 ] ) );
+    if ( !pr->slots )
+        FATAL_ERROR( calloc );
+    for ( size_t i = 0; i < pr->nslots; i++ )
+    {
+        pr->slots[ i ].data = ( char * )malloc( slot_size );
+        if ( !pr->slots[ i ].data )
+            FATAL_ERROR( malloc );
+    }
+    pr->stats.slots = pr->nslots;
+
+    if ( pipe( pr->notify_pipe ) || pipe( pr->stop_pipe ) )
+        FATAL_ERROR( pipe );
+    ptyreader_set_fd_flags( pr->notify_pipe[ 0 ] );
+    ptyreader_set_fd_flags( pr->notify_pipe[ 1 ] );
+    ptyreader_set_fd_flags( pr->stop_pipe[ 0 ] );
+    ptyreader_set_fd_flags( pr->stop_pipe[ 1 ] );
+
+    pthread_mutex_init( &pr->mutex, NULL );
+    pthread_cond_init( &pr->cond, NULL );
+
+    if ( pthread_create( &pr->thread, NULL, ptyreader_thread, pr ) )
+        FATAL_ERROR( pthread_create );
+
+    clog_info( CLOG( 0 ), "pty reader thread: %zu buffers of %zu bytes", pr->nslots, slot_size );
+    return pr;
+}
+
+void ptyreader_free( ptyreader *pr )
+{
+    if ( !pr )
+        return;
+
+    char c = 0;
+    ssize_t ret = write( pr->stop_pipe[ 1 ], &c, 1 );
+    ( void )ret;
+
+    pthread_mutex_lock( &pr->mutex );
+    __atomic_store_n( &pr->quit, 1, __ATOMIC_SEQ_CST );
+    pthread_cond_signal( &pr->cond );
+    pthread_mutex_unlock( &pr->mutex );
+    pthread_join( pr->thread, NULL );
+
+    pthread_cond_destroy( &pr->cond );
+    pthread_mutex_destroy( &pr->mutex );
+    close( pr->notify_pipe[ 0 ] );
+    close( pr->notify_pipe[ 1 ] );
+    close( pr->stop_pipe[ 0 ] );
+    close( pr->stop_pipe[ 1 ] );
+
+    for ( size_t i = 0; i < pr->nslots; i++ )
+        free( pr->slots[ i ].data );
+    free( pr->slots );
+    free( pr );
+}
+
+int ptyreader_get_notify_fd( ptyreader *pr )
+{
+    return pr->notify_pipe[ 0 ];
+}
+
+void ptyreader_clear_notify( ptyreader *pr )
+{
+    char buf[ 64 ];
+
+    // Clear the flag first: anything published after this writes a new wakeup.
+    __atomic_store_n( &pr->notified, 0, __ATOMIC_SEQ_CST );
+    while ( TEMP_FAILURE_RETRY( read( pr->notify_pipe[ 0 ], buf, sizeof( buf ) ) ) > 0 )
+        ;
+
+    // Buffers the caller left (or that raced with the flag) need a new wakeup.
+    if ( pr->read_idx != __atomic_load_n( &pr->write_idx, __ATOMIC_SEQ_CST ) )
+        ptyreader_notify( pr );
+}
+
+const char *ptyreader_peek( ptyreader *pr, size_t *len )
+{
+    if ( pr->read_idx == __atomic_load_n( &pr->write_idx, __ATOMIC_SEQ_CST ) )
+        return NULL;
+
+    ptyreader_slot *slot = &pr->slots[ pr->read_idx % pr->nslots ];
+
+    *len = slot->len;
+    return slot->data;
+}
+
+void ptyreader_release( ptyreader *pr )
+{
+    __atomic_store_n( &pr->read_idx, pr->read_idx + 1, __ATOMIC_SEQ_CST );
+
+    if ( __atomic_load_n( &pr->reader_waiting, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &pr->mutex );
+        pthread_cond_signal( &pr->cond );
+        pthread_mutex_unlock( &pr->mutex );
+    }
+}
+
+int ptyreader_done( ptyreader *pr )
+{
+    return __atomic_load_n( &pr->eof, __ATOMIC_SEQ_CST ) &&
+           ( pr->read_idx == __atomic_load_n( &pr->write_idx, __ATOMIC_SEQ_CST ) );
+}
+
+void ptyreader_getstats( ptyreader *pr, ptyreader_stats *stats )
+{
+    // Counters written by the thread are read racily; fine for reporting.
+    *stats = pr->stats;
+    stats->fill = __atomic_load_n( &pr->write_idx, __ATOMIC_SEQ_CST ) - pr->read_idx;
+}
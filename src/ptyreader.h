@@ -0,0 +1,70 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _PTYREADER_H_
+#define _PTYREADER_H_
+
+// Optional reader thread for the master pty. The thread fills a single
+// producer / single consumer ring of large buffers and wakes the main thread
+// through a pipe, so parsing and rendering never wait on read().
+//
+// The reader thread doesn't log: clog isn't safe to call from two threads.
+
+typedef struct ptyreader ptyreader;
+
+typedef struct ptyreader_stats
+{
+    uint64_t reads;      // read() calls that returned data
+    uint64_t bytes;      // Bytes read
+    uint64_t buffers;    // Buffers handed to the main thread
+    uint64_t full_waits; // Times the thread waited for a free buffer
+    size_t slots;        // Ring size in buffers
+    size_t fill;         // Buffers waiting for the main thread right now
+    size_t fill_max;     // Most buffers ever waiting
+    int read_errno;      // errno of the read that stopped the thread (0: EOF)
+} ptyreader_stats;
+
+ptyreader *ptyreader_init( int fd, size_t slots, size_t slot_size );
+void ptyreader_free( ptyreader *pr );
+
+// Becomes readable when buffers are ready. Call ptyreader_clear_notify()
+// after taking what you want with ptyreader_peek(): if buffers are left the
+// fd stays readable.
+int ptyreader_get_notify_fd( ptyreader *pr );
+void ptyreader_clear_notify( ptyreader *pr );
+
+// Oldest filled buffer, or NULL if none is ready. ptyreader_release() hands
+// it back to the thread once consumed.
+const char *ptyreader_peek( ptyreader *pr, size_t *len );
+void ptyreader_release( ptyreader *pr );
+
+// Non-zero once the pty closed and every buffer has been consumed.
+int ptyreader_done( ptyreader *pr );
+
+void ptyreader_getstats( ptyreader *pr, ptyreader_stats *stats );
+
+#endif // _PTYREADER_H_
@@ -0,0 +1,353 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "record.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define RECORD_MAGIC "CVTREC01"
+#define RECORD_MAGIC_LEN 8
+#define RECORD_HEADER_SIZE 16
+#define RECORD_CHUNK_HEADER_SIZE 16
+
+#define RECORD_BUFFER_SIZE ( 256 * 1024 )
+#define RECORD_INDEX_ENTRIES 4096
+#define RECORD_FLUSH_NS 1000000000ULL
+
+struct recorder
+{
+    int fd;
+    int idxfd;
+    int failed;
+
+    uint64_t start_ns;
+    uint64_t oldest_ns; // When the oldest buffered chunk was added (0: none)
+    uint64_t offset;    // File offset of the next chunk
+
+    char *buf;
+    size_t buf_len;
+    uint64_t idx[ RECORD_INDEX_ENTRIES ];
+    size_t idx_len;
+};
+
+static int record_write_all( int fd, const struct iovec *iov_in, int iovcnt )
+{
+    struct iovec iov[ 2 ];
+
+    memcpy( iov, iov_in, iovcnt * sizeof( iov[ 0 ] ) );
+    while ( iovcnt > 0 )
+    {
+        ssize_t ret = TEMP_FAILURE_RETRY( writev( fd, iov, iovcnt ) );
+
+        if ( ret < 0 )
+            return -1;
+
+        while ( iovcnt > 0 && ( size_t )ret >= iov[ 0 ].iov_len )
+        {
+            ret -= iov[ 0 ].iov_len;
+            memmove( &iov[ 0 ], &iov[ 1 ], ( iovcnt - 1 ) * sizeof( iov[ 0 ] ) );
+            iovcnt--;
+        }
+        if ( iovcnt > 0 )
+        {
+            iov[ 0 ].iov_base = ( char * )iov[ 0 ].iov_base + ret;
+            iov[ 0 ].iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void record_write( recorder *rec, int fd, const void *buf, size_t len, const void *buf2, size_t len2 )
+{
+    struct iovec iov[ 2 ] = { { ( void * )buf, len }, { ( void * )buf2, len2 } };
+
+    if ( !rec->failed && record_write_all( fd, iov, len2 ? 2 : 1 ) )
+    {
+        clog_error( CLOG( 0 ), "recording write failed: %d, recording stopped", errno );
+        rec->failed = 1;
+    }
+}
+
+static void record_flush( recorder *rec )
+{
+    if ( rec->buf_len )
+        record_write( rec, rec->fd, rec->buf, rec->buf_len, NULL, 0 );
+    if ( rec->idx_len )
+        record_write( rec, rec->idxfd, rec->idx, rec->idx_len * sizeof( rec->idx[ 0 ] ), NULL, 0 );
+
+    rec->buf_len = 0;
+    rec->idx_len = 0;
+    rec->oldest_ns = 0;
+}
+
+recorder *record_init( const char *filename, int rows, int cols )
+{
+    char idxname[ PATH_MAX ];
+    recorder *rec;
+
+    if ( snprintf( idxname, sizeof( idxname ), "%s.idx", filename ) >= ( int )sizeof( idxname ) )
+        return NULL;
+
+    rec = ( recorder * )calloc( 1, sizeof( *rec ) );
+    if ( !rec )
+        FATAL_ERROR( calloc );
+
+    rec->fd = open( filename, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666 );
+    rec->idxfd = open( idxname, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666 );
+    rec->buf = ( char * )malloc( RECORD_BUFFER_SIZE );
+    if ( rec->fd < 0 || rec->idxfd < 0 || !rec->buf )
+    {
+        clog_error( CLOG( 0 ), "Unable to create recording %s: %d", filename, errno );
+        if ( rec->fd >= 0 )
+            close( rec->fd );
+        if ( rec->idxfd >= 0 )
+            close( rec->idxfd );
+        free( rec->buf );
+        free( rec );
+        return NULL;
+    }
+
+    uint16_t size[ 2 ] = { ( uint16_t )rows, ( uint16_t )cols };
+    uint32_t reserved = 0;
+
+    memcpy( rec->buf, RECORD_MAGIC, RECORD_MAGIC_LEN );
+    memcpy( rec->buf + 8, size, sizeof( size ) );
+    memcpy( rec->buf + 12, &reserved, sizeof( reserved ) );
+    rec->buf_len = RECORD_HEADER_SIZE;
+    rec->offset = RECORD_HEADER_SIZE;
+    rec->start_ns = get_time_ns();
+
+    clog_info( CLOG( 0 ), "recording to %s", filename );
+    return rec;
+}
+
+void record_free( recorder *rec )
+{
+    if ( rec )
+    {
+        record_flush( rec );
+        close( rec->fd );
+        close( rec->idxfd );
+        free( rec->buf );
+        free( rec );
+    }
+}
+
+void record_chunk( recorder *rec, int type, const void *buf, size_t len )
+{
+    if ( rec->failed || !len )
+        return;
+
+    uint64_t now = get_time_ns();
+    char header[ RECORD_CHUNK_HEADER_SIZE ];
+    uint64_t time_ns = now - rec->start_ns;
+    uint32_t len32 = ( uint32_t )len;
+
+    memset( header, 0, sizeof( header ) );
+    memcpy( header, &time_ns, sizeof( time_ns ) );
+    memcpy( header + 8, &len32, sizeof( len32 ) );
+    header[ 12 ] = ( char )type;
+
+    if ( ( rec->buf_len + sizeof( header ) + len > RECORD_BUFFER_SIZE ) || ( rec->idx_len == RECORD_INDEX_ENTRIES ) )
+        record_flush( rec );
+
+    rec->idx[ rec->idx_len++ ] = rec->offset;
+    rec->offset += sizeof( header ) + len;
+
+    if ( sizeof( header ) + len > RECORD_BUFFER_SIZE )
+    {
+        // Too big to batch: straight to the file.
+        record_write( rec, rec->fd, header, sizeof( header ), buf, len );
+        return;
+    }
+
+    memcpy( rec->buf + rec->buf_len, header, sizeof( header ) );
+    memcpy( rec->buf + rec->buf_len + sizeof( header ), buf, len );
+    rec->buf_len += sizeof( header ) + len;
+    if ( !rec->oldest_ns )
+        rec->oldest_ns = now;
+}
+
+int record_update( recorder *rec, uint64_t now )
+{
+    if ( !rec->oldest_ns )
+        return -1;
+
+    if ( now - rec->oldest_ns >= RECORD_FLUSH_NS )
+    {
+        record_flush( rec );
+        return -1;
+    }
+    return ( int )( ( rec->oldest_ns + RECORD_FLUSH_NS - now + 999999 ) / 1000000 );
+}
+
+struct record_reader
+{
+    const char *data;
+    size_t len;
+    const uint64_t *idx;
+    size_t idx_count;
+    size_t idx_len;
+    size_t pos;
+    int rows;
+    int cols;
+};
+
+static const void *record_map( const char *filename, size_t *len )
+{
+    int fd = open( filename, O_RDONLY | O_CLOEXEC );
+    struct stat st;
+    void *data = NULL;
+
+    *len = 0;
+    if ( fd < 0 )
+        return NULL;
+
+    if ( !fstat( fd, &st ) && st.st_size > 0 )
+    {
+        int flags = MAP_PRIVATE;
+
+#if defined( MAP_POPULATE )
+        // Fault everything in now rather than in the middle of a benchmark.
+        flags |= MAP_POPULATE;
+#endif
+        data = mmap( NULL, st.st_size, PROT_READ, flags, fd, 0 );
+        if ( data == MAP_FAILED )
+            data = NULL;
+        else
+            *len = st.st_size;
+    }
+
+    close( fd );
+    return data;
+}
+
+record_reader *record_reader_open( const char *filename )
+{
+    char idxname[ PATH_MAX ];
+    size_t len;
+    const char *data = ( const char * )record_map( filename, &len );
+
+    if ( !data )
+        return NULL;
+    if ( len < RECORD_HEADER_SIZE || memcmp( data, RECORD_MAGIC, RECORD_MAGIC_LEN ) )
+    {
+        munmap( ( void * )data, len );
+        return NULL;
+    }
+
+    record_reader *rr = ( record_reader * )calloc( 1, sizeof( *rr ) );
+    uint16_t size[ 2 ];
+
+    if ( !rr )
+        FATAL_ERROR( calloc );
+
+    memcpy( size, data + 8, sizeof( size ) );
+    rr->data = data;
+    rr->len = len;
+    rr->rows = size[ 0 ];
+    rr->cols = size[ 1 ];
+    rr->pos = RECORD_HEADER_SIZE;
+
+    if ( snprintf( idxname, sizeof( idxname ), "%s.idx", filename ) < ( int )sizeof( idxname ) )
+    {
+        rr->idx = ( const uint64_t * )record_map( idxname, &rr->idx_len );
+        rr->idx_count = rr->idx_len / sizeof( rr->idx[ 0 ] );
+    }
+    return rr;
+}
+
+void record_reader_close( record_reader *rr )
+{
+    if ( rr )
+    {
+        munmap( ( void * )rr->data, rr->len );
+        if ( rr->idx )
+            munmap( ( void * )rr->idx, rr->idx_len );
+        free( rr );
+    }
+}
+
+void record_reader_getsize( record_reader *rr, int *rows, int *cols )
+{
+    *rows = rr->rows;
+    *cols = rr->cols;
+}
+
+int record_reader_seek( record_reader *rr, size_t index )
+{
+    record_chunk_info chunk;
+
+    if ( index < rr->idx_count && rr->idx[ index ] >= RECORD_HEADER_SIZE && rr->idx[ index ] < rr->len )
+    {
+        rr->pos = rr->idx[ index ];
+        return 0;
+    }
+
+    // No (or a short) index: walk the chunks.
+    rr->pos = RECORD_HEADER_SIZE;
+    while ( index-- > 0 )
+    {
+        if ( !record_reader_next( rr, &chunk ) )
+            return -1;
+    }
+    return 0;
+}
+
+int record_reader_next( record_reader *rr, record_chunk_info *chunk )
+{
+    uint32_t len32;
+
+    if ( rr->pos + RECORD_CHUNK_HEADER_SIZE > rr->len )
+        return 0;
+
+    memcpy( &chunk->time_ns, rr->data + rr->pos, sizeof( chunk->time_ns ) );
+    memcpy( &len32, rr->data + rr->pos + 8, sizeof( len32 ) );
+    chunk->type = ( unsigned char )rr->data[ rr->pos + 12 ];
+    chunk->len = len32;
+
+    // Truncated last chunk (recording was killed): stop there.
+    if ( chunk->len > rr->len - rr->pos - RECORD_CHUNK_HEADER_SIZE )
+        return 0;
+
+    chunk->data = rr->data + rr->pos + RECORD_CHUNK_HEADER_SIZE;
+    rr->pos += RECORD_CHUNK_HEADER_SIZE + chunk->len;
+    return 1;
+}
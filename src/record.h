@@ -0,0 +1,82 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+// Session capture files, for --record and --replay.
+//
+// FILE holds a 16 byte header ("CVTREC01", uint16 rows, uint16 cols,
+// uint32 reserved) followed by chunks, each a 16 byte header (uint64
+// monotonic ns since recording started, uint32 length, uint8 type, 3 bytes
+// padding) plus its data. All integers are host byte order.
+//
+// FILE.idx holds one uint64 file offset per chunk so a replay can jump to
+// chunk N without scanning everything before it.
+
+#define RECORD_OUTPUT 0 // Bytes read from the pty
+#define RECORD_INPUT 1  // Bytes written to the pty
+#define RECORD_RESIZE 2 // uint16 rows, uint16 cols
+
+typedef struct recorder recorder;
+
+recorder *record_init( const char *filename, int rows, int cols );
+
+// Flushes everything that's still buffered.
+void record_free( recorder *rec );
+
+// Buffer a chunk. Data goes to disk in large batches, when the buffer fills
+// or it's been sitting there for a while (see record_update).
+void record_chunk( recorder *rec, int type, const void *buf, size_t len );
+
+// Flush data older than a second. Returns the ms until the next call is
+// needed, or -1 if nothing is buffered.
+int record_update( recorder *rec, uint64_t now );
+
+typedef struct record_reader record_reader;
+
+typedef struct record_chunk_info
+{
+    uint64_t time_ns;
+    int type;
+    size_t len;
+    const char *data;
+} record_chunk_info;
+
+// Returns NULL if filename isn't a capture file.
+record_reader *record_reader_open( const char *filename );
+void record_reader_close( record_reader *rr );
+
+void record_reader_getsize( record_reader *rr, int *rows, int *cols );
+
+// Position before chunk index. Uses FILE.idx when there is one.
+int record_reader_seek( record_reader *rr, size_t index );
+
+// Next chunk, or 0 at the end of the capture.
+int record_reader_next( record_reader *rr, record_chunk_info *chunk );
+
+#endif // _RECORD_H_
@@ -0,0 +1,356 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vterm.h"
+#include "input.h"
+#include "eventloop.h"
+#include "remote.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+static int remote_addr( struct sockaddr_un *addr, const char *path )
+{
+    memset( addr, 0, sizeof( *addr ) );
+    addr->sun_family = AF_UNIX;
+
+    if ( strlen( path ) >= sizeof( addr->sun_path ) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy( addr->sun_path, path );
+    return 0;
+}
+
+// Is a server answering at addr?
+static int remote_alive( const struct sockaddr_un *addr )
+{
+    int alive = 0;
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( fd >= 0 )
+    {
+        alive = !connect( fd, ( const struct sockaddr * )addr, sizeof( *addr ) );
+        close( fd );
+    }
+    return alive;
+}
+
+int remote_listen( const char *path )
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ( remote_addr( &addr, path ) )
+        return -1;
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 )
+        return -1;
+
+    if ( bind( fd, ( struct sockaddr * )&addr, sizeof( addr ) ) )
+    {
+        // Left behind by a server that died: take it over, but not from one
+        // that's still running.
+        if ( ( errno != EADDRINUSE ) || remote_alive( &addr ) ||
+             unlink( path ) || bind( fd, ( struct sockaddr * )&addr, sizeof( addr ) ) )
+        {
+            int err = errno;
+
+            close( fd );
+            errno = err;
+            return -1;
+        }
+    }
+
+    // Whoever attaches gets a shell as us.
+    if ( chmod( path, 0600 ) || listen( fd, 8 ) )
+    {
+        int err = errno;
+
+        close( fd );
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int remote_accept( int listen_fd )
+{
+    return accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+}
+
+int remote_read( int fd, remote_msgreader *rd, remote_msg_cb cb, void *user )
+{
+    for ( ;; )
+    {
+        ssize_t bytes_read = TEMP_FAILURE_RETRY( read( fd, rd->buf + rd->len, sizeof( rd->buf ) - rd->len ) );
+
+        if ( !bytes_read )
+            return -1;
+        if ( bytes_read < 0 )
+            return ( errno == EAGAIN ) ? 0 : -1;
+
+        rd->len += bytes_read;
+
+        size_t offset = 0;
+
+        while ( rd->len - offset >= REMOTE_MSG_HEADER_SIZE )
+        {
+            uint32_t len;
+            int type = ( unsigned char )rd->buf[ offset ];
+
+            memcpy( &len, rd->buf + offset + 1, sizeof( len ) );
+            if ( len > REMOTE_MSG_MAX )
+            {
+                clog_warn( CLOG( 0 ), "remote message type %d too big: %u", type, len );
+                return -1;
+            }
+            if ( rd->len - offset < REMOTE_MSG_HEADER_SIZE + len )
+                break;
+
+            cb( type, rd->buf + offset + REMOTE_MSG_HEADER_SIZE, len, user );
+            offset += REMOTE_MSG_HEADER_SIZE + len;
+        }
+
+        memmove( rd->buf, rd->buf + offset, rd->len - offset );
+        rd->len -= offset;
+    }
+}
+
+// Client side: everything below is blocking, the server is the one that
+// has to cope with slow peers.
+typedef struct remote_client
+{
+    int fd;
+    int quit;
+    int prefix; // Saw REMOTE_DETACH_PREFIX
+    int detached;
+
+    // Inside a bracketed paste, and how much of the marker that ends (or
+    // starts) one has been seen, which may be in an earlier read.
+    int in_paste;
+    int paste_match;
+} remote_client;
+
+static int write_all( int fd, const char *buf, size_t len )
+{
+    while ( len )
+    {
+        ssize_t ret = TEMP_FAILURE_RETRY( write( fd, buf, len ) );
+
+        if ( ret < 0 )
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void remote_send( remote_client *rc, int type, const void *buf, size_t len )
+{
+    char header[ REMOTE_MSG_HEADER_SIZE ];
+    uint32_t len32 = ( uint32_t )len;
+
+    header[ 0 ] = ( char )type;
+    memcpy( header + 1, &len32, sizeof( len32 ) );
+
+    if ( write_all( rc->fd, header, sizeof( header ) ) || write_all( rc->fd, ( const char * )buf, len ) )
+        rc->quit = 1;
+}
+
+static void remote_send_size( remote_client *rc, int type, int truecolor )
+{
+    struct winsize ws;
+    unsigned char msg[ 5 ];
+
+    if ( ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws ) )
+        FATAL_ERROR( ioctl( TIOCGWINSZ ) );
+
+    memcpy( msg, &ws.ws_row, 2 );
+    memcpy( msg + 2, &ws.ws_col, 2 );
+    msg[ 4 ] = ( unsigned char )truecolor;
+    remote_send( rc, type, msg, ( type == REMOTE_MSG_HELLO ) ? 5 : 4 );
+}
+
+static void remote_sigwinch( int signo, void *user )
+{
+    remote_send_size( ( remote_client * )user, REMOTE_MSG_RESIZE, 0 );
+}
+
+// Follow PASTE_START and PASTE_END through the input a byte at a time.
+static void remote_paste_scan( remote_client *rc, char c )
+{
+    const char *marker = rc->in_paste ? PASTE_END : PASTE_START;
+
+    if ( c == marker[ rc->paste_match ] )
+    {
+        if ( ++rc->paste_match == PASTE_MARKER_LEN )
+        {
+            rc->in_paste = !rc->in_paste;
+            rc->paste_match = 0;
+        }
+    }
+    else
+    {
+        rc->paste_match = ( c == marker[ 0 ] );
+    }
+}
+
+static void remote_stdin_cb( int fd, int events, void *user )
+{
+    remote_client *rc = ( remote_client * )user;
+    char buf[ 4096 ];
+    char out[ sizeof( buf ) + 1 ];
+    size_t outlen = 0;
+    ssize_t i;
+    ssize_t bytes_read = TEMP_FAILURE_RETRY( read( STDIN_FILENO, buf, sizeof( buf ) ) );
+
+    if ( bytes_read <= 0 )
+    {
+        rc->quit = 1;
+        return;
+    }
+
+    // The prefix is held back until we know what follows it, which may be
+    // in the next read. A pasted one is just text.
+    for ( i = 0; i < bytes_read; i++ )
+    {
+        remote_paste_scan( rc, buf[ i ] );
+
+        if ( rc->prefix )
+        {
+            rc->prefix = 0;
+            if ( buf[ i ] == REMOTE_DETACH_KEY )
+            {
+                rc->detached = 1;
+                rc->quit = 1;
+                break;
+            }
+            out[ outlen++ ] = REMOTE_DETACH_PREFIX;
+            out[ outlen++ ] = buf[ i ];
+        }
+        else if ( ( buf[ i ] == REMOTE_DETACH_PREFIX ) && !rc->in_paste )
+        {
+            rc->prefix = 1;
+        }
+        else
+        {
+            out[ outlen++ ] = buf[ i ];
+        }
+    }
+
+    if ( outlen )
+        remote_send( rc, REMOTE_MSG_INPUT, out, outlen );
+}
+
+static void remote_socket_cb( int fd, int events, void *user )
+{
+    remote_client *rc = ( remote_client * )user;
+    char buf[ 64 * 1024 ];
+    ssize_t bytes_read = TEMP_FAILURE_RETRY( read( fd, buf, sizeof( buf ) ) );
+
+    if ( bytes_read <= 0 )
+    {
+        rc->quit = 1;
+        return;
+    }
+
+    if ( write_all( STDOUT_FILENO, buf, bytes_read ) )
+        rc->quit = 1;
+}
+
+int remote_attach( const char *path, int truecolor )
+{
+    struct sockaddr_un addr;
+    struct termios saved, raw;
+    remote_client rc;
+
+    memset( &rc, 0, sizeof( rc ) );
+
+    if ( remote_addr( &addr, path ) )
+    {
+        fprintf( stderr, "ERROR: Bad socket path '%s'.\n", path );
+        return 1;
+    }
+
+    rc.fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( ( rc.fd < 0 ) || connect( rc.fd, ( struct sockaddr * )&addr, sizeof( addr ) ) )
+    {
+        fprintf( stderr, "ERROR: Unable to connect to '%s': %s\n", path, strerror( errno ) );
+        return 1;
+    }
+
+    if ( tcgetattr( STDIN_FILENO, &saved ) )
+        FATAL_ERROR( tcgetattr );
+    raw = saved;
+    cfmakeraw( &raw );
+    if ( tcsetattr( STDIN_FILENO, TCSANOW, &raw ) )
+        FATAL_ERROR( tcsetattr );
+    input_set_host_paste( 1 );
+
+    clog_info( CLOG( 0 ), "attached to %s", path );
+
+    eventloop *el = eventloop_init();
+
+    eventloop_add_signal( el, SIGWINCH, remote_sigwinch, &rc );
+    eventloop_add_fd( el, STDIN_FILENO, EVENTLOOP_READ, remote_stdin_cb, &rc );
+    eventloop_add_fd( el, rc.fd, EVENTLOOP_READ, remote_socket_cb, &rc );
+
+    remote_send_size( &rc, REMOTE_MSG_HELLO, truecolor );
+
+    while ( !rc.quit )
+        eventloop_run_once( el, -1 );
+
+    eventloop_free( el );
+    close( rc.fd );
+
+    // The server's stream may have stopped anywhere: put the terminal back.
+    static const char s_leave[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+
+    write_all( STDOUT_FILENO, s_leave, sizeof( s_leave ) - 1 );
+    input_set_host_paste( 0 );
+    tcsetattr( STDIN_FILENO, TCSANOW, &saved );
+
+    clog_info( CLOG( 0 ), "%s %s", rc.detached ? "detached from" : "lost", path );
+    printf( "[%s %s]\n", rc.detached ? "detached from" : "server closed", path );
+    return 0;
+}
@@ -0,0 +1,72 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _REMOTE_H_
+#define _REMOTE_H_
+
+// cvterm --server and --attach. The server owns the ptys and vterms and
+// listens on a unix socket. A client sends framed messages (a u8 type and a
+// u32 length, host byte order, then the payload) and gets back nothing but
+// an escape sequence stream to write to its terminal: a full screen when it
+// says hello, then whatever the damage callbacks change.
+
+#define REMOTE_MSG_HELLO 1  // u16 lines, u16 columns, u8 truecolor
+#define REMOTE_MSG_INPUT 2  // Bytes read from the client's stdin
+#define REMOTE_MSG_RESIZE 3 // u16 lines, u16 columns
+
+#define REMOTE_MSG_HEADER_SIZE 5
+#define REMOTE_MSG_MAX ( 64 * 1024 )
+
+// Ctrl-] d in the client detaches. It's only checked for on the client;
+// everything else goes to the server as is.
+#define REMOTE_DETACH_PREFIX 0x1d
+#define REMOTE_DETACH_KEY 'd'
+
+typedef void ( *remote_msg_cb )( int type, const char *buf, size_t len, void *user );
+
+// Partial messages read from a nonblocking socket.
+typedef struct remote_msgreader
+{
+    size_t len;
+    char buf[ REMOTE_MSG_HEADER_SIZE + REMOTE_MSG_MAX ];
+} remote_msgreader;
+
+// Nonblocking listening socket at path, replacing a stale one. Returns -1
+// with errno set on failure.
+int remote_listen( const char *path );
+// Next connection on a remote_listen socket, nonblocking, or -1.
+int remote_accept( int listen_fd );
+
+// Read what's waiting on fd and call cb for each complete message. Returns
+// -1 on EOF, a read error, or a bad message.
+int remote_read( int fd, remote_msgreader *rd, remote_msg_cb cb, void *user );
+
+// The --attach client: put stdin in raw mode and relay to the server until
+// it goes away or Ctrl-] d. Returns the process exit code.
+int remote_attach( const char *path, int truecolor );
+
+#endif // _REMOTE_H_
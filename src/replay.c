@@ -0,0 +1,245 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include "vterm.h"
+#include "metrics.h"
+#include "termwin.h"
+#include "scrollback.h"
+#include "record.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+static int cmp_uint64( const void *a, const void *b )
+{
+    uint64_t x = *( const uint64_t * )a;
+    uint64_t y = *( const uint64_t * )b;
+
+    return ( x > y ) - ( x < y );
+}
+
+// pct'th percentile of count sorted values.
+static uint64_t percentile( const uint64_t *vals, size_t count, int pct )
+{
+    if ( !count )
+        return 0;
+    return vals[ MIN( count - 1, count * pct / 100 ) ];
+}
+
+static char *read_file( const char *filename, size_t *len )
+{
+    FILE *fp = fopen( filename, "rb" );
+    size_t size = 0;
+    char *data = NULL;
+
+    *len = 0;
+    if ( !fp )
+        return NULL;
+
+    for ( ;; )
+    {
+        if ( *len == size )
+        {
+            size = MAX( 64 * 1024, size * 2 );
+            data = ( char * )realloc( data, size );
+            if ( !data )
+                FATAL_ERROR( realloc );
+        }
+
+        size_t count = fread( data + *len, 1, size - *len, fp );
+        if ( !count )
+            break;
+        *len += count;
+    }
+
+    fclose( fp );
+    return data;
+}
+
+// Sleep until the monotonic clock reaches ns.
+static void sleep_until_ns( uint64_t ns )
+{
+    uint64_t now = get_time_ns();
+
+    if ( ns > now )
+    {
+        struct timespec ts = { ( time_t )( ( ns - now ) / 1000000000ULL ), ( long )( ( ns - now ) % 1000000000ULL ) };
+
+        while ( nanosleep( &ts, &ts ) && errno == EINTR )
+            ;
+    }
+}
+
+int replay_main( const replay_opts *opts, const replay_callbacks *cb, void *user )
+{
+    size_t len = 0;
+    char *data = NULL;
+    record_reader *rr = record_reader_open( opts->file );
+    int replay_rows = 24;
+    int replay_cols = 80;
+
+    if ( rr )
+    {
+        record_reader_getsize( rr, &replay_rows, &replay_cols );
+        if ( record_reader_seek( rr, opts->offset ) )
+        {
+            fprintf( stderr, "ERROR: '%s' has fewer than %d chunks.\n", opts->file, opts->offset );
+            record_reader_close( rr );
+            return 1;
+        }
+    }
+    else if ( !( data = read_file( opts->file, &len ) ) )
+    {
+        fprintf( stderr, "ERROR: Unable to read '%s': %s\n", opts->file, strerror( errno ) );
+        return 1;
+    }
+
+    if ( opts->rows )
+    {
+        replay_rows = opts->rows;
+        replay_cols = opts->cols;
+    }
+
+    int rows, cols;
+    cb->start( replay_rows, replay_cols, &rows, &cols, user );
+
+    uint64_t start_ns = get_time_ns();
+
+    if ( rr )
+    {
+        record_chunk_info chunk;
+        uint64_t first_ns = UINT64_MAX;
+
+        // Input and resize chunks are skipped: the output already reflects
+        // them, and the headless screen has a fixed size.
+        while ( record_reader_next( rr, &chunk ) )
+        {
+            if ( chunk.type != RECORD_OUTPUT )
+                continue;
+
+            if ( opts->realtime )
+            {
+                if ( first_ns == UINT64_MAX )
+                    first_ns = chunk.time_ns;
+                sleep_until_ns( start_ns + ( chunk.time_ns - first_ns ) );
+            }
+
+            cb->write( chunk.data, chunk.len, user );
+            len += chunk.len;
+        }
+    }
+    else
+    {
+        size_t size = ( size_t )opts->chunk;
+
+        for ( size_t offset = 0; offset < len; offset += size )
+            cb->write( data + offset, MIN( size, len - offset ), user );
+    }
+
+    // Last frame with whatever is still pending.
+    replay_result res;
+
+    memset( &res, 0, sizeof( res ) );
+    cb->finish( &res, user );
+
+    uint64_t elapsed_ns = get_time_ns() - start_ns;
+    char snapshot_report[ 1024 ] = "";
+    int ret = 0;
+
+    // Regression checks: keep the screen we ended up with, or compare it.
+    if ( opts->snapshot )
+    {
+        uint64_t snapshot_ns = get_time_ns();
+
+        if ( snapshot_save( opts->snapshot, res.vt, res.sb, res.cursor_visible ) )
+        {
+            snprintf( snapshot_report, sizeof( snapshot_report ), "  snapshot: %s failed: %s\n", opts->snapshot, strerror( errno ) );
+            ret = 1;
+        }
+        else
+        {
+            snprintf( snapshot_report, sizeof( snapshot_report ), "  snapshot: %s (%.2fms)\n", opts->snapshot, ( get_time_ns() - snapshot_ns ) / 1e6 );
+        }
+    }
+    if ( opts->snapshot_check )
+    {
+        int row;
+        int diff = snapshot_compare( opts->snapshot_check, res.vt, &row );
+        size_t used = strlen( snapshot_report );
+
+        if ( diff < 0 )
+            snprintf( snapshot_report + used, sizeof( snapshot_report ) - used, "  snapshot_check: %s failed: %s\n", opts->snapshot_check, strerror( errno ) );
+        else if ( diff )
+            snprintf( snapshot_report + used, sizeof( snapshot_report ) - used, "  snapshot_check: %s differs at row %d\n", opts->snapshot_check, row );
+        else
+            snprintf( snapshot_report + used, sizeof( snapshot_report ) - used, "  snapshot_check: %s matches\n", opts->snapshot_check );
+        ret = ret || diff;
+    }
+
+    qsort( res.frame_times, res.frames, sizeof( res.frame_times[ 0 ] ), cmp_uint64 );
+
+    char report[ 1024 ];
+    const uint64_t *times = res.frame_times;
+    size_t frames = res.frames;
+
+    snprintf( report, sizeof( report ),
+              "replay: %s (%dx%d, %s)\n"
+              "  bytes: %zu\n"
+              "  time: %.3fs\n"
+              "  throughput: %.2f MB/s\n"
+              "  frames: %zu\n"
+              "  cells_drawn: %" PRIu64 " (%" PRIu64 " per frame)\n"
+              "  cells_skipped: %" PRIu64 "\n"
+              "  frame_us: p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 "\n"
+              "  bytes_written: %" PRIu64 "\n",
+              opts->file, cols, rows, opts->renderer, len, elapsed_ns / 1e9,
+              elapsed_ns ? ( len / ( 1024.0 * 1024.0 ) ) / ( elapsed_ns / 1e9 ) : 0.0,
+              frames, res.stats.cells_drawn, frames ? res.stats.cells_drawn / frames : 0, res.stats.cells_skipped,
+              percentile( times, frames, 50 ) / 1000, percentile( times, frames, 90 ) / 1000,
+              percentile( times, frames, 99 ) / 1000, frames ? times[ frames - 1 ] / 1000 : 0,
+              res.stats.bytes_written );
+
+    free( data );
+    record_reader_close( rr );
+
+    // Tear down ncurses before printing.
+    cb->stop( user );
+
+    fputs( report, stdout );
+    fputs( snapshot_report, stdout );
+    return ret;
+}
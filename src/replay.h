@@ -0,0 +1,77 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+// --replay: feed a captured pty stream through vterm and termwin as fast as
+// possible and report throughput and frame times. The file is either a
+// --record capture, fed a chunk at a time as it was read from the pty, or a
+// raw stream cut into chunk byte pieces. The screen and renderer are the
+// caller's, set up and driven through replay_callbacks.
+
+typedef struct replay_opts
+{
+    const char *file;
+    int chunk;       // Bytes per write of a raw stream
+    int rows;        // Screen size, 0 for the capture's (or 80x24)
+    int cols;
+    int offset;      // First capture chunk
+    int realtime;    // At the recorded speed instead of flat out
+    const char *snapshot;       // Save the final screen here
+    const char *snapshot_check; // Fail unless the final screen matches this
+    const char *renderer;       // For the report
+} replay_opts;
+
+// What was drawn, once the replay is done.
+typedef struct replay_result
+{
+    VTerm *vt;
+    scrollback *sb;
+    int cursor_visible;
+    termwin_stats stats;
+    uint64_t *frame_times; // Draw time of each frame, sorted in place
+    size_t frames;
+} replay_result;
+
+typedef struct replay_callbacks
+{
+    // Set up a rows x cols screen and say how much of it is the terminal.
+    void ( *start )( int rows, int cols, int *term_rows, int *term_cols, void *user );
+    // Output to parse and draw, frames paced as the caller likes.
+    void ( *write )( const char *buf, size_t len, void *user );
+    // Draw what's still pending and fill in result.
+    void ( *finish )( replay_result *result, void *user );
+    // Tear down the screen before the report goes to stdout.
+    void ( *stop )( void *user );
+} replay_callbacks;
+
+// Returns the process exit code: 1 if the file can't be read or a snapshot
+// check failed.
+int replay_main( const replay_opts *opts, const replay_callbacks *callbacks, void *user );
+
+#endif // _REPLAY_H_
@@ -0,0 +1,457 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "sbview.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Lines are numbered as in scrollback_range, with the screen's rows after
+// the newest scrollback line. Searches read SBVIEW_SEARCH_LINES lines per
+// sbview_idle call, so they don't keep the ptys waiting.
+#define SBVIEW_QUERY_MAX 256
+#define SBVIEW_SEARCH_LINES ( 64 * 1024 )
+
+struct sbview
+{
+    VTerm *vt;
+    scrollback *sb;
+
+    sbview_draw_cb draw;
+    void *user;
+
+    int active;
+    int prompt;     // Typing a query
+    int dir;        // Of the last / or ?: -1 towards older lines, 1 newer
+    int searching;  // Looking for the next match in search_dir, next at search_line
+    int search_dir;
+    int not_found;
+    uint64_t search_line;
+    uint64_t top;  // Line at the top of the window
+    int64_t match; // Line of the current match, -1 for none
+    char query[ SBVIEW_QUERY_MAX ];
+    size_t query_len;
+    VTermScreenCell *cells; // rows x cols view
+    VTermScreenCell *row;   // One row, for searching the screen
+    size_t cells_size;
+    int rows;
+    int cols;
+};
+
+sbview *sbview_init( sbview_draw_cb draw, void *user )
+{
+    sbview *view = ( sbview * )calloc( 1, sizeof( *view ) );
+
+    if ( !view )
+        FATAL_ERROR( calloc );
+
+    view->draw = draw;
+    view->user = user;
+    return view;
+}
+
+void sbview_free( sbview *view )
+{
+    if ( view )
+    {
+        free( view->cells );
+        free( view );
+    }
+}
+
+int sbview_active( sbview *view )
+{
+    return view->active;
+}
+
+// Lines [*first, *end) are in scrollback, the screen takes up the next view->rows.
+static void sbview_range( sbview *view, uint64_t *first, uint64_t *end )
+{
+    *first = 0;
+    *end = 0;
+    if ( view->sb )
+        scrollback_range( view->sb, first, end );
+}
+
+static void sbview_getline( sbview *view, uint64_t line, VTermScreenCell *cells )
+{
+    uint64_t first, end;
+
+    sbview_range( view, &first, &end );
+    if ( line < end )
+    {
+        scrollback_getline( view->sb, end - 1 - line, view->cols, cells );
+        return;
+    }
+
+    VTermScreen *vts = vterm_obtain_screen( view->vt );
+    for ( int col = 0; col < view->cols; col++ )
+    {
+        VTermPos pos = { ( int )( line - end ), col };
+
+        vterm_screen_get_cell( vts, pos, &cells[ col ] );
+    }
+}
+
+static int sbview_line_matches( sbview *view, uint64_t line )
+{
+    int end_col;
+
+    sbview_getline( view, line, view->row );
+    return scrollback_match_cells( view->query, view->cols, view->row, 0, &end_col ) >= 0;
+}
+
+void sbview_update( sbview *view )
+{
+    uint64_t first, end;
+    char status[ SBVIEW_QUERY_MAX + 64 ];
+
+    vterm_get_size( view->vt, &view->rows, &view->cols );
+    if ( ( size_t )( view->rows + 1 ) * view->cols > view->cells_size )
+    {
+        view->cells_size = ( size_t )( view->rows + 1 ) * view->cols;
+        view->cells = ( VTermScreenCell * )realloc( view->cells, view->cells_size * sizeof( view->cells[ 0 ] ) );
+        if ( !view->cells )
+            FATAL_ERROR( realloc );
+    }
+    view->row = view->cells + view->rows * view->cols;
+
+    // The oldest lines may have been dropped since, and the bottom of the
+    // view can't go past the screen.
+    sbview_range( view, &first, &end );
+    view->top = MIN( MAX( view->top, first ), end );
+
+    for ( int row = 0; row < view->rows; row++ )
+    {
+        VTermScreenCell *cells = &view->cells[ row * view->cols ];
+        int start_col, end_col;
+
+        sbview_getline( view, view->top + row, cells );
+        if ( view->prompt || !view->query_len )
+            continue;
+
+        for ( int col = 0; ( start_col = scrollback_match_cells( view->query, view->cols, cells, col, &end_col ) ) >= 0; col = end_col )
+        {
+            for ( int i = start_col; i < MIN( end_col, view->cols ); i++ )
+                cells[ i ].attrs.reverse ^= 1;
+        }
+    }
+
+    if ( view->prompt )
+        snprintf( status, sizeof( status ), " %c%s ", ( view->dir < 0 ) ? '/' : '?', view->query );
+    else if ( view->searching )
+        snprintf( status, sizeof( status ), " Searching for %s... ", view->query );
+    else if ( view->not_found )
+        snprintf( status, sizeof( status ), " Not found: %s ", view->query );
+    else
+        snprintf( status, sizeof( status ), " Scrollback %" PRIu64 "/%" PRIu64 " ", end - view->top, end - first );
+
+    view->draw( view->cells, view->rows, view->cols, status, view->user );
+}
+
+void sbview_open( sbview *view, VTerm *vt, scrollback *sb )
+{
+    uint64_t first;
+
+    view->vt = vt;
+    view->sb = sb;
+    view->active = 1;
+    view->prompt = 0;
+    view->searching = 0;
+    view->not_found = 0;
+    view->match = -1;
+    sbview_range( view, &first, &view->top );
+}
+
+void sbview_close( sbview *view )
+{
+    if ( !view->active )
+        return;
+
+    view->active = 0;
+    view->prompt = 0;
+    view->searching = 0;
+    view->vt = NULL;
+    view->sb = NULL;
+    view->draw( NULL, 0, 0, NULL, view->user );
+}
+
+static void sbview_scroll( sbview *view, int64_t lines )
+{
+    uint64_t first, end;
+
+    sbview_range( view, &first, &end );
+    if ( ( lines < 0 ) && ( ( uint64_t )-lines > view->top - first ) )
+        view->top = first;
+    else
+        view->top = MIN( view->top + lines, end );
+}
+
+// Look for the next match in direction dir from the current one, or from
+// the bottom (searching back) or top of the view.
+static void sbview_search( sbview *view, int dir )
+{
+    view->not_found = 0;
+    view->searching = 1;
+    if ( view->match >= 0 )
+        view->search_line = view->match + dir;
+    else
+        view->search_line = ( dir < 0 ) ? view->top + view->rows - 1 : view->top;
+
+    if ( ( dir < 0 ) && !view->match )
+    {
+        view->searching = 0;
+        view->not_found = 1;
+    }
+    view->search_dir = dir;
+}
+
+// Search up to SBVIEW_SEARCH_LINES more lines of scrollback, and the screen.
+static void sbview_search_step( sbview *view, int dir )
+{
+    uint64_t first, end;
+    uint64_t line = view->search_line;
+    uint64_t screen_end;
+    int found = 0;
+
+    sbview_range( view, &first, &end );
+    screen_end = end + view->rows;
+
+    if ( dir < 0 )
+    {
+        for ( line = MIN( line, screen_end - 1 ); !found && ( line >= end ); line-- )
+        {
+            found = sbview_line_matches( view, line );
+            if ( found || !line )
+                break;
+        }
+        if ( !found && ( line >= first ) && view->sb )
+        {
+            int ret = scrollback_find( view->sb, view->query, -1, &line, SBVIEW_SEARCH_LINES );
+
+            if ( !ret )
+            {
+                view->search_line = line;
+                return;
+            }
+            found = ( ret > 0 );
+        }
+    }
+    else
+    {
+        if ( ( line < end ) && view->sb )
+        {
+            int ret = scrollback_find( view->sb, view->query, 1, &line, SBVIEW_SEARCH_LINES );
+
+            if ( !ret )
+            {
+                view->search_line = line;
+                return;
+            }
+            found = ( ret > 0 );
+        }
+        if ( !found )
+        {
+            for ( line = MAX( line, end ); line < screen_end; line++ )
+            {
+                found = sbview_line_matches( view, line );
+                if ( found )
+                    break;
+            }
+        }
+    }
+
+    view->searching = 0;
+    if ( !found )
+    {
+        view->not_found = 1;
+        return;
+    }
+
+    // Bring it into view, in the middle if it wasn't.
+    view->match = line;
+    if ( ( line < view->top ) || ( line >= view->top + view->rows ) )
+        view->top = ( line > ( uint64_t )view->rows / 2 ) ? line - view->rows / 2 : 0;
+}
+
+int sbview_idle( sbview *view )
+{
+    if ( !view->active || !view->searching )
+        return 0;
+
+    sbview_search_step( view, view->search_dir );
+    if ( !view->searching )
+        sbview_update( view );
+    return view->searching;
+}
+
+// Typing the query.
+static void sbview_prompt_key( sbview *view, const char *buf, size_t len, size_t *i )
+{
+    unsigned char c = buf[ *i ];
+
+    if ( ( c == '\r' ) || ( c == '\n' ) )
+    {
+        view->prompt = 0;
+        view->match = -1;
+        if ( view->query_len )
+            sbview_search( view, view->dir );
+    }
+    else if ( ( c == 0x1b ) || ( c == 0x03 ) )
+    {
+        // Cancelled. Skip the rest of an escape sequence.
+        view->prompt = 0;
+        view->query_len = 0;
+        if ( ( c == 0x1b ) && ( *i + 1 < len ) && ( ( buf[ *i + 1 ] == '[' ) || ( buf[ *i + 1 ] == 'O' ) ) )
+        {
+            for ( *i += 2; ( *i < len ) && ( ( buf[ *i ] < 0x40 ) || ( buf[ *i ] > 0x7e ) ); ( *i )++ )
+                ;
+        }
+    }
+    else if ( ( c == 0x7f ) || ( c == 0x08 ) )
+    {
+        // Back over a whole UTF-8 character.
+        while ( view->query_len && ( ( view->query[ --view->query_len ] & 0xc0 ) == 0x80 ) )
+            ;
+    }
+    else if ( c == 0x15 )
+    {
+        view->query_len = 0;
+    }
+    else if ( ( c >= 0x20 ) && ( view->query_len + 1 < sizeof( view->query ) ) )
+    {
+        view->query[ view->query_len++ ] = c;
+    }
+    view->query[ view->query_len ] = 0;
+}
+
+size_t sbview_input( sbview *view, const char *buf, size_t len )
+{
+    size_t i;
+
+    for ( i = 0; ( i < len ) && view->active; i++ )
+    {
+        unsigned char c = buf[ i ];
+        int page = MAX( 1, view->rows - 1 );
+
+        if ( view->prompt )
+        {
+            sbview_prompt_key( view, buf, len, &i );
+            continue;
+        }
+
+        // Cursor and page keys, in normal or application mode. A lone
+        // escape closes the view.
+        if ( c == 0x1b )
+        {
+            if ( ( i + 1 >= len ) || ( ( buf[ i + 1 ] != '[' ) && ( buf[ i + 1 ] != 'O' ) ) )
+            {
+                sbview_close( view );
+                continue;
+            }
+
+            int param = 0;
+            for ( i += 2; ( i < len ) && ( buf[ i ] >= '0' ) && ( buf[ i ] <= '9' ); i++ )
+                param = param * 10 + ( buf[ i ] - '0' );
+            c = ( i < len ) ? buf[ i ] : 0;
+            if ( c == 'A' )
+                sbview_scroll( view, -1 );
+            else if ( c == 'B' )
+                sbview_scroll( view, 1 );
+            else if ( ( c == '~' ) && ( param == 5 ) )
+                sbview_scroll( view, -page );
+            else if ( ( c == '~' ) && ( param == 6 ) )
+                sbview_scroll( view, page );
+            else if ( c == 'H' )
+                sbview_scroll( view, INT64_MIN / 2 );
+            else if ( c == 'F' )
+                sbview_scroll( view, INT64_MAX / 2 );
+            continue;
+        }
+
+        switch ( c )
+        {
+        case 'q':
+            sbview_close( view );
+            break;
+        case 'k':
+            sbview_scroll( view, -1 );
+            break;
+        case 'j':
+        case '\r':
+            sbview_scroll( view, 1 );
+            break;
+        case 'b':
+        case 0x02: // Ctrl-B
+            sbview_scroll( view, -page );
+            break;
+        case ' ':
+        case 0x06: // Ctrl-F
+            sbview_scroll( view, page );
+            break;
+        case 'u':
+        case 0x15: // Ctrl-U
+            sbview_scroll( view, -page / 2 );
+            break;
+        case 'd':
+        case 0x04: // Ctrl-D
+            sbview_scroll( view, page / 2 );
+            break;
+        case 'g':
+            sbview_scroll( view, INT64_MIN / 2 );
+            break;
+        case 'G':
+            sbview_scroll( view, INT64_MAX / 2 );
+            break;
+        case '/':
+        case '?':
+            view->prompt = 1;
+            view->dir = ( c == '/' ) ? -1 : 1;
+            view->query_len = 0;
+            view->query[ 0 ] = 0;
+            break;
+        case 'n':
+        case 'N':
+            if ( view->query_len )
+                sbview_search( view, ( c == 'n' ) ? view->dir : -view->dir );
+            break;
+        }
+    }
+
+    if ( view->active )
+        sbview_update( view );
+    return i;
+}
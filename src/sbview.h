@@ -0,0 +1,66 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SBVIEW_H_
+#define _SBVIEW_H_
+
+// Scrollback view: a frozen window on a session's history and screen,
+// moved around and searched with less-like keys. Keys: up/down, k/j,
+// PgUp/PgDn, b/space, g/G for the oldest line and the screen, / and ? for
+// a new search back or forward, n/N for the next/previous match, and q or
+// Escape to go back to the live screen.
+//
+// What to show goes out through the draw callback, with NULL cells and
+// status when the view closes.
+
+typedef struct sbview sbview;
+
+typedef void ( *sbview_draw_cb )( const VTermScreenCell *cells, int rows, int cols, const char *status, void *user );
+
+// How many lines of scrollback to index per idle moment.
+#define SBVIEW_INDEX_LINES 1024
+
+sbview *sbview_init( sbview_draw_cb draw, void *user );
+void sbview_free( sbview *view );
+
+// Show sb (which may be NULL) and vt's screen below it, from the bottom.
+// Both have to stay around until sbview_close.
+void sbview_open( sbview *view, VTerm *vt, scrollback *sb );
+void sbview_close( sbview *view );
+int sbview_active( sbview *view );
+
+// Redraw, after opening or when the screen size changed.
+void sbview_update( sbview *view );
+
+// Keys while the view is up. Returns how much of buf was used: everything
+// unless a key closed the view, in which case the rest goes to the child.
+size_t sbview_input( sbview *view, const char *buf, size_t len );
+
+// Take the next step of a search. Returns 1 while it has more to do.
+int sbview_idle( sbview *view );
+
+#endif // _SBVIEW_H_
@@ -0,0 +1,854 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "arena.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    Lines are packed into SCROLLBACK_PAGE_SIZE pages. Records grow up from the
+    start of the page data and a uint16 offset table grows down from the end.
+    Pages form a ring: once max_bytes worth are in use, the oldest page is
+    recycled whole for new lines, so push and pop never touch malloc after
+    warmup.
+
+    Line record (uint16s are unaligned, little endian via memcpy):
+        uint16 ncells   // Cells stored, trailing blanks are trimmed.
+        uint16 nruns
+        uint16 textlen
+        runs[ nruns ]   // uint16 count, uint16 attrs, uint8 fg[3], uint8 bg[3]
+        text[ textlen ] // One entry per cell, see below.
+
+    The last run's style also fills any cells past ncells when the line is
+    read back. A run with count 0 is appended when that fill style differs
+    from the last stored cell.
+
+    Text is UTF-8 with bytes that never occur in UTF-8 as markers:
+        0x00       empty cell
+        0xfe       right half of a wide character
+        0xff cp    combining character added to the previous cell
+
+    Search index: each page has a bloom filter of the trigrams in the text
+    of its first `indexed` lines, folded the way matching folds it (see
+    sb_line_text). A page of build output has a few thousand distinct
+    trigrams: at 8k of them and two bits each in SB_BLOOM_BITS, a trigram
+    that isn't there gets through 15% of the time, so a five byte query
+    (three trigrams) reads 0.3% of the pages it doesn't match.
+
+    Lines are numbered from when they were pushed, so a number stays put
+    while newer lines come in: page->first_line is the number of its line 0.
+*/
+#define SCROLLBACK_PAGE_SIZE ( 64 * 1024 )
+#define SCROLLBACK_PAGE_DATA ( SCROLLBACK_PAGE_SIZE - sizeof( scrollback_page ) )
+
+#define SB_RECORD_HEADER 6
+#define SB_RUN_SIZE 10
+
+#define SB_TEXT_EMPTY 0x00
+#define SB_TEXT_WIDE_RIGHT 0xfe
+#define SB_TEXT_COMBINING 0xff
+
+#define SB_BLOOM_BITS ( 32 * 1024 )
+#define SB_BLOOM_MASK ( SB_BLOOM_BITS - 1 )
+#define SB_BLOOM_WORDS ( SB_BLOOM_BITS / 64 )
+
+// Queries are cut to this many bytes.
+#define SB_QUERY_MAX 256
+
+typedef struct scrollback_page
+{
+    uint32_t used;    // Bytes of records at the start of data.
+    uint32_t nlines;  // Entries in the offset table at the end of data.
+    uint32_t indexed; // Lines [0, indexed) are in bloom.
+    uint32_t pad;
+    uint64_t first_line;
+    uint64_t bloom[ SB_BLOOM_WORDS ];
+    uint8_t data[];
+} scrollback_page;
+
+struct scrollback
+{
+    scrollback_page **pages; // Ring of max_pages, allocated as needed.
+    size_t max_pages;
+    size_t head;  // Oldest page
+    size_t count; // Pages holding lines.
+
+    uint8_t *scratch; // Encode buffer
+    size_t scratch_size;
+
+    uint64_t first_line; // Number of the oldest line
+    size_t index_page;   // Pages before this one are fully indexed.
+    uint8_t *text;       // sb_line_text buffer, SCROLLBACK_PAGE_DATA bytes
+
+    scrollback_stats stats;
+};
+
+static uint16_t *sb_page_offsets( scrollback_page *page )
+{
+    // Offset of line i is at sb_page_offsets( page )[ -1 - i ].
+    return ( uint16_t * )( page->data + SCROLLBACK_PAGE_DATA );
+}
+
+static uint16_t sb_get16( const uint8_t *p )
+{
+    return ( uint16_t )( p[ 0 ] | ( p[ 1 ] << 8 ) );
+}
+
+static void sb_put16( uint8_t *p, uint16_t val )
+{
+    p[ 0 ] = ( uint8_t )val;
+    p[ 1 ] = ( uint8_t )( val >> 8 );
+}
+
+static uint16_t sb_pack_attrs( const VTermScreenCellAttrs *attrs )
+{
+    return ( uint16_t )( attrs->bold |
+                         ( attrs->underline << 1 ) |
+                         ( attrs->italic << 3 ) |
+                         ( attrs->blink << 4 ) |
+                         ( attrs->reverse << 5 ) |
+                         ( attrs->strike << 6 ) |
+                         ( attrs->font << 7 ) |
+                         ( attrs->dwl << 11 ) |
+                         ( attrs->dhl << 12 ) );
+}
+
+static void sb_unpack_attrs( uint16_t val, VTermScreenCellAttrs *attrs )
+{
+    attrs->bold = val & 0x1;
+    attrs->underline = ( val >> 1 ) & 0x3;
+    attrs->italic = ( val >> 3 ) & 0x1;
+    attrs->blink = ( val >> 4 ) & 0x1;
+    attrs->reverse = ( val >> 5 ) & 0x1;
+    attrs->strike = ( val >> 6 ) & 0x1;
+    attrs->font = ( val >> 7 ) & 0xf;
+    attrs->dwl = ( val >> 11 ) & 0x1;
+    attrs->dhl = ( val >> 12 ) & 0x3;
+}
+
+static int sb_style_equal( const VTermScreenCell *a, const VTermScreenCell *b )
+{
+    return ( sb_pack_attrs( &a->attrs ) == sb_pack_attrs( &b->attrs ) ) &&
+           ( a->fg.red == b->fg.red ) && ( a->fg.green == b->fg.green ) && ( a->fg.blue == b->fg.blue ) &&
+           ( a->bg.red == b->bg.red ) && ( a->bg.green == b->bg.green ) && ( a->bg.blue == b->bg.blue );
+}
+
+static uint8_t *sb_put_run( uint8_t *p, uint16_t count, const VTermScreenCell *cell )
+{
+    sb_put16( p, count );
+    sb_put16( p + 2, sb_pack_attrs( &cell->attrs ) );
+    p[ 4 ] = cell->fg.red;
+    p[ 5 ] = cell->fg.green;
+    p[ 6 ] = cell->fg.blue;
+    p[ 7 ] = cell->bg.red;
+    p[ 8 ] = cell->bg.green;
+    p[ 9 ] = cell->bg.blue;
+    return p + SB_RUN_SIZE;
+}
+
+static void sb_get_run( const uint8_t *p, VTermScreenCell *cell )
+{
+    sb_unpack_attrs( sb_get16( p + 2 ), &cell->attrs );
+    cell->fg.red = p[ 4 ];
+    cell->fg.green = p[ 5 ];
+    cell->fg.blue = p[ 6 ];
+    cell->bg.red = p[ 7 ];
+    cell->bg.green = p[ 8 ];
+    cell->bg.blue = p[ 9 ];
+}
+
+static uint8_t *sb_put_utf8( uint8_t *p, uint32_t cp )
+{
+    if ( cp > 0x10ffff )
+        cp = 0xfffd;
+
+    if ( cp < 0x80 )
+    {
+        *p++ = ( uint8_t )cp;
+    }
+    else if ( cp < 0x800 )
+    {
+        *p++ = ( uint8_t )( 0xc0 | ( cp >> 6 ) );
+        *p++ = ( uint8_t )( 0x80 | ( cp & 0x3f ) );
+    }
+    else if ( cp < 0x10000 )
+    {
+        *p++ = ( uint8_t )( 0xe0 | ( cp >> 12 ) );
+        *p++ = ( uint8_t )( 0x80 | ( ( cp >> 6 ) & 0x3f ) );
+        *p++ = ( uint8_t )( 0x80 | ( cp & 0x3f ) );
+    }
+    else
+    {
+        *p++ = ( uint8_t )( 0xf0 | ( cp >> 18 ) );
+        *p++ = ( uint8_t )( 0x80 | ( ( cp >> 12 ) & 0x3f ) );
+        *p++ = ( uint8_t )( 0x80 | ( ( cp >> 6 ) & 0x3f ) );
+        *p++ = ( uint8_t )( 0x80 | ( cp & 0x3f ) );
+    }
+    return p;
+}
+
+static const uint8_t *sb_get_utf8( const uint8_t *p, const uint8_t *end, uint32_t *cp )
+{
+    uint32_t c = *p++;
+    int extra = ( c >= 0xf0 ) ? 3 : ( c >= 0xe0 ) ? 2 : ( c >= 0xc0 ) ? 1 : 0;
+
+    if ( extra )
+        c &= 0x3f >> extra;
+    while ( extra-- && ( p < end ) )
+        c = ( c << 6 ) | ( *p++ & 0x3f );
+
+    *cp = c;
+    return p;
+}
+
+size_t scrollback_encode( uint8_t *out, int cols, const VTermScreenCell *cells )
+{
+    // Trim trailing blanks with the same style as the last cell.
+    int ncells = cols;
+    const VTermScreenCell *fill = cols ? &cells[ cols - 1 ] : NULL;
+    while ( ( ncells > 0 ) && !cells[ ncells - 1 ].chars[ 0 ] && sb_style_equal( &cells[ ncells - 1 ], fill ) )
+        ncells--;
+
+    uint8_t *runs = out + SB_RECORD_HEADER;
+    uint8_t *p = runs;
+    int nruns = 0;
+
+    for ( int start = 0; start < ncells; )
+    {
+        int end = start + 1;
+
+        while ( ( end < ncells ) && ( end - start < UINT16_MAX ) && sb_style_equal( &cells[ start ], &cells[ end ] ) )
+            end++;
+
+        p = sb_put_run( p, ( uint16_t )( end - start ), &cells[ start ] );
+        nruns++;
+        start = end;
+    }
+    if ( fill && ( !ncells || !sb_style_equal( &cells[ ncells - 1 ], fill ) ) )
+    {
+        p = sb_put_run( p, 0, fill );
+        nruns++;
+    }
+
+    uint8_t *text = p;
+    for ( int col = 0; col < ncells; col++ )
+    {
+        const uint32_t *chars = cells[ col ].chars;
+
+        if ( chars[ 0 ] == ( uint32_t )-1 )
+        {
+            *p++ = SB_TEXT_WIDE_RIGHT;
+        }
+        else if ( !chars[ 0 ] )
+        {
+            *p++ = SB_TEXT_EMPTY;
+        }
+        else
+        {
+            p = sb_put_utf8( p, chars[ 0 ] );
+            for ( int i = 1; ( i < VTERM_MAX_CHARS_PER_CELL ) && chars[ i ]; i++ )
+            {
+                *p++ = SB_TEXT_COMBINING;
+                p = sb_put_utf8( p, chars[ i ] );
+            }
+        }
+    }
+
+    sb_put16( out, ( uint16_t )ncells );
+    sb_put16( out + 2, ( uint16_t )nruns );
+    sb_put16( out + 4, ( uint16_t )( p - text ) );
+    return p - out;
+}
+
+// Encode cols cells into sb->scratch. Returns the record size.
+static size_t sb_encode( scrollback *sb, int cols, const VTermScreenCell *cells )
+{
+    size_t size = SCROLLBACK_LINE_MAX( cols );
+
+    if ( size > sb->scratch_size )
+    {
+        sb->scratch_size = size;
+        sb->scratch = ( uint8_t * )realloc( sb->scratch, size );
+        if ( !sb->scratch )
+            FATAL_ERROR( realloc );
+    }
+
+    return scrollback_encode( sb->scratch, cols, cells );
+}
+
+size_t scrollback_record_size( const uint8_t *rec, size_t avail )
+{
+    if ( avail < SB_RECORD_HEADER )
+        return 0;
+
+    size_t len = SB_RECORD_HEADER + sb_get16( rec + 2 ) * SB_RUN_SIZE + sb_get16( rec + 4 );
+
+    return ( len <= avail ) ? len : 0;
+}
+
+void scrollback_decode( const uint8_t *rec, int cols, VTermScreenCell *cells )
+{
+    int ncells = sb_get16( rec );
+    int nruns = sb_get16( rec + 2 );
+    const uint8_t *runs = rec + SB_RECORD_HEADER;
+    const uint8_t *text = runs + nruns * SB_RUN_SIZE;
+    const uint8_t *text_end = text + sb_get16( rec + 4 );
+
+    // Styles first: runs cover the stored cells, the last run fills the rest.
+    VTermScreenCell style;
+    int col = 0;
+
+    memset( &style, 0, sizeof( style ) );
+    for ( int i = 0; i < nruns; i++, runs += SB_RUN_SIZE )
+    {
+        int end = MIN( cols, col + sb_get16( runs ) );
+
+        sb_get_run( runs, &style );
+        for ( ; col < end; col++ )
+        {
+            cells[ col ].attrs = style.attrs;
+            cells[ col ].fg = style.fg;
+            cells[ col ].bg = style.bg;
+        }
+    }
+    for ( ; col < cols; col++ )
+    {
+        cells[ col ].attrs = style.attrs;
+        cells[ col ].fg = style.fg;
+        cells[ col ].bg = style.bg;
+    }
+
+    for ( col = 0; col < cols; col++ )
+    {
+        cells[ col ].chars[ 0 ] = 0;
+        cells[ col ].width = 1;
+    }
+
+    // Then the text.
+    int nchars = 0;
+    col = -1;
+    while ( ( text < text_end ) && ( col < MIN( ncells, cols ) ) )
+    {
+        uint8_t c = *text;
+
+        if ( c == SB_TEXT_COMBINING )
+        {
+            uint32_t cp;
+
+            text = sb_get_utf8( text + 1, text_end, &cp );
+            if ( ( col >= 0 ) && ( nchars < VTERM_MAX_CHARS_PER_CELL ) )
+            {
+                cells[ col ].chars[ nchars++ ] = cp;
+                if ( nchars < VTERM_MAX_CHARS_PER_CELL )
+                    cells[ col ].chars[ nchars ] = 0;
+            }
+            continue;
+        }
+
+        if ( ++col >= MIN( ncells, cols ) )
+            break;
+
+        if ( c == SB_TEXT_WIDE_RIGHT )
+        {
+            text++;
+            cells[ col ].chars[ 0 ] = ( uint32_t )-1;
+            if ( col > 0 )
+                cells[ col - 1 ].width = 2;
+            nchars = VTERM_MAX_CHARS_PER_CELL;
+        }
+        else if ( c == SB_TEXT_EMPTY )
+        {
+            text++;
+            nchars = VTERM_MAX_CHARS_PER_CELL;
+        }
+        else
+        {
+            text = sb_get_utf8( text, text_end, &cells[ col ].chars[ 0 ] );
+            cells[ col ].chars[ 1 ] = 0;
+            nchars = 1;
+        }
+    }
+}
+
+static uint8_t sb_fold( uint8_t c )
+{
+    return ( ( c >= 'A' ) && ( c <= 'Z' ) ) ? ( uint8_t )( c + 'a' - 'A' ) : c;
+}
+
+// What search matches against: the record's text with empty cells as
+// spaces, wide character right halves and combining characters left out,
+// and ASCII folded to lower case. Returns the length, at most textlen.
+static size_t sb_line_text( const uint8_t *rec, uint8_t *out )
+{
+    const uint8_t *text = rec + SB_RECORD_HEADER + sb_get16( rec + 2 ) * SB_RUN_SIZE;
+    const uint8_t *text_end = text + sb_get16( rec + 4 );
+    uint8_t *p = out;
+
+    while ( text < text_end )
+    {
+        uint8_t c = *text++;
+
+        if ( c == SB_TEXT_COMBINING )
+        {
+            // Its lead byte, then any continuation bytes.
+            if ( text < text_end )
+                text++;
+            while ( ( text < text_end ) && ( ( *text & 0xc0 ) == 0x80 ) )
+                text++;
+        }
+        else if ( c != SB_TEXT_WIDE_RIGHT )
+        {
+            *p++ = ( c == SB_TEXT_EMPTY ) ? ' ' : sb_fold( c );
+        }
+    }
+    return p - out;
+}
+
+// Both bloom bits of the trigram at p, in the low and high halves.
+static uint32_t sb_trigram_hash( const uint8_t *p )
+{
+    uint32_t h = p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 );
+
+    // murmur3's finalizer: every bit of the trigram reaches both halves.
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static void sb_bloom_add( uint64_t *bloom, uint32_t h )
+{
+    uint32_t bit0 = h & SB_BLOOM_MASK;
+    uint32_t bit1 = ( h >> 16 ) & SB_BLOOM_MASK;
+
+    bloom[ bit0 >> 6 ] |= 1ULL << ( bit0 & 63 );
+    bloom[ bit1 >> 6 ] |= 1ULL << ( bit1 & 63 );
+}
+
+// 0 if a line in the filter can't have all of the trigrams.
+static int sb_bloom_test( const uint64_t *bloom, const uint32_t *hashes, int count )
+{
+    for ( int i = 0; i < count; i++ )
+    {
+        uint32_t bit0 = hashes[ i ] & SB_BLOOM_MASK;
+        uint32_t bit1 = ( hashes[ i ] >> 16 ) & SB_BLOOM_MASK;
+
+        if ( !( bloom[ bit0 >> 6 ] & ( 1ULL << ( bit0 & 63 ) ) ) ||
+             !( bloom[ bit1 >> 6 ] & ( 1ULL << ( bit1 & 63 ) ) ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static scrollback_page *sb_page( scrollback *sb, size_t i )
+{
+    return sb->pages[ ( sb->head + i ) % sb->max_pages ];
+}
+
+static uint8_t *sb_page_line( scrollback_page *page, uint32_t line )
+{
+    return page->data + sb_page_offsets( page )[ -1 - ( int )line ];
+}
+
+scrollback *scrollback_init( size_t max_bytes )
+{
+    scrollback *sb = ( scrollback * )calloc( 1, sizeof( *sb ) );
+
+    if ( !sb )
+        FATAL_ERROR( calloc );
+
+    // Keep at least two pages so dropping the oldest never empties us.
+    sb->max_pages = MAX( 2, max_bytes / SCROLLBACK_PAGE_SIZE );
+    sb->pages = ( scrollback_page ** )calloc( sb->max_pages, sizeof( sb->pages[ 0 ] ) );
+    if ( !sb->pages )
+        FATAL_ERROR( calloc );
+    sb->text = ( uint8_t * )malloc( SCROLLBACK_PAGE_DATA );
+    if ( !sb->text )
+        FATAL_ERROR( malloc );
+
+    clog_info( CLOG( 0 ), "scrollback: %zu pages of %d bytes", sb->max_pages, SCROLLBACK_PAGE_SIZE );
+    return sb;
+}
+
+void scrollback_free( scrollback *sb )
+{
+    if ( !sb )
+        return;
+
+    for ( size_t i = 0; i < sb->max_pages; i++ )
+        free( sb->pages[ i ] );
+    free( sb->pages );
+    free( sb->scratch );
+    free( sb->text );
+    free( sb );
+}
+
+void scrollback_push( scrollback *sb, int cols, const VTermScreenCell *cells )
+{
+    cols = MIN( cols, UINT16_MAX );
+
+    size_t len = sb_encode( sb, cols, cells );
+
+    // A single line has to fit in a page. Drop cells off the end until it does.
+    while ( len + sizeof( uint16_t ) > SCROLLBACK_PAGE_DATA )
+    {
+        cols = cols * 3 / 4;
+        len = sb_encode( sb, cols, cells );
+    }
+
+    scrollback_push_raw( sb, sb->scratch, len );
+}
+
+int scrollback_push_raw( scrollback *sb, const uint8_t *rec, size_t len )
+{
+    if ( len + sizeof( uint16_t ) > SCROLLBACK_PAGE_DATA )
+        return -1;
+
+    scrollback_page *page = sb->count ? sb_page( sb, sb->count - 1 ) : NULL;
+
+    if ( !page || ( page->used + ( page->nlines + 1 ) * sizeof( uint16_t ) + len > SCROLLBACK_PAGE_DATA ) )
+    {
+        if ( sb->count == sb->max_pages )
+        {
+            // Full: recycle the oldest page.
+            page = sb_page( sb, 0 );
+            sb->stats.lines_dropped += page->nlines;
+            sb->stats.lines -= page->nlines;
+            sb->stats.lines_unindexed -= page->nlines - page->indexed;
+            sb->stats.bytes_used -= page->used;
+            sb->first_line += page->nlines;
+
+            sb->head = ( sb->head + 1 ) % sb->max_pages;
+            sb->count--;
+            if ( sb->index_page )
+                sb->index_page--;
+        }
+
+        scrollback_page **slot = &sb->pages[ ( sb->head + sb->count ) % sb->max_pages ];
+        if ( !*slot )
+        {
+            *slot = ( scrollback_page * )malloc( SCROLLBACK_PAGE_SIZE );
+            if ( !*slot )
+                FATAL_ERROR( malloc );
+            sb->stats.bytes_alloced += SCROLLBACK_PAGE_SIZE;
+        }
+
+        page = *slot;
+        page->used = 0;
+        page->nlines = 0;
+        page->indexed = 0;
+        page->first_line = sb->first_line + sb->stats.lines;
+        memset( page->bloom, 0, sizeof( page->bloom ) );
+        sb->count++;
+    }
+
+    sb_page_offsets( page )[ -1 - ( int )page->nlines ] = ( uint16_t )page->used;
+    memcpy( page->data + page->used, rec, len );
+    page->used += len;
+    page->nlines++;
+
+    sb->stats.lines++;
+    sb->stats.lines_unindexed++;
+    sb->stats.lines_pushed++;
+    sb->stats.bytes_used += len;
+    return 0;
+}
+
+int scrollback_pop( scrollback *sb, int cols, VTermScreenCell *cells )
+{
+    if ( !sb->count )
+        return 0;
+
+    scrollback_page *page = sb_page( sb, sb->count - 1 );
+    uint32_t line = page->nlines - 1;
+    uint16_t offset = sb_page_offsets( page )[ -1 - ( int )line ];
+
+    scrollback_decode( page->data + offset, cols, cells );
+
+    sb->stats.lines--;
+    sb->stats.lines_popped++;
+    sb->stats.bytes_used -= page->used - offset;
+
+    // Its trigrams stay in the filter, which only costs a wasted read.
+    if ( line >= page->indexed )
+        sb->stats.lines_unindexed--;
+    else
+        page->indexed = line;
+
+    page->used = offset;
+    page->nlines = line;
+    if ( !page->nlines )
+    {
+        sb->count--;
+        sb->index_page = MIN( sb->index_page, sb->count ? sb->count - 1 : 0 );
+    }
+    return 1;
+}
+
+size_t scrollback_get_lines( scrollback *sb )
+{
+    return sb->stats.lines;
+}
+
+int scrollback_getline( scrollback *sb, size_t idx, int cols, VTermScreenCell *cells )
+{
+    for ( size_t i = sb->count; i-- > 0; )
+    {
+        scrollback_page *page = sb_page( sb, i );
+
+        if ( idx < page->nlines )
+        {
+            scrollback_decode( sb_page_line( page, page->nlines - 1 - ( uint32_t )idx ), cols, cells );
+            return 1;
+        }
+        idx -= page->nlines;
+    }
+    return 0;
+}
+
+const uint8_t *scrollback_next_raw( scrollback *sb, uint64_t *pos, size_t *len )
+{
+    size_t page_idx = ( size_t )( *pos >> 32 );
+    uint32_t line = ( uint32_t )*pos;
+
+    for ( ; page_idx < sb->count; page_idx++, line = 0 )
+    {
+        scrollback_page *page = sb_page( sb, page_idx );
+
+        if ( line < page->nlines )
+        {
+            uint16_t offset = sb_page_offsets( page )[ -1 - ( int )line ];
+            uint32_t end = ( line + 1 < page->nlines ) ? sb_page_offsets( page )[ -2 - ( int )line ] : page->used;
+
+            *len = end - offset;
+            *pos = ( ( uint64_t )page_idx << 32 ) | ( line + 1 );
+            return page->data + offset;
+        }
+    }
+    return NULL;
+}
+
+void scrollback_range( scrollback *sb, uint64_t *first, uint64_t *end )
+{
+    *first = sb->first_line;
+    *end = sb->first_line + sb->stats.lines;
+}
+
+size_t scrollback_index( scrollback *sb, size_t max_lines )
+{
+    while ( sb->stats.lines_unindexed && max_lines && ( sb->index_page < sb->count ) )
+    {
+        scrollback_page *page = sb_page( sb, sb->index_page );
+
+        for ( ; ( page->indexed < page->nlines ) && max_lines; page->indexed++, max_lines-- )
+        {
+            size_t len = sb_line_text( sb_page_line( page, page->indexed ), sb->text );
+
+            for ( size_t i = 0; i + 3 <= len; i++ )
+                sb_bloom_add( page->bloom, sb_trigram_hash( sb->text + i ) );
+            sb->stats.lines_unindexed--;
+        }
+
+        // The newest page keeps filling up, so it stays the one to look at.
+        if ( ( page->indexed < page->nlines ) || ( sb->index_page + 1 >= sb->count ) )
+            break;
+        sb->index_page++;
+    }
+    return sb->stats.lines_unindexed;
+}
+
+// Index of the page holding line, which has to be stored.
+static size_t sb_find_page( scrollback *sb, uint64_t line )
+{
+    size_t lo = 0;
+    size_t hi = sb->count - 1;
+
+    while ( lo < hi )
+    {
+        size_t mid = ( lo + hi + 1 ) / 2;
+
+        if ( sb_page( sb, mid )->first_line <= line )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int scrollback_find( scrollback *sb, const char *query, int dir, uint64_t *line, size_t max_lines )
+{
+    uint8_t q[ SB_QUERY_MAX ];
+    uint32_t hashes[ SB_QUERY_MAX ];
+    size_t qlen = MIN( strlen( query ), SB_QUERY_MAX );
+    uint64_t end = sb->first_line + sb->stats.lines;
+    int nhashes = 0;
+
+    for ( size_t i = 0; i < qlen; i++ )
+        q[ i ] = sb_fold( ( uint8_t )query[ i ] );
+    for ( size_t i = 0; i + 3 <= qlen; i++ )
+        hashes[ nhashes++ ] = sb_trigram_hash( q + i );
+
+    if ( !qlen || !sb->stats.lines )
+        return -1;
+
+    uint64_t cur = *line;
+    if ( dir < 0 )
+    {
+        if ( cur < sb->first_line )
+            return -1;
+        cur = MIN( cur, end - 1 );
+    }
+    else
+    {
+        if ( cur >= end )
+            return -1;
+        cur = MAX( cur, sb->first_line );
+    }
+
+    size_t page_idx = sb_find_page( sb, cur );
+    uint32_t l = ( uint32_t )( cur - sb_page( sb, page_idx )->first_line );
+
+    for ( ;; )
+    {
+        scrollback_page *page = sb_page( sb, page_idx );
+        // No line in [0, skip) can match.
+        uint32_t skip = ( nhashes && !sb_bloom_test( page->bloom, hashes, nhashes ) ) ? page->indexed : 0;
+
+        if ( skip )
+            sb->stats.search_pages_skipped++;
+
+        if ( dir < 0 )
+        {
+            for ( ; l >= skip; l-- )
+            {
+                if ( !max_lines-- )
+                {
+                    *line = page->first_line + l;
+                    return 0;
+                }
+                size_t len = sb_line_text( sb_page_line( page, l ), sb->text );
+
+                sb->stats.search_lines_read++;
+                if ( memmem( sb->text, len, q, qlen ) )
+                {
+                    *line = page->first_line + l;
+                    return 1;
+                }
+                if ( !l )
+                    break;
+            }
+            if ( !page_idx )
+                return -1;
+            page_idx--;
+            l = sb_page( sb, page_idx )->nlines - 1;
+        }
+        else
+        {
+            for ( l = MAX( l, skip ); l < page->nlines; l++ )
+            {
+                if ( !max_lines-- )
+                {
+                    *line = page->first_line + l;
+                    return 0;
+                }
+                size_t len = sb_line_text( sb_page_line( page, l ), sb->text );
+
+                sb->stats.search_lines_read++;
+                if ( memmem( sb->text, len, q, qlen ) )
+                {
+                    *line = page->first_line + l;
+                    return 1;
+                }
+            }
+            if ( ++page_idx >= sb->count )
+                return -1;
+            l = 0;
+        }
+    }
+}
+
+int scrollback_match_cells( const char *query, int cols, const VTermScreenCell *cells, int start_col, int *end_col )
+{
+    size_t qlen = strlen( query );
+    uint8_t q[ SB_QUERY_MAX ];
+    arena *scratch = arena_thread();
+    arena_mark mark = arena_getmark( scratch );
+    uint8_t *text = ( uint8_t * )arena_alloc( scratch, cols * 4 + 1 );
+    int *textcols = ( int * )arena_alloc( scratch, ( cols * 4 + 1 ) * sizeof( textcols[ 0 ] ) );
+    size_t len = 0;
+    int ret = -1;
+
+    // The same folding as sb_line_text, one cell at a time.
+    for ( int col = MAX( 0, start_col ); col < cols; col++ )
+    {
+        uint32_t cp = cells[ col ].chars[ 0 ];
+        uint8_t *p = text + len;
+
+        if ( cp == ( uint32_t )-1 )
+            continue;
+        if ( cp )
+            p = sb_put_utf8( p, cp );
+        else
+            *p++ = ' ';
+        text[ len ] = sb_fold( text[ len ] );
+        while ( text + len < p )
+            textcols[ len++ ] = col;
+    }
+
+    qlen = MIN( qlen, SB_QUERY_MAX );
+    for ( size_t i = 0; i < qlen; i++ )
+        q[ i ] = sb_fold( ( uint8_t )query[ i ] );
+
+    const uint8_t *match = qlen ? ( const uint8_t * )memmem( text, len, q, qlen ) : NULL;
+    if ( match )
+    {
+        int last = textcols[ match - text + qlen - 1 ];
+
+        ret = textcols[ match - text ];
+        *end_col = last + ( ( cells[ last ].width == 2 ) ? 2 : 1 );
+    }
+
+    arena_release( scratch, mark );
+    return ret;
+}
+
+void scrollback_getstats( scrollback *sb, scrollback_stats *stats )
+{
+    *stats = sb->stats;
+}
@@ -0,0 +1,103 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SCROLLBACK_H_
+#define _SCROLLBACK_H_
+
+// Scrollback lines, stored compactly in fixed size pages that are recycled
+// oldest first once max_bytes is reached. Lines are UTF-8 text plus
+// run-length encoded style runs instead of VTermScreenCell arrays.
+
+typedef struct scrollback scrollback;
+
+typedef struct scrollback_stats
+{
+    uint64_t lines_pushed;
+    uint64_t lines_popped;
+    uint64_t lines_dropped;        // Lost when the oldest page was recycled.
+    size_t lines;                  // Lines currently stored
+    size_t bytes_used;             // Bytes of line data currently stored
+    size_t bytes_alloced;          // Page memory allocated
+    size_t lines_unindexed;        // Waiting for scrollback_index
+    uint64_t search_pages_skipped; // Pages scrollback_find ruled out with the index
+    uint64_t search_lines_read;    // Lines it had to look at
+} scrollback_stats;
+
+scrollback *scrollback_init( size_t max_bytes );
+void scrollback_free( scrollback *sb );
+
+// Add a line that scrolled off the top of the screen.
+void scrollback_push( scrollback *sb, int cols, const VTermScreenCell *cells );
+
+// Remove the most recent line into cells. Returns 0 if there are none.
+int scrollback_pop( scrollback *sb, int cols, VTermScreenCell *cells );
+
+// Number of lines stored and read access to them (0 is the most recent).
+size_t scrollback_get_lines( scrollback *sb );
+int scrollback_getline( scrollback *sb, size_t idx, int cols, VTermScreenCell *cells );
+
+void scrollback_getstats( scrollback *sb, scrollback_stats *stats );
+
+// The encoded line records themselves, for snapshots. A record is
+// self-describing and decodes to any width.
+#define SCROLLBACK_LINE_MAX( _cols ) ( 6 + ( ( _cols ) + 1 ) * ( 4 + 5 * ( VTERM_MAX_CHARS_PER_CELL - 1 ) + 10 ) )
+
+// Encode cols cells into out, which has room for SCROLLBACK_LINE_MAX( cols ).
+// Returns the record size.
+size_t scrollback_encode( uint8_t *out, int cols, const VTermScreenCell *cells );
+void scrollback_decode( const uint8_t *rec, int cols, VTermScreenCell *cells );
+// Size of the record at rec, or 0 if it doesn't fit in avail bytes.
+size_t scrollback_record_size( const uint8_t *rec, size_t avail );
+
+// Walk stored records oldest first: start with *pos 0. Returns NULL at the end.
+const uint8_t *scrollback_next_raw( scrollback *sb, uint64_t *pos, size_t *len );
+// Append a record as the most recent line. Returns -1 if it can't fit a page.
+int scrollback_push_raw( scrollback *sb, const uint8_t *rec, size_t len );
+
+// Lines are also numbered in the order they were pushed: [*first, *end)
+// are stored. A line keeps its number until it is dropped or popped, so
+// scrollback_getline index i is line *end - 1 - i.
+void scrollback_range( scrollback *sb, uint64_t *first, uint64_t *end );
+
+// Search. Matching is on a line's text alone, with ASCII case folded. Each
+// page keeps an index of the trigrams in its lines so scrollback_find can
+// skip pages without reading them. Pushing doesn't update it: that's done
+// by scrollback_index, a few lines at a time, whenever there's a moment.
+//
+// Index up to max_lines of the lines pushed since. Returns how many are left.
+size_t scrollback_index( scrollback *sb, size_t max_lines );
+// Look for query in line *line and then the lines older (dir < 0) or newer
+// (dir > 0) than it, reading at most max_lines lines. Returns 1 with *line
+// set to the first line that matches, 0 with *line set to where to carry on
+// when max_lines ran out, or -1 if there are no more matches.
+int scrollback_find( scrollback *sb, const char *query, int dir, uint64_t *line, size_t max_lines );
+// First match of query in cells at or after start_col, with the same
+// matching as scrollback_find. Returns its column and sets *end_col just
+// past it, or returns -1.
+int scrollback_match_cells( const char *query, int cols, const VTermScreenCell *cells, int start_col, int *end_col );
+
+#endif // _SCROLLBACK_H_
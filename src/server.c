@@ -0,0 +1,349 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vterm.h"
+#include "metrics.h"
+#include "termwin.h"
+#include "writequeue.h"
+#include "eventloop.h"
+#include "remote.h"
+#include "server.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+typedef struct client
+{
+    int id;
+    int fd;
+    server *srv;
+    termwin *twin; // NULL until it says hello
+    writequeue *queue;
+    remote_msgreader rd;
+    int behind; // Skipped a frame because the queue was full
+    int closed;
+    uint64_t frames;
+    uint64_t frames_skipped;
+} client;
+
+struct server
+{
+    int listen_fd;
+    const char *path;
+    eventloop *el;
+    server_callbacks cb;
+    void *user;
+
+    client *clients[ SERVER_CLIENTS_MAX ];
+    int client_count;
+    int next_id;
+    termwin *twins[ SERVER_CLIENTS_MAX ];
+};
+
+server *server_init( const char *path, const server_callbacks *callbacks, void *user )
+{
+    int fd = remote_listen( path );
+
+    if ( fd < 0 )
+        return NULL;
+
+    server *srv = ( server * )calloc( 1, sizeof( *srv ) );
+
+    if ( !srv )
+        FATAL_ERROR( calloc );
+
+    srv->listen_fd = fd;
+    srv->path = path;
+    srv->cb = *callbacks;
+    srv->user = user;
+    return srv;
+}
+
+static void server_update_twins( server *srv )
+{
+    int count = 0;
+
+    for ( int i = 0; i < srv->client_count; i++ )
+    {
+        if ( srv->clients[ i ]->twin )
+            srv->twins[ count++ ] = srv->clients[ i ]->twin;
+    }
+    srv->cb.clients( srv->twins, count, srv->user );
+}
+
+static void client_flush( client *c )
+{
+    if ( writequeue_flush( c->queue ) )
+    {
+        c->closed = 1;
+        return;
+    }
+
+    size_t pending = writequeue_get_pending( c->queue );
+
+    if ( c->srv->el )
+        eventloop_mod_fd( c->srv->el, c->fd, EVENTLOOP_READ | ( pending ? EVENTLOOP_WRITE : 0 ) );
+
+    if ( c->behind && ( pending <= SERVER_QUEUE_HIGH / 2 ) )
+    {
+        c->behind = 0;
+        c->srv->cb.redraw( c->srv->user );
+    }
+}
+
+static int client_refresh( client *c )
+{
+    size_t len;
+    const char *buf;
+
+    if ( !c->twin || c->closed )
+        return 0;
+
+    if ( writequeue_get_pending( c->queue ) > SERVER_QUEUE_HIGH )
+    {
+        c->behind = 1;
+        c->frames_skipped++;
+        return 0;
+    }
+
+    if ( !termwin_refresh( c->twin ) )
+        return 0;
+
+    buf = termwin_take_output( c->twin, &len );
+    writequeue_append( c->queue, buf, len );
+    c->frames++;
+
+    client_flush( c );
+    return 1;
+}
+
+int server_refresh( server *srv )
+{
+    int drew = 0;
+
+    for ( int i = 0; i < srv->client_count; i++ )
+        drew |= client_refresh( srv->clients[ i ] );
+    return drew;
+}
+
+static void client_msg( int type, const char *buf, size_t len, void *user )
+{
+    client *c = ( client * )user;
+    server *srv = c->srv;
+
+    if ( ( type == REMOTE_MSG_HELLO ) || ( type == REMOTE_MSG_RESIZE ) )
+    {
+        uint16_t lines, columns;
+        int rows, cols;
+
+        if ( len < 4 )
+            return;
+
+        memcpy( &lines, buf, 2 );
+        memcpy( &columns, buf + 2, 2 );
+
+        if ( type == REMOTE_MSG_HELLO )
+        {
+            if ( c->twin )
+                return;
+
+            c->twin = termwin_init_direct_remote( lines, columns, ( len > 4 ) && buf[ 4 ] );
+            server_update_twins( srv );
+            srv->cb.attach( c->twin, srv->user );
+        }
+        else if ( c->twin )
+        {
+            termwin_resize( c->twin, lines, columns );
+        }
+        else
+        {
+            return;
+        }
+
+        clog_info( CLOG( 0 ), "client %d %s %dx%d", c->id, ( type == REMOTE_MSG_HELLO ) ? "attached" : "resized", columns, lines );
+
+        // The screen follows whoever attached or resized last.
+        termwin_getsize( c->twin, &rows, &cols );
+        srv->cb.resize( rows, cols, srv->user );
+    }
+    else if ( type == REMOTE_MSG_INPUT )
+    {
+        srv->cb.input( buf, len, srv->user );
+    }
+}
+
+static void client_cb( int fd, int events, void *user )
+{
+    client *c = ( client * )user;
+
+    if ( events & EVENTLOOP_WRITE )
+        client_flush( c );
+
+    if ( ( events & ( EVENTLOOP_READ | EVENTLOOP_HANGUP ) ) && remote_read( fd, &c->rd, client_msg, c ) )
+        c->closed = 1;
+}
+
+static void listen_cb( int fd, int events, void *user )
+{
+    server *srv = ( server * )user;
+
+    for ( ;; )
+    {
+        int client_fd = remote_accept( fd );
+
+        if ( client_fd < 0 )
+        {
+            if ( ( errno != EAGAIN ) && ( errno != EINTR ) )
+                clog_warn( CLOG( 0 ), "accept failed: %d", errno );
+            return;
+        }
+
+        if ( srv->client_count == SERVER_CLIENTS_MAX )
+        {
+            clog_warn( CLOG( 0 ), "too many clients, dropping new one" );
+            close( client_fd );
+            continue;
+        }
+
+        client *c = ( client * )calloc( 1, sizeof( *c ) );
+
+        if ( !c )
+            FATAL_ERROR( calloc );
+
+        c->id = srv->next_id++;
+        c->fd = client_fd;
+        c->srv = srv;
+        c->queue = writequeue_init( client_fd );
+        eventloop_add_fd( srv->el, client_fd, EVENTLOOP_READ, client_cb, c );
+
+        srv->clients[ srv->client_count++ ] = c;
+        server_update_twins( srv );
+        clog_info( CLOG( 0 ), "client %d connected", c->id );
+    }
+}
+
+static void client_free( client *c )
+{
+    writequeue_stats stats;
+
+    writequeue_getstats( c->queue, &stats );
+    clog_info( CLOG( 0 ), "client %d closed frames:%" PRIu64 " skipped:%" PRIu64 " bytes:%" PRIu64 " stalls:%" PRIu64 " depth_max:%zu",
+               c->id, c->frames, c->frames_skipped, stats.bytes_written, stats.stalls, stats.depth_max );
+
+    if ( c->srv->el )
+        eventloop_del_fd( c->srv->el, c->fd );
+    close( c->fd );
+
+    writequeue_free( c->queue );
+    termwin_free( c->twin );
+    free( c );
+}
+
+void server_reap( server *srv )
+{
+    int i = 0;
+    int reaped = 0;
+
+    while ( i < srv->client_count )
+    {
+        client *c = srv->clients[ i ];
+
+        if ( !c->closed )
+        {
+            i++;
+            continue;
+        }
+
+        memmove( &srv->clients[ i ], &srv->clients[ i + 1 ], ( srv->client_count - i - 1 ) * sizeof( srv->clients[ 0 ] ) );
+        srv->client_count--;
+        client_free( c );
+        reaped = 1;
+    }
+
+    if ( reaped )
+        server_update_twins( srv );
+}
+
+void server_start( server *srv, eventloop *el )
+{
+    srv->el = el;
+    eventloop_add_fd( el, srv->listen_fd, EVENTLOOP_READ, listen_cb, srv );
+}
+
+void server_stop( server *srv )
+{
+    if ( srv->el )
+    {
+        for ( int i = 0; i < srv->client_count; i++ )
+            eventloop_del_fd( srv->el, srv->clients[ i ]->fd );
+        eventloop_del_fd( srv->el, srv->listen_fd );
+        srv->el = NULL;
+    }
+}
+
+void server_free( server *srv )
+{
+    if ( !srv )
+        return;
+
+    // Clients see the socket close and put their terminals back.
+    server_stop( srv );
+    while ( srv->client_count )
+        client_free( srv->clients[ --srv->client_count ] );
+    server_update_twins( srv );
+
+    close( srv->listen_fd );
+    unlink( srv->path );
+    free( srv );
+}
+
+void server_stats_json( server *srv, metrics_json *json )
+{
+    metrics_json_object( json, "clients" );
+    metrics_json_uint( json, "count", srv->client_count );
+    for ( int i = 0; i < srv->client_count; i++ )
+    {
+        client *c = srv->clients[ i ];
+        char name[ 32 ];
+
+        snprintf( name, sizeof( name ), "%d", c->id );
+        metrics_json_object( json, name );
+        metrics_json_uint( json, "frames", c->frames );
+        metrics_json_uint( json, "frames_skipped", c->frames_skipped );
+        metrics_json_uint( json, "pending", writequeue_get_pending( c->queue ) );
+        metrics_json_end( json );
+    }
+    metrics_json_end( json );
+}
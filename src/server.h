@@ -0,0 +1,74 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+// The --server end of remote.h. Each client gets its own direct renderer
+// fed by the focused session's damage callbacks, so a new client starts
+// with a full screen and after that only gets what changed. Frames go out
+// through a nonblocking queue: a client that falls SERVER_QUEUE_HIGH behind
+// doesn't get drawn until it catches up, and then gets everything that
+// changed meanwhile as one diff. Nothing else ever waits for it.
+
+#define SERVER_CLIENTS_MAX 16
+#define SERVER_QUEUE_HIGH ( 256 * 1024 )
+
+typedef struct server server;
+
+typedef struct server_callbacks
+{
+    // The termwins of the clients that said hello, whenever that changes.
+    void ( *clients )( termwin **twins, int count, void *user );
+    // A new client's termwin, to draw the focused session into.
+    void ( *attach )( termwin *twin, void *user );
+    // A client attached or resized; the screen follows it.
+    void ( *resize )( int rows, int cols, void *user );
+    // Keys read by a client.
+    void ( *input )( const char *buf, size_t len, void *user );
+    // A client that was skipped caught up and wants a frame.
+    void ( *redraw )( void *user );
+} server_callbacks;
+
+// Listen at path. Returns NULL with errno set on failure.
+server *server_init( const char *path, const server_callbacks *callbacks, void *user );
+// Drop the clients, close the socket and remove it.
+void server_free( server *srv );
+
+// Take connections from el, until server_stop (before el is freed).
+void server_start( server *srv, eventloop *el );
+void server_stop( server *srv );
+
+// Send each client whatever changed. Returns 1 if any got a frame.
+int server_refresh( server *srv );
+// Free clients that went away.
+void server_reap( server *srv );
+
+// A "clients" object with what each one was sent.
+void server_stats_json( server *srv, metrics_json *json );
+
+#endif // _SERVER_H_
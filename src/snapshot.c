@@ -0,0 +1,485 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "termout.h"
+#include "snapshot.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define SNAPSHOT_MAGIC "CVTSNAP"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_PALETTE 18 // ANSI 0-15, default fg, default bg
+
+#define SNAPSHOT_CURSOR_VISIBLE 0x1
+
+typedef struct snapshot_header
+{
+    char magic[ SNAPSHOT_MAGIC_LEN ];
+    uint32_t version;
+    uint16_t rows;
+    uint16_t cols;
+    uint16_t cursor_row;
+    uint16_t cursor_col;
+    uint32_t flags;
+    uint32_t sb_lines;
+    uint32_t reserved;
+    uint64_t screen_bytes;
+    uint64_t sb_bytes;
+    uint8_t palette[ SNAPSHOT_PALETTE ][ 3 ];
+    uint8_t pad[ 2 ];
+} snapshot_header;
+
+typedef struct snapshot_map
+{
+    const uint8_t *data;
+    size_t len;
+    snapshot_header hdr;
+    const uint8_t *screen; // hdr.rows records
+    const uint8_t *sb;     // hdr.sb_lines records
+} snapshot_map;
+
+// Map filename and check the header and section sizes. Records are checked
+// as they're read.
+static int snapshot_open( const char *filename, snapshot_map *map )
+{
+    int fd = open( filename, O_RDONLY | O_CLOEXEC );
+    struct stat st;
+
+    memset( map, 0, sizeof( *map ) );
+    if ( fd < 0 )
+        return -1;
+
+    if ( fstat( fd, &st ) )
+    {
+        close( fd );
+        return -1;
+    }
+
+    if ( ( size_t )st.st_size < sizeof( map->hdr ) )
+    {
+        close( fd );
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+    close( fd );
+    if ( data == MAP_FAILED )
+        return -1;
+
+    map->data = ( const uint8_t * )data;
+    map->len = st.st_size;
+    memcpy( &map->hdr, map->data, sizeof( map->hdr ) );
+
+    const snapshot_header *hdr = &map->hdr;
+    size_t avail = map->len - sizeof( *hdr );
+
+    if ( memcmp( hdr->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN ) ||
+         ( hdr->version > SNAPSHOT_VERSION ) ||
+         ( hdr->screen_bytes > avail ) || ( hdr->sb_bytes > avail - hdr->screen_bytes ) )
+    {
+        munmap( data, map->len );
+        memset( map, 0, sizeof( *map ) );
+        errno = EINVAL;
+        return -1;
+    }
+
+    map->screen = map->data + sizeof( *hdr );
+    map->sb = map->screen + hdr->screen_bytes;
+    return 0;
+}
+
+static void snapshot_close( snapshot_map *map )
+{
+    if ( map->data )
+        munmap( ( void * )map->data, map->len );
+}
+
+// Next record of a section, or NULL if what's left of it isn't one.
+static const uint8_t *snapshot_next( const uint8_t **p, const uint8_t *end, size_t *len )
+{
+    const uint8_t *rec = *p;
+
+    *len = scrollback_record_size( rec, end - rec );
+    if ( !*len )
+        return NULL;
+
+    *p += *len;
+    return rec;
+}
+
+static void snapshot_getline( VTermScreen *screen, int row, int cols, VTermScreenCell *cells )
+{
+    VTermPos pos;
+
+    pos.row = row;
+    for ( pos.col = 0; pos.col < cols; pos.col++ )
+        vterm_screen_get_cell( screen, pos, &cells[ pos.col ] );
+}
+
+int snapshot_save( const char *filename, VTerm *vt, scrollback *sb, int cursor_visible )
+{
+    char tmpname[ PATH_MAX ];
+    snapshot_header hdr;
+    VTermScreen *screen = vterm_obtain_screen( vt );
+    VTermState *state = vterm_obtain_state( vt );
+    VTermColor palette[ SNAPSHOT_PALETTE ];
+    VTermPos cursor;
+    int rows, cols;
+
+    if ( snprintf( tmpname, sizeof( tmpname ), "%s.tmp", filename ) >= ( int )sizeof( tmpname ) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    vterm_get_size( vt, &rows, &cols );
+    vterm_state_get_cursorpos( state, &cursor );
+    for ( int i = 0; i < 16; i++ )
+        vterm_state_get_palette_color( state, i, &palette[ i ] );
+    vterm_state_get_default_colors( state, &palette[ 16 ], &palette[ 17 ] );
+
+    memset( &hdr, 0, sizeof( hdr ) );
+    memcpy( hdr.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN );
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.rows = ( uint16_t )rows;
+    hdr.cols = ( uint16_t )MIN( cols, UINT16_MAX );
+    hdr.cursor_row = ( uint16_t )cursor.row;
+    hdr.cursor_col = ( uint16_t )cursor.col;
+    hdr.flags = cursor_visible ? SNAPSHOT_CURSOR_VISIBLE : 0;
+    for ( int i = 0; i < SNAPSHOT_PALETTE; i++ )
+    {
+        hdr.palette[ i ][ 0 ] = palette[ i ].red;
+        hdr.palette[ i ][ 1 ] = palette[ i ].green;
+        hdr.palette[ i ][ 2 ] = palette[ i ].blue;
+    }
+
+    FILE *fp = fopen( tmpname, "wb" );
+    if ( !fp )
+        return -1;
+    setvbuf( fp, NULL, _IOFBF, 256 * 1024 );
+
+    uint8_t *line = ( uint8_t * )malloc( SCROLLBACK_LINE_MAX( hdr.cols ) );
+    VTermScreenCell *cells = ( VTermScreenCell * )malloc( hdr.cols * sizeof( *cells ) );
+    if ( !line || !cells )
+        FATAL_ERROR( malloc );
+
+    // The header goes in last, once the section sizes are known.
+    int ok = !fseek( fp, sizeof( hdr ), SEEK_SET );
+
+    for ( int row = 0; ok && ( row < rows ); row++ )
+    {
+        snapshot_getline( screen, row, hdr.cols, cells );
+
+        size_t len = scrollback_encode( line, hdr.cols, cells );
+
+        ok = ( fwrite( line, 1, len, fp ) == len );
+        hdr.screen_bytes += len;
+    }
+
+    if ( sb )
+    {
+        uint64_t pos = 0;
+        size_t len;
+        const uint8_t *rec;
+
+        while ( ok && ( rec = scrollback_next_raw( sb, &pos, &len ) ) )
+        {
+            ok = ( fwrite( rec, 1, len, fp ) == len );
+            hdr.sb_bytes += len;
+            hdr.sb_lines++;
+        }
+    }
+
+    ok = ok && !fseek( fp, 0, SEEK_SET ) && ( fwrite( &hdr, 1, sizeof( hdr ), fp ) == sizeof( hdr ) );
+
+    free( cells );
+    free( line );
+
+    // No fsync: this is for cvterm going away, not the machine.
+    int err = errno;
+    if ( fclose( fp ) || !ok || rename( tmpname, filename ) )
+    {
+        err = ok ? errno : err;
+        unlink( tmpname );
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int snapshot_color_equal( const VTermColor *a, const VTermColor *b )
+{
+    return ( a->red == b->red ) && ( a->green == b->green ) && ( a->blue == b->blue );
+}
+
+static int snapshot_style_equal( const VTermScreenCell *a, const VTermScreenCell *b )
+{
+    return ( a->attrs.bold == b->attrs.bold ) && ( a->attrs.underline == b->attrs.underline ) &&
+           ( a->attrs.italic == b->attrs.italic ) && ( a->attrs.blink == b->attrs.blink ) &&
+           ( a->attrs.reverse == b->attrs.reverse ) && ( a->attrs.strike == b->attrs.strike ) &&
+           ( a->attrs.font == b->attrs.font ) &&
+           snapshot_color_equal( &a->fg, &b->fg ) && snapshot_color_equal( &a->bg, &b->bg );
+}
+
+static char *snapshot_put_color( char *p, const char *end, int base, const VTermColor *color, const VTermColor *dflt )
+{
+    if ( snapshot_color_equal( color, dflt ) )
+        return p + snprintf( p, end - p, ";%d", base + 1 );
+    return p + snprintf( p, end - p, ";%d;2;%d;%d;%d", base, color->red, color->green, color->blue );
+}
+
+// SGR for the whole of cell's style, from a reset. The default colours are
+// sent as 39 / 49 so they stay the default if the palette changes.
+static void snapshot_put_style( termout *out, const VTermScreenCell *cell, const VTermColor *dflt )
+{
+    char params[ 128 ];
+    char *end = params + sizeof( params );
+    char *p = params;
+
+    *p++ = '0';
+    if ( cell->attrs.bold )
+        p += snprintf( p, end - p, ";1" );
+    if ( cell->attrs.underline )
+        p += snprintf( p, end - p, ( cell->attrs.underline == 2 ) ? ";21" : ";4" );
+    if ( cell->attrs.italic )
+        p += snprintf( p, end - p, ";3" );
+    if ( cell->attrs.blink )
+        p += snprintf( p, end - p, ";5" );
+    if ( cell->attrs.reverse )
+        p += snprintf( p, end - p, ";7" );
+    if ( cell->attrs.strike )
+        p += snprintf( p, end - p, ";9" );
+    if ( cell->attrs.font )
+        p += snprintf( p, end - p, ";%d", 10 + cell->attrs.font );
+    p = snapshot_put_color( p, end, 38, &cell->fg, &dflt[ 0 ] );
+    p = snapshot_put_color( p, end, 48, &cell->bg, &dflt[ 1 ] );
+
+    termout_sgr( out, params );
+}
+
+// Draw the first cols cells of a line. The screen was cleared with the
+// default style, so blanks in that style are skipped and other blanks are
+// erased with ECH, which leaves them empty rather than spaces.
+static void snapshot_put_line( termout *out, int row, const VTermScreenCell *cells, int cols,
+                               VTermScreenCell *pen, const VTermColor *dflt )
+{
+    VTermScreenCell blank;
+
+    memset( &blank, 0, sizeof( blank ) );
+    blank.fg = dflt[ 0 ];
+    blank.bg = dflt[ 1 ];
+
+    for ( int col = 0; col < cols; col++ )
+    {
+        const VTermScreenCell *cell = &cells[ col ];
+
+        // Right half of a wide character, or a wide character cut in half.
+        if ( ( cell->chars[ 0 ] == ( uint32_t )-1 ) || ( col + cell->width > cols ) )
+            continue;
+        if ( !cell->chars[ 0 ] && snapshot_style_equal( cell, &blank ) )
+            continue;
+
+        termout_move( out, row, col );
+        if ( !snapshot_style_equal( cell, pen ) )
+        {
+            snapshot_put_style( out, cell, dflt );
+            *pen = *cell;
+        }
+
+        if ( !cell->chars[ 0 ] )
+        {
+            char ech[ 16 ];
+            int count = 1;
+
+            while ( ( col + count < cols ) && !cells[ col + count ].chars[ 0 ] && snapshot_style_equal( &cells[ col + count ], cell ) )
+                count++;
+
+            termout_raw( out, ech, snprintf( ech, sizeof( ech ), "\x1b[%dX", count ) );
+            col += count - 1;
+            continue;
+        }
+
+        termout_cell( out, cell->chars, VTERM_MAX_CHARS_PER_CELL, cell->width );
+    }
+}
+
+int snapshot_restore( const char *filename, VTerm *vt, scrollback *sb )
+{
+    snapshot_map map;
+    VTermState *state = vterm_obtain_state( vt );
+    VTermColor palette[ SNAPSHOT_PALETTE ];
+    int rows, cols;
+
+    if ( snapshot_open( filename, &map ) )
+        return -1;
+
+    const snapshot_header *hdr = &map.hdr;
+    const uint8_t *p;
+    const uint8_t *end;
+    const uint8_t *rec;
+    size_t len;
+
+    // Scrollback first: it goes in oldest first, ahead of any screen lines
+    // that have to be pushed off the top.
+    if ( sb )
+    {
+        p = map.sb;
+        end = map.sb + hdr->sb_bytes;
+        for ( uint32_t i = 0; ( i < hdr->sb_lines ) && ( rec = snapshot_next( &p, end, &len ) ); i++ )
+            scrollback_push_raw( sb, rec, len );
+    }
+
+    for ( int i = 0; i < SNAPSHOT_PALETTE; i++ )
+    {
+        palette[ i ].red = hdr->palette[ i ][ 0 ];
+        palette[ i ].green = hdr->palette[ i ][ 1 ];
+        palette[ i ].blue = hdr->palette[ i ][ 2 ];
+    }
+    for ( int i = 0; i < 16; i++ )
+        vterm_state_set_palette_color( state, i, &palette[ i ] );
+    vterm_state_set_default_colors( state, &palette[ 16 ], &palette[ 17 ] );
+
+    vterm_get_size( vt, &rows, &cols );
+
+    // Drop lines off the top into sb only as far as it takes to keep the
+    // cursor on screen; the rest is clipped at the bottom.
+    int skip = MAX( 0, hdr->cursor_row + 1 - rows );
+    int ncols = MIN( cols, hdr->cols );
+    VTermScreenCell *cells = ( VTermScreenCell * )malloc( MAX( 1, cols ) * sizeof( *cells ) );
+    termout *out = termout_init( -1, 1 );
+    VTermScreenCell pen;
+
+    if ( !cells )
+        FATAL_ERROR( malloc );
+
+    memset( &pen, 0, sizeof( pen ) );
+    pen.fg = palette[ 16 ];
+    pen.bg = palette[ 17 ];
+
+    // Default style, cleared screen.
+    termout_raw( out, "\x1b[0m\x1b[H\x1b[2J", 11 );
+    termout_invalidate( out );
+
+    p = map.screen;
+    end = map.screen + hdr->screen_bytes;
+    for ( int row = 0; ( row < MIN( hdr->rows, skip + rows ) ) && ( rec = snapshot_next( &p, end, &len ) ); row++ )
+    {
+        if ( row < skip )
+        {
+            if ( sb )
+                scrollback_push_raw( sb, rec, len );
+            continue;
+        }
+
+        scrollback_decode( rec, ncols, cells );
+        snapshot_put_line( out, row - skip, cells, ncols, &pen, &palette[ 16 ] );
+    }
+
+    int cursor_row = MIN( hdr->cursor_row - skip, rows - 1 );
+    int cursor_col = MIN( hdr->cursor_col, cols - 1 );
+    termout_move( out, cursor_row, cursor_col );
+    termout_sgr( out, "0" );
+    if ( !( hdr->flags & SNAPSHOT_CURSOR_VISIBLE ) )
+        termout_raw( out, "\x1b[?25l", 6 );
+
+    const char *buf = termout_take( out, &len );
+    vterm_input_write( vt, buf, len );
+
+    clog_debug( CLOG( 0 ), "snapshot %s: %dx%d restored into %dx%d, %u scrollback lines, %zu bytes of escapes",
+                filename, hdr->cols, hdr->rows, cols, rows, hdr->sb_lines, len );
+
+    termout_free( out );
+    free( cells );
+    snapshot_close( &map );
+    return 0;
+}
+
+int snapshot_compare( const char *filename, VTerm *vt, int *row )
+{
+    snapshot_map map;
+    int rows, cols;
+
+    if ( snapshot_open( filename, &map ) )
+        return -1;
+
+    vterm_get_size( vt, &rows, &cols );
+
+    *row = 0;
+    if ( ( map.hdr.rows != rows ) || ( map.hdr.cols != cols ) )
+    {
+        snapshot_close( &map );
+        return 1;
+    }
+
+    // Same encoder on both sides, so equal screens give equal bytes.
+    VTermScreen *screen = vterm_obtain_screen( vt );
+    uint8_t *line = ( uint8_t * )malloc( SCROLLBACK_LINE_MAX( cols ) );
+    VTermScreenCell *cells = ( VTermScreenCell * )malloc( MAX( 1, cols ) * sizeof( *cells ) );
+    const uint8_t *p = map.screen;
+    const uint8_t *end = map.screen + map.hdr.screen_bytes;
+    int ret = 0;
+
+    if ( !line || !cells )
+        FATAL_ERROR( malloc );
+
+    for ( *row = 0; *row < rows; ( *row )++ )
+    {
+        size_t reclen;
+        const uint8_t *rec = snapshot_next( &p, end, &reclen );
+
+        snapshot_getline( screen, *row, cols, cells );
+
+        size_t len = scrollback_encode( line, cols, cells );
+
+        if ( !rec || ( len != reclen ) || memcmp( rec, line, len ) )
+        {
+            ret = 1;
+            break;
+        }
+    }
+
+    free( cells );
+    free( line );
+    snapshot_close( &map );
+    return ret;
+}
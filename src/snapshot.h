@@ -0,0 +1,61 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+// Screen snapshots: what a vterm shows (cells, cursor, palette) plus its
+// scrollback, in one file that restores in a single pass over a mmap of it.
+//
+// FILE holds a 104 byte header ("CVTSNAP\0", uint32 version, uint16 rows,
+// uint16 cols, uint16 cursor row, uint16 cursor col, uint32 flags, uint32
+// scrollback lines, uint32 reserved, uint64 screen bytes, uint64 scrollback
+// bytes, 18 rgb triples for the 16 ANSI colours and default fg / bg, 2 bytes
+// padding), rows screen lines, then the scrollback lines oldest first. Lines
+// are scrollback records (run-length encoded styles and UTF-8 text, see
+// scrollback.c). Header integers are host byte order.
+
+#define SNAPSHOT_VERSION 1
+
+// Save vt, and sb unless it's NULL. Written to FILE.tmp and renamed into
+// place, so an existing snapshot is never left half written. Returns 0, or
+// -1 with errno set.
+int snapshot_save( const char *filename, VTerm *vt, scrollback *sb, int cursor_visible );
+
+// Load a snapshot into vt, which should be freshly reset, by feeding it the
+// escape sequences that draw it. If vt is smaller, lines above the cursor
+// that don't fit go to sb after the saved scrollback (with sb NULL both are
+// dropped), and the rest is clipped. Returns -1 with errno set (EINVAL: not a
+// snapshot, or a version we don't know).
+int snapshot_restore( const char *filename, VTerm *vt, scrollback *sb );
+
+// Compare vt's screen with the one in a snapshot. Returns 0 if they match, 1
+// with *row set to the first line that doesn't (0 for a different size), or
+// -1 with errno set if the snapshot can't be read.
+int snapshot_compare( const char *filename, VTerm *vt, int *row );
+
+#endif // _SNAPSHOT_H_
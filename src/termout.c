@@ -0,0 +1,348 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "termout.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define TERMOUT_BUFFER_SIZE ( 64 * 1024 )
+
+// Longest cursor move or SGR (bold, underline, blink, reverse and two rgb
+// colours).
+#define TERMOUT_MAX_SEQ 64
+
+#define TERMOUT_STYLE_UNKNOWN ( ~0ULL )
+
+struct termout
+{
+    int fd;
+    int truecolor;
+
+    char *buf;
+    size_t len;
+    size_t size;
+
+    // Where the terminal's cursor is and what SGR is active (-1 / UNKNOWN:
+    // no idea, send it).
+    int row;
+    int col;
+    uint64_t style;
+
+    termout_stats stats;
+};
+
+termout *termout_init( int fd, int truecolor )
+{
+    termout *out = ( termout * )calloc( 1, sizeof( *out ) );
+
+    if ( !out )
+        FATAL_ERROR( calloc );
+
+    out->fd = fd;
+    out->truecolor = truecolor;
+    out->size = TERMOUT_BUFFER_SIZE;
+    out->buf = ( char * )malloc( out->size );
+    if ( !out->buf )
+        FATAL_ERROR( malloc );
+
+    termout_invalidate( out );
+    return out;
+}
+
+void termout_free( termout *out )
+{
+    if ( out )
+    {
+        free( out->buf );
+        free( out );
+    }
+}
+
+// Room for another len bytes.
+static char *termout_reserve( termout *out, size_t len )
+{
+    if ( out->len + len > out->size )
+    {
+        out->size = MAX( out->size * 2, out->len + len );
+        out->buf = ( char * )realloc( out->buf, out->size );
+        if ( !out->buf )
+            FATAL_ERROR( realloc );
+    }
+    return out->buf + out->len;
+}
+
+void termout_raw( termout *out, const char *buf, size_t len )
+{
+    memcpy( termout_reserve( out, len ), buf, len );
+    out->len += len;
+}
+
+void termout_invalidate( termout *out )
+{
+    out->row = -1;
+    out->col = -1;
+    out->style = TERMOUT_STYLE_UNKNOWN;
+}
+
+static char *put_uint( char *p, unsigned int val )
+{
+    char tmp[ 12 ];
+    int n = 0;
+
+    do
+    {
+        tmp[ n++ ] = '0' + ( val % 10 );
+        val /= 10;
+    } while ( val );
+
+    while ( n )
+        *p++ = tmp[ --n ];
+    return p;
+}
+
+static char *put_param( char *p, unsigned int val )
+{
+    *p++ = ';';
+    return put_uint( p, val );
+}
+
+void termout_move( termout *out, int row, int col )
+{
+    if ( ( row == out->row ) && ( col == out->col ) )
+        return;
+
+    char *start = termout_reserve( out, TERMOUT_MAX_SEQ );
+    char *p = start;
+
+    if ( row == out->row && col == 0 )
+    {
+        *p++ = '\r';
+    }
+    else
+    {
+        // CUP: ESC [ row ; col H, one based.
+        *p++ = '\x1b';
+        *p++ = '[';
+        p = put_uint( p, row + 1 );
+        p = put_param( p, col + 1 );
+        *p++ = 'H';
+    }
+
+    out->len += p - start;
+    out->row = row;
+    out->col = col;
+}
+
+// Nearest entry in the xterm 256 colour cube or grey ramp.
+static int rgb_to_xterm256( uint32_t rgb )
+{
+    int r = ( rgb >> 16 ) & 0xff;
+    int g = ( rgb >> 8 ) & 0xff;
+    int b = rgb & 0xff;
+
+    if ( ( r == g ) && ( g == b ) )
+    {
+        if ( r < 4 )
+            return 16;
+        if ( r > 246 )
+            return 231;
+        return 232 + MIN( 23, ( r - 3 ) / 10 );
+    }
+
+#define CUBE( _v ) ( ( _v ) < 48 ? 0 : ( ( _v ) < 115 ? 1 : ( ( _v ) - 35 ) / 40 ) )
+    return 16 + 36 * CUBE( r ) + 6 * CUBE( g ) + CUBE( b );
+#undef CUBE
+}
+
+static char *put_color( char *p, const termout *out, int base, uint32_t rgb )
+{
+    // 38 / 48: fg / bg.
+    p = put_param( p, base );
+
+    if ( out->truecolor )
+    {
+        p = put_param( p, 2 );
+        p = put_param( p, ( rgb >> 16 ) & 0xff );
+        p = put_param( p, ( rgb >> 8 ) & 0xff );
+        p = put_param( p, rgb & 0xff );
+    }
+    else
+    {
+        p = put_param( p, 5 );
+        p = put_param( p, rgb_to_xterm256( rgb ) );
+    }
+    return p;
+}
+
+void termout_style( termout *out, uint64_t style )
+{
+    if ( style == out->style )
+        return;
+
+    char *start = termout_reserve( out, TERMOUT_MAX_SEQ );
+    char *p = start;
+
+    // Always from a reset: turning single attributes off isn't worth it.
+    memcpy( p, "\x1b[0", 3 );
+    p += 3;
+
+    int attrs = ( style >> 48 ) & 0xff;
+
+    if ( attrs & TERMOUT_ATTR_BOLD )
+        p = put_param( p, 1 );
+    if ( attrs & TERMOUT_ATTR_UNDERLINE )
+        p = put_param( p, 4 );
+    if ( attrs & TERMOUT_ATTR_BLINK )
+        p = put_param( p, 5 );
+    if ( attrs & TERMOUT_ATTR_REVERSE )
+        p = put_param( p, 7 );
+
+    if ( !( style & TERMOUT_STYLE_DEFAULT_COLORS ) )
+    {
+        p = put_color( p, out, 38, style & 0xffffff );
+        p = put_color( p, out, 48, ( style >> 24 ) & 0xffffff );
+    }
+    *p++ = 'm';
+
+    out->len += p - start;
+    out->style = style;
+}
+
+void termout_sgr( termout *out, const char *params )
+{
+    termout_raw( out, "\x1b[", 2 );
+    termout_raw( out, params, strlen( params ) );
+    termout_raw( out, "m", 1 );
+    out->style = TERMOUT_STYLE_UNKNOWN;
+}
+
+static char *put_utf8( char *p, uint32_t c )
+{
+    if ( c < 0x80 )
+    {
+        *p++ = c;
+    }
+    else if ( c < 0x800 )
+    {
+        *p++ = 0xc0 | ( c >> 6 );
+        *p++ = 0x80 | ( c & 0x3f );
+    }
+    else if ( c < 0x10000 )
+    {
+        *p++ = 0xe0 | ( c >> 12 );
+        *p++ = 0x80 | ( ( c >> 6 ) & 0x3f );
+        *p++ = 0x80 | ( c & 0x3f );
+    }
+    else
+    {
+        *p++ = 0xf0 | ( ( c >> 18 ) & 0x07 );
+        *p++ = 0x80 | ( ( c >> 12 ) & 0x3f );
+        *p++ = 0x80 | ( ( c >> 6 ) & 0x3f );
+        *p++ = 0x80 | ( c & 0x3f );
+    }
+    return p;
+}
+
+void termout_cell( termout *out, const uint32_t *chars, int count, int width )
+{
+    int i;
+    char *start = termout_reserve( out, count * 4 + 1 );
+    char *p = start;
+
+    if ( !count || !chars[ 0 ] )
+        *p++ = ' ';
+
+    for ( i = 0; ( i < count ) && chars[ i ]; i++ )
+        p = put_utf8( p, chars[ i ] );
+
+    out->len += p - start;
+    out->col += width;
+}
+
+int termout_flush( termout *out )
+{
+    size_t offset = 0;
+
+    // No fd: it stays queued for termout_take.
+    if ( !out->len || ( out->fd < 0 ) )
+        return 0;
+
+    out->stats.flushes++;
+    while ( offset < out->len )
+    {
+        ssize_t ret = TEMP_FAILURE_RETRY( write( out->fd, out->buf + offset, out->len - offset ) );
+
+        if ( ret < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                struct pollfd pfd = { out->fd, POLLOUT, 0 };
+
+                TEMP_FAILURE_RETRY( poll( &pfd, 1, -1 ) );
+                continue;
+            }
+
+            clog_error( CLOG( 0 ), "terminal write failed: %d", errno );
+            out->len = 0;
+            return -1;
+        }
+
+        offset += ret;
+        out->stats.bytes += ret;
+        out->stats.writes++;
+    }
+
+    out->len = 0;
+    return 0;
+}
+
+const char *termout_take( termout *out, size_t *len )
+{
+    *len = out->len;
+    if ( out->len )
+    {
+        out->stats.bytes += out->len;
+        out->stats.flushes++;
+    }
+
+    out->len = 0;
+    return out->buf;
+}
+
+void termout_getstats( termout *out, termout_stats *stats )
+{
+    *stats = out->stats;
+}
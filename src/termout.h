@@ -0,0 +1,86 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _TERMOUT_H_
+#define _TERMOUT_H_
+
+// Escape sequence output buffer for drawing straight to a terminal. Tracks
+// the cursor and the current SGR state so only what changed is sent, and
+// everything queued goes out in one write() on termout_flush.
+
+#define TERMOUT_ATTR_BOLD 0x01
+#define TERMOUT_ATTR_UNDERLINE 0x02
+#define TERMOUT_ATTR_BLINK 0x04
+#define TERMOUT_ATTR_REVERSE 0x08
+
+// Style is fg rgb | bg rgb << 24 | TERMOUT_ATTR_* << 48, or
+// TERMOUT_STYLE_DEFAULT_COLORS | TERMOUT_ATTR_* << 48 for the terminal's own
+// colours.
+#define TERMOUT_STYLE_DEFAULT_COLORS ( 1ULL << 62 )
+#define TERMOUT_STYLE( _fg, _bg, _attrs ) \
+    ( ( uint64_t )( _fg ) | ( ( uint64_t )( _bg ) << 24 ) | ( ( uint64_t )( _attrs ) << 48 ) )
+
+typedef struct termout termout;
+
+typedef struct termout_stats
+{
+    uint64_t bytes;  // Bytes written
+    uint64_t writes; // write() calls
+    uint64_t flushes;
+} termout_stats;
+
+// truecolor: send 38;2 / 48;2 colours, else the nearest xterm 256 colour.
+// fd -1: nothing is written, collect the output with termout_take.
+termout *termout_init( int fd, int truecolor );
+void termout_free( termout *out );
+
+// Append bytes as is. The cursor and style are assumed unchanged.
+void termout_raw( termout *out, const char *buf, size_t len );
+
+// Forget what we think the cursor and style are (after a clear or a reset).
+void termout_invalidate( termout *out );
+
+// Zero based screen position.
+void termout_move( termout *out, int row, int col );
+void termout_style( termout *out, uint64_t style );
+
+// Send ESC [ params m as is, for styles a uint64_t can't say.
+void termout_sgr( termout *out, const char *params );
+
+// One cell: up to count codepoints (a base character plus combining ones,
+// 0 terminates early, 0 as the first is a blank) taking width columns.
+void termout_cell( termout *out, const uint32_t *chars, int count, int width );
+
+// write() everything queued. Returns -1 if the fd failed.
+int termout_flush( termout *out );
+
+// Everything queued, which is then forgotten. Good until the next append.
+const char *termout_take( termout *out, size_t *len );
+
+void termout_getstats( termout *out, termout_stats *stats );
+
+#endif // _TERMOUT_H_
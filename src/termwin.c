@@ -28,6 +28,15 @@
 #define _GNU_SOURCE
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/ioctl.h>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
 
 #if defined( __APPLE__ )
 #include <ncurses.h>
@@ -36,7 +45,10 @@
 #endif
 
 #include "vterm.h"
+#include "metrics.h"
+#include "termout.h"
 #include "termwin.h"
+#include "arena.h"
 #include "clog.h"
 #include "cvterm_utils.h"
 
@@ -68,28 +80,268 @@
 
 #define MAX_ANSI_COLORS 256
 
+// Direct-mapped cache from exact 24-bit rgb to nearest palette index.
+#define COLOR_CACHE_BITS 12
+#define COLOR_CACHE_SIZE ( 1 << COLOR_CACHE_BITS )
+#define COLOR_CACHE_VALID 0x1000000
+
+// Colour pairs are allocated on first use. Once COLOR_PAIRS (or SHRT_MAX,
+// init_pair takes a short) is used up, the least recently used pair is
+// re-initialised and whatever was drawn with it gets repainted.
+#define PAIRMAP_INITIAL_SIZE 256
+#define PAIRMAP_EMPTY 0xffffffff
+
+typedef struct termwin_pair
+{
+    uint16_t key;  // ( fgid << 8 ) | bgid
+    uint16_t prev; // LRU list links, pair 0 is the list head.
+    uint16_t next;
+    uint16_t pinned;
+} termwin_pair;
+
+// Direct-mapped cache from a cell's packed style to what ncurses needs.
+#define STYLE_CACHE_BITS 8
+#define STYLE_CACHE_SIZE ( 1 << STYLE_CACHE_BITS )
+#define STYLE_KEY_VALID ( 1ULL << 63 )
+
+typedef struct termwin_style
+{
+    uint64_t key; // fg rgb | bg rgb << 24 | SHADOW_ATTR_* << 48 | STYLE_KEY_VALID
+    attr_t attr;
+    int pairid;
+} termwin_style;
+
+// Palette padding entries: far enough away to never win, close enough
+// that the squared distance can't overflow an int32.
+#define PALETTE_PAD_VALUE 0x4000
+
+// Damage is kept as a short sorted list of disjoint column spans per row.
+// Spans closer than TERMWIN_SPAN_MERGE_GAP cells are merged (a wmove costs
+// about as much as drawing a few cells), and once a row has more than
+// TERMWIN_MAX_ROW_SPANS spans the two closest ones are merged.
+#define TERMWIN_MAX_ROW_SPANS 4
+#define TERMWIN_SPAN_MERGE_GAP 4
+
+typedef struct termwin_span
+{
+    int start_col;
+    int end_col;
+} termwin_span;
+
+typedef struct termwin_rowdamage
+{
+    int count;
+    termwin_span spans[ TERMWIN_MAX_ROW_SPANS ];
+} termwin_rowdamage;
+
+// Shadow copy of what we last handed ncurses for each cell. Damaged cells
+// that match it are not sent again. The attribute bits are the same as
+// TERMOUT_ATTR_* so style keys can go straight to termout_style.
+#define SHADOW_ATTR_BOLD TERMOUT_ATTR_BOLD
+#define SHADOW_ATTR_UNDERLINE TERMOUT_ATTR_UNDERLINE
+#define SHADOW_ATTR_BLINK TERMOUT_ATTR_BLINK
+#define SHADOW_ATTR_REVERSE TERMOUT_ATTR_REVERSE
+
+#define SHADOW_FLAG_COMBINING 0x01 // More than one codepoint: always redrawn.
+#define SHADOW_FLAG_WIDE 0x02
+
+#define SHADOW_CH_WIDE_RIGHT 0xfffffffe // Right half of a wide character.
+
+typedef struct termwin_shadowcell
+{
+    uint32_t ch;
+    uint8_t attrs;
+    uint8_t flags;
+    int16_t pairid; // -1: unknown, cell must be drawn.
+} termwin_shadowcell;
+
+// Our window sits this many cells in from the top left of the screen, and
+// as far in from the bottom right.
+#define TERMWIN_WIN_ORIGIN 5
+
+// Room for termwin_setstatus text, in bytes.
+#define TERMWIN_STATUS_MAX 256
+
 struct termwin
 {
     VTerm *vt;
     WINDOW *win;
     int numcolors;
-    VTermRect damage_rect;
-    int pairid_count;
-    short pair_table[ MAX_ANSI_COLORS * MAX_ANSI_COLORS ];
+
+    // Headless: ncurses renders into /dev/null.
+    SCREEN *screen;
+    FILE *null_out;
+    FILE *null_in;
+
+    // Direct backend (out != NULL): escape sequences go straight to the
+    // terminal and ncurses isn't used at all. win is NULL and the window
+    // geometry and cursor are kept here instead.
+    termout *out;
+    int out_fd;
+    int win_lines;
+    int win_cols;
+    int cursor_row;
+    int cursor_col;
+    int cursor_visible;
+    int cursor_dirty;
+    int restore_termios;
+    struct termios saved_termios;
+
+    // Full style key per cell for the direct backend, next to the shadow
+    // (whose pairid is always 0 there).
+    uint64_t *shadow_style;
+
+    // Damaged cells, in vterm coordinates. Rows [damage_top, damage_bottom) may be dirty.
+    int rows;
+    int cols;
+    int damage_top;
+    int damage_bottom;
+    termwin_rowdamage *damage;
+    int border_dirty;
+
+    // rows * cols shadow cells.
+    termwin_shadowcell *shadow;
+
+    // Scratch row for termwin_drawspan: cchars and the column each one starts at.
+    cchar_t *rowbuf;
+    int *rowcols;
+
+    termwin_stats stats;
+
+    // pairs[ 1, pairs_count ) are allocated, up to pairs_max.
+    int pairs_count;
+    int pairs_max;
+    int pairs_size;
+    termwin_pair *pairs;
+
+    // Open addressed ( key << 16 | pairid ) hash, key -> pairid.
+    int pairmap_size;
+    int pairmap_count;
+    uint32_t *pairmap;
     VTermColor ansi_colors[ MAX_ANSI_COLORS ];
-    uint16_t vterm_color_hash[ 32768 ]; // 2^(5+5+5)
+
+    // Colours whose init_color hasn't been sent yet, and what to send. That
+    // happens when a pair first needs them rather than all up front.
+    uint32_t colors_pending[ MAX_ANSI_COLORS / 32 ];
+    short color_rgb[ MAX_ANSI_COLORS ][ 3 ];
+
+    // Palette as int16 pairs for the nearest colour search: (red, green) and
+    // (blue, 0) per entry, padded to a multiple of 4 entries.
+    int numcolors_padded;
+    int16_t palette_rg[ MAX_ANSI_COLORS * 2 ];
+    int16_t palette_b[ MAX_ANSI_COLORS * 2 ];
+
+    uint32_t color_cache_key[ COLOR_CACHE_SIZE ];
+    uint8_t color_cache_id[ COLOR_CACHE_SIZE ];
+
+    termwin_style style_cache[ STYLE_CACHE_SIZE ];
+
+    // termwin_setview: view_rows x view_cols cells drawn instead of the
+    // vterm's, NULL for none. Points at view_buf, which only ever grows so
+    // paging through scrollback doesn't go back to the heap.
+    VTermScreenCell *view;
+    int view_rows;
+    int view_cols;
+    VTermScreenCell *view_buf;
+    size_t view_size;
+
+    char status[ TERMWIN_STATUS_MAX ]; // Shown in the bottom border
 };
 
-termwin *termwin_init( const char *nc_term )
+static void termwin_shadow_invalidate( termwin *twin, int start_row, int end_row )
+{
+    memset( &twin->shadow[ start_row * twin->cols ], 0xff,
+            ( end_row - start_row ) * twin->cols * sizeof( twin->shadow[ 0 ] ) );
+}
+
+// Window size, border included.
+static int termwin_win_lines( termwin *twin )
+{
+    return twin->out ? twin->win_lines : getmaxy( twin->win );
+}
+
+static int termwin_win_cols( termwin *twin )
+{
+    return twin->out ? twin->win_cols : getmaxx( twin->win );
+}
+
+// Size damage array to the window interior and mark everything dirty.
+static void termwin_damage_alloc( termwin *twin )
+{
+    int row;
+
+    twin->rows = MAX( 1, termwin_win_lines( twin ) - 2 );
+    twin->cols = MAX( 1, termwin_win_cols( twin ) - 2 );
+    twin->damage = ( termwin_rowdamage * )realloc( twin->damage, twin->rows * sizeof( twin->damage[ 0 ] ) );
+    if ( !twin->damage )
+        FATAL_ERROR( realloc );
+    twin->rowbuf = ( cchar_t * )realloc( twin->rowbuf, twin->cols * sizeof( twin->rowbuf[ 0 ] ) );
+    if ( !twin->rowbuf )
+        FATAL_ERROR( realloc );
+    twin->rowcols = ( int * )realloc( twin->rowcols, twin->cols * sizeof( twin->rowcols[ 0 ] ) );
+    if ( !twin->rowcols )
+        FATAL_ERROR( realloc );
+    twin->shadow = ( termwin_shadowcell * )realloc( twin->shadow, twin->rows * twin->cols * sizeof( twin->shadow[ 0 ] ) );
+    if ( !twin->shadow )
+        FATAL_ERROR( realloc );
+    termwin_shadow_invalidate( twin, 0, twin->rows );
+    if ( twin->out )
+    {
+        twin->shadow_style = ( uint64_t * )realloc( twin->shadow_style, twin->rows * twin->cols * sizeof( twin->shadow_style[ 0 ] ) );
+        if ( !twin->shadow_style )
+            FATAL_ERROR( realloc );
+    }
+
+    for ( row = 0; row < twin->rows; row++ )
+    {
+        twin->damage[ row ].count = 1;
+        twin->damage[ row ].spans[ 0 ].start_col = 0;
+        twin->damage[ row ].spans[ 0 ].end_col = twin->cols;
+    }
+
+    twin->damage_top = 0;
+    twin->damage_bottom = twin->rows;
+    twin->border_dirty = 1;
+}
+
+static termwin *termwin_create( const char *nc_term, int rows, int cols )
 {
     int ret;
     int maxx, maxy;
     WINDOW *win = NULL;
+    SCREEN *screen = NULL;
+    FILE *null_out = NULL;
+    FILE *null_in = NULL;
 
     if ( nc_term && setenv( "TERM", nc_term, 1 ) )
         FATAL_ERROR( setenv );
 
-    initscr();
+    if ( rows > 0 )
+    {
+        char buf[ 32 ];
+
+        // Without a tty ncurses takes its size from LINES and COLUMNS. Add
+        // room for the margins and border around our window.
+        snprintf( buf, sizeof( buf ), "%d", rows + 12 );
+        if ( setenv( "LINES", buf, 1 ) )
+            FATAL_ERROR( setenv );
+        snprintf( buf, sizeof( buf ), "%d", cols + 12 );
+        if ( setenv( "COLUMNS", buf, 1 ) )
+            FATAL_ERROR( setenv );
+
+        null_out = fopen( "/dev/null", "w" );
+        null_in = fopen( "/dev/null", "r" );
+        if ( !null_out || !null_in )
+            FATAL_ERROR( fopen );
+
+        screen = newterm( nc_term, null_out, null_in );
+        if ( !screen )
+            FATAL_ERROR( newterm );
+    }
+    else
+    {
+        initscr();
+    }
 
     if ( !has_colors() )
     {
@@ -100,59 +352,207 @@ termwin *termwin_init( const char *nc_term )
     NCURSES_CHECK( ret, start_color );
     NCURSES_CHECK( ret, use_default_colors );
 
-    NCURSES_CHECK( ret, raw );
+    // raw() fails when there's no tty behind us.
+    if ( !screen )
+        NCURSES_CHECK( ret, raw );
     NCURSES_CHECK( ret, noecho );
     NCURSES_CHECK( ret, nonl );
 
     maxy = getmaxy( stdscr );
     maxx = getmaxx( stdscr );
-    win = newwin( maxy - 10, maxx - 10, 5, 5 );
+    win = newwin( maxy - 2 * TERMWIN_WIN_ORIGIN, maxx - 2 * TERMWIN_WIN_ORIGIN, TERMWIN_WIN_ORIGIN, TERMWIN_WIN_ORIGIN );
 
     NCURSES_CHECK( ret, nodelay, stdscr, true );
     NCURSES_CHECK( ret, keypad, stdscr, false );
     NCURSES_CHECK( ret, nodelay, win, true );
     NCURSES_CHECK( ret, keypad, win, false );
 
-    termwin *twin = ( termwin * )malloc( sizeof( *twin ) );
+    // cvterm reads stdin itself, don't let pending input cut refreshes short.
+    NCURSES_CHECK( ret, typeahead, -1 );
+
+    termwin *twin = ( termwin * )calloc( 1, sizeof( *twin ) );
+    if ( !twin )
+        FATAL_ERROR( calloc );
     twin->win = win;
     twin->vt = NULL;
     twin->numcolors = 0;
-
-    memset( &twin->damage_rect, 0, sizeof( twin->damage_rect ) );
+    twin->screen = screen;
+    twin->null_out = null_out;
+    twin->null_in = null_in;
+
+    twin->damage = NULL;
+    twin->rowbuf = NULL;
+    twin->rowcols = NULL;
+    twin->shadow = NULL;
+    twin->rows = 0;
+    twin->cols = 0;
+    termwin_damage_alloc( twin );
+
+    memset( &twin->stats, 0, sizeof( twin->stats ) );
     memset( twin->ansi_colors, 0, sizeof( twin->ansi_colors ) );
-    memset( twin->pair_table, 0xff, sizeof( twin->pair_table ) );
-    memset( twin->vterm_color_hash, 0xff, sizeof( twin->vterm_color_hash ) );
+    memset( twin->color_cache_key, 0, sizeof( twin->color_cache_key ) );
+    memset( twin->style_cache, 0, sizeof( twin->style_cache ) );
+    twin->numcolors_padded = 0;
 
     // First pairid is set by ncurses.
-    twin->pairid_count = 1;
-    twin->pair_table[ 0 ] = 0;
+    twin->pairs_count = 1;
+    twin->pairs_max = 1;
+    twin->pairs_size = 0;
+    twin->pairs = NULL;
+    twin->pairmap_size = 0;
+    twin->pairmap_count = 0;
+    twin->pairmap = NULL;
+
+    return twin;
+}
+
+termwin *termwin_init( const char *nc_term )
+{
+    return termwin_create( nc_term, 0, 0 );
+}
+
+termwin *termwin_init_headless( const char *nc_term, int rows, int cols )
+{
+    return termwin_create( nc_term, rows, cols );
+}
+
+static void termwin_direct_setsize( termwin *twin, int lines, int columns )
+{
+    twin->win_lines = MAX( 4, lines - 2 * TERMWIN_WIN_ORIGIN );
+    twin->win_cols = MAX( 4, columns - 2 * TERMWIN_WIN_ORIGIN );
+}
 
+static termwin *termwin_create_direct( int fd, int lines, int columns, int truecolor, int tty )
+{
+    termwin *twin = ( termwin * )calloc( 1, sizeof( *twin ) );
+
+    if ( !twin )
+        FATAL_ERROR( calloc );
+
+    if ( tty )
+    {
+        struct termios raw;
+
+        // What ncurses' raw() and noecho() would do.
+        if ( tcgetattr( STDIN_FILENO, &twin->saved_termios ) )
+            FATAL_ERROR( tcgetattr );
+        raw = twin->saved_termios;
+        cfmakeraw( &raw );
+        if ( tcsetattr( STDIN_FILENO, TCSANOW, &raw ) )
+            FATAL_ERROR( tcsetattr );
+        twin->restore_termios = 1;
+    }
+
+    twin->out = termout_init( fd, truecolor );
+    twin->out_fd = fd;
+    twin->cursor_visible = 1;
+    termwin_direct_setsize( twin, lines, columns );
+
+    // Alternate screen, cleared.
+    static const char s_enter[] = "\x1b[?1049h\x1b[0m\x1b[H\x1b[2J";
+    termout_raw( twin->out, s_enter, sizeof( s_enter ) - 1 );
+
+    termwin_damage_alloc( twin );
+
+    clog_info( CLOG( 0 ), "direct renderer: %dx%d %s", columns, lines, truecolor ? "truecolor" : "256 colors" );
     return twin;
 }
 
+termwin *termwin_init_direct( int truecolor )
+{
+    struct winsize ws;
+
+    if ( ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws ) )
+        FATAL_ERROR( ioctl( TIOCGWINSZ ) );
+
+    return termwin_create_direct( STDOUT_FILENO, ws.ws_row, ws.ws_col, truecolor, 1 );
+}
+
+termwin *termwin_init_direct_headless( int rows, int cols, int truecolor )
+{
+    int fd = open( "/dev/null", O_WRONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+        FATAL_ERROR( open );
+
+    // Same margins and border as the ncurses version.
+    return termwin_create_direct( fd, rows + 2 * TERMWIN_WIN_ORIGIN + 2, cols + 2 * TERMWIN_WIN_ORIGIN + 2, truecolor, 0 );
+}
+
+termwin *termwin_init_direct_remote( int lines, int columns, int truecolor )
+{
+    return termwin_create_direct( -1, lines, columns, truecolor, 0 );
+}
+
+const char *termwin_take_output( termwin *twin, size_t *len )
+{
+    if ( !twin->out )
+    {
+        *len = 0;
+        return NULL;
+    }
+    return termout_take( twin->out, len );
+}
+
+static void termwin_free_direct( termwin *twin )
+{
+    static const char s_leave[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+
+    termout_raw( twin->out, s_leave, sizeof( s_leave ) - 1 );
+    termout_flush( twin->out );
+    termout_free( twin->out );
+    twin->out = NULL;
+
+    if ( twin->restore_termios )
+        tcsetattr( STDIN_FILENO, TCSANOW, &twin->saved_termios );
+    else if ( twin->out_fd >= 0 )
+        close( twin->out_fd );
+}
+
 void termwin_free( termwin *twin )
 {
     if ( twin )
     {
         int ret;
 
-        NCURSES_CHECK( ret, delwin, twin->win );
-        twin->win = NULL;
         twin->vt = NULL;
 
-        NCURSES_CHECK( ret, endwin );
+        if ( twin->out )
+        {
+            termwin_free_direct( twin );
+        }
+        else
+        {
+            NCURSES_CHECK( ret, delwin, twin->win );
+            twin->win = NULL;
 
+            if ( twin->screen )
+            {
+                // endwin() has no tty modes to restore and returns ERR.
+                endwin();
+                delscreen( twin->screen );
+                fclose( twin->null_out );
+                fclose( twin->null_in );
+            }
+            else
+            {
+                NCURSES_CHECK( ret, endwin );
+            }
+        }
+
+        free( twin->shadow_style );
+        free( twin->damage );
+        free( twin->rowbuf );
+        free( twin->rowcols );
+        free( twin->shadow );
+        free( twin->pairs );
+        free( twin->pairmap );
+        free( twin->view_buf );
         free( twin );
     }
 }
 
-static int vterm_color_equal( const VTermColor *a, const VTermColor *b )
-{
-    return ( a->red == b->red ) &&
-           ( a->green == b->green ) &&
-           ( a->blue == b->blue );
-}
-
+#if !defined( __SSE2__ )
 static int vterm_color_distance( const VTermColor *a, const VTermColor *b )
 {
     int red = a->red - b->red;
@@ -161,212 +561,831 @@ static int vterm_color_distance( const VTermColor *a, const VTermColor *b )
 
     return red * red + green * green + blue * blue;
 }
+#endif
 
-// Get index into vterm_color_hash array.
-static int vterm_color_hashid( VTermColor *color )
+// Index of the palette entry closest to color (the first one wins ties).
+static int palette_nearest( const termwin *twin, const VTermColor *color )
 {
-    // We're using the high five bits for each color channel.
-    int hashid = ( ( color->red >> 3 ) << 10 ) |
-                 ( ( color->green >> 3 ) << 5 ) |
-                 ( color->blue >> 3 );
+    int i;
+    int idx = 0;
+
+#if defined( __SSE2__ )
+    // Four palette entries per iteration: madd squares and sums the
+    // (red, green) pairs, then the (blue, 0) pairs.
+    int32_t lane_d[ 4 ];
+    int32_t lane_idx[ 4 ];
+    const __m128i rg = _mm_set1_epi32( color->red | ( color->green << 16 ) );
+    const __m128i b = _mm_set1_epi32( color->blue );
+    const __m128i four = _mm_set1_epi32( 4 );
+    __m128i best_d = _mm_set1_epi32( INT_MAX );
+    __m128i best_idx = _mm_setzero_si128();
+    __m128i cur_idx = _mm_setr_epi32( 0, 1, 2, 3 );
+
+    for ( i = 0; i < twin->numcolors_padded; i += 4 )
+    {
+        __m128i drg = _mm_sub_epi16( _mm_loadu_si128( ( const __m128i * )&twin->palette_rg[ i * 2 ] ), rg );
+        __m128i db = _mm_sub_epi16( _mm_loadu_si128( ( const __m128i * )&twin->palette_b[ i * 2 ] ), b );
+        __m128i d = _mm_add_epi32( _mm_madd_epi16( drg, drg ), _mm_madd_epi16( db, db ) );
+        __m128i lt = _mm_cmplt_epi32( d, best_d );
+
+        best_d = _mm_or_si128( _mm_and_si128( lt, d ), _mm_andnot_si128( lt, best_d ) );
+        best_idx = _mm_or_si128( _mm_and_si128( lt, cur_idx ), _mm_andnot_si128( lt, best_idx ) );
+        cur_idx = _mm_add_epi32( cur_idx, four );
+    }
 
-    return hashid & 0x7fff;
+    _mm_storeu_si128( ( __m128i * )lane_d, best_d );
+    _mm_storeu_si128( ( __m128i * )lane_idx, best_idx );
+
+    for ( i = 1; i < 4; i++ )
+    {
+        if ( ( lane_d[ i ] < lane_d[ idx ] ) ||
+             ( ( lane_d[ i ] == lane_d[ idx ] ) && ( lane_idx[ i ] < lane_idx[ idx ] ) ) )
+        {
+            idx = i;
+        }
+    }
+    idx = lane_idx[ idx ];
+#else
+    int distance = INT_MAX;
+
+    for ( i = 0; i < twin->numcolors; i++ )
+    {
+        int d = vterm_color_distance( &twin->ansi_colors[ i ], color );
+
+        if ( d < distance )
+        {
+            distance = d;
+            idx = i;
+        }
+    }
+#endif
+
+    return idx;
 }
 
-static int get_ncurses_colorid( termwin *twin, VTermColor *color )
+static int get_ncurses_colorid( termwin *twin, const VTermColor *color )
 {
-    int hashid = vterm_color_hashid( color );
+    uint32_t rgb = ( color->red << 16 ) | ( color->green << 8 ) | color->blue;
+    uint32_t hashid = ( rgb * 2654435761U ) >> ( 32 - COLOR_CACHE_BITS );
 
-    if ( twin->vterm_color_hash[ hashid ] == 0xffff )
+    if ( twin->color_cache_key[ hashid ] != ( rgb | COLOR_CACHE_VALID ) )
     {
-        int i;
-        int idx = 0;
-        int distance = INT_MAX;
+        twin->color_cache_key[ hashid ] = rgb | COLOR_CACHE_VALID;
+        twin->color_cache_id[ hashid ] = palette_nearest( twin, color );
+        twin->stats.color_cache_misses++;
+    }
 
-        for ( i = 0; i < twin->numcolors; i++ )
+    return twin->color_cache_id[ hashid ];
+}
+
+static uint32_t pairmap_slot( termwin *twin, uint16_t key )
+{
+    return ( ( key * 40503U ) & 0xffff ) & ( twin->pairmap_size - 1 );
+}
+
+static int pairmap_find( termwin *twin, uint16_t key )
+{
+    uint32_t i;
+
+    if ( !twin->pairmap_size )
+        return -1;
+
+    for ( i = pairmap_slot( twin, key ); twin->pairmap[ i ] != PAIRMAP_EMPTY; i = ( i + 1 ) & ( twin->pairmap_size - 1 ) )
+    {
+        if ( ( twin->pairmap[ i ] >> 16 ) == key )
+            return twin->pairmap[ i ] & 0xffff;
+    }
+    return -1;
+}
+
+static void pairmap_insert( termwin *twin, uint16_t key, int pairid )
+{
+    uint32_t i;
+
+    if ( ( twin->pairmap_count + 1 ) * 2 > twin->pairmap_size )
+    {
+        int j;
+        int oldsize = twin->pairmap_size;
+        uint32_t *oldmap = twin->pairmap;
+
+        twin->pairmap_size = oldsize ? ( oldsize * 2 ) : PAIRMAP_INITIAL_SIZE;
+        twin->pairmap = ( uint32_t * )malloc( twin->pairmap_size * sizeof( twin->pairmap[ 0 ] ) );
+        if ( !twin->pairmap )
+            FATAL_ERROR( malloc );
+        memset( twin->pairmap, 0xff, twin->pairmap_size * sizeof( twin->pairmap[ 0 ] ) );
+        twin->pairmap_count = 0;
+
+        for ( j = 0; j < oldsize; j++ )
         {
-            if ( vterm_color_equal( &twin->ansi_colors[ i ], color ) )
-            {
-                idx = i;
-                break;
-            }
+            if ( oldmap[ j ] != PAIRMAP_EMPTY )
+                pairmap_insert( twin, oldmap[ j ] >> 16, oldmap[ j ] & 0xffff );
+        }
+        free( oldmap );
+    }
+
+    for ( i = pairmap_slot( twin, key ); twin->pairmap[ i ] != PAIRMAP_EMPTY; i = ( i + 1 ) & ( twin->pairmap_size - 1 ) )
+        ;
+    twin->pairmap[ i ] = ( ( uint32_t )key << 16 ) | pairid;
+    twin->pairmap_count++;
+}
+
+static void pairmap_remove( termwin *twin, uint16_t key )
+{
+    uint32_t mask = twin->pairmap_size - 1;
+    uint32_t i = pairmap_slot( twin, key );
+    uint32_t j;
+
+    while ( ( twin->pairmap[ i ] >> 16 ) != key )
+    {
+        if ( twin->pairmap[ i ] == PAIRMAP_EMPTY )
+            return;
+        i = ( i + 1 ) & mask;
+    }
+
+    // Backward shift deletion: pull later entries of the probe run into the hole.
+    for ( j = ( i + 1 ) & mask; twin->pairmap[ j ] != PAIRMAP_EMPTY; j = ( j + 1 ) & mask )
+    {
+        uint32_t home = pairmap_slot( twin, twin->pairmap[ j ] >> 16 );
+
+        if ( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) )
+        {
+            twin->pairmap[ i ] = twin->pairmap[ j ];
+            i = j;
+        }
+    }
+    twin->pairmap[ i ] = PAIRMAP_EMPTY;
+    twin->pairmap_count--;
+}
+
+static void pair_unlink( termwin *twin, int pairid )
+{
+    termwin_pair *pair = &twin->pairs[ pairid ];
+
+    twin->pairs[ pair->prev ].next = pair->next;
+    twin->pairs[ pair->next ].prev = pair->prev;
+}
+
+// Make pairid the most recently used.
+static void pair_link_front( termwin *twin, int pairid )
+{
+    termwin_pair *pair = &twin->pairs[ pairid ];
+
+    pair->prev = 0;
+    pair->next = twin->pairs[ 0 ].next;
+    twin->pairs[ pair->next ].prev = pairid;
+    twin->pairs[ 0 ].next = pairid;
+}
+
+static void pair_touch( termwin *twin, int pairid )
+{
+    if ( !twin->pairs[ pairid ].pinned && ( twin->pairs[ 0 ].next != pairid ) )
+    {
+        pair_unlink( twin, pairid );
+        pair_link_front( twin, pairid );
+    }
+}
 
-            int d = vterm_color_distance( &twin->ansi_colors[ i ], color );
-            if ( d < distance )
+// pairid now means different colours: repaint every cell drawn with it.
+static void termwin_pair_evicted( termwin *twin, int pairid )
+{
+    int row, col;
+
+    for ( row = 0; row < twin->rows; row++ )
+    {
+        termwin_shadowcell *shadow = &twin->shadow[ row * twin->cols ];
+
+        for ( col = 0; col < twin->cols; col++ )
+        {
+            if ( shadow[ col ].pairid == pairid )
             {
-                distance = d;
-                idx = i;
+                int start_col = col;
+
+                while ( ( col < twin->cols ) && ( shadow[ col ].pairid == pairid ) )
+                    shadow[ col++ ].pairid = -1;
+
+                VTermRect rect = { row, row + 1, start_col, col };
+                termwin_damage_callback( rect, twin );
             }
         }
+    }
+}
+
+static void termwin_color_init( termwin *twin, int id )
+{
+    uint32_t bit = 1U << ( id & 31 );
+
+    if ( !( twin->colors_pending[ id >> 5 ] & bit ) )
+        return;
 
-        twin->vterm_color_hash[ hashid ] = idx;
+    twin->colors_pending[ id >> 5 ] &= ~bit;
+    if ( init_color( id, twin->color_rgb[ id ][ 0 ], twin->color_rgb[ id ][ 1 ], twin->color_rgb[ id ][ 2 ] ) == ERR )
+    {
+        clog_warn( CLOG( 0 ), "init_color( %d, %d, %d, %d ) failed: %d", id,
+                   twin->color_rgb[ id ][ 0 ], twin->color_rgb[ id ][ 1 ], twin->color_rgb[ id ][ 2 ], errno );
     }
+}
 
-    return twin->vterm_color_hash[ hashid ];
+static int termwin_alloc_pair( termwin *twin, uint16_t key )
+{
+    int ret;
+    int pairid;
+
+    if ( twin->pairs_count < twin->pairs_max )
+    {
+        if ( twin->pairs_count >= twin->pairs_size )
+        {
+            twin->pairs_size = MIN( twin->pairs_max, MAX( 64, twin->pairs_size * 2 ) );
+            twin->pairs = ( termwin_pair * )realloc( twin->pairs, twin->pairs_size * sizeof( twin->pairs[ 0 ] ) );
+            if ( !twin->pairs )
+                FATAL_ERROR( realloc );
+        }
+
+        pairid = twin->pairs_count++;
+    }
+    else
+    {
+        pairid = twin->pairs[ 0 ].prev;
+        if ( !pairid )
+            return 0;
+
+        pair_unlink( twin, pairid );
+        pairmap_remove( twin, twin->pairs[ pairid ].key );
+        termwin_pair_evicted( twin, pairid );
+        memset( twin->style_cache, 0, sizeof( twin->style_cache ) );
+        twin->stats.pairs_evicted++;
+    }
+
+    termwin_color_init( twin, key >> 8 );
+    termwin_color_init( twin, key & 0xff );
+    NCURSES_CHECK( ret, init_pair, pairid, key >> 8, key & 0xff );
+
+    twin->pairs[ pairid ].key = key;
+    twin->pairs[ pairid ].pinned = 0;
+    pair_link_front( twin, pairid );
+    pairmap_insert( twin, key, pairid );
+
+    twin->stats.pairs_allocated++;
+    return pairid;
 }
 
 static int get_ncurses_pairid( termwin *twin, int fgid, int bgid )
 {
-    int pairidx = ( fgid << 8 ) + bgid;
+    uint16_t key = ( fgid << 8 ) | bgid;
+    int pairid;
 
-    if ( twin->pair_table[ pairidx ] == -1 )
-    {
-        int ret;
+    // Pair 0 is the terminal default colours, which is what vterm's
+    // black on black default maps to.
+    if ( !key )
+        return 0;
 
-        NCURSES_CHECK( ret, init_pair, twin->pairid_count, fgid, bgid );
+    pairid = pairmap_find( twin, key );
+    if ( pairid < 0 )
+        return termwin_alloc_pair( twin, key );
+
+    pair_touch( twin, pairid );
+    return pairid;
+}
+
+// Pair that is never evicted.
+static int get_ncurses_pinned_pairid( termwin *twin, int fgid, int bgid )
+{
+    int pairid = get_ncurses_pairid( twin, fgid, bgid );
 
-        twin->pair_table[ pairidx ] = twin->pairid_count++;
+    if ( pairid && !twin->pairs[ pairid ].pinned )
+    {
+        pair_unlink( twin, pairid );
+        twin->pairs[ pairid ].pinned = 1;
     }
+    return pairid;
+}
+
+void termwin_initvterm( VTerm *vterm )
+{
+    static const VTermColor s_default_color = { 0, 0, 0 };
 
-    return twin->pair_table[ pairidx ];
+    // Black on black is what we map to the terminal's own default colours.
+    vterm_state_set_default_colors( vterm_obtain_state( vterm ), &s_default_color, &s_default_color );
 }
 
 void termwin_setvterm( termwin *twin, VTerm *vterm )
 {
     int i;
     int ret;
-    int fgid, bgid;
     VTermState *state = vterm_obtain_state( vterm );
 
     twin->vt = vterm;
+    termwin_initvterm( vterm );
+
+    // Colours go out exactly as vterm has them: no palette or pairs. The
+    // palette only depends on the terminal, so switching vterms keeps it.
+    if ( twin->out || twin->numcolors )
+    {
+        termwin_damage_alloc( twin );
+        return;
+    }
 
-    twin->numcolors = sqrt_uint32( COLOR_PAIRS );
-    if ( twin->numcolors > COLORS )
-        twin->numcolors = COLORS;
+    // Pairs are allocated lazily, so we can use every colour the terminal has.
+    twin->numcolors = MIN( COLORS, MAX_ANSI_COLORS );
+    twin->pairs_max = MIN( COLOR_PAIRS, SHRT_MAX );
 
     clog_info( CLOG( 0 ), "COLORS:%d COLOR_PAIRS:%d numcolors:%d\n",
                COLORS, COLOR_PAIRS, twin->numcolors );
 
-    if ( twin->numcolors > MAX_ANSI_COLORS )
-        twin->numcolors = MAX_ANSI_COLORS;
+    // Pair 0 is the LRU list head.
+    twin->pairs_size = MIN( twin->pairs_max, 64 );
+    twin->pairs = ( termwin_pair * )realloc( twin->pairs, twin->pairs_size * sizeof( twin->pairs[ 0 ] ) );
+    if ( !twin->pairs )
+        FATAL_ERROR( realloc );
+    memset( &twin->pairs[ 0 ], 0, sizeof( twin->pairs[ 0 ] ) );
 
     for ( i = 0; i < twin->numcolors; i++ )
         vterm_state_get_palette_color( state, i, &twin->ansi_colors[ i ] );
 
+    // Colours 16 and up are set to vterm's palette if the terminal lets us.
+    // Each init_color is a tparm and a write, so that's put off until a pair
+    // first uses the colour (see termwin_color_init).
+    memset( twin->colors_pending, 0, sizeof( twin->colors_pending ) );
     if ( can_change_color() )
     {
+        // What color_content will say once init_color has been sent.
         for ( i = 16; i < twin->numcolors; i++ )
         {
-            short r = ( twin->ansi_colors[ i ].red * 1000 ) / 255;
-            short g = ( twin->ansi_colors[ i ].green * 1000 ) / 255;
-            short b = ( twin->ansi_colors[ i ].blue * 1000 ) / 255;
+            short *rgb = twin->color_rgb[ i ];
 
-            ret = init_color( i, r, g, b );
-            if ( ret == ERR )
-            {
-                clog_warn( CLOG( 0 ), "init_color( %d, %d, %d, %d ) failed: %d", i, r, g, b, errno );
-                break;
-            }
+            rgb[ 0 ] = ( twin->ansi_colors[ i ].red * 1000 ) / 255;
+            rgb[ 1 ] = ( twin->ansi_colors[ i ].green * 1000 ) / 255;
+            rgb[ 2 ] = ( twin->ansi_colors[ i ].blue * 1000 ) / 255;
+            twin->colors_pending[ i >> 5 ] |= 1U << ( i & 31 );
+
+            twin->ansi_colors[ i ].red = rgb[ 0 ] * 255 / 1000;
+            twin->ansi_colors[ i ].green = rgb[ 1 ] * 255 / 1000;
+            twin->ansi_colors[ i ].blue = rgb[ 2 ] * 255 / 1000;
+        }
+    }
+    else
+    {
+        // Whatever the terminfo entry says. ncurses answers from its own
+        // tables, nothing goes to the terminal.
+        for ( i = 16; i < twin->numcolors; i++ )
+        {
+            short r, g, b;
+
+            NCURSES_CHECK( ret, color_content, i, &r, &g, &b );
+
+            twin->ansi_colors[ i ].red = r * 255 / 1000;
+            twin->ansi_colors[ i ].green = g * 255 / 1000;
+            twin->ansi_colors[ i ].blue = b * 255 / 1000;
         }
     }
 
-    for ( i = 16; i < twin->numcolors; i++ )
+    twin->numcolors_padded = ( twin->numcolors + 3 ) & ~3;
+    for ( i = 0; i < twin->numcolors_padded; i++ )
+    {
+        int pad = ( i >= twin->numcolors );
+
+        twin->palette_rg[ i * 2 ] = pad ? PALETTE_PAD_VALUE : twin->ansi_colors[ i ].red;
+        twin->palette_rg[ i * 2 + 1 ] = pad ? PALETTE_PAD_VALUE : twin->ansi_colors[ i ].green;
+        twin->palette_b[ i * 2 ] = pad ? 0 : twin->ansi_colors[ i ].blue;
+        twin->palette_b[ i * 2 + 1 ] = 0;
+    }
+    memset( twin->color_cache_key, 0, sizeof( twin->color_cache_key ) );
+    memset( twin->style_cache, 0, sizeof( twin->style_cache ) );
+
+    get_ncurses_pinned_pairid( twin, COLOR_MAGENTA, 0 );
+}
+
+static uint64_t vterm_cell_style_key( const VTermScreenCell *cell )
+{
+    uint64_t attrs = ( cell->attrs.bold ? SHADOW_ATTR_BOLD : 0 ) |
+                     ( cell->attrs.underline ? SHADOW_ATTR_UNDERLINE : 0 ) |
+                     ( cell->attrs.blink ? SHADOW_ATTR_BLINK : 0 ) |
+                     ( cell->attrs.reverse ? SHADOW_ATTR_REVERSE : 0 );
+
+    return ( ( uint64_t )cell->fg.red << 16 ) | ( ( uint64_t )cell->fg.green << 8 ) | cell->fg.blue |
+           ( ( uint64_t )cell->bg.red << 40 ) | ( ( uint64_t )cell->bg.green << 32 ) | ( ( uint64_t )cell->bg.blue << 24 ) |
+           ( attrs << 48 ) | STYLE_KEY_VALID;
+}
+
+static const termwin_style *termwin_get_style( termwin *twin, const VTermScreenCell *cell, uint64_t key )
+{
+    termwin_style *style = &twin->style_cache[ ( key * 0x9e3779b97f4a7c15ULL ) >> ( 64 - STYLE_CACHE_BITS ) ];
+
+    if ( style->key == key )
     {
-        short r, g, b;
+        // Keep the LRU honest, we skipped get_ncurses_pairid.
+        if ( style->pairid )
+            pair_touch( twin, style->pairid );
+
+        twin->stats.style_cache_hits++;
+        return style;
+    }
+
+    style->attr = A_NORMAL;
+    if ( cell->attrs.bold )
+        style->attr |= A_BOLD;
+    if ( cell->attrs.underline )
+        style->attr |= A_UNDERLINE;
+    if ( cell->attrs.blink )
+        style->attr |= A_BLINK;
+    if ( cell->attrs.reverse )
+        style->attr |= A_REVERSE;
+
+    int fgid = get_ncurses_colorid( twin, &cell->fg );
+    int bgid = get_ncurses_colorid( twin, &cell->bg );
+    style->pairid = get_ncurses_pairid( twin, fgid, bgid );
+
+    // get_ncurses_pairid may have evicted a pair and cleared the cache.
+    style->key = key;
+
+    twin->stats.style_cache_misses++;
+    return style;
+}
+
+// The cell to draw at pos: from the view if there is one, else the vterm.
+// View cells are used where they are; only the vterm's get copied to buf.
+static const VTermScreenCell *termwin_getcell( termwin *twin, VTermScreen *vts, VTermPos pos, VTermScreenCell *buf )
+{
+    if ( !twin->view )
+        vterm_screen_get_cell( vts, pos, buf );
+    else if ( ( pos.row < twin->view_rows ) && ( pos.col < twin->view_cols ) )
+        return &twin->view[ pos.row * twin->view_cols + pos.col ];
+    else
+        memset( buf, 0, sizeof( *buf ) );
+    return buf;
+}
+
+// Push rowbuf[ first, last ] to ncurses in one go.
+static void termwin_drawrun( termwin *twin, int row, int first, int last )
+{
+    int ret;
+
+    NCURSES_CHECK( ret, mvwadd_wchnstr, twin->win, row + 1, twin->rowcols[ first ] + 1,
+                   &twin->rowbuf[ first ], last - first + 1 );
+}
+
+// Columns rowbuf[ first, last ] covers, both halves of a wide character
+// at the end included.
+static int termwin_run_cols( termwin *twin, const termwin_shadowcell *shadow, int first, int last )
+{
+    int end = twin->rowcols[ last ];
+
+    end += ( shadow[ end ].flags & SHADOW_FLAG_WIDE ) ? 2 : 1;
+    return end - twin->rowcols[ first ];
+}
+
+// Draw cells in [start_col, end_col) of row that differ from the shadow
+// copy. Returns number of cells sent to ncurses.
+static int termwin_drawspan( termwin *twin, VTermScreen *vts, int row, int start_col, int end_col )
+{
+    int ret;
+    int col;
+    int count = 0;
+    int drawn = 0;
+    int run_first = -1;
+    int run_last = -1;
+    attr_t attr = A_NORMAL;
+    uint8_t shadow_attrs = 0;
+    int pairid = 0;
+    uint64_t style_key = 0;
+    VTermScreenCell cellbuf;
+    const VTermScreenCell *cell;
+    termwin_shadowcell *shadow = &twin->shadow[ row * twin->cols ];
+    static const wchar_t s_blankchar[] = L" ";
 
-        NCURSES_CHECK( ret, color_content, i, &r, &g, &b );
+    // Don't start in the second half of a wide character.
+    if ( start_col > 0 )
+    {
+        VTermPos pos = { row, start_col };
 
-        twin->ansi_colors[ i ].red = r * 255 / 1000;
-        twin->ansi_colors[ i ].green = g * 255 / 1000;
-        twin->ansi_colors[ i ].blue = b * 255 / 1000;
+        cell = termwin_getcell( twin, vts, pos, &cellbuf );
+        if ( cell->chars[ 0 ] == ( uint32_t )-1 )
+            start_col--;
     }
 
-    for ( bgid = 0; bgid < twin->numcolors; bgid++ )
+    for ( col = start_col; col < end_col; )
     {
-        for ( fgid = 0; fgid < twin->numcolors; fgid++ )
+        const wchar_t *wch;
+        termwin_shadowcell shadowcell;
+        VTermPos pos = { row, col };
+        int width;
+
+        cell = termwin_getcell( twin, vts, pos, &cellbuf );
+        width = ( ( cell->width == 2 ) && ( col + 1 < twin->cols ) ) ? 2 : 1;
+
+        // Runs of the same style are common: only look it up when it changes.
+        uint64_t key = vterm_cell_style_key( cell );
+        if ( key != style_key )
+        {
+            const termwin_style *style = termwin_get_style( twin, cell, key );
+
+            attr = style->attr;
+            pairid = style->pairid;
+            shadow_attrs = ( key >> 48 ) & 0xff;
+            style_key = key;
+        }
+
+        shadowcell.ch = ( cell->chars[ 0 ] == ( uint32_t )-1 ) ? 0 : cell->chars[ 0 ];
+        shadowcell.attrs = shadow_attrs;
+        shadowcell.flags = ( ( cell->chars[ 0 ] && cell->chars[ 1 ] ) ? SHADOW_FLAG_COMBINING : 0 ) |
+                           ( ( width == 2 ) ? SHADOW_FLAG_WIDE : 0 );
+        shadowcell.pairid = pairid;
+
+        if ( memcmp( &shadow[ col ], &shadowcell, sizeof( shadowcell ) ) ||
+             ( shadowcell.flags & SHADOW_FLAG_COMBINING ) ||
+             ( ( width == 2 ) && ( shadow[ col + 1 ].ch != SHADOW_CH_WIDE_RIGHT ) ) )
+        {
+            shadow[ col ] = shadowcell;
+            if ( width == 2 )
+            {
+                shadow[ col + 1 ] = shadowcell;
+                shadow[ col + 1 ].ch = SHADOW_CH_WIDE_RIGHT;
+            }
+
+            if ( run_first < 0 )
+                run_first = count;
+            run_last = count;
+        }
+        else if ( ( run_first >= 0 ) && ( col - twin->rowcols[ run_last ] > TERMWIN_SPAN_MERGE_GAP ) )
         {
-            get_ncurses_pairid( twin, fgid, bgid );
+            // Unchanged for a while: flush what we have.
+            termwin_drawrun( twin, row, run_first, run_last );
+            drawn += termwin_run_cols( twin, shadow, run_first, run_last );
+            run_first = -1;
         }
+
+        wch = ( cell->chars[ 0 ] && ( cell->chars[ 0 ] != ( uint32_t )-1 ) ) ?
+                  ( wchar_t * )&cell->chars[ 0 ] : s_blankchar;
+
+        NCURSES_CHECK( ret, setcchar, &twin->rowbuf[ count ], wch, attr, pairid, NULL );
+        twin->rowcols[ count ] = col;
+        count++;
+
+        // ncurses fills in the right half of wide characters itself.
+        col += width;
     }
 
-    const VTermColor default_color = { 0, 0, 0 };
-    vterm_state_set_default_colors( state, &default_color, &default_color );
+    if ( run_first >= 0 )
+    {
+        termwin_drawrun( twin, row, run_first, run_last );
+        drawn += termwin_run_cols( twin, shadow, run_first, run_last );
+    }
+
+    twin->stats.cells_skipped += ( col - start_col ) - drawn;
+    return drawn;
+}
+
+// termout style for a cell's style key. Black on black is the terminal's
+// default colours, like pair 0 in the ncurses version.
+static uint64_t termwin_direct_style( uint64_t key )
+{
+    uint64_t attrs = key & ( 0xffULL << 48 );
+
+    if ( !( key & 0xffffffffffffULL ) )
+        return TERMOUT_STYLE_DEFAULT_COLORS | attrs;
+    return key & ~STYLE_KEY_VALID;
 }
 
-int termwin_getch( termwin *twin )
+// termwin_drawspan for the direct backend: cells that differ from the
+// shadow are appended to the output buffer, termout skips the cursor moves
+// between neighbours and repeated SGRs.
+static int termwin_drawspan_direct( termwin *twin, VTermScreen *vts, int row, int start_col, int end_col )
 {
-    int key_resize_count = 0;
-    int ch = wgetch( twin->win );
+    int col;
+    int drawn = 0;
+    VTermScreenCell cellbuf;
+    const VTermScreenCell *cell;
+    termwin_shadowcell *shadow = &twin->shadow[ row * twin->cols ];
+    uint64_t *shadow_style = &twin->shadow_style[ row * twin->cols ];
+
+    // Don't start in the second half of a wide character.
+    if ( start_col > 0 )
+    {
+        VTermPos pos = { row, start_col };
 
-    // Kill terminal resize events.
-    while ( ch == KEY_RESIZE )
+        cell = termwin_getcell( twin, vts, pos, &cellbuf );
+        if ( cell->chars[ 0 ] == ( uint32_t )-1 )
+            start_col--;
+    }
+
+    for ( col = start_col; col < end_col; )
     {
-        if ( key_resize_count++ > 128 )
+        termwin_shadowcell shadowcell;
+        VTermPos pos = { row, col };
+        int width;
+
+        cell = termwin_getcell( twin, vts, pos, &cellbuf );
+        width = ( cell->width == 2 ) ? 2 : 1;
+
+        uint64_t key = vterm_cell_style_key( cell );
+        int wide_cut = ( width == 2 ) && ( col + 1 >= twin->cols );
+
+        shadowcell.ch = ( cell->chars[ 0 ] == ( uint32_t )-1 ) ? 0 : cell->chars[ 0 ];
+        shadowcell.attrs = ( key >> 48 ) & 0xff;
+        shadowcell.flags = ( ( cell->chars[ 0 ] && cell->chars[ 1 ] ) ? SHADOW_FLAG_COMBINING : 0 ) |
+                           ( ( width == 2 ) ? SHADOW_FLAG_WIDE : 0 );
+        shadowcell.pairid = 0;
+
+        // A wide character with no room for its right half would spill
+        // onto the border: draw a blank instead.
+        if ( wide_cut )
         {
-            // If I resize the gnome-terminal over and over, the input buffer seems
-            // to get filled with an endless supply of KEY_RESIZE events and we hang
-            // here. Workaround this by discarding all our input and starting over.
-            clog_warn( CLOG( 0 ), "wgetch got 128 KEY_RESIZE events: calling flushinp()." );
-            flushinp();
-            return -1;
+            width = 1;
+            shadowcell.ch = ' ';
+            shadowcell.flags = 0;
         }
 
-        ch = wgetch( twin->win );
-    }
+        if ( memcmp( &shadow[ col ], &shadowcell, sizeof( shadowcell ) ) || ( shadow_style[ col ] != key ) ||
+             ( shadowcell.flags & SHADOW_FLAG_COMBINING ) ||
+             ( ( width == 2 ) && ( shadow[ col + 1 ].ch != SHADOW_CH_WIDE_RIGHT ) ) )
+        {
+            shadow[ col ] = shadowcell;
+            shadow_style[ col ] = key;
+            if ( width == 2 )
+            {
+                shadow[ col + 1 ] = shadowcell;
+                shadow[ col + 1 ].ch = SHADOW_CH_WIDE_RIGHT;
+                shadow_style[ col + 1 ] = key;
+            }
 
-    if ( ch == ERR )
-        clog_warn( CLOG( 0 ), "wgetch failed: %d", errno );
+            termout_move( twin->out, TERMWIN_WIN_ORIGIN + 1 + row, TERMWIN_WIN_ORIGIN + 1 + col );
+            termout_style( twin->out, termwin_direct_style( key ) );
+            if ( wide_cut || ( cell->chars[ 0 ] == ( uint32_t )-1 ) )
+                termout_cell( twin->out, NULL, 0, 1 );
+            else
+                termout_cell( twin->out, cell->chars, VTERM_MAX_CHARS_PER_CELL, width );
+            drawn += width;
+        }
 
-    return ch;
+        col += width;
+    }
+
+    twin->stats.cells_skipped += ( col - start_col ) - drawn;
+    return drawn;
 }
 
-static void termwin_drawcell( termwin *twin, VTermScreen *vts, int row, int col )
+static void termwin_damage_span( termwin *twin, int row, int start_col, int end_col )
 {
-    int ret;
-    cchar_t cch;
-    const wchar_t *wch;
-    VTermScreenCell cell;
-    VTermPos pos = { row, col };
-    static const wchar_t s_blankchar[] = L" ";
+    int i = 0;
+    int count = 0;
+    int inserted = 0;
+    termwin_span spans[ TERMWIN_MAX_ROW_SPANS + 1 ];
+    termwin_rowdamage *rowdamage = &twin->damage[ row ];
+
+    // Merge new span into the start_col ordered list.
+    while ( ( i < rowdamage->count ) || !inserted )
+    {
+        termwin_span span;
 
-    vterm_screen_get_cell( vts, pos, &cell );
+        if ( !inserted && ( ( i == rowdamage->count ) || ( start_col < rowdamage->spans[ i ].start_col ) ) )
+        {
+            span.start_col = start_col;
+            span.end_col = end_col;
+            inserted = 1;
+        }
+        else
+        {
+            span = rowdamage->spans[ i++ ];
+        }
 
-    attr_t attr = A_NORMAL;
-    if ( cell.attrs.bold )
-        attr |= A_BOLD;
-    if ( cell.attrs.underline )
-        attr |= A_UNDERLINE;
-    if ( cell.attrs.blink )
-        attr |= A_BLINK;
-    if ( cell.attrs.reverse )
-        attr |= A_REVERSE;
-
-    int fgid = get_ncurses_colorid( twin, &cell.fg );
-    int bgid = get_ncurses_colorid( twin, &cell.bg );
-    int pairid = get_ncurses_pairid( twin, fgid, bgid );
+        if ( count && ( span.start_col <= spans[ count - 1 ].end_col + TERMWIN_SPAN_MERGE_GAP ) )
+            spans[ count - 1 ].end_col = MAX( spans[ count - 1 ].end_col, span.end_col );
+        else
+            spans[ count++ ] = span;
+    }
+
+    if ( count > TERMWIN_MAX_ROW_SPANS )
+    {
+        int j;
+        int mingap = INT_MAX;
+        int minidx = 0;
 
-    wch = cell.chars[ 0 ] ? ( wchar_t * )&cell.chars[ 0 ] : s_blankchar;
+        for ( i = 0; i < count - 1; i++ )
+        {
+            int gap = spans[ i + 1 ].start_col - spans[ i ].end_col;
 
-    NCURSES_CHECK( ret, setcchar, &cch, wch, attr, pairid, NULL );
+            if ( gap < mingap )
+            {
+                mingap = gap;
+                minidx = i;
+            }
+        }
 
-    NCURSES_CHECK( ret, wmove, twin->win, row + 1, col + 1 );
+        spans[ minidx ].end_col = spans[ minidx + 1 ].end_col;
+        for ( j = minidx + 1; j < count - 1; j++ )
+            spans[ j ] = spans[ j + 1 ];
+        count--;
+    }
 
-    NCURSES_CHECK( ret, wadd_wch, twin->win, &cch );
+    rowdamage->count = count;
+    memcpy( rowdamage->spans, spans, count * sizeof( spans[ 0 ] ) );
 }
 
 int termwin_damage_callback( VTermRect rect, void *user )
 {
+    int row;
     termwin *twin = ( termwin * )user;
+    int start_row = MAX( 0, rect.start_row );
+    int end_row = MIN( twin->rows, rect.end_row );
+    int start_col = MAX( 0, rect.start_col );
+    int end_col = MIN( twin->cols, rect.end_col );
+
+    twin->stats.damage_rects++;
+    if ( ( start_row >= end_row ) || ( start_col >= end_col ) )
+        return 1;
 
-    if ( twin->damage_rect.end_col || twin->damage_rect.end_row )
+    for ( row = start_row; row < end_row; row++ )
+        termwin_damage_span( twin, row, start_col, end_col );
+
+    if ( twin->damage_top >= twin->damage_bottom )
     {
-        twin->damage_rect.start_col = MIN( twin->damage_rect.start_col, rect.start_col );
-        twin->damage_rect.start_row = MIN( twin->damage_rect.start_row, rect.start_row );
-        twin->damage_rect.end_col = MAX( twin->damage_rect.end_col, rect.end_col );
-        twin->damage_rect.end_row = MAX( twin->damage_rect.end_row, rect.end_row );
+        twin->damage_top = start_row;
+        twin->damage_bottom = end_row;
     }
     else
     {
-        twin->damage_rect = rect;
+        twin->damage_top = MIN( twin->damage_top, start_row );
+        twin->damage_bottom = MAX( twin->damage_bottom, end_row );
     }
     return 1;
 }
 
+static void termwin_damage_rows( termwin *twin, int start_row, int end_row )
+{
+    VTermRect rect = { start_row, end_row, 0, twin->cols };
+
+    termwin_damage_callback( rect, twin );
+}
+
+int termwin_moverect_callback( VTermRect dest, VTermRect src, void *user )
+{
+    int ret;
+    termwin *twin = ( termwin * )user;
+    int top = MIN( dest.start_row, src.start_row );
+    int bottom = MAX( dest.end_row, src.end_row );
+    int lines = src.start_row - dest.start_row;
+
+    // The direct backend can't scroll the inside of an inset window (that
+    // needs left/right margins, which few terminals have). libvterm
+    // damages dest instead and the shadow keeps what didn't change from
+    // being sent. A view doesn't move with the vterm at all.
+    if ( twin->out || twin->view )
+        return 0;
+
+    // Only whole-line vertical moves map onto ncurses scrolling. Returning 0
+    // for anything else makes libvterm damage dest instead.
+    if ( ( src.start_col != 0 ) || ( src.end_col != twin->cols ) ||
+         ( dest.start_col != 0 ) || ( dest.end_col != twin->cols ) ||
+         ( top < 0 ) || ( bottom > twin->rows ) || !lines )
+    {
+        return 0;
+    }
+
+    // Window row 0 is the border, so vterm row N is window row N + 1.
+    NCURSES_CHECK( ret, wsetscrreg, twin->win, top + 1, bottom );
+    NCURSES_CHECK( ret, scrollok, twin->win, TRUE );
+    NCURSES_CHECK( ret, wscrl, twin->win, lines );
+    NCURSES_CHECK( ret, scrollok, twin->win, FALSE );
+    NCURSES_CHECK( ret, wsetscrreg, twin->win, 0, getmaxy( twin->win ) - 1 );
+
+    // Damage we haven't drawn yet and the shadow move along with their rows.
+    memmove( &twin->damage[ dest.start_row ], &twin->damage[ src.start_row ],
+             ( src.end_row - src.start_row ) * sizeof( twin->damage[ 0 ] ) );
+    memmove( &twin->shadow[ dest.start_row * twin->cols ], &twin->shadow[ src.start_row * twin->cols ],
+             ( src.end_row - src.start_row ) * twin->cols * sizeof( twin->shadow[ 0 ] ) );
+
+    if ( twin->damage_top >= twin->damage_bottom )
+    {
+        twin->damage_top = top;
+        twin->damage_bottom = bottom;
+    }
+    else
+    {
+        twin->damage_top = MIN( twin->damage_top, top );
+        twin->damage_bottom = MAX( twin->damage_bottom, bottom );
+    }
+
+    // Rows uncovered by the move were blanked by wscrl, border included.
+    if ( lines > 0 )
+    {
+        termwin_shadow_invalidate( twin, dest.end_row, src.end_row );
+        termwin_damage_rows( twin, dest.end_row, src.end_row );
+    }
+    else
+    {
+        termwin_shadow_invalidate( twin, src.start_row, dest.start_row );
+        termwin_damage_rows( twin, src.start_row, dest.start_row );
+    }
+    twin->border_dirty = 1;
+
+    twin->stats.moverects++;
+    return 1;
+}
+
 static void draw_border( termwin *twin, WINDOW *win )
 {
 #if 1
     int attr = A_BOLD;
-    int pairid = get_ncurses_pairid( twin, COLOR_MAGENTA, 0 );
+    int pairid = get_ncurses_pinned_pairid( twin, COLOR_MAGENTA, 0 );
 
     wborder( win,
              NCURSES_COLORED_CHTYPE( ACS_VLINE, attr, pairid ),
@@ -423,66 +1442,208 @@ static void draw_border( termwin *twin, WINDOW *win )
         mvwprintw( win, maxy - 1, i, g_utf8_horz );
     }
 #endif
+
+    if ( twin->status[ 0 ] )
+        mvwaddnstr( win, getmaxy( win ) - 1, 2, twin->status, MAX( 0, getmaxx( win ) - 4 ) );
 }
 
-static int termwin_draw( termwin *twin )
+// Box drawing characters around the window, bold magenta like the ncurses
+// border.
+static void draw_border_direct( termwin *twin )
 {
-    if ( twin->damage_rect.end_col || twin->damage_rect.end_row )
+    int i;
+    int top = TERMWIN_WIN_ORIGIN;
+    int left = TERMWIN_WIN_ORIGIN;
+    int bottom = top + twin->win_lines - 1;
+    int right = left + twin->win_cols - 1;
+    static const uint32_t s_horz = 0x2500;
+    static const uint32_t s_vert = 0x2502;
+    static const uint32_t s_topleft = 0x250c;
+    static const uint32_t s_topright = 0x2510;
+    static const uint32_t s_bottomleft = 0x2514;
+    static const uint32_t s_bottomright = 0x2518;
+
+    termout_sgr( twin->out, "0;1;35" );
+
+    termout_move( twin->out, top, left );
+    termout_cell( twin->out, &s_topleft, 1, 1 );
+    for ( i = left + 1; i < right; i++ )
+        termout_cell( twin->out, &s_horz, 1, 1 );
+    termout_cell( twin->out, &s_topright, 1, 1 );
+
+    for ( i = top + 1; i < bottom; i++ )
     {
-        int ret;
-        int row, col;
-        int y = getcury( twin->win );
-        int x = getcurx( twin->win );
-        int maxy = getmaxy( twin->win ) - 2;
-        int maxx = getmaxx( twin->win ) - 2;
-        int endrow = MIN( maxy, twin->damage_rect.end_row );
-        int endcol = MIN( maxx, twin->damage_rect.end_col );
-        VTermScreen *vts = vterm_obtain_screen( twin->vt );
-
-        if ( ( twin->damage_rect.start_row == 0 ) ||
-             ( twin->damage_rect.start_col == 0 ) ||
-             ( endrow > maxy ) ||
-             ( endcol > maxx ) )
+        termout_move( twin->out, i, left );
+        termout_cell( twin->out, &s_vert, 1, 1 );
+        termout_move( twin->out, i, right );
+        termout_cell( twin->out, &s_vert, 1, 1 );
+    }
+
+    termout_move( twin->out, bottom, left );
+    termout_cell( twin->out, &s_bottomleft, 1, 1 );
+    for ( i = left + 1; i < right; i++ )
+        termout_cell( twin->out, &s_horz, 1, 1 );
+    termout_cell( twin->out, &s_bottomright, 1, 1 );
+
+    if ( twin->status[ 0 ] )
+    {
+        const char *p = twin->status;
+        mbstate_t mbs;
+        int col = left + 2;
+
+        memset( &mbs, 0, sizeof( mbs ) );
+        termout_sgr( twin->out, "0" );
+        termout_move( twin->out, bottom, col );
+        while ( *p )
         {
-            draw_border( twin, twin->win );
+            wchar_t wc;
+            size_t len = mbrtowc( &wc, p, strlen( p ), &mbs );
+
+            if ( ( len == ( size_t )-1 ) || ( len == ( size_t )-2 ) )
+            {
+                memset( &mbs, 0, sizeof( mbs ) );
+                wc = '?';
+                len = 1;
+            }
+
+            uint32_t cp = ( uint32_t )wc;
+            int width = MAX( 1, wcwidth( wc ) );
+
+            if ( col + width > right - 1 )
+                break;
+            termout_cell( twin->out, &cp, 1, width );
+            col += width;
+            p += len;
         }
+    }
+}
+
+static int termwin_draw( termwin *twin )
+{
+    int ret;
+    int row, i, pass;
+    int cells_drawn = 0;
+    int y = 0;
+    int x = 0;
+
+    if ( ( twin->damage_top >= twin->damage_bottom ) && !twin->border_dirty && !twin->cursor_dirty )
+        return 0;
+
+    VTermScreen *vts = vterm_obtain_screen( twin->vt );
+
+    if ( twin->out )
+    {
+        // Hide the cursor so it doesn't flicker across the screen as we draw.
+        if ( twin->cursor_visible )
+            termout_raw( twin->out, "\x1b[?25l", 6 );
+    }
+    else
+    {
+        y = getcury( twin->win );
+        x = getcurx( twin->win );
+    }
 
-        for ( row = twin->damage_rect.start_row; row < endrow; row++ )
+    if ( twin->border_dirty )
+    {
+        if ( twin->out )
+            draw_border_direct( twin );
+        else
+            draw_border( twin, twin->win );
+        twin->border_dirty = 0;
+    }
+
+    // Evicting a colour pair while drawing can damage cells again, so go
+    // around once more if that happens.
+    for ( pass = 0; ( pass < 2 ) && ( twin->damage_top < twin->damage_bottom ); pass++ )
+    {
+        int top = twin->damage_top;
+        int bottom = twin->damage_bottom;
+
+        twin->damage_top = 0;
+        twin->damage_bottom = 0;
+
+        for ( row = top; row < bottom; row++ )
         {
-            for ( col = twin->damage_rect.start_col; col < endcol; col++ )
+            termwin_rowdamage rowdamage = twin->damage[ row ];
+
+            twin->damage[ row ].count = 0;
+
+            for ( i = 0; i < rowdamage.count; i++ )
             {
-                termwin_drawcell( twin, vts, row, col );
+                termwin_span *span = &rowdamage.spans[ i ];
+
+                if ( twin->out )
+                    cells_drawn += termwin_drawspan_direct( twin, vts, row, span->start_col, span->end_col );
+                else
+                    cells_drawn += termwin_drawspan( twin, vts, row, span->start_col, span->end_col );
             }
         }
+    }
 
+    if ( twin->out )
+    {
+        termout_move( twin->out, TERMWIN_WIN_ORIGIN + 1 + twin->cursor_row, TERMWIN_WIN_ORIGIN + 1 + twin->cursor_col );
+        if ( twin->cursor_visible && !twin->view )
+            termout_raw( twin->out, "\x1b[?25h", 6 );
+        twin->cursor_dirty = 0;
+    }
+    else
+    {
         NCURSES_CHECK( ret, wmove, twin->win, y, x );
-
-        memset( &twin->damage_rect, 0, sizeof( twin->damage_rect ) );
-
-        return 1;
     }
 
-    return 0;
+    twin->stats.frames++;
+    twin->stats.cells_drawn += cells_drawn;
+    twin->stats.frame_cells_drawn = cells_drawn;
+    return 1;
 }
 
-void termwin_refresh( termwin *twin )
+int termwin_refresh( termwin *twin )
 {
     int ret;
+    uint64_t start_ns = get_time_ns();
+
+    if ( !termwin_draw( twin ) )
+        return 0;
 
-    if ( termwin_draw( twin ) )
+    if ( twin->out )
     {
-        NCURSES_CHECK( ret, wnoutrefresh, stdscr );
-        NCURSES_CHECK( ret, wnoutrefresh, twin->win );
-        NCURSES_CHECK( ret, doupdate );
+        uint64_t write_ns = get_time_ns();
+
+        termout_flush( twin->out );
+
+        metrics_hist_add( &twin->stats.draw_ns, write_ns - start_ns );
+        metrics_hist_add( &twin->stats.doupdate_ns, get_time_ns() - write_ns );
+        return 1;
     }
+
+    NCURSES_CHECK( ret, wnoutrefresh, stdscr );
+    NCURSES_CHECK( ret, wnoutrefresh, twin->win );
+
+    uint64_t update_ns = get_time_ns();
+#ifdef ARENA_COUNT_HEAP
+    uint64_t heap_allocs = arena_heap_allocs();
+#endif
+
+    NCURSES_CHECK( ret, doupdate );
+
+#ifdef ARENA_COUNT_HEAP
+    // libtinfo caches each capability string the first time tparm
+    // expands it, so the first frames with a new escape allocate.
+    twin->stats.doupdate_allocs += arena_heap_allocs() - heap_allocs;
+#endif
+
+    metrics_hist_add( &twin->stats.draw_ns, update_ns - start_ns );
+    metrics_hist_add( &twin->stats.doupdate_ns, get_time_ns() - update_ns );
+    return 1;
 }
 
 int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user )
 {
     int ret;
     termwin *twin = ( termwin * )user;
-    int maxy = getmaxy( twin->win ) - 2;
-    int maxx = getmaxx( twin->win ) - 2;
+    int maxy = termwin_win_lines( twin ) - 2;
+    int maxx = termwin_win_cols( twin ) - 2;
 
     if ( pos.row >= maxy || pos.col >= maxx )
     {
@@ -490,6 +1651,14 @@ int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, voi
         return 1;
     }
 
+    if ( twin->out )
+    {
+        twin->cursor_row = pos.row;
+        twin->cursor_col = pos.col;
+        twin->cursor_dirty = 1;
+        return 1;
+    }
+
     NCURSES_CHECK( ret, wmove, twin->win, pos.row + 1, pos.col + 1 );
     return 1;
 }
@@ -497,6 +1666,15 @@ int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, voi
 int termwin_bell_callback( void *user )
 {
     int ret;
+    termwin *twin = ( termwin * )user;
+
+    if ( twin->out )
+    {
+        // Goes out with the next frame, which this forces.
+        termout_raw( twin->out, "\a", 1 );
+        twin->cursor_dirty = 1;
+        return 1;
+    }
 
     NCURSES_CHECK( ret, beep );
     return 1;
@@ -504,11 +1682,25 @@ int termwin_bell_callback( void *user )
 
 int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
 {
+    termwin *twin = ( termwin * )user;
+
     switch ( prop )
     {
     case VTERM_PROP_CURSORVISIBLE:
         clog_info( CLOG( 0 ), "VTERM_PROP_CURSORVISIBLE:%d", val->boolean );
-        curs_set( !!val->boolean );
+        if ( twin->out )
+        {
+            if ( twin->cursor_visible && !val->boolean )
+                termout_raw( twin->out, "\x1b[?25l", 6 );
+            twin->cursor_visible = !!val->boolean;
+            twin->cursor_dirty = 1;
+        }
+        else
+        {
+            twin->cursor_visible = !!val->boolean;
+            if ( !twin->view )
+                curs_set( twin->cursor_visible );
+        }
         return 1;
     case VTERM_PROP_ALTSCREEN:
         clog_debug( CLOG( 0 ), "NYI PROP_ALTSCREEN NYI" );
@@ -529,25 +1721,95 @@ int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
     }
 }
 
+void termwin_setview( termwin *twin, const VTermScreenCell *cells, int rows, int cols )
+{
+    if ( cells )
+    {
+        if ( ( size_t )rows * cols > twin->view_size )
+        {
+            twin->view_size = ( size_t )rows * cols;
+            twin->view_buf = ( VTermScreenCell * )realloc( twin->view_buf, twin->view_size * sizeof( twin->view_buf[ 0 ] ) );
+            if ( !twin->view_buf )
+                FATAL_ERROR( realloc );
+        }
+        twin->view = twin->view_buf;
+        memcpy( twin->view, cells, ( size_t )rows * cols * sizeof( twin->view[ 0 ] ) );
+        twin->view_rows = rows;
+        twin->view_cols = cols;
+    }
+    else
+    {
+        twin->view = NULL;
+    }
+
+    // The shadow keeps this to what actually changed.
+    termwin_damage_rows( twin, 0, twin->rows );
+    if ( twin->out )
+        twin->cursor_dirty = 1;
+    else
+        curs_set( twin->cursor_visible && !twin->view );
+}
+
+void termwin_setstatus( termwin *twin, const char *status )
+{
+    status = status ? status : "";
+    if ( strcmp( status, twin->status ) )
+    {
+        snprintf( twin->status, sizeof( twin->status ), "%s", status );
+        twin->border_dirty = 1;
+    }
+}
+
 void termwin_getsize( termwin *twin, int *rows, int *cols )
 {
-    *rows = getmaxy( twin->win ) - 2;
-    *cols = getmaxx( twin->win ) - 2;
+    *rows = termwin_win_lines( twin ) - 2;
+    *cols = termwin_win_cols( twin ) - 2;
+}
+
+void termwin_size_for_terminal( int lines, int columns, int *rows, int *cols )
+{
+    *rows = MAX( 4, lines - 2 * TERMWIN_WIN_ORIGIN ) - 2;
+    *cols = MAX( 4, columns - 2 * TERMWIN_WIN_ORIGIN ) - 2;
 }
 
-void termwin_resize( termwin *twin )
+void termwin_resize( termwin *twin, int lines, int columns )
 {
     int ret;
-    int maxy = getmaxy( stdscr );
-    int maxx = getmaxx( stdscr );
-    int lines = MAX( 4, maxy - 10 );
-    int columns = MAX( 4, maxx - 10 );
-
-    NCURSES_CHECK( ret, wresize, twin->win, lines, columns );
-
-    // Damage entire window.
-    twin->damage_rect.start_row = 0;
-    twin->damage_rect.start_col = 0;
-    twin->damage_rect.end_row = maxy;
-    twin->damage_rect.end_col = maxx;
+
+    if ( twin->out )
+    {
+        termwin_direct_setsize( twin, lines, columns );
+
+        termout_sgr( twin->out, "0" );
+        termout_raw( twin->out, "\x1b[2J", 4 );
+        termout_invalidate( twin->out );
+        termwin_damage_alloc( twin );
+        return;
+    }
+
+    // We read the new size ourselves rather than letting ncurses catch
+    // SIGWINCH, so tell it.
+    if ( ( lines != LINES ) || ( columns != COLS ) )
+        NCURSES_CHECK( ret, resizeterm, lines, columns );
+
+    int win_lines = MAX( 4, getmaxy( stdscr ) - 2 * TERMWIN_WIN_ORIGIN );
+    int win_columns = MAX( 4, getmaxx( stdscr ) - 2 * TERMWIN_WIN_ORIGIN );
+
+    NCURSES_CHECK( ret, wresize, twin->win, win_lines, win_columns );
+
+    // Repaint everything: the old border is still on the screen.
+    NCURSES_CHECK( ret, wclear, stdscr );
+    termwin_damage_alloc( twin );
+}
+
+void termwin_getstats( termwin *twin, termwin_stats *stats )
+{
+    if ( twin->out )
+    {
+        termout_stats out_stats;
+
+        termout_getstats( twin->out, &out_stats );
+        twin->stats.bytes_written = out_stats.bytes;
+    }
+    *stats = twin->stats;
 }
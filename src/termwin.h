@@ -30,17 +30,63 @@
 
 typedef struct termwin termwin;
 
+typedef struct termwin_stats
+{
+    uint64_t frames;            // Frames that drew something
+    uint64_t cells_drawn;       // Cells sent to ncurses, all frames
+    uint64_t cells_skipped;     // Damaged cells that matched what ncurses already had
+    uint32_t frame_cells_drawn; // Cells sent to ncurses, last frame
+    uint64_t moverects;         // Scrolls done in ncurses instead of repainted
+    uint64_t color_cache_misses; // Nearest palette colour searches
+    uint64_t pairs_allocated;   // init_pair calls
+    uint64_t pairs_evicted;     // Pairs recycled because COLOR_PAIRS ran out
+    uint64_t style_cache_hits;  // Cell styles resolved from the style cache
+    uint64_t style_cache_misses;
+    uint64_t damage_rects;      // vterm damage callbacks
+    metrics_hist draw_ns;       // Building a frame: termwin_draw and wnoutrefresh
+    metrics_hist doupdate_ns;   // Time spent in doupdate (the write for the direct backend)
+    uint64_t bytes_written;     // Sent to the terminal, direct backend only
+    uint64_t doupdate_allocs;   // Heap allocations inside doupdate, ARENA_COUNT_HEAP builds only
+} termwin_stats;
+
 termwin *termwin_init( const char *nc_term );
+// Render into /dev/null with a rows x cols vterm area, for replay benchmarks.
+termwin *termwin_init_headless( const char *nc_term, int rows, int cols );
+// Same window, drawn with escape sequences written straight to stdout
+// instead of through ncurses. truecolor: 24-bit colours, else the xterm
+// 256 colour cube.
+termwin *termwin_init_direct( int truecolor );
+termwin *termwin_init_direct_headless( int rows, int cols, int truecolor );
+// Direct renderer for a lines x columns terminal somewhere else: nothing is
+// written, each frame is picked up with termwin_take_output.
+termwin *termwin_init_direct_remote( int lines, int columns, int truecolor );
+const char *termwin_take_output( termwin *twin, size_t *len );
 void termwin_free( termwin *twin );
 
+// Show term in the window, repainting all of it. Palette and colour pairs
+// are set up on the first call and kept when switching to another vterm.
 void termwin_setvterm( termwin *twin, VTerm *term );
-int termwin_getch( termwin *twin );
-void termwin_refresh( termwin *twin );
-void termwin_resize( termwin *twin );
+// Give a vterm that isn't shown yet the default colours termwin expects.
+void termwin_initvterm( VTerm *term );
+// Draw rows x cols cells (copied) instead of what the vterm has, e.g. a
+// page of scrollback, until this is called again with NULL. The vterm goes
+// on being updated underneath. No cursor is shown meanwhile.
+void termwin_setview( termwin *twin, const VTermScreenCell *cells, int rows, int cols );
+// Text for the bottom border, NULL or "" for none.
+void termwin_setstatus( termwin *twin, const char *status );
+// Returns 1 if anything was drawn.
+int termwin_refresh( termwin *twin );
+// The host terminal is now lines x columns.
+void termwin_resize( termwin *twin, int lines, int columns );
 void termwin_getsize( termwin *twin, int *rows, int *cols );
+// What termwin_getsize will say on a lines x columns terminal, before there
+// is a termwin.
+void termwin_size_for_terminal( int lines, int columns, int *rows, int *cols );
+void termwin_getstats( termwin *twin, termwin_stats *stats );
 
 // libvterm callbacks
 int termwin_damage_callback( VTermRect rect, void *user );
+int termwin_moverect_callback( VTermRect dest, VTermRect src, void *user );
 int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user );
 int termwin_bell_callback( void *user );
 int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user );
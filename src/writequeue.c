@@ -0,0 +1,281 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "writequeue.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define WRITEQUEUE_CHUNK_SIZE ( 16 * 1024 )
+#define WRITEQUEUE_MAX_IOV 64
+// Spare chunks kept once the queue is empty. While there's a backlog every
+// chunk is recycled, so a fd that stays behind doesn't cost a malloc and
+// free per chunk.
+#define WRITEQUEUE_MAX_SPARE 4
+
+typedef struct writequeue_chunk
+{
+    struct writequeue_chunk *next;
+    size_t start; // First unwritten byte
+    size_t end;   // End of valid data
+    char data[ WRITEQUEUE_CHUNK_SIZE ];
+} writequeue_chunk;
+
+struct writequeue
+{
+    int fd;
+
+    writequeue_chunk *head;  // Oldest pending data
+    writequeue_chunk *tail;  // Appends go here
+    writequeue_chunk *spare; // Recycled chunks
+    int spare_count;
+
+    uint64_t stall_start_ns; // When the current stall began (0: not stalled)
+    writequeue_stats stats;
+};
+
+writequeue *writequeue_init( int fd )
+{
+    writequeue *wq = ( writequeue * )calloc( 1, sizeof( *wq ) );
+
+    if ( !wq )
+        FATAL_ERROR( calloc );
+
+    wq->fd = fd;
+
+    // A chunk ready to go, so the first backed up write doesn't allocate.
+    wq->spare = ( writequeue_chunk * )malloc( sizeof( *wq->spare ) );
+    if ( !wq->spare )
+        FATAL_ERROR( malloc );
+    wq->spare->next = NULL;
+    wq->spare_count = 1;
+    return wq;
+}
+
+static void writequeue_free_chain( writequeue_chunk *chunk )
+{
+    while ( chunk )
+    {
+        writequeue_chunk *next = chunk->next;
+
+        free( chunk );
+        chunk = next;
+    }
+}
+
+void writequeue_free( writequeue *wq )
+{
+    if ( wq )
+    {
+        writequeue_free_chain( wq->head );
+        writequeue_free_chain( wq->spare );
+        free( wq );
+    }
+}
+
+static writequeue_chunk *writequeue_new_chunk( writequeue *wq )
+{
+    writequeue_chunk *chunk = wq->spare;
+
+    if ( chunk )
+    {
+        wq->spare = chunk->next;
+        wq->spare_count--;
+    }
+    else
+    {
+        chunk = ( writequeue_chunk * )malloc( sizeof( *chunk ) );
+        if ( !chunk )
+            FATAL_ERROR( malloc );
+    }
+
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    return chunk;
+}
+
+static void writequeue_release_chunk( writequeue *wq, writequeue_chunk *chunk )
+{
+    chunk->next = wq->spare;
+    wq->spare = chunk;
+    wq->spare_count++;
+}
+
+// The backlog is gone: hand back what a burst needed beyond the usual.
+static void writequeue_trim_spare( writequeue *wq )
+{
+    while ( wq->spare_count > WRITEQUEUE_MAX_SPARE )
+    {
+        writequeue_chunk *chunk = wq->spare;
+
+        wq->spare = chunk->next;
+        wq->spare_count--;
+        free( chunk );
+    }
+}
+
+void writequeue_append( writequeue *wq, const char *buf, size_t len )
+{
+    wq->stats.bytes_queued += len;
+    wq->stats.depth += len;
+    wq->stats.depth_max = MAX( wq->stats.depth_max, wq->stats.depth );
+
+    while ( len > 0 )
+    {
+        if ( !wq->tail || ( wq->tail->end == WRITEQUEUE_CHUNK_SIZE ) )
+        {
+            writequeue_chunk *chunk = writequeue_new_chunk( wq );
+
+            if ( wq->tail )
+                wq->tail->next = chunk;
+            else
+                wq->head = chunk;
+            wq->tail = chunk;
+        }
+
+        size_t count = MIN( len, WRITEQUEUE_CHUNK_SIZE - wq->tail->end );
+
+        memcpy( wq->tail->data + wq->tail->end, buf, count );
+        wq->tail->end += count;
+        buf += count;
+        len -= count;
+    }
+}
+
+static void writequeue_clear( writequeue *wq )
+{
+    while ( wq->head )
+    {
+        writequeue_chunk *chunk = wq->head;
+
+        wq->head = chunk->next;
+        writequeue_release_chunk( wq, chunk );
+    }
+    wq->tail = NULL;
+    wq->stats.depth = 0;
+    writequeue_trim_spare( wq );
+}
+
+// Remove count written bytes from the front of the queue.
+static void writequeue_consume( writequeue *wq, size_t count )
+{
+    wq->stats.bytes_written += count;
+    wq->stats.depth -= count;
+
+    while ( count > 0 )
+    {
+        writequeue_chunk *chunk = wq->head;
+        size_t avail = chunk->end - chunk->start;
+
+        if ( count < avail )
+        {
+            chunk->start += count;
+            break;
+        }
+
+        count -= avail;
+        wq->head = chunk->next;
+        writequeue_release_chunk( wq, chunk );
+        if ( !wq->head )
+        {
+            wq->tail = NULL;
+            writequeue_trim_spare( wq );
+        }
+    }
+}
+
+static void writequeue_stall_end( writequeue *wq )
+{
+    if ( wq->stall_start_ns )
+    {
+        uint64_t stall_ns = get_time_ns() - wq->stall_start_ns;
+
+        wq->stats.stall_ns += stall_ns;
+        wq->stats.stall_ns_max = MAX( wq->stats.stall_ns_max, stall_ns );
+        wq->stall_start_ns = 0;
+    }
+}
+
+int writequeue_flush( writequeue *wq )
+{
+    while ( wq->head )
+    {
+        int iovcnt = 0;
+        struct iovec iov[ WRITEQUEUE_MAX_IOV ];
+
+        for ( writequeue_chunk *chunk = wq->head; chunk && ( iovcnt < WRITEQUEUE_MAX_IOV ); chunk = chunk->next )
+        {
+            iov[ iovcnt ].iov_base = chunk->data + chunk->start;
+            iov[ iovcnt ].iov_len = chunk->end - chunk->start;
+            iovcnt++;
+        }
+
+        ssize_t bytes_write = TEMP_FAILURE_RETRY( writev( wq->fd, iov, iovcnt ) );
+        if ( bytes_write < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                // Full: wait for the fd to become writable again.
+                if ( !wq->stall_start_ns )
+                {
+                    wq->stall_start_ns = get_time_ns();
+                    wq->stats.stalls++;
+                }
+                return 0;
+            }
+
+            clog_error( CLOG( 0 ), "writev failed: %d, dropping %zu bytes", errno, wq->stats.depth );
+            writequeue_clear( wq );
+            writequeue_stall_end( wq );
+            return -1;
+        }
+
+        wq->stats.writes++;
+        writequeue_consume( wq, bytes_write );
+    }
+
+    writequeue_stall_end( wq );
+    return 0;
+}
+
+size_t writequeue_get_pending( writequeue *wq )
+{
+    return wq->stats.depth;
+}
+
+void writequeue_getstats( writequeue *wq, writequeue_stats *stats )
+{
+    *stats = wq->stats;
+}
@@ -0,0 +1,63 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _WRITEQUEUE_H_
+#define _WRITEQUEUE_H_
+
+// Outbound queue for a nonblocking fd. Data that the fd won't take right
+// away is kept in a chain of fixed size chunks and written out with writev()
+// once the fd becomes writable again.
+
+typedef struct writequeue writequeue;
+
+typedef struct writequeue_stats
+{
+    uint64_t bytes_queued;  // Total bytes passed to writequeue_append
+    uint64_t bytes_written; // Total bytes written to the fd
+    uint64_t writes;        // write/writev calls that wrote something
+    uint64_t stalls;        // Times the fd filled up with data still pending
+    uint64_t stall_ns;      // Total time spent with data pending after a stall
+    uint64_t stall_ns_max;  // Longest single stall
+    size_t depth;           // Bytes currently pending
+    size_t depth_max;       // Most bytes ever pending
+} writequeue_stats;
+
+writequeue *writequeue_init( int fd );
+void writequeue_free( writequeue *wq );
+
+// Queue len bytes behind anything already pending. Nothing is written yet.
+void writequeue_append( writequeue *wq, const char *buf, size_t len );
+
+// Write as much as the fd takes without blocking. Returns 0 on success (data
+// may still be pending) or -1 if the fd failed, in which case the queue is
+// emptied.
+int writequeue_flush( writequeue *wq );
+
+size_t writequeue_get_pending( writequeue *wq );
+void writequeue_getstats( writequeue *wq, writequeue_stats *stats );
+
+#endif // _WRITEQUEUE_H_